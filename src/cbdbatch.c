@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * batch and shell run many commands in one process: the module is checked
+ * once and transport infos and blkdev snapshots are cached across commands
+ * (see cbdsys_cache_enable()), so only what a mutating command touched is
+ * rescanned. Every command yields one NDJSON record on stdout:
+ *
+ *   {"line": 3, "command": "dev-list", "status": 0, "result": [...]}
+ *
+ * "result" is the command's JSON output, commands printing anything else
+ * get it as an "output" string instead.
+ */
+#define BATCH_ARGS_MAX		64
+#define BATCH_PROMPT		"cbdctrl> "
+
+struct batch_ctx {
+	FILE			*in;
+	bool			prompt;
+	unsigned int		deadline_ms;	/* default of lines without --deadline */
+	unsigned int		line_nr;
+	int			ret;		/* first failed status */
+};
+
+/* Split @line in place on blanks, '' and "" quote, \ escapes outside '' */
+static int batch_split(char *line, char **argv, int argv_max)
+{
+	char *src = line, *dst = line;
+	int argc = 0;
+
+	while (true) {
+		char quote = 0;
+
+		while (isspace((unsigned char)*src))
+			src++;
+		if (!*src)
+			break;
+		if (argc == argv_max)
+			return -E2BIG;
+
+		argv[argc++] = dst;
+		for (; *src; src++) {
+			if (quote) {
+				if (*src == quote)
+					quote = 0;
+				else if (*src == '\\' && quote == '"' && src[1])
+					*dst++ = *++src;
+				else
+					*dst++ = *src;
+			} else if (*src == '\'' || *src == '"') {
+				quote = *src;
+			} else if (*src == '\\' && src[1]) {
+				*dst++ = *++src;
+			} else if (isspace((unsigned char)*src)) {
+				break;
+			} else {
+				*dst++ = *src;
+			}
+		}
+		if (quote)
+			return -EINVAL;
+		if (*src)
+			src++;
+		*dst++ = '\0';
+	}
+
+	return argc;
+}
+
+static void batch_emit(struct batch_ctx *ctx, const char *command, int status,
+		       const char *output)
+{
+	json_t *json_rec = json_object();
+	char *json_str;
+
+	json_object_set_new(json_rec, "line", json_integer(ctx->line_nr));
+	json_object_set_new(json_rec, "command", json_string(command));
+	json_object_set_new(json_rec, "status", json_integer(status));
+
+	if (output && *output) {
+		json_t *json_result = json_loads(output, 0, NULL);
+
+		if (json_result)
+			json_object_set_new(json_rec, "result", json_result);
+		else
+			json_object_set_new(json_rec, "output", json_string(output));
+	}
+
+	json_str = json_dumps(json_rec, JSON_COMPACT);
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	fflush(stdout);
+	json_decref(json_rec);
+
+	if (status && !ctx->ret)
+		ctx->ret = status;
+}
+
+/* Read back what was printed to @tmp, without the trailing newline */
+static char *batch_capture_read(FILE *tmp)
+{
+	long len;
+	char *buf;
+
+	fflush(stdout);
+	len = ftell(tmp);
+	if (len < 0 || fseek(tmp, 0, SEEK_SET))
+		return NULL;
+
+	buf = malloc(len + 1);
+	if (!buf)
+		return NULL;
+
+	len = fread(buf, 1, len, tmp);
+	while (len && buf[len - 1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/*
+ * A command's output is kept until it returns, so commands that only stop
+ * on a signal are refused: the stats, export and record need a --count,
+ * host-monitor may wait forever for a host to die.
+ */
+static const char *batch_unbounded(const cbd_opt_t *options)
+{
+	switch (options->co_cmd) {
+	case CCT_BACKEND_STAT:
+	case CCT_DEV_STAT:
+	case CCT_EXPORT:
+	case CCT_RECORD:
+		return options->co_count ? NULL : "Runs until interrupted without --count";
+	case CCT_HOST_MONITOR:
+		return "Runs until interrupted";
+	default:
+		return NULL;
+	}
+}
+
+/* Parse and run one command with its stdout captured into @output */
+static int batch_run(struct batch_ctx *ctx, int argc, char **argv, char **output)
+{
+	const char *unbounded;
+	cbd_opt_t options;
+	FILE *tmp;
+	int saved_fd;
+	int ret;
+
+	tmp = tmpfile();
+	if (!tmp)
+		return -errno;
+
+	fflush(stdout);
+	saved_fd = dup(STDOUT_FILENO);
+	if (saved_fd < 0 || dup2(fileno(tmp), STDOUT_FILENO) < 0) {
+		ret = -errno;
+		if (saved_fd >= 0)
+			close(saved_fd);
+		fclose(tmp);
+		return ret;
+	}
+
+	ret = cbd_options_parse_line(argc, argv, &options);
+	if (ret == 1) {
+		/* -h, the usage is the output */
+		ret = 0;
+	} else if (ret == 0 && (unbounded = batch_unbounded(&options))) {
+		printf("%s, not run in batch and shell\n", unbounded);
+		ret = -EINVAL;
+	} else if (ret == 0) {
+		cbdsys_set_deadline(options.co_deadline_ms ? options.co_deadline_ms : ctx->deadline_ms);
+		cbdctrl_stopping = 0;
+		ret = cbdctrl_dispatch(&options);
+	}
+
+	*output = batch_capture_read(tmp);
+	dup2(saved_fd, STDOUT_FILENO);
+	close(saved_fd);
+	fclose(tmp);
+
+	return ret;
+}
+
+static void batch_help(struct batch_ctx *ctx, const char *command)
+{
+	batch_emit(ctx, command, 0,
+		   "Any cbdctrl command, one per line, e.g. \"dev-list -t 0\", "
+		   "\"<command> -h\" for its options. Builtins: "
+		   "refresh (rescan everything), help, quit.");
+}
+
+/* Returns false once the input asked to quit */
+static bool batch_line(struct batch_ctx *ctx, char *line)
+{
+	char *argv[BATCH_ARGS_MAX + 1] = { "cbdctrl" };
+	char command[CBD_PATH_LEN * 4];
+	char *output = NULL;
+	enum CBDCTL_CMD_TYPE cmd;
+	int argc;
+	int ret;
+
+	trim_newline(line);
+	while (isspace((unsigned char)*line))
+		line++;
+	if (!*line || *line == '#')
+		return true;
+
+	snprintf(command, sizeof(command), "%s", line);
+	argc = batch_split(line, argv + 1, BATCH_ARGS_MAX);
+	if (argc < 0) {
+		batch_emit(ctx, command, argc, argc == -E2BIG ? "Too many arguments" :
+							      "Unterminated quote");
+		return true;
+	}
+
+	if (!strcmp(argv[1], "quit") || !strcmp(argv[1], "exit"))
+		return false;
+	if (!strcmp(argv[1], "help")) {
+		batch_help(ctx, command);
+		return true;
+	}
+	if (!strcmp(argv[1], "refresh")) {
+		cbdsys_cache_invalidate(-1);
+		batch_emit(ctx, command, 0, NULL);
+		return true;
+	}
+
+	cmd = cbd_get_cmd_type(argv[1]);
+	if (cmd == CCT_INVALID) {
+		batch_emit(ctx, command, -EINVAL, "Unknown command");
+		return true;
+	}
+	if (cmd == CCT_BATCH || cmd == CCT_SHELL) {
+		batch_emit(ctx, command, -EINVAL, "batch and shell can't be nested");
+		return true;
+	}
+
+	ret = batch_run(ctx, argc + 1, argv, &output);
+	batch_emit(ctx, command, ret, output);
+	free(output);
+
+	return true;
+}
+
+static int batch_loop(struct batch_ctx *ctx)
+{
+	char *line = NULL;
+	size_t cap = 0;
+
+	cbdsys_cache_enable();
+
+	while (true) {
+		if (ctx->prompt) {
+			fprintf(stderr, BATCH_PROMPT);
+			fflush(stderr);
+		}
+
+		if (getline(&line, &cap, ctx->in) < 0)
+			break;
+
+		ctx->line_nr++;
+		if (!batch_line(ctx, line))
+			break;
+	}
+	free(line);
+
+	cbdsys_cache_invalidate(-1);
+	return ctx->ret;
+}
+
+int cbdctrl_batch(cbd_opt_t *options)
+{
+	struct batch_ctx ctx = {
+		.in = stdin,
+		.deadline_ms = options->co_deadline_ms,
+	};
+	int ret;
+
+	if (options->co_path[0] && strcmp(options->co_path, "-")) {
+		ctx.in = fopen(options->co_path, "r");
+		if (!ctx.in) {
+			ret = -errno;
+			printf("Failed to open %s: %s\n", options->co_path, strerror(-ret));
+			return ret;
+		}
+	}
+
+	ret = batch_loop(&ctx);
+
+	if (ctx.in != stdin)
+		fclose(ctx.in);
+	return ret;
+}
+
+int cbdctrl_shell(cbd_opt_t *options)
+{
+	struct batch_ctx ctx = {
+		.in = stdin,
+		.prompt = isatty(STDIN_FILENO),
+		.deadline_ms = options->co_deadline_ms,
+	};
+
+	batch_loop(&ctx);
+
+	/* A failed command is already reported in its record */
+	return 0;
+}
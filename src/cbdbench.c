@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <liburing.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdhist.h"
+#include "cbdtiming.h"
+#include "libcbdsys.h"
+
+/* O_DIRECT needs buffers aligned to the logical block size, a page is always enough */
+#define BENCH_BUF_ALIGN		4096
+#define BENCH_STOP_POLL_NS	(100 * 1000000ULL)	/* Ctrl-C may land on a job thread */
+
+enum bench_rw {
+	BENCH_RANDREAD,
+	BENCH_RANDWRITE,
+	BENCH_RANDRW,
+	BENCH_READ,
+	BENCH_WRITE,
+};
+
+static const char *bench_rw_names[] = {
+	[BENCH_RANDREAD]	= "randread",
+	[BENCH_RANDWRITE]	= "randwrite",
+	[BENCH_RANDRW]		= "randrw",
+	[BENCH_READ]		= "read",
+	[BENCH_WRITE]		= "write",
+};
+
+struct bench_io {
+	struct bench_job	*job;
+	void			*buf;
+	uint64_t		start_ns;
+	bool			write;
+};
+
+struct bench_job {
+	pthread_t		thread;
+	unsigned int		index;
+	struct bench_ctx	*ctx;
+	int			fd;
+	struct io_uring		ring;
+	struct bench_io		*ios;
+	uint64_t		rand_state;
+	uint64_t		seq_block;	/* next block of a sequential workload */
+	uint64_t		rd_ios;
+	uint64_t		wr_ios;
+	unsigned int		inflight;	/* left unreaped, their buffers can't be freed */
+	int			error;
+	struct cbd_hist		rd_hist;
+	struct cbd_hist		wr_hist;
+};
+
+struct bench_ctx {
+	const char		*path;
+	enum bench_rw		rw;
+	unsigned int		bs;
+	unsigned int		iodepth;
+	unsigned int		jobs;
+	uint64_t		blocks;
+	volatile bool		stop;
+	struct bench_job	*job;
+};
+
+static int bench_parse_rw(const char *name, enum bench_rw *rw)
+{
+	if (!name[0]) {
+		*rw = BENCH_RANDREAD;
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < sizeof(bench_rw_names) / sizeof(bench_rw_names[0]); i++) {
+		if (strcmp(name, bench_rw_names[i]) == 0) {
+			*rw = (enum bench_rw)i;
+			return 0;
+		}
+	}
+
+	printf("Unknown workload '%s'\n", name);
+	return -EINVAL;
+}
+
+static bool bench_rw_writes(enum bench_rw rw)
+{
+	return rw == BENCH_RANDWRITE || rw == BENCH_RANDRW || rw == BENCH_WRITE;
+}
+
+static uint64_t bench_rand(struct bench_job *job)
+{
+	/* xorshift64*, plenty for spreading offsets */
+	job->rand_state ^= job->rand_state >> 12;
+	job->rand_state ^= job->rand_state << 25;
+	job->rand_state ^= job->rand_state >> 27;
+	return job->rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int bench_queue_io(struct bench_job *job, struct bench_io *io)
+{
+	struct bench_ctx *ctx = job->ctx;
+	struct io_uring_sqe *sqe;
+	uint64_t block;
+
+	sqe = io_uring_get_sqe(&job->ring);
+	if (!sqe)
+		return -EBUSY;
+
+	switch (ctx->rw) {
+	case BENCH_READ:
+	case BENCH_WRITE:
+		block = job->seq_block++;
+		if (job->seq_block >= ctx->blocks)
+			job->seq_block = 0;
+		break;
+	default:
+		block = bench_rand(job) % ctx->blocks;
+		break;
+	}
+
+	if (ctx->rw == BENCH_RANDRW)
+		io->write = bench_rand(job) & 1;
+	else
+		io->write = (ctx->rw == BENCH_RANDWRITE || ctx->rw == BENCH_WRITE);
+
+	if (io->write)
+		io_uring_prep_write(sqe, job->fd, io->buf, ctx->bs, block * ctx->bs);
+	else
+		io_uring_prep_read(sqe, job->fd, io->buf, ctx->bs, block * ctx->bs);
+	io_uring_sqe_set_data(sqe, io);
+
+	io->start_ns = cbd_now_ns();
+	return 0;
+}
+
+static void *bench_job_fn(void *arg)
+{
+	struct bench_job *job = arg;
+	struct bench_ctx *ctx = job->ctx;
+	unsigned int inflight = 0;
+	int ret;
+
+	for (unsigned int i = 0; i < ctx->iodepth; i++) {
+		if (bench_queue_io(job, &job->ios[i]) == 0)
+			inflight++;
+	}
+
+	while (inflight) {
+		struct io_uring_cqe *cqe;
+
+		ret = io_uring_submit_and_wait(&job->ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			job->error = ret;
+			break;
+		}
+
+		while (io_uring_peek_cqe(&job->ring, &cqe) == 0) {
+			struct bench_io *io = io_uring_cqe_get_data(cqe);
+			uint64_t lat = cbd_now_ns() - io->start_ns;
+
+			if (cqe->res != (int)ctx->bs) {
+				job->error = cqe->res < 0 ? cqe->res : -EIO;
+				ctx->stop = true;
+			} else if (io->write) {
+				cbd_hist_record(&job->wr_hist, lat);
+				job->wr_ios++;
+			} else {
+				cbd_hist_record(&job->rd_hist, lat);
+				job->rd_ios++;
+			}
+			io_uring_cqe_seen(&job->ring, cqe);
+			inflight--;
+
+			if (!ctx->stop && bench_queue_io(job, io) == 0)
+				inflight++;
+		}
+	}
+
+	/* The kernel may still DMA into the buffers of submitted requests, reap them first */
+	inflight -= io_uring_sq_ready(&job->ring);
+	while (inflight) {
+		struct io_uring_cqe *cqe;
+
+		ret = io_uring_wait_cqe(&job->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		io_uring_cqe_seen(&job->ring, cqe);
+		inflight--;
+	}
+	job->inflight = inflight;
+
+	return NULL;
+}
+
+static int bench_open_target(const char *path, bool write, uint64_t *size)
+{
+	struct stat st;
+	int fd, ret;
+
+	fd = open(path, (write ? O_RDWR : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0)
+		goto err;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size) < 0)
+			goto err;
+	} else {
+		*size = st.st_size;
+	}
+
+	return fd;
+err:
+	ret = -errno;
+	printf("Failed to get size of '%s': %s\n", path, strerror(-ret));
+	close(fd);
+	return ret;
+}
+
+static void bench_job_cleanup(struct bench_job *job, unsigned int iodepth)
+{
+	if (job->ios) {
+		io_uring_queue_exit(&job->ring);
+		/* Better leaked than reused under a request that might still complete */
+		for (unsigned int i = 0; !job->inflight && i < iodepth; i++)
+			free(job->ios[i].buf);
+		free(job->ios);
+	}
+
+	if (job->fd >= 0)
+		close(job->fd);
+}
+
+static int bench_job_setup(struct bench_ctx *ctx, struct bench_job *job, unsigned int index)
+{
+	uint64_t size;
+	int ret;
+
+	job->index = index;
+	job->ctx = ctx;
+	job->rand_state = 0x9E3779B97F4A7C15ULL * (index + 1) ^ cbd_now_ns();
+	job->seq_block = ctx->blocks / ctx->jobs * index;
+	cbd_hist_init(&job->rd_hist);
+	cbd_hist_init(&job->wr_hist);
+
+	/* Own fd and ring per job, nothing is shared on the I/O path */
+	job->fd = bench_open_target(ctx->path, bench_rw_writes(ctx->rw), &size);
+	if (job->fd < 0)
+		return job->fd;
+
+	ret = io_uring_queue_init(ctx->iodepth, &job->ring, 0);
+	if (ret < 0) {
+		printf("Failed to set up io_uring: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	job->ios = calloc(ctx->iodepth, sizeof(*job->ios));
+	if (!job->ios) {
+		io_uring_queue_exit(&job->ring);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < ctx->iodepth; i++) {
+		job->ios[i].job = job;
+		if (posix_memalign(&job->ios[i].buf, BENCH_BUF_ALIGN, ctx->bs))
+			return -ENOMEM;
+		/* Non-zero pattern, so writes aren't optimized away by dedup or zero detection */
+		memset(job->ios[i].buf, 0xa5 ^ i, ctx->bs);
+	}
+
+	return 0;
+}
+
+static json_t *bench_hist_to_json(struct cbd_hist *hist)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+	static const char *names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+	json_t *json_lat = json_object();
+
+	json_object_set_new(json_lat, "min", json_integer(hist->count ? hist->min : 0));
+	json_object_set_new(json_lat, "mean", json_real(cbd_hist_mean(hist)));
+	json_object_set_new(json_lat, "max", json_integer(hist->max));
+	for (unsigned int i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		json_object_set_new(json_lat, names[i], json_integer(cbd_hist_percentile(hist, percentiles[i])));
+
+	return json_lat;
+}
+
+static json_t *bench_dir_to_json(uint64_t ios, struct cbd_hist *hist, unsigned int bs, double elapsed)
+{
+	json_t *json_dir = json_object();
+
+	json_object_set_new(json_dir, "ios", json_integer(ios));
+	json_object_set_new(json_dir, "iops", json_real(ios / elapsed));
+	json_object_set_new(json_dir, "bw_bytes", json_real(ios * (double)bs / elapsed));
+	json_object_set_new(json_dir, "lat_ns", bench_hist_to_json(hist));
+
+	return json_dir;
+}
+
+/* Run the workload of @ctx on @path and return its result, NULL on failure */
+static json_t *bench_run(struct bench_ctx *ctx, const char *path, unsigned long runtime_us)
+{
+	struct cbd_hist rd_hist, wr_hist;
+	uint64_t rd_ios = 0, wr_ios = 0;
+	uint64_t size, start_ns;
+	unsigned int started = 0;
+	double elapsed;
+	json_t *json_res = NULL;
+	uint64_t deadline_ns, now_ns;
+	int fd, ret = 0;
+
+	ctx->path = path;
+	ctx->stop = false;
+
+	fd = bench_open_target(path, bench_rw_writes(ctx->rw), &size);
+	if (fd < 0)
+		return NULL;
+	close(fd);
+
+	ctx->blocks = size / ctx->bs;
+	if (!ctx->blocks) {
+		printf("'%s' is smaller than the block size %u\n", path, ctx->bs);
+		return NULL;
+	}
+
+	ctx->job = calloc(ctx->jobs, sizeof(*ctx->job));
+	if (!ctx->job)
+		return NULL;
+
+	for (unsigned int i = 0; i < ctx->jobs; i++)
+		ctx->job[i].fd = -1;
+
+	for (unsigned int i = 0; i < ctx->jobs; i++) {
+		ret = bench_job_setup(ctx, &ctx->job[i], i);
+		if (ret < 0)
+			goto out;
+	}
+
+	start_ns = cbd_now_ns();
+	for (; started < ctx->jobs; started++) {
+		ret = pthread_create(&ctx->job[started].thread, NULL, bench_job_fn, &ctx->job[started]);
+		if (ret) {
+			ctx->stop = true;
+			break;
+		}
+	}
+
+	/* Short sleeps, a signal delivered to a job thread doesn't interrupt this one */
+	deadline_ns = start_ns + runtime_us * 1000ULL;
+	while (!ret && !cbdctrl_stopping && (now_ns = cbd_now_ns()) < deadline_ns)
+		cbd_sleep_until_ns(deadline_ns - now_ns > BENCH_STOP_POLL_NS ? now_ns + BENCH_STOP_POLL_NS :
+				   deadline_ns);
+	ctx->stop = true;
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(ctx->job[i].thread, NULL);
+	elapsed = (cbd_now_ns() - start_ns) / 1e9;
+
+	if (ret) {
+		printf("Failed to start bench job: %s\n", strerror(ret));
+		goto out;
+	}
+
+	cbd_hist_init(&rd_hist);
+	cbd_hist_init(&wr_hist);
+	for (unsigned int i = 0; i < ctx->jobs; i++) {
+		struct bench_job *job = &ctx->job[i];
+
+		if (job->error) {
+			printf("I/O error on '%s': %s\n", path, strerror(-job->error));
+			goto out;
+		}
+
+		cbd_hist_merge(&rd_hist, &job->rd_hist);
+		cbd_hist_merge(&wr_hist, &job->wr_hist);
+		rd_ios += job->rd_ios;
+		wr_ios += job->wr_ios;
+	}
+
+	json_res = json_object();
+	json_object_set_new(json_res, "path", json_string(path));
+	json_object_set_new(json_res, "rw", json_string(bench_rw_names[ctx->rw]));
+	json_object_set_new(json_res, "bs", json_integer(ctx->bs));
+	json_object_set_new(json_res, "iodepth", json_integer(ctx->iodepth));
+	json_object_set_new(json_res, "jobs", json_integer(ctx->jobs));
+	json_object_set_new(json_res, "runtime", json_real(elapsed));
+	json_object_set_new(json_res, "iops", json_real((rd_ios + wr_ios) / elapsed));
+	json_object_set_new(json_res, "bw_bytes", json_real((rd_ios + wr_ios) * (double)ctx->bs / elapsed));
+	if (rd_ios)
+		json_object_set_new(json_res, "read", bench_dir_to_json(rd_ios, &rd_hist, ctx->bs, elapsed));
+	if (wr_ios)
+		json_object_set_new(json_res, "write", bench_dir_to_json(wr_ios, &wr_hist, ctx->bs, elapsed));
+out:
+	for (unsigned int i = 0; i < ctx->jobs; i++)
+		bench_job_cleanup(&ctx->job[i], ctx->iodepth);
+	free(ctx->job);
+	ctx->job = NULL;
+	return json_res;
+}
+
+static double bench_json_p99(json_t *json_res)
+{
+	json_t *json_dir = json_object_get(json_res, "read");
+
+	if (!json_dir)
+		json_dir = json_object_get(json_res, "write");
+	if (!json_dir)
+		return 0;
+
+	return json_number_value(json_object_get(json_object_get(json_dir, "lat_ns"), "p99"));
+}
+
+struct bench_phase {
+	const char		*cmd;
+	const char		*name;
+	struct cbd_hist		hist;
+};
+
+static void bench_phases_record(struct bench_phase *phases, unsigned int *nr_phases,
+				const char *cmd, struct cbd_timing *timing)
+{
+	for (unsigned int i = 0; i < timing->nr_phases; i++) {
+		struct cbd_timing_phase *tp = &timing->phases[i];
+		unsigned int j;
+
+		for (j = 0; j < *nr_phases; j++) {
+			if (phases[j].cmd == cmd && !strcmp(phases[j].name, tp->name))
+				break;
+		}
+
+		if (j == *nr_phases) {
+			phases[j].cmd = cmd;
+			phases[j].name = tp->name;
+			cbd_hist_init(&phases[j].hist);
+			(*nr_phases)++;
+		}
+		cbd_hist_record(&phases[j].hist, tp->ns);
+	}
+}
+
+/*
+ * bench --timing: repeat dev-start/dev-stop on a backend and report every
+ * lifecycle phase as a latency histogram across the cycles.
+ */
+static int bench_lifecycle(cbd_opt_t *options)
+{
+	static const char *cmds[] = { "dev-start", "dev-stop" };
+	unsigned long cycles = options->co_count ? options->co_count : CBD_BENCH_CYCLES_DEFAULT;
+	struct cbd_timing start_timing, stop_timing;
+	struct bench_phase *phases;
+	unsigned int nr_phases = 0;
+	unsigned long done = 0;
+	json_t *json_out;
+	char *json_str;
+	int ret = 0;
+
+	if (options->co_backend_id == UINT_MAX) {
+		printf("--backend required for bench --timing\n");
+		return -EINVAL;
+	}
+
+	phases = calloc(2 * CBD_TIMING_PHASES_MAX, sizeof(*phases));
+	if (!phases)
+		return -ENOMEM;
+
+	cbd_timing_init(&start_timing);
+	cbd_timing_init(&stop_timing);
+
+	/* Ctrl-C ends the cycles early and still reports what was measured */
+	cbdctrl_catch_stop_signals();
+
+	for (done = 0; done < cycles && !cbdctrl_stopping; done++) {
+		ret = cbdctrl_dev_cycle(options->co_transport_id, options->co_backend_id,
+					&start_timing, &stop_timing);
+		if (ret) {
+			printf("cycle %lu failed: %s\n", done, strerror(-ret));
+			break;
+		}
+
+		bench_phases_record(phases, &nr_phases, cmds[0], &start_timing);
+		bench_phases_record(phases, &nr_phases, cmds[1], &stop_timing);
+	}
+
+	json_out = json_object();
+	json_object_set_new(json_out, "backend_id", json_integer(options->co_backend_id));
+	json_object_set_new(json_out, "cycles", json_integer(done));
+	for (unsigned int c = 0; c < sizeof(cmds) / sizeof(cmds[0]); c++) {
+		json_t *json_cmd = json_object();
+
+		for (unsigned int i = 0; i < nr_phases; i++) {
+			if (phases[i].cmd == cmds[c])
+				json_object_set_new(json_cmd, phases[i].name, bench_hist_to_json(&phases[i].hist));
+		}
+		json_object_set_new(json_out, cmds[c], json_cmd);
+	}
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	cbd_timing_exit(&start_timing);
+	cbd_timing_exit(&stop_timing);
+	free(phases);
+
+	return ret;
+}
+
+int cbdctrl_bench(cbd_opt_t *options)
+{
+	struct bench_ctx ctx = { 0 };
+	struct cbd_transport cbdt;
+	struct cbd_blkdev blkdev;
+	struct cbd_backend backend;
+	char path[CBD_PATH_LEN];
+	json_t *json_dev, *json_backend = NULL, *json_out;
+	char *json_str;
+	int ret;
+
+	if (options->co_timing)
+		return bench_lifecycle(options);
+
+	ret = bench_parse_rw(options->co_rw, &ctx.rw);
+	if (ret)
+		return ret;
+
+	ctx.bs = options->co_bs;
+	ctx.iodepth = options->co_iodepth;
+	ctx.jobs = options->co_jobs ? options->co_jobs : 1;
+	if (!ctx.bs || ctx.bs % 512 || !ctx.iodepth) {
+		printf("Block size must be a multiple of 512, iodepth must be greater than 0\n");
+		return -EINVAL;
+	}
+
+	if (options->co_dev_id != UINT_MAX) {
+		ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+		if (ret < 0) {
+			printf("transport for id %u not found.\n", options->co_transport_id);
+			return ret;
+		}
+
+		ret = cbdsys_blkdev_init(&cbdt, &blkdev, options->co_dev_id);
+		if (ret < 0 || !blkdev.alive || blkdev.host_id != cbdt.host_id) {
+			printf("blkdev %u is not alive on this host.\n", options->co_dev_id);
+			return -ENOENT;
+		}
+		strncpy(path, blkdev.dev_name, sizeof(path) - 1);
+		path[sizeof(path) - 1] = '\0';
+	} else if (strlen(options->co_path)) {
+		strncpy(path, options->co_path, sizeof(path));
+	} else {
+		printf("--dev or --path required for bench command\n");
+		return -EINVAL;
+	}
+
+	if (bench_rw_writes(ctx.rw) && !options->co_force) {
+		printf("%s overwrites data on %s, use --force to confirm\n", bench_rw_names[ctx.rw], path);
+		return -EINVAL;
+	}
+
+	if (options->co_compare_backend) {
+		if (options->co_dev_id == UINT_MAX) {
+			printf("--compare-backend requires --dev\n");
+			return -EINVAL;
+		}
+
+		/* Writing the backend directly would bypass and corrupt the cache */
+		if (bench_rw_writes(ctx.rw)) {
+			printf("--compare-backend only supports read workloads\n");
+			return -EINVAL;
+		}
+
+		ret = cbdsys_backend_info_init(&cbdt, &backend, blkdev.backend_id);
+		if (ret < 0 || backend.host_id != cbdt.host_id) {
+			printf("backend %u is not on this host.\n", blkdev.backend_id);
+			return -ENOENT;
+		}
+	}
+
+	/* Ctrl-C ends the run early and still reports what was measured */
+	cbdctrl_catch_stop_signals();
+
+	json_dev = bench_run(&ctx, path, options->co_runtime_us);
+	if (!json_dev)
+		return -EIO;
+
+	/* Interrupted during the device run, there's nothing to compare with */
+	if (!options->co_compare_backend || cbdctrl_stopping) {
+		json_out = json_dev;
+	} else {
+		json_backend = bench_run(&ctx, backend.backend_path, options->co_runtime_us);
+		if (!json_backend) {
+			json_decref(json_dev);
+			return -EIO;
+		}
+
+		json_out = json_object();
+		json_object_set_new(json_out, "device", json_dev);
+		json_object_set_new(json_out, "backend", json_backend);
+		json_object_set_new(json_out, "iops_ratio",
+			json_real(json_number_value(json_object_get(json_dev, "iops")) /
+				  json_number_value(json_object_get(json_backend, "iops"))));
+		if (bench_json_p99(json_dev) > 0)
+			json_object_set_new(json_out, "p99_ratio",
+				json_real(bench_json_p99(json_backend) / bench_json_p99(json_dev)));
+	}
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+
+	json_decref(json_out);
+	return 0;
+}
+
+int cbdctrl_bench_probe(const char *path, unsigned int iodepth, unsigned int jobs,
+			unsigned long runtime_us, double *iops)
+{
+	struct bench_ctx ctx = { 0 };
+	json_t *json_res;
+
+	ctx.rw = BENCH_RANDREAD;
+	ctx.bs = CBD_BENCH_BS_DEFAULT;
+	ctx.iodepth = iodepth;
+	ctx.jobs = jobs;
+
+	json_res = bench_run(&ctx, path, runtime_us);
+	if (!json_res)
+		return -EIO;
+
+	*iops = json_number_value(json_object_get(json_res, "iops"));
+	json_decref(json_res);
+	return 0;
+}
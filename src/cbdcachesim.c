@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdtrace.h"
+
+/*
+ * Offline model of the cbd cache: data is appended block by block to the
+ * current segment, segments are used as a ring, and GC reclaims the oldest
+ * segment once the used segments exceed cache_gc_percent, dropping whatever
+ * is still live in it. Writes always go to the cache (writeback), read
+ * misses are filled into the cache. Writeback is assumed to keep up, so GC
+ * never waits for dirty data.
+ */
+#define SIM_BLOCK_SIZE		(1U << CBD_TRACE_BLOCK_SHIFT)	/* cache accounting granularity */
+#define SIM_CONFIGS_MAX		256
+#define SIM_SEG_NONE		UINT32_MAX
+
+/* block -> segment map, open addressing; entries of reclaimed segments go stale */
+struct sim_entry {
+	uint64_t		block;		/* block + 1, 0 is an empty slot */
+	uint32_t		seg;
+	uint32_t		gen;
+};
+
+struct sim_result {
+	uint64_t		cache_size;
+	unsigned int		gc_percent;
+	uint64_t		rd_blocks;
+	uint64_t		rd_hit_blocks;
+	uint64_t		rd_ios;
+	uint64_t		rd_hit_ios;	/* reads served entirely from cache */
+	uint64_t		wr_ios;
+	uint64_t		wr_blocks;
+	uint64_t		wr_overwrites;	/* writes which replaced a cached block */
+	uint64_t		fill_blocks;
+	uint64_t		cache_blocks;	/* blocks written to the cache media */
+	uint64_t		bypass_blocks;	/* no free segment, I/O went around the cache */
+	uint64_t		gc_segs;
+	uint64_t		gc_live_blocks;	/* live blocks dropped by GC */
+	uint64_t		over_gc_ios;	/* I/Os seen with usage above the GC threshold */
+	int			error;
+};
+
+struct sim_ctx {
+	const struct cbd_trace	*trace;
+	uint64_t		seg_size;
+	uint64_t		gc_rate;	/* bytes per second, 0 for unlimited */
+	struct sim_result	*results;
+	unsigned int		nr_results;
+	unsigned int		next;
+	pthread_mutex_t		lock;
+};
+
+struct sim_cache {
+	uint32_t		nr_segs;
+	uint32_t		blocks_per_seg;
+	uint32_t		gc_segs;	/* GC starts above this many used segments */
+	uint32_t		head;		/* segment being filled */
+	uint32_t		tail;		/* oldest used segment */
+	uint32_t		used;
+	uint32_t		head_off;	/* blocks used in the head segment */
+	uint32_t		*gen;
+	uint32_t		*live;
+	struct sim_entry	*map;
+	uint64_t		map_mask;
+	uint64_t		map_used;
+	double			gc_credit;	/* bytes GC may reclaim with a limited rate */
+};
+
+static inline uint64_t sim_hash(uint64_t block)
+{
+	return (block * 0x9e3779b97f4a7c15ULL) >> 17;
+}
+
+static int sim_map_grow(struct sim_cache *cache)
+{
+	uint64_t size = cache->map ? (cache->map_mask + 1) * 2 : 1 << 20;
+	struct sim_entry *map = calloc(size, sizeof(*map));
+
+	if (!map)
+		return -ENOMEM;
+
+	for (uint64_t i = 0; cache->map && i <= cache->map_mask; i++) {
+		struct sim_entry *old = &cache->map[i];
+		uint64_t slot;
+
+		if (!old->block || old->seg == SIM_SEG_NONE || cache->gen[old->seg] != old->gen)
+			continue;
+
+		slot = sim_hash(old->block) & (size - 1);
+		while (map[slot].block)
+			slot = (slot + 1) & (size - 1);
+		map[slot] = *old;
+	}
+
+	free(cache->map);
+	cache->map = map;
+	cache->map_mask = size - 1;
+	/* stale entries were dropped on the way */
+	cache->map_used = 0;
+	for (uint64_t i = 0; i < size; i++)
+		cache->map_used += map[i].block != 0;
+
+	return 0;
+}
+
+/*
+ * Returns the slot of @block, which is either its live entry, or an empty or
+ * stale slot it can be inserted at.
+ */
+static struct sim_entry *sim_map_lookup(struct sim_cache *cache, uint64_t block)
+{
+	uint64_t slot = sim_hash(block + 1) & cache->map_mask;
+	struct sim_entry *reuse = NULL;
+
+	while (true) {
+		struct sim_entry *entry = &cache->map[slot];
+
+		if (!entry->block)
+			return reuse ? reuse : entry;
+
+		if (entry->block == block + 1)
+			return entry;
+
+		if (!reuse && (entry->seg == SIM_SEG_NONE || cache->gen[entry->seg] != entry->gen))
+			reuse = entry;
+
+		slot = (slot + 1) & cache->map_mask;
+	}
+}
+
+static inline bool sim_entry_live(struct sim_cache *cache, struct sim_entry *entry, uint64_t block)
+{
+	return entry->block == block + 1 && entry->seg != SIM_SEG_NONE &&
+	       cache->gen[entry->seg] == entry->gen;
+}
+
+static void sim_gc(struct sim_cache *cache, struct sim_result *res, uint64_t seg_size, bool limited)
+{
+	while (cache->used > cache->gc_segs && cache->tail != cache->head) {
+		if (limited) {
+			if (cache->gc_credit < seg_size)
+				break;
+			cache->gc_credit -= seg_size;
+		}
+
+		res->gc_live_blocks += cache->live[cache->tail];
+		res->gc_segs++;
+		cache->live[cache->tail] = 0;
+		cache->gen[cache->tail]++;
+		cache->tail = (cache->tail + 1) % cache->nr_segs;
+		cache->used--;
+	}
+}
+
+/* Allocate one block in the head segment, returns false if the cache is full */
+static bool sim_alloc(struct sim_cache *cache, struct sim_result *res, uint64_t seg_size,
+		      bool limited, uint32_t *seg)
+{
+	if (cache->head_off == cache->blocks_per_seg) {
+		if (cache->used == cache->nr_segs)
+			return false;
+
+		cache->head = (cache->head + 1) % cache->nr_segs;
+		cache->head_off = 0;
+		cache->used++;
+		sim_gc(cache, res, seg_size, limited);
+	}
+
+	cache->head_off++;
+	cache->live[cache->head]++;
+	*seg = cache->head;
+	return true;
+}
+
+static int sim_insert(struct sim_cache *cache, struct sim_entry *entry, uint64_t block, uint32_t seg)
+{
+	bool new_slot = !entry->block;
+
+	entry->block = block + 1;
+	entry->seg = seg;
+	entry->gen = cache->gen[seg];
+
+	if (new_slot && ++cache->map_used * 2 > cache->map_mask + 1)
+		return sim_map_grow(cache);
+
+	return 0;
+}
+
+static int sim_replay(const struct cbd_trace *trace, uint64_t seg_size, uint64_t gc_rate,
+		      struct sim_result *res)
+{
+	struct sim_cache cache = { 0 };
+	bool limited = gc_rate != 0;
+	uint64_t last_ts = trace->nr_ios ? trace->ios[0].ts_ns : 0;
+	int ret = 0;
+
+	cache.nr_segs = res->cache_size / seg_size;
+	cache.blocks_per_seg = seg_size >> CBD_TRACE_BLOCK_SHIFT;
+	cache.gc_segs = (uint64_t)cache.nr_segs * res->gc_percent / 100;
+	cache.used = 1;
+	cache.gen = calloc(cache.nr_segs, sizeof(*cache.gen));
+	cache.live = calloc(cache.nr_segs, sizeof(*cache.live));
+	if (!cache.gen || !cache.live || sim_map_grow(&cache)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (uint64_t i = 0; i < trace->nr_ios && !ret; i++) {
+		const struct cbd_trace_io *io = &trace->ios[i];
+		uint64_t hits = 0;
+
+		if (limited && io->ts_ns > last_ts) {
+			cache.gc_credit += (double)(io->ts_ns - last_ts) * gc_rate / 1000000000.0;
+			/* idle time can't bank more than a full cache worth of GC */
+			if (cache.gc_credit > (double)res->cache_size)
+				cache.gc_credit = (double)res->cache_size;
+			sim_gc(&cache, res, seg_size, limited);
+		}
+		last_ts = io->ts_ns;
+
+		if (cache.used > cache.gc_segs)
+			res->over_gc_ios++;
+
+		for (uint64_t block = io->block; block < io->block + io->nr_blocks; block++) {
+			struct sim_entry *entry = sim_map_lookup(&cache, block);
+			bool live = sim_entry_live(&cache, entry, block);
+			uint32_t seg;
+
+			if (!io->write && live) {
+				hits++;
+				continue;
+			}
+
+			if (io->write && live) {
+				cache.live[entry->seg]--;
+				res->wr_overwrites++;
+			}
+
+			if (!sim_alloc(&cache, res, seg_size, limited, &seg)) {
+				res->bypass_blocks++;
+				/* the cached copy is older than what went to the backend */
+				if (live)
+					entry->seg = SIM_SEG_NONE;
+				continue;
+			}
+
+			if (!io->write)
+				res->fill_blocks++;
+			res->cache_blocks++;
+			ret = sim_insert(&cache, entry, block, seg);
+			if (ret)
+				break;
+		}
+
+		if (io->write) {
+			res->wr_ios++;
+			res->wr_blocks += io->nr_blocks;
+		} else {
+			res->rd_ios++;
+			res->rd_blocks += io->nr_blocks;
+			res->rd_hit_blocks += hits;
+			if (hits == io->nr_blocks)
+				res->rd_hit_ios++;
+		}
+	}
+
+out:
+	free(cache.map);
+	free(cache.gen);
+	free(cache.live);
+	return ret;
+}
+
+static void *sim_worker(void *arg)
+{
+	struct sim_ctx *ctx = arg;
+
+	while (true) {
+		struct sim_result *res;
+
+		pthread_mutex_lock(&ctx->lock);
+		res = ctx->next < ctx->nr_results ? &ctx->results[ctx->next++] : NULL;
+		pthread_mutex_unlock(&ctx->lock);
+		if (!res)
+			break;
+
+		res->error = sim_replay(ctx->trace, ctx->seg_size, ctx->gc_rate, res);
+	}
+
+	return NULL;
+}
+
+static double ratio(uint64_t num, uint64_t den)
+{
+	return den ? (double)num / den : 0;
+}
+
+static json_t *sim_result_to_json(struct sim_result *res, uint64_t seg_size)
+{
+	json_t *json_res = json_object();
+	uint64_t cache_wr = res->cache_blocks;
+
+	json_object_set_new(json_res, "cache_size", json_integer(res->cache_size));
+	json_object_set_new(json_res, "gc_percent", json_integer(res->gc_percent));
+	json_object_set_new(json_res, "read_hit_ratio", json_real(ratio(res->rd_hit_blocks, res->rd_blocks)));
+	json_object_set_new(json_res, "read_io_hit_ratio", json_real(ratio(res->rd_hit_ios, res->rd_ios)));
+	/* bytes written to the cache media per byte written by the host, read fills included */
+	json_object_set_new(json_res, "write_amplification", json_real(ratio(cache_wr, res->wr_blocks)));
+	json_object_set_new(json_res, "overwrite_ratio", json_real(ratio(res->wr_overwrites, res->wr_blocks)));
+	json_object_set_new(json_res, "fill_bytes", json_integer(res->fill_blocks << CBD_TRACE_BLOCK_SHIFT));
+	json_object_set_new(json_res, "bypass_bytes", json_integer(res->bypass_blocks << CBD_TRACE_BLOCK_SHIFT));
+	json_object_set_new(json_res, "gc_segments", json_integer(res->gc_segs));
+	json_object_set_new(json_res, "gc_segments_per_gb",
+		json_real(cache_wr ? res->gc_segs / ((double)(cache_wr << CBD_TRACE_BLOCK_SHIFT) / (1 << 30)) : 0));
+	/* share of reclaimed space which still held live data */
+	json_object_set_new(json_res, "gc_live_ratio",
+		json_real(ratio(res->gc_live_blocks, res->gc_segs * (seg_size >> CBD_TRACE_BLOCK_SHIFT))));
+	json_object_set_new(json_res, "over_gc_threshold_ratio",
+		json_real(ratio(res->over_gc_ios, res->rd_ios + res->wr_ios)));
+
+	return json_res;
+}
+
+/* Parse a comma separated list of sizes or percents into @vals */
+static int parse_list(const char *list, uint64_t *vals, unsigned int max, bool size)
+{
+	char buf[CBD_PATH_LEN];
+	char *tok, *save;
+	unsigned int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (n == max)
+			return -E2BIG;
+		vals[n++] = size ? opt_to_bytes(tok) : strtoull(tok, NULL, 10);
+	}
+
+	return n;
+}
+
+int cbdctrl_cache_sim(cbd_opt_t *options)
+{
+	struct cbd_trace trace = { 0 };
+	struct sim_ctx ctx = { 0 };
+	uint64_t sizes[SIM_CONFIGS_MAX], percents[SIM_CONFIGS_MAX];
+	int nr_sizes, nr_percents;
+	unsigned int threads;
+	pthread_t *tids = NULL;
+	uint64_t t0, t1, t2;
+	json_t *json_out, *json_trace, *json_results;
+	char *json_str;
+	int ret;
+
+	if (!strlen(options->co_path)) {
+		printf("--path <trace> required for cache-sim command\n");
+		return -EINVAL;
+	}
+
+	if (options->co_cache_sizes[0]) {
+		nr_sizes = parse_list(options->co_cache_sizes, sizes, SIM_CONFIGS_MAX, true);
+	} else if (options->co_cache_size) {
+		sizes[0] = (uint64_t)options->co_cache_size << 20;
+		nr_sizes = 1;
+	} else {
+		printf("--cache-size or --cache-sizes required for cache-sim command\n");
+		return -EINVAL;
+	}
+
+	nr_percents = parse_list(options->co_gc_percents[0] ? options->co_gc_percents : "70",
+				 percents, SIM_CONFIGS_MAX, false);
+	if (nr_sizes <= 0 || nr_percents <= 0 || nr_sizes * nr_percents > SIM_CONFIGS_MAX) {
+		printf("invalid sweep, at most %u cache size and GC percent combinations\n", SIM_CONFIGS_MAX);
+		return -EINVAL;
+	}
+
+	ctx.seg_size = options->co_segment_size ? options->co_segment_size : CBD_CACHE_SIM_SEG_SIZE_DEFAULT;
+	if (ctx.seg_size % SIM_BLOCK_SIZE) {
+		printf("segment size must be a multiple of %u\n", SIM_BLOCK_SIZE);
+		return -EINVAL;
+	}
+	ctx.gc_rate = options->co_gc_rate;
+
+	ctx.results = calloc(nr_sizes * nr_percents, sizeof(*ctx.results));
+	if (!ctx.results)
+		return -ENOMEM;
+
+	for (int i = 0; i < nr_sizes; i++) {
+		for (int j = 0; j < nr_percents; j++) {
+			struct sim_result *res = &ctx.results[ctx.nr_results++];
+
+			if (sizes[i] / ctx.seg_size < 2 || percents[j] == 0 || percents[j] > 100) {
+				printf("invalid config: cache size %lu (2 segments at least), gc percent %lu (1-100)\n",
+				       (unsigned long)sizes[i], (unsigned long)percents[j]);
+				ret = -EINVAL;
+				goto out;
+			}
+			res->cache_size = sizes[i] / ctx.seg_size * ctx.seg_size;
+			res->gc_percent = (unsigned int)percents[j];
+		}
+	}
+
+	t0 = cbd_now_ns();
+	ret = cbd_trace_load(options->co_path, &trace);
+	if (ret)
+		goto out;
+	if (!trace.nr_ios) {
+		printf("no read or write requests found in %s\n", options->co_path);
+		ret = -EINVAL;
+		goto out;
+	}
+	ctx.trace = &trace;
+
+	/* One replay per config, run side by side like the multi-threaded tp-bench runs */
+	t1 = cbd_now_ns();
+	threads = options->co_jobs ? options->co_jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > ctx.nr_results)
+		threads = ctx.nr_results;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	tids = calloc(threads, sizeof(*tids));
+	if (!tids) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < threads; i++) {
+		ret = pthread_create(&tids[i], NULL, sim_worker, &ctx);
+		if (ret) {
+			threads = i;
+			ret = -ret;
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	if (ret)
+		goto out;
+	t2 = cbd_now_ns();
+
+	json_trace = json_object();
+	json_object_set_new(json_trace, "path", json_string(options->co_path));
+	json_object_set_new(json_trace, "requests", json_integer(trace.nr_ios));
+	json_object_set_new(json_trace, "skipped_lines", json_integer(trace.skipped));
+	json_object_set_new(json_trace, "read_bytes", json_integer(trace.rd_bytes));
+	json_object_set_new(json_trace, "write_bytes", json_integer(trace.wr_bytes));
+	json_object_set_new(json_trace, "parse_sec", json_real((t1 - t0) / 1e9));
+	json_object_set_new(json_trace, "replay_sec", json_real((t2 - t1) / 1e9));
+
+	json_results = json_array();
+	for (unsigned int i = 0; i < ctx.nr_results; i++) {
+		if (ctx.results[i].error) {
+			ret = ctx.results[i].error;
+			printf("replay failed: %s\n", strerror(-ret));
+			json_decref(json_trace);
+			json_decref(json_results);
+			goto out;
+		}
+		json_array_append_new(json_results, sim_result_to_json(&ctx.results[i], ctx.seg_size));
+	}
+
+	json_out = json_object();
+	json_object_set_new(json_out, "trace", json_trace);
+	json_object_set_new(json_out, "segment_size", json_integer(ctx.seg_size));
+	json_object_set_new(json_out, "gc_rate", json_integer(ctx.gc_rate));
+	json_object_set_new(json_out, "results", json_results);
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+	ret = 0;
+out:
+	free(tids);
+	cbd_trace_free(&trace);
+	free(ctx.results);
+	return ret;
+}
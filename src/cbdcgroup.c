@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdcgroup.h"
+#include "libcbdsys.h"
+
+/* "253:0", as io.max and io.weight key their lines */
+static int cgroup_dev(unsigned int mapped_id, char *dev, size_t dev_len)
+{
+	char path[CBD_PATH_LEN];
+
+	block_dev_path(mapped_id, path, sizeof(path));
+	return read_sysfs_value(path, dev, dev_len);
+}
+
+static void cgroup_dir(const char *cgroup, char *dir, size_t dir_len)
+{
+	if (!strncmp(cgroup, CBD_CGROUP_ROOT "/", strlen(CBD_CGROUP_ROOT "/"))) {
+		snprintf(dir, dir_len, "%s", cgroup);
+		return;
+	}
+
+	while (*cgroup == '/')
+		cgroup++;
+	snprintf(dir, dir_len, "%s/%s", CBD_CGROUP_ROOT, cgroup);
+}
+
+/* @dir/@name in @path, -ENAMETOOLONG if it doesn't fit */
+static int cgroup_path(char *path, size_t path_len, const char *dir, const char *name)
+{
+	if (snprintf(path, path_len, "%s/%s", dir, name) >= (int)path_len)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/* Name of @dir as given to --cgroup */
+static const char *cgroup_name(const char *dir)
+{
+	const char *name = dir + strlen(CBD_CGROUP_ROOT);
+
+	while (*name == '/')
+		name++;
+	return *name ? name : "/";
+}
+
+/* The rest of the line of @dev in the cgroup file @path */
+static int cgroup_dev_line(const char *path, const char *dev, char *buf, size_t buf_len)
+{
+	size_t dev_len = strlen(dev);
+	char line[CBD_PATH_LEN];
+	int ret = -ENOENT;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, dev, dev_len) || line[dev_len] != ' ')
+			continue;
+
+		trim_newline(line);
+		snprintf(buf, buf_len, "%s", line + dev_len + 1);
+		ret = 0;
+		break;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+/* "rbps=max wbps=1048576 riops=max wiops=max" as {"wbps": 1048576}, NULL if unlimited */
+static json_t *cgroup_io_max_to_json(char *line)
+{
+	json_t *json_io_max = json_object();
+	char *tok, *save = NULL;
+
+	for (tok = strtok_r(line, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+		char *eq = strchr(tok, '=');
+
+		if (!eq || !strcmp(eq + 1, "max"))
+			continue;
+
+		*eq = '\0';
+		json_object_set_new(json_io_max, tok, json_integer(strtoull(eq + 1, NULL, 10)));
+	}
+
+	if (!json_object_size(json_io_max)) {
+		json_decref(json_io_max);
+		return NULL;
+	}
+	return json_io_max;
+}
+
+static int cgroup_limit_write(const char *dir, const char *file, const char *dev,
+			      const char *value)
+{
+	char path[PATH_MAX];
+	char line[CBD_PATH_LEN];
+	int fd, ret;
+
+	ret = cgroup_path(path, sizeof(path), dir, file);
+	if (ret < 0) {
+		printf("Path of %s in %s too long\n", file, dir);
+		return ret;
+	}
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		if (ret == -ENOENT)
+			printf("%s has no %s, add +io to cgroup.subtree_control of its parent\n",
+			       dir, file);
+		else
+			printf("Failed to open %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	snprintf(line, sizeof(line), "%s %s", dev, value);
+	if (write(fd, line, strlen(line)) < 0) {
+		ret = -errno;
+		printf("Failed to write '%s' to %s: %s\n", line, path, strerror(-ret));
+	}
+	close(fd);
+
+	return ret;
+}
+
+/* Whether every key=value of @wanted reads back from @json_io_max */
+static bool cgroup_io_max_match(const char *wanted, json_t *json_io_max)
+{
+	char buf[CBD_PATH_LEN];
+	char *tok, *save = NULL;
+
+	snprintf(buf, sizeof(buf), "%s", wanted);
+	for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+		char *eq = strchr(tok, '=');
+		json_t *json_value;
+
+		if (!eq)
+			continue;
+		*eq = '\0';
+
+		json_value = json_io_max ? json_object_get(json_io_max, tok) : NULL;
+		if (!strcmp(eq + 1, "max") ? json_value != NULL :
+		    !json_value || (uint64_t)json_integer_value(json_value) != strtoull(eq + 1, NULL, 10))
+			return false;
+	}
+
+	return true;
+}
+
+int cbd_cgroup_check(const char *cgroup)
+{
+	char dir[PATH_MAX];
+
+	cgroup_dir(cgroup, dir, sizeof(dir));
+	if (access(dir, F_OK)) {
+		printf("cgroup %s not found\n", dir);
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+int cbd_cgroup_apply(const char *cgroup, unsigned int mapped_id, const char *io_max,
+		     unsigned int io_weight, json_t **json_out)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	char dev[32], line[CBD_PATH_LEN];
+	json_t *json_limits = json_object();
+	bool ok = true;
+	int ret;
+
+	*json_out = json_limits;
+
+	ret = cbd_cgroup_check(cgroup);
+	if (ret < 0)
+		return ret;
+
+	cgroup_dir(cgroup, dir, sizeof(dir));
+	json_object_set_new(json_limits, "cgroup", json_string(cgroup_name(dir)));
+
+	ret = cgroup_dev(mapped_id, dev, sizeof(dev));
+	if (ret < 0) {
+		printf("Device number of %s%u not found\n", SYSFS_BLOCK_BASE_PATH, mapped_id);
+		return ret;
+	}
+	json_object_set_new(json_limits, "dev", json_string(dev));
+
+	if (io_max[0]) {
+		json_t *json_io_max = NULL;
+
+		ret = cgroup_limit_write(dir, "io.max", dev, io_max);
+		if (ret < 0)
+			return ret;
+
+		if (cgroup_path(path, sizeof(path), dir, "io.max") == 0 &&
+		    cgroup_dev_line(path, dev, line, sizeof(line)) == 0)
+			json_io_max = cgroup_io_max_to_json(line);
+		ok = cgroup_io_max_match(io_max, json_io_max);
+		json_object_set_new(json_limits, "io_max", json_io_max ? json_io_max : json_null());
+	}
+
+	if (io_weight) {
+		char value[16];
+
+		snprintf(value, sizeof(value), "%u", io_weight);
+		ret = cgroup_limit_write(dir, "io.weight", dev, value);
+		if (ret < 0)
+			return ret;
+
+		if (cgroup_path(path, sizeof(path), dir, "io.weight") == 0 &&
+		    cgroup_dev_line(path, dev, line, sizeof(line)) == 0) {
+			json_object_set_new(json_limits, "io_weight", json_integer(strtoul(line, NULL, 10)));
+			ok = ok && strtoul(line, NULL, 10) == io_weight;
+		} else {
+			ok = false;
+		}
+	}
+
+	json_object_set_new(json_limits, "ok", json_boolean(ok));
+	if (!ok)
+		printf("cgroup limits of %s in %s did not read back as written\n", dev, dir);
+
+	return ok ? 0 : -EIO;
+}
+
+struct cgroup_walk {
+	char			(*devs)[32];	/* "" for a blkdev without a device number */
+	unsigned int		nr;
+	json_t			**json_cgroups;	/* per blkdev */
+	json_t			**json_dir;	/* limits found in the current dir, per blkdev */
+};
+
+static json_t *cgroup_walk_limits(struct cgroup_walk *walk, const char *dir, unsigned int i)
+{
+	if (!walk->json_dir[i]) {
+		walk->json_dir[i] = json_object();
+		json_object_set_new(walk->json_dir[i], "cgroup", json_string(cgroup_name(dir)));
+	}
+	return walk->json_dir[i];
+}
+
+/* Hand every line of the cgroup file @name of @dir to the blkdev it is for */
+static void cgroup_walk_file(struct cgroup_walk *walk, const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	char line[CBD_PATH_LEN];
+	FILE *fp;
+
+	if (cgroup_path(path, sizeof(path), dir, name) < 0)
+		return;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *value = strchr(line, ' ');
+		unsigned int i;
+
+		if (!value)
+			continue;
+		*value++ = '\0';
+		trim_newline(value);
+
+		for (i = 0; i < walk->nr; i++) {
+			if (!strcmp(walk->devs[i], line))
+				break;
+		}
+		if (i == walk->nr)
+			continue;
+
+		if (!strcmp(name, "io.max")) {
+			json_t *json_io_max = cgroup_io_max_to_json(value);
+
+			if (json_io_max)
+				json_object_set_new(cgroup_walk_limits(walk, dir, i), "io_max", json_io_max);
+		} else {
+			json_object_set_new(cgroup_walk_limits(walk, dir, i), "io_weight",
+					    json_integer(strtol(value, NULL, 10)));
+		}
+	}
+	fclose(fp);
+}
+
+static void cgroup_walk(struct cgroup_walk *walk, const char *dir, unsigned int depth)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	DIR *d;
+
+	cgroup_walk_file(walk, dir, "io.max");
+	cgroup_walk_file(walk, dir, "io.weight");
+
+	for (unsigned int i = 0; i < walk->nr; i++) {
+		if (walk->json_dir[i]) {
+			json_array_append_new(walk->json_cgroups[i], walk->json_dir[i]);
+			walk->json_dir[i] = NULL;
+		}
+	}
+
+	if (depth == CBD_CGROUP_DEPTH_MAX)
+		return;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+
+		/* Too deep for a path is too deep to hold limits we could read */
+		if (cgroup_path(path, sizeof(path), dir, entry->d_name) == 0)
+			cgroup_walk(walk, path, depth + 1);
+	}
+	closedir(d);
+}
+
+int cbd_cgroup_limits_scan(const unsigned int *mapped_ids, unsigned int nr, json_t **json_cgroups)
+{
+	struct cgroup_walk walk = { .nr = nr, .json_cgroups = json_cgroups };
+	bool any = false;
+
+	for (unsigned int i = 0; i < nr; i++)
+		json_cgroups[i] = NULL;
+	if (!nr)
+		return 0;
+
+	walk.devs = calloc(nr, sizeof(*walk.devs));
+	walk.json_dir = calloc(nr, sizeof(*walk.json_dir));
+	if (!walk.devs || !walk.json_dir) {
+		free(walk.devs);
+		free(walk.json_dir);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < nr; i++) {
+		if (cgroup_dev(mapped_ids[i], walk.devs[i], sizeof(walk.devs[i])) < 0) {
+			walk.devs[i][0] = '\0';
+			continue;
+		}
+		json_cgroups[i] = json_array();
+		any = true;
+	}
+
+	if (any)
+		cgroup_walk(&walk, CBD_CGROUP_ROOT, 0);
+
+	free(walk.devs);
+	free(walk.json_dir);
+	return 0;
+}
+
+json_t *cbd_cgroup_limits_to_json(unsigned int mapped_id)
+{
+	json_t *json_cgroups;
+
+	if (cbd_cgroup_limits_scan(&mapped_id, 1, &json_cgroups) < 0)
+		return NULL;
+
+	return json_cgroups;
+}
@@ -0,0 +1,35 @@
+#ifndef CBDCGROUP_H
+#define CBDCGROUP_H
+
+#include <jansson.h>
+
+#include "cbdctrl.h"
+
+/*
+ * cgroup v2 I/O limits of a blkdev: io.max and io.weight take one
+ * "MAJ:MIN ..." line per device, the device number is read from
+ * /sys/block/cbdN/dev. A cgroup is given relative to CBD_CGROUP_ROOT, or
+ * as an absolute path below it.
+ */
+#define CBD_CGROUP_ROOT		"/sys/fs/cgroup"
+#define CBD_CGROUP_DEPTH_MAX	16		/* of the walk looking for limits */
+#define CBD_IO_WEIGHT_MIN	1
+#define CBD_IO_WEIGHT_MAX	10000
+
+/* Whether @cgroup exists */
+int cbd_cgroup_check(const char *cgroup);
+
+/* Write @io_max ("riops=N wbps=N ...") and @io_weight (0 for none), read back into *@json_out */
+int cbd_cgroup_apply(const char *cgroup, unsigned int mapped_id, const char *io_max,
+		     unsigned int io_weight, json_t **json_out);
+
+/* Every cgroup limiting /dev/cbd@mapped_id, NULL without a device number */
+json_t *cbd_cgroup_limits_to_json(unsigned int mapped_id);
+
+/*
+ * Same for @nr blkdevs in one walk of the cgroup tree, which is slow on a
+ * busy host: @json_cgroups[i] gets the limits of @mapped_ids[i].
+ */
+int cbd_cgroup_limits_scan(const unsigned int *mapped_ids, unsigned int nr, json_t **json_cgroups);
+
+#endif // CBDCGROUP_H
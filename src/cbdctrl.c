@@ -4,10 +4,22 @@
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
 #include <jansson.h>
 
 #include "cbdctrl.h"
+#include "cbdtiming.h"
+#include "cbdqueue.h"
+#include "cbdcgroup.h"
+#include "cbdmeta.h"
+#include "cbdrebalance.h"
 #include "libcbdsys.h"
 
 #define CBDCTL_PROGRAM_NAME "cbdctrl"
@@ -20,6 +32,10 @@ static void usage ()
 	fprintf(stdout, "   See the documentation for details on CBD:\n");
 	fprintf(stdout, "   https://datatravelguide.github.io/dtg-blog/cbd/cbd.html\n\n");
 
+	fprintf(stdout, "Global options:\n");
+	fprintf(stdout, "   --deadline <time>    Bound sysfs reads (units: ms, s; plain number is ms), each read waits at most %dms,\n", CBDSYS_ATTR_TIMEOUT_MS);
+	fprintf(stdout, "                        entities that time out are listed as \"stale\": true\n\n");
+
 	fprintf(stdout, "These are common cbdctrl commands used in various situations:\n\n");
 
 	fprintf(stdout, "Managing transports:\n");
@@ -40,26 +56,94 @@ static void usage ()
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s tp-list\n\n", CBDCTL_PROGRAM_NAME);
 
+	fprintf(stdout, "   tp-bench        Measure latency and bandwidth of transport memory\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                       --segment <n>            Benchmark this unused segment of the transport\n");
+	fprintf(stdout, "                   -p, --path <path>            Benchmark this image file or device instead\n");
+	fprintf(stdout, "                       --size <size>            Size of the range of --path (units: K, M, G)\n");
+	fprintf(stdout, "                       --jobs <n>               Threads of the multi-threaded runs (default: CPUs, max 8)\n");
+	fprintf(stdout, "                       --numa                   Repeat the measurements on every NUMA node\n");
+	fprintf(stdout, "                   -F, --force                  Confirm the segment is unused\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s tp-bench -t 0 --segment 300 -F --numa\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   tp-check        Verify the metadata of a transport image or device offline\n");
+	fprintf(stdout, "                       --image <path>           Transport device or image to check, mapped read-only\n");
+	fprintf(stdout, "                       --jobs <n>               Checksumming threads (default: CPUs, max 64)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s tp-check --image /dev/pmem0\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   tp-segments     Show how the segments of a transport are used and how fragmented the free ones are\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                       --image <path>           Read this transport device or image instead, no cbd module needed\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s tp-segments -t 0\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   tp-prepare      Zero a device in parallel before tp-reg --format, no cbd module needed\n");
+	fprintf(stdout, "                   -p, --path <path>            Block device, device DAX or image file\n");
+	fprintf(stdout, "                       --size <size>            Only prepare this much, creates or grows an image file\n");
+	fprintf(stdout, "                       --jobs <n>               Threads (default: CPUs, max 64)\n");
+	fprintf(stdout, "                       --verify                 Read the device back and check it is zeroed\n");
+	fprintf(stdout, "                   -i, --interval <time>        Progress interval (units: us, ms, s; default: 1s)\n");
+	fprintf(stdout, "                   -F, --force                  Confirm the device may be overwritten\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s tp-prepare -p /dev/dax0.0 -F --verify\n\n", CBDCTL_PROGRAM_NAME);
+
 	fprintf(stdout, "Managing hosts:\n");
 	fprintf(stdout, "   host-list       List all hosts\n");
 	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s host-list\n\n", CBDCTL_PROGRAM_NAME);
 
+	fprintf(stdout, "   host-monitor    Report hosts dying and coming back as NDJSON, run failover hooks on death\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -i, --interval <time>        Sampling interval, a tenth of it while a heartbeat is late (default: 1s)\n");
+	fprintf(stdout, "                       --hooks <dir>            Run the executables in dir in parallel when a host dies\n");
+	fprintf(stdout, "                       --clear-dead             Clear the blkdevs a dead host left behind\n");
+	fprintf(stdout, "                       --count <n>              Stop after n deaths (default: until interrupted)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s host-monitor --hooks /etc/cbd/failover.d --clear-dead\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   gc              Clear all dead blkdevs, and dead backends of dead hosts, of a transport\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                       --jobs <n>               Clears in flight (default: %d)\n", CBD_GC_JOBS_DEFAULT);
+	fprintf(stdout, "                       --dry-run                Only report what would be cleared\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s gc --dry-run\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   health          Check the module, transport, this host and a backend or blkdev within a time budget\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -b, --backend <bid>          Also check this backend is alive\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Also check this blkdev of this host is alive with its disk\n");
+	fprintf(stdout, "                       --local                  Also check every backend and blkdev of this host\n");
+	fprintf(stdout, "                       --deadline <time>        Time budget (default: %dms)\n", CBD_HEALTH_BUDGET_MS);
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Exit status: 0 ok, 1 bad arguments, 2 module, 3 transport, 4 host, 5 backend, 6 dev, 7 timeout\n");
+	fprintf(stdout, "                   Example: %s health --dev 0\n\n", CBDCTL_PROGRAM_NAME);
+
 	fprintf(stdout, "Managing backends:\n");
 	fprintf(stdout, "   backend-start   Start a backend\n");
 	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
 	fprintf(stdout, "                   -p, --path <path>            Specify backend path\n");
 	fprintf(stdout, "                   -c, --cache-size <size>      Set cache size (units: K, M, G)\n");
-	fprintf(stdout, "                   -n, --handlers <count>       Set handler count (max %d)\n", CBD_BACKEND_HANDLERS_MAX);
+	fprintf(stdout, "                   -n, --handlers <count|auto>  Set handler count (max %d), auto probes for the best count\n", CBD_BACKEND_HANDLERS_MAX);
 	fprintf(stdout, "                   -D, --start-dev              Start a blkdev at the same time\n");
+	fprintf(stdout, "                       --cpus <list>            Pin the handlers to the given CPUs (e.g. 0-7,16)\n");
+	fprintf(stdout, "                       --numa-local             Pin the handlers to the NUMA node of the transport\n");
+	fprintf(stdout, "                       --auto-place             Pick the transport with the most free cache segments, overrides -t\n");
+	fprintf(stdout, "                       --queue-profile <name|file> Queue settings of the -D blkdev, see dev-tune\n");
+	fprintf(stdout, "                       --cgroup, --io-max, --io-weight  cgroup I/O limits of the -D blkdev, see dev-start\n");
+	fprintf(stdout, "                       --timing                 Print the time of each phase as JSON\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
-	fprintf(stdout, "                   Example: %s backend-start -p /path -c 512M -n 1\n\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s backend-start -p /path -c 512M -n 1\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s backend-start -p /path -n 4 --numa-local\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s backend-start -p /path -c 1G --auto-place\n\n", CBDCTL_PROGRAM_NAME);
 
 	fprintf(stdout, "   backend-stop    Stop a backend\n");
 	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
 	fprintf(stdout, "                   -b, --backend <bid>          Specify backend ID\n");
 	fprintf(stdout, "                   -F, --force                  Force stop backend\n");
+	fprintf(stdout, "                       --timing                 Print the time of each phase as JSON\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s backend-stop --backend 0\n\n", CBDCTL_PROGRAM_NAME);
 
@@ -69,16 +153,43 @@ static void usage ()
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s backend-list\n\n", CBDCTL_PROGRAM_NAME);
 
+	fprintf(stdout, "   backend-stat    Sample backend cache statistics periodically\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -b, --backend <bid>          Sample only this backend\n");
+	fprintf(stdout, "                   -a, --all                    Sample backends on all hosts\n");
+	fprintf(stdout, "                   -i, --interval <time>        Sampling interval (units: us, ms, s; default: 1s)\n");
+	fprintf(stdout, "                       --count <n>              Stop after n samples (default: until interrupted)\n");
+	fprintf(stdout, "                       --ndjson                 Print one JSON object per line\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s backend-stat -b 0 -i 100ms\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   rebalance       Plan, or carry out, backend moves between transports to even out cache pressure\n");
+	fprintf(stdout, "                       --plan                   Only print the plan (default)\n");
+	fprintf(stdout, "                       --execute                Move the backends of this host as planned, one step at a time\n");
+	fprintf(stdout, "                       --count <n>              Plan at most n moves\n");
+	fprintf(stdout, "                       --profile <dir>          Warm each moved blkdev from <dir>/<backend file name>.prof\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s rebalance --plan\n\n", CBDCTL_PROGRAM_NAME);
+
 	fprintf(stdout, "Managing block devices:\n");
 	fprintf(stdout, "   dev-start       Start a block device\n");
 	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
 	fprintf(stdout, "                   -b, --backend <bid>          Specify backend ID\n");
+	fprintf(stdout, "                       --queue-profile <name|file> Apply queue settings before printing the device, see dev-tune\n");
+	fprintf(stdout, "                       --cgroup <path>          cgroup v2 of --io-max and --io-weight, relative to %s\n", CBD_CGROUP_ROOT);
+	fprintf(stdout, "                       --io-max <limits>        io.max of the device, riops=,wiops=,rbps=,wbps= (n, size units or max)\n");
+	fprintf(stdout, "                       --io-weight <weight>     io.weight of the device (%d-%d)\n", CBD_IO_WEIGHT_MIN, CBD_IO_WEIGHT_MAX);
+	fprintf(stdout, "                       --timing                 Print the time of each phase as JSON\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
-	fprintf(stdout, "                   Example: %s dev-start --backend 0\n\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s dev-start --backend 0\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s dev-start --backend 0 --queue-profile latency\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s dev-start --backend 0 --cgroup tenant-a --io-max riops=20000,wbps=200M\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s dev-start --backend 0 --timing\n\n", CBDCTL_PROGRAM_NAME);
 
 	fprintf(stdout, "   dev-stop        Stop a block device\n");
 	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
 	fprintf(stdout, "                   -d, --dev <dev_id>           Specify device ID\n");
+	fprintf(stdout, "                       --timing                 Print the time of each phase as JSON\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s dev-stop --dev 0\n\n", CBDCTL_PROGRAM_NAME);
 
@@ -87,6 +198,109 @@ static void usage ()
 	fprintf(stdout, "                   -a, --all                    List blkdevs on all hosts\n");
 	fprintf(stdout, "                   -h, --help                   Print this help message\n");
 	fprintf(stdout, "                   Example: %s blkdev-list\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   dev-tune        Show or set the block queue settings and cgroup I/O limits of a blkdev on this host\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Specify device ID\n");
+	fprintf(stdout, "                       --queue-profile <name|file> Apply and verify latency, throughput or a file of attr = value lines\n");
+	fprintf(stdout, "                       --cgroup, --io-max, --io-weight  Set cgroup I/O limits, as dev-start\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s dev-tune -d 0 --queue-profile throughput\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   dev-stat        Sample I/O statistics of blkdevs on this host\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Sample only this device\n");
+	fprintf(stdout, "                   -i, --interval <time>        Sampling interval (units: us, ms, s; default: 1s)\n");
+	fprintf(stdout, "                       --count <n>              Stop after n samples (default: until interrupted)\n");
+	fprintf(stdout, "                       --ndjson                 Print one JSON object per line\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s dev-stat -i 1s\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   record          Record backend, host and blkdev state into a preallocated ring file\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                       --ring <file>            Ring file, appended to if it exists\n");
+	fprintf(stdout, "                       --size <size>            Size of a new ring (units: K, M, G; default: 64M)\n");
+	fprintf(stdout, "                   -i, --interval <time>        Sampling interval (units: us, ms, s; default: 1s)\n");
+	fprintf(stdout, "                       --count <n>              Stop after n samples (default: until interrupted)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s record --ring /var/lib/cbd/flight.bin --interval 1s\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   record-dump     Print the samples of a ring file as NDJSON, no cbd module needed\n");
+	fprintf(stdout, "                       --ring <file>            Ring file written by record\n");
+	fprintf(stdout, "                       --from <time>            Skip older samples (-<duration>, YYYY-MM-DD HH:MM:SS or unix seconds)\n");
+	fprintf(stdout, "                       --to <time>              Skip newer samples\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s record-dump --ring /var/lib/cbd/flight.bin --from -10m\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   bench           Run an io_uring O_DIRECT benchmark on a blkdev or any block device or file\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Benchmark this blkdev\n");
+	fprintf(stdout, "                   -p, --path <path>            Benchmark this block device or file\n");
+	fprintf(stdout, "                       --rw <workload>          randread, randwrite, randrw, read or write (default: randread)\n");
+	fprintf(stdout, "                       --bs <size>              Block size (units: K, M; default: 4K)\n");
+	fprintf(stdout, "                       --iodepth <n>            Queue depth per job (default: %d)\n", CBD_BENCH_IODEPTH_DEFAULT);
+	fprintf(stdout, "                       --jobs <n>               Number of jobs (default: 1)\n");
+	fprintf(stdout, "                       --runtime <time>         Duration (units: ms, s, m; default: 10s)\n");
+	fprintf(stdout, "                       --compare-backend        Run the same workload on the backend path\n");
+	fprintf(stdout, "                       --timing                 Cycle dev-start/dev-stop on --backend instead, report phase histograms\n");
+	fprintf(stdout, "                   -b, --backend <bid>          Backend of the --timing cycles\n");
+	fprintf(stdout, "                       --count <n>              Number of --timing cycles (default: %d)\n", CBD_BENCH_CYCLES_DEFAULT);
+	fprintf(stdout, "                   -F, --force                  Allow write workloads\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s bench -d 0 --rw randread --iodepth 64 --compare-backend\n", CBDCTL_PROGRAM_NAME);
+	fprintf(stdout, "                   Example: %s bench -b 0 --timing --count 50\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "Warming caches:\n");
+	fprintf(stdout, "   cache-profile   Capture an access profile of a blkdev or a trace for cache-warm\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Sample the I/O of this blkdev through tracefs\n");
+	fprintf(stdout, "                   -p, --path <trace>           Build the profile from a blkparse or CSV trace instead\n");
+	fprintf(stdout, "                       --profile <file>         Profile to write\n");
+	fprintf(stdout, "                       --region <size>          Granularity of the profile (default: 1M)\n");
+	fprintf(stdout, "                       --runtime <time>         Sampling duration (units: ms, s, m; default: 10s)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s cache-profile -d 0 --profile /var/lib/cbd/dev0.prof --runtime 10m\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   cache-warm      Read the hottest ranges of a profile to populate the cache of a blkdev\n");
+	fprintf(stdout, "                   -t, --transport <tid>        Specify transport ID\n");
+	fprintf(stdout, "                   -d, --dev <dev_id>           Warm this blkdev\n");
+	fprintf(stdout, "                       --profile <file>         Profile written by cache-profile\n");
+	fprintf(stdout, "                       --iodepth <n>            Reads in flight (default: %d)\n", CBD_BENCH_IODEPTH_DEFAULT);
+	fprintf(stdout, "                       --rate <size>            Bytes read per second, 0 for unlimited (default: 256M)\n");
+	fprintf(stdout, "                       --size <size>            Bytes to warm (default: cache size up to the GC threshold)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s cache-warm -d 0 --profile /var/lib/cbd/dev0.prof --iodepth 64\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "Monitoring:\n");
+	fprintf(stdout, "   export          Export metrics of all transports in Prometheus text format\n");
+	fprintf(stdout, "                       --listen <addr:port>     Serve metrics over HTTP\n");
+	fprintf(stdout, "                       --textfile <path>        Write metrics to a node_exporter textfile\n");
+	fprintf(stdout, "                   -i, --interval <time>        Refresh interval (units: us, ms, s; default: 1s)\n");
+	fprintf(stdout, "                       --count <n>              Stop after n refreshes (default: until interrupted)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s export --listen 127.0.0.1:9477\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "Planning:\n");
+	fprintf(stdout, "   cache-sim       Replay a block I/O trace through a model of the cache, no cbd module needed\n");
+	fprintf(stdout, "                   -p, --path <trace>           blkparse text output or CSV (seconds,R|W,offset,length)\n");
+	fprintf(stdout, "                   -c, --cache-size <size>      Cache size to simulate (units: K, M, G)\n");
+	fprintf(stdout, "                       --cache-sizes <list>     Sweep these cache sizes, e.g. 1G,2G,4G\n");
+	fprintf(stdout, "                       --gc-percents <list>     Sweep these GC thresholds, e.g. 50,70,90 (default: 70)\n");
+	fprintf(stdout, "                       --segment-size <size>    Transport bytes_per_segment (default: 16M)\n");
+	fprintf(stdout, "                       --gc-rate <size>         Bytes GC reclaims per second of trace time (default: unlimited)\n");
+	fprintf(stdout, "                       --jobs <n>               Replays run in parallel (default: CPUs)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s cache-sim -p trace.txt --cache-sizes 1G,2G,4G --gc-percents 50,70,90\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "Scripting:\n");
+	fprintf(stdout, "   batch           Run commands, one per line, in one process and print an NDJSON record per command\n");
+	fprintf(stdout, "                   -p, --path <file>            Read the commands from this file (default: stdin)\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: printf 'dev-stop -d 1\\ndev-list\\n' | %s batch\n\n", CBDCTL_PROGRAM_NAME);
+
+	fprintf(stdout, "   shell           Interactive batch, builtins: refresh, help, quit\n");
+	fprintf(stdout, "                   -h, --help                   Print this help message\n");
+	fprintf(stdout, "                   Example: %s shell\n\n", CBDCTL_PROGRAM_NAME);
 }
 
 static void cbd_options_init(cbd_opt_t* options)
@@ -126,9 +340,70 @@ static struct option long_options[] =
 	{"handlers", required_argument,0, 'n'},
 	{"force", no_argument, 0, 'F'},
 	{"all", no_argument, 0, 'a'},
+	{"interval", required_argument, 0, 'i'},
+	{"count", required_argument, 0, CLO_COUNT},
+	{"ndjson", no_argument, 0, CLO_NDJSON},
+	{"listen", required_argument, 0, CLO_LISTEN},
+	{"textfile", required_argument, 0, CLO_TEXTFILE},
+	{"rw", required_argument, 0, CLO_RW},
+	{"bs", required_argument, 0, CLO_BS},
+	{"iodepth", required_argument, 0, CLO_IODEPTH},
+	{"jobs", required_argument, 0, CLO_JOBS},
+	{"runtime", required_argument, 0, CLO_RUNTIME},
+	{"compare-backend", no_argument, 0, CLO_COMPARE_BACKEND},
+	{"segment", required_argument, 0, CLO_SEGMENT},
+	{"size", required_argument, 0, CLO_SIZE},
+	{"numa", no_argument, 0, CLO_NUMA},
+	{"cpus", required_argument, 0, CLO_CPUS},
+	{"numa-local", no_argument, 0, CLO_NUMA_LOCAL},
+	{"auto-place", no_argument, 0, CLO_AUTO_PLACE},
+	{"timing", no_argument, 0, CLO_TIMING},
+	{"image", required_argument, 0, CLO_IMAGE},
+	{"cache-sizes", required_argument, 0, CLO_CACHE_SIZES},
+	{"gc-percents", required_argument, 0, CLO_GC_PERCENTS},
+	{"segment-size", required_argument, 0, CLO_SEGMENT_SIZE},
+	{"gc-rate", required_argument, 0, CLO_GC_RATE},
+	{"profile", required_argument, 0, CLO_PROFILE},
+	{"region", required_argument, 0, CLO_REGION},
+	{"rate", required_argument, 0, CLO_RATE},
+	{"deadline", required_argument, 0, CLO_DEADLINE},
+	{"hooks", required_argument, 0, CLO_HOOKS},
+	{"clear-dead", no_argument, 0, CLO_CLEAR_DEAD},
+	{"dry-run", no_argument, 0, CLO_DRY_RUN},
+	{"verify", no_argument, 0, CLO_VERIFY},
+	{"queue-profile", required_argument, 0, CLO_QUEUE_PROFILE},
+	{"cgroup", required_argument, 0, CLO_CGROUP},
+	{"io-max", required_argument, 0, CLO_IO_MAX},
+	{"io-weight", required_argument, 0, CLO_IO_WEIGHT},
+	{"ring", required_argument, 0, CLO_RING},
+	{"from", required_argument, 0, CLO_FROM},
+	{"to", required_argument, 0, CLO_TO},
+	{"local", no_argument, 0, CLO_LOCAL},
+	{"plan", no_argument, 0, CLO_PLAN},
+	{"execute", no_argument, 0, CLO_EXECUTE},
 	{0, 0, 0, 0},
 };
 
+/*
+ * batch and shell parse every line with the same parser, there a bad line
+ * must fail that line instead of ending the process.
+ */
+static jmp_buf *cbd_parse_env;
+
+static __attribute__((noreturn)) void cbd_parse_exit(int status)
+{
+	if (cbd_parse_env)
+		longjmp(*cbd_parse_env, status == EXIT_SUCCESS ? 1 : 2);
+	exit(status);
+}
+
+/* The line's error says enough, don't bury it under the whole usage */
+static void cbd_parse_usage(void)
+{
+	if (!cbd_parse_env)
+		usage();
+}
+
 unsigned int opt_to_MB(const char *input)
 {
 	char *endptr;
@@ -144,7 +419,7 @@ unsigned int opt_to_MB(const char *input)
 			size *= 1024;  /* Convert GiB to MiB */
 		} else {
 			fprintf(stderr, "Invalid unit for cache size: %s\n", endptr);
-			exit(EXIT_FAILURE);
+			cbd_parse_exit(EXIT_FAILURE);
 		}
 	} else {
 		/* Assume bytes if no unit; convert to MiB, rounding up */
@@ -154,6 +429,127 @@ unsigned int opt_to_MB(const char *input)
 	return (unsigned int)size;
 }
 
+unsigned long opt_to_bytes(const char *input)
+{
+	char *endptr;
+	unsigned long size = strtoul(input, &endptr, 10);
+
+	/* Convert to bytes based on unit suffix, bytes if no unit */
+	if (*endptr == '\0') {
+		/* Already in bytes */
+	} else if (strcasecmp(endptr, "K") == 0 || strcasecmp(endptr, "KiB") == 0) {
+		size *= 1024;
+	} else if (strcasecmp(endptr, "M") == 0 || strcasecmp(endptr, "MiB") == 0) {
+		size *= 1024 * 1024;
+	} else if (strcasecmp(endptr, "G") == 0 || strcasecmp(endptr, "GiB") == 0) {
+		size *= 1024 * 1024 * 1024UL;
+	} else {
+		fprintf(stderr, "Invalid unit for size: %s\n", endptr);
+		cbd_parse_exit(EXIT_FAILURE);
+	}
+
+	return size;
+}
+
+unsigned long opt_to_usec(const char *input)
+{
+	char *endptr;
+	unsigned long val = strtoul(input, &endptr, 10);
+
+	/* Convert to usecs based on unit suffix, milliseconds if no unit */
+	if (*endptr == '\0' || strcasecmp(endptr, "ms") == 0) {
+		val *= 1000;
+	} else if (strcasecmp(endptr, "us") == 0) {
+		/* Already in usecs, no conversion needed */
+	} else if (strcasecmp(endptr, "s") == 0) {
+		val *= 1000000;
+	} else if (strcasecmp(endptr, "m") == 0 || strcasecmp(endptr, "min") == 0) {
+		val *= 60 * 1000000UL;
+	} else {
+		fprintf(stderr, "Invalid unit for time: %s\n", endptr);
+		cbd_parse_exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+/* "-10m" before now, "2024-05-01 12:00:00" local time, or unix seconds, in unix ns */
+static uint64_t opt_to_unix_ns(const char *input)
+{
+	struct timespec now;
+	struct tm tm = { 0 };
+	const char *end;
+	char *endptr;
+	double secs;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (input[0] == '-')
+		return now.tv_sec * 1000000000ULL + now.tv_nsec - opt_to_usec(input + 1) * 1000ULL;
+
+	end = strptime(input, "%Y-%m-%d %H:%M:%S", &tm);
+	if (!end)
+		end = strptime(input, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end && *end == '\0') {
+		tm.tm_isdst = -1;
+		return (uint64_t)mktime(&tm) * 1000000000ULL;
+	}
+
+	secs = strtod(input, &endptr);
+	if (*endptr != '\0' || secs <= 0) {
+		fprintf(stderr, "Invalid time: %s (-<duration>, YYYY-MM-DD HH:MM:SS or unix seconds)\n", input);
+		cbd_parse_exit(EXIT_FAILURE);
+	}
+
+	return secs * 1e9;
+}
+
+/* "riops=1000,wbps=100M" as io.max wants it, "riops=1000 wbps=104857600" */
+static void opt_to_io_max(const char *input, char *buf, size_t buf_len)
+{
+	char spec[CBD_PATH_LEN];
+	char *tok, *save = NULL;
+	size_t len = 0;
+
+	snprintf(spec, sizeof(spec), "%s", input);
+	buf[0] = '\0';
+	for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(tok, '=');
+		unsigned long limit;
+		char *endptr;
+
+		if (len >= buf_len - 1) {
+			fprintf(stderr, "Too many io limits: %s\n", input);
+			cbd_parse_exit(EXIT_FAILURE);
+		}
+
+		if (value)
+			*value++ = '\0';
+
+		if (!value || (strcmp(tok, "riops") && strcmp(tok, "wiops") &&
+			       strcmp(tok, "rbps") && strcmp(tok, "wbps"))) {
+			fprintf(stderr, "Invalid io limit: %s (riops, wiops, rbps or wbps=<n|max>)\n", tok);
+			cbd_parse_exit(EXIT_FAILURE);
+		}
+
+		if (!strcmp(value, "max")) {
+			len += snprintf(buf + len, buf_len - len, "%s%s=max", len ? " " : "", tok);
+			continue;
+		}
+
+		/* Byte limits take size units, IOPS limits are plain numbers */
+		if (tok[1] == 'b') {
+			limit = opt_to_bytes(value);
+		} else {
+			limit = strtoul(value, &endptr, 10);
+			if (*endptr != '\0') {
+				fprintf(stderr, "Invalid io limit: %s=%s\n", tok, value);
+				cbd_parse_exit(EXIT_FAILURE);
+			}
+		}
+		len += snprintf(buf + len, buf_len - len, "%s%s=%lu", len ? " " : "", tok, limit);
+	}
+}
+
 /*
  * Public function that loops until command line options were parsed
  */
@@ -162,25 +558,32 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 	int arg; /* Current option */
 
 	if (argc < 2) {
-		usage();
-		exit(1);
+		cbd_parse_usage();
+		cbd_parse_exit(EXIT_FAILURE);
 	}
 	cbd_options_init(options);
 	options->co_cmd = cbd_get_cmd_type(argv[1]);
 	options->co_backend_id = UINT_MAX;
 	options->co_dev_id = UINT_MAX;
+	options->co_segment = UINT_MAX;
 	options->co_handlers = UINT_MAX;
 	options->co_transport_id = 0;
+	options->co_interval_us = CBD_STAT_INTERVAL_DEFAULT;
+	options->co_bs = CBD_BENCH_BS_DEFAULT;
+	options->co_iodepth = CBD_BENCH_IODEPTH_DEFAULT;
+	options->co_jobs = 0;
+	options->co_runtime_us = CBD_BENCH_RUNTIME_DEFAULT;
+	options->co_rate = CBD_CACHE_WARM_RATE_DEFAULT;
 
 	if (options->co_cmd == CCT_INVALID) {
-		usage();
-		exit(1);
+		cbd_parse_usage();
+		cbd_parse_exit(EXIT_FAILURE);
 	}
 
 	while (true) {
 		int option_index = 0;
 
-		arg = getopt_long(argc, argv, "a:h:t:H:b:d:p:f:c:n:D:F", long_options, &option_index);
+		arg = getopt_long(argc, argv, "a:h:t:H:b:d:p:f:c:n:D:Fi:", long_options, &option_index);
 		/* End of the options? */
 		if (arg == -1) {
 			break;
@@ -190,7 +593,7 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 		switch (arg) {
 		case 'h':
 			usage();
-			exit(EXIT_SUCCESS);
+			cbd_parse_exit(EXIT_SUCCESS);
 		case 't':
 			options->co_transport_id = strtoul(optarg, NULL, 10);
 			break;
@@ -203,8 +606,8 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 		case 'H':
 			if (!optarg || (strlen(optarg) == 0)) {
 				printf("Host name is null or empty!!\n");
-				usage();
-				exit(EXIT_FAILURE);
+				cbd_parse_usage();
+				cbd_parse_exit(EXIT_FAILURE);
 			}
 
 			strncpy(options->co_host, optarg, sizeof(options->co_host) - 1);
@@ -218,8 +621,8 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 		case 'p':
 			if (!optarg || (strlen(optarg) == 0)) {
 				printf("path is null or empty!!\n");
-				usage();
-				exit(EXIT_FAILURE);
+				cbd_parse_usage();
+				cbd_parse_exit(EXIT_FAILURE);
 			}
 
 			strncpy(options->co_path, optarg, sizeof(options->co_path) - 1);
@@ -229,11 +632,15 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 			break;
 
 		case 'n':
+			if (strcmp(optarg, "auto") == 0) {
+				options->co_handlers = CBD_BACKEND_HANDLERS_AUTO;
+				break;
+			}
 			options->co_handlers = strtoul(optarg, NULL, 10);
 			if (options->co_handlers > CBD_BACKEND_HANDLERS_MAX) {
 				printf("Handlers exceed maximum of %d!\n", CBD_BACKEND_HANDLERS_MAX);
-				usage();
-				exit(EXIT_FAILURE);
+				cbd_parse_usage();
+				cbd_parse_exit(EXIT_FAILURE);
 			}
 			break;
 		case 'a':
@@ -242,16 +649,191 @@ void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options)
 		case 'D':
 			options->co_start_dev = true;
 			break;
+		case 'i':
+			options->co_interval_us = opt_to_usec(optarg);
+			if (options->co_interval_us == 0) {
+				printf("Interval must be greater than 0!\n");
+				cbd_parse_exit(EXIT_FAILURE);
+			}
+			break;
+		case CLO_COUNT:
+			options->co_count = strtoul(optarg, NULL, 10);
+			break;
+		case CLO_NDJSON:
+			options->co_ndjson = true;
+			break;
+		case CLO_LISTEN:
+			strncpy(options->co_listen, optarg, sizeof(options->co_listen) - 1);
+			break;
+		case CLO_TEXTFILE:
+			strncpy(options->co_textfile, optarg, sizeof(options->co_textfile) - 1);
+			break;
+		case CLO_RW:
+			strncpy(options->co_rw, optarg, sizeof(options->co_rw) - 1);
+			break;
+		case CLO_BS:
+			options->co_bs = (unsigned int)opt_to_bytes(optarg);
+			break;
+		case CLO_IODEPTH:
+			options->co_iodepth = strtoul(optarg, NULL, 10);
+			break;
+		case CLO_JOBS:
+			options->co_jobs = strtoul(optarg, NULL, 10);
+			break;
+		case CLO_RUNTIME:
+			options->co_runtime_us = opt_to_usec(optarg);
+			break;
+		case CLO_COMPARE_BACKEND:
+			options->co_compare_backend = true;
+			break;
+		case CLO_SEGMENT:
+			options->co_segment = strtoul(optarg, NULL, 10);
+			break;
+		case CLO_SIZE:
+			options->co_size = opt_to_bytes(optarg);
+			break;
+		case CLO_NUMA:
+			options->co_numa = true;
+			break;
+		case CLO_CPUS:
+			strncpy(options->co_cpus, optarg, sizeof(options->co_cpus) - 1);
+			break;
+		case CLO_NUMA_LOCAL:
+			options->co_numa_local = true;
+			break;
+		case CLO_AUTO_PLACE:
+			options->co_auto_place = true;
+			break;
+		case CLO_TIMING:
+			options->co_timing = true;
+			break;
+		case CLO_IMAGE:
+			strncpy(options->co_image, optarg, sizeof(options->co_image) - 1);
+			break;
+		case CLO_HOOKS:
+			strncpy(options->co_hooks, optarg, sizeof(options->co_hooks) - 1);
+			break;
+		case CLO_CLEAR_DEAD:
+			options->co_clear_dead = true;
+			break;
+		case CLO_DRY_RUN:
+			options->co_dry_run = true;
+			break;
+		case CLO_VERIFY:
+			options->co_verify = true;
+			break;
+		case CLO_QUEUE_PROFILE:
+			strncpy(options->co_queue_profile, optarg, sizeof(options->co_queue_profile) - 1);
+			break;
+		case CLO_CGROUP:
+			strncpy(options->co_cgroup, optarg, sizeof(options->co_cgroup) - 1);
+			break;
+		case CLO_IO_MAX:
+			opt_to_io_max(optarg, options->co_io_max, sizeof(options->co_io_max));
+			break;
+		case CLO_IO_WEIGHT:
+			options->co_io_weight = strtoul(optarg, NULL, 10);
+			if (options->co_io_weight < CBD_IO_WEIGHT_MIN || options->co_io_weight > CBD_IO_WEIGHT_MAX) {
+				fprintf(stderr, "Invalid io weight: %s (%d-%d)\n", optarg,
+					CBD_IO_WEIGHT_MIN, CBD_IO_WEIGHT_MAX);
+				cbd_parse_exit(EXIT_FAILURE);
+			}
+			break;
+		case CLO_RING:
+			strncpy(options->co_ring, optarg, sizeof(options->co_ring) - 1);
+			break;
+		case CLO_FROM:
+			options->co_from_ns = opt_to_unix_ns(optarg);
+			break;
+		case CLO_TO:
+			options->co_to_ns = opt_to_unix_ns(optarg);
+			break;
+		case CLO_LOCAL:
+			options->co_local = true;
+			break;
+		case CLO_PLAN:
+			options->co_plan = true;
+			break;
+		case CLO_EXECUTE:
+			options->co_execute = true;
+			break;
+		case CLO_CACHE_SIZES:
+			strncpy(options->co_cache_sizes, optarg, sizeof(options->co_cache_sizes) - 1);
+			break;
+		case CLO_GC_PERCENTS:
+			strncpy(options->co_gc_percents, optarg, sizeof(options->co_gc_percents) - 1);
+			break;
+		case CLO_SEGMENT_SIZE:
+			options->co_segment_size = opt_to_bytes(optarg);
+			break;
+		case CLO_GC_RATE:
+			options->co_gc_rate = opt_to_bytes(optarg);
+			break;
+		case CLO_PROFILE:
+			strncpy(options->co_profile, optarg, sizeof(options->co_profile) - 1);
+			break;
+		case CLO_REGION:
+			options->co_region = opt_to_bytes(optarg);
+			break;
+		case CLO_RATE:
+			options->co_rate = opt_to_bytes(optarg);
+			break;
+		case CLO_DEADLINE:
+			options->co_deadline_ms = opt_to_usec(optarg) / 1000;
+			if (!options->co_deadline_ms)
+				options->co_deadline_ms = 1;
+			break;
 		case '?':
-			usage();
-			exit(EXIT_FAILURE);
+			cbd_parse_usage();
+			cbd_parse_exit(EXIT_FAILURE);
 		default:
-			usage();
-			exit(1);
+			cbd_parse_usage();
+			cbd_parse_exit(EXIT_FAILURE);
 		}
 	}
 }
 
+/*
+ * Parse one command of a batch, @argv[0] is the program name as for
+ * cbd_options_parser(). Returns 1 if only help was asked for.
+ */
+int cbd_options_parse_line(int argc, char *argv[], cbd_opt_t *options)
+{
+	jmp_buf env;
+	int ret;
+
+	ret = setjmp(env);
+	if (ret) {
+		cbd_parse_env = NULL;
+		return ret == 1 ? 1 : -EINVAL;
+	}
+
+	cbd_parse_env = &env;
+	optind = 0;		/* rescan from the start, as for a new argv */
+	cbd_options_parser(argc, argv, options);
+	cbd_parse_env = NULL;
+
+	return 0;
+}
+
+volatile sig_atomic_t cbdctrl_stopping;
+
+static void cbdctrl_stop_handler(int sig)
+{
+	cbdctrl_stopping = 1;
+}
+
+void cbdctrl_catch_stop_signals(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cbdctrl_stop_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
 void trim_newline(char *str) {
 	size_t len = strlen(str);
 	if (len > 0 && str[len - 1] == '\n') {
@@ -263,9 +845,6 @@ json_t *cbd_transport_to_json(struct cbd_transport *cbdt) {
 	/* Create a new JSON object */
 	json_t *json_obj = json_object();
 
-	/* Remove trailing newline from path */
-	trim_newline(cbdt->path);
-
 	/* Format magic as a hexadecimal string */
 	char magic_str[19]; // 16 digits + "0x" prefix + null terminator
 	snprintf(magic_str, sizeof(magic_str), "0x%016lx", cbdt->magic);
@@ -299,6 +878,17 @@ json_t *cbd_transport_to_json(struct cbd_transport *cbdt) {
 	return json_obj;
 }
 
+/* Placeholder for an entity whose attributes timed out under --deadline */
+static json_t *cbd_stale_to_json(const char *id_name, unsigned int id)
+{
+	json_t *json_obj = json_object();
+
+	json_object_set_new(json_obj, id_name, json_integer(id));
+	json_object_set_new(json_obj, "stale", json_true());
+
+	return json_obj;
+}
+
 int cbdctrl_transport_register(cbd_opt_t *opt)
 {
 	int ret = 0;
@@ -340,6 +930,12 @@ int cbdctrl_transport_list(cbd_opt_t *opt)
 			break;
 		}
 
+		if (ret == -ETIMEDOUT) {
+			json_array_append_new(array, cbd_stale_to_json("transport_id", i));
+			ret = 0;
+			continue;
+		}
+
 		if (ret < 0) {
 			json_decref(array);
 			return ret;
@@ -380,6 +976,10 @@ int cbdctrl_host_list(cbd_opt_t *opt)
 	for (unsigned int i = 0; i < cbdt.host_num; i++) {
 		struct cbd_host host;
 		ret = cbdsys_host_init(&cbdt, &host, i); // Initialize current host
+		if (ret == -ETIMEDOUT) {
+			json_array_append_new(array, cbd_stale_to_json("host_id", i));
+			continue;
+		}
 		if (ret < 0) {
 			continue;
 		}
@@ -405,14 +1005,62 @@ int cbdctrl_host_list(cbd_opt_t *opt)
 	return 0;
 }
 
-static int dev_start(unsigned int transport_id, unsigned int backend_id)
+static bool blkdev_alive(struct cbd_transport *cbdt, unsigned int blkdev_id)
+{
+	struct cbd_blkdev blkdev;
+
+	return cbdsys_blkdev_init(cbdt, &blkdev, blkdev_id) == 0 && blkdev.alive;
+}
+
+static bool backend_alive(struct cbd_transport *cbdt, unsigned int backend_id)
+{
+	struct cbd_backend backend;
+
+	return cbdsys_backend_info_init(cbdt, &backend, backend_id) == 0 && backend.alive;
+}
+
+/* Record phase @name once the alive state of an entity turns @alive */
+static int timing_wait_alive(struct cbd_timing *timing, const char *name,
+			     bool (*is_alive)(struct cbd_transport *, unsigned int),
+			     struct cbd_transport *cbdt, unsigned int id, bool alive)
+{
+	uint64_t deadline_ns = cbd_now_ns() + CBD_TIMING_WAIT_MS * 1000000ULL;
+
+	while (is_alive(cbdt, id) != alive) {
+		if (cbd_now_ns() > deadline_ns) {
+			fprintf(stderr, "%s%s not reached within %dms\n", timing ? "timing: " : "",
+				name, CBD_TIMING_WAIT_MS);
+			return -ETIMEDOUT;
+		}
+		usleep(1000);
+	}
+
+	cbd_timing_mark(timing, name);
+	return 0;
+}
+
+/* From the blkdev found in sysfs to the first read served through its node */
+static void dev_start_timing(struct cbd_transport *cbdt, struct cbd_blkdev *blkdev,
+			     struct cbd_timing *timing)
+{
+	timing_wait_alive(timing, "alive", blkdev_alive, cbdt, blkdev->blkdev_id, true);
+	cbd_timing_wait_uevent(timing, "uevent", "add", blkdev->dev_name);
+	if (cbd_timing_wait_node(timing, "dev_node", blkdev->dev_name, true) == 0)
+		cbd_timing_wait_read(timing, "first_read", blkdev->dev_name);
+}
+
+static int dev_start(unsigned int transport_id, unsigned int backend_id, struct cbd_blkdev *blkdev,
+		     struct cbd_timing *timing)
 {
 	char adm_path[CBD_PATH_LEN];
 	char cmd[CBD_PATH_LEN * 3] = { 0 };
 	struct cbd_transport cbdt;
+	struct cbd_snapshot old_snap, new_snap;
 	struct cbd_backend old_backend, new_backend;
 	bool found = false;
 	struct cbd_blkdev *found_dev = NULL;
+	char lock_name[32];
+	int lock_fd;
 	int ret;
 
 	/* Initialize transport */
@@ -420,16 +1068,32 @@ static int dev_start(unsigned int transport_id, unsigned int backend_id)
 	if (ret)
 		return ret;
 
+	/*
+	 * The new blkdev is found by diffing the backend before and after the
+	 * write, keep other dev-starts on this backend out of the window.
+	 */
+	snprintf(lock_name, sizeof(lock_name), CBD_LOCK_BACKEND_FMT, backend_id);
+	lock_fd = cbdsys_lock(transport_id, lock_name);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	/* A batch may hold a snapshot from before another process took the lock */
+	cbdsys_cache_invalidate(transport_id);
+
 	/* Clear block devices associated with the backend */
 	ret = cbdsys_backend_blkdevs_clear(&cbdt, backend_id);
 	if (ret)
-		return ret;
+		goto unlock;
 
 	/* Get information about the current backend */
-	ret = cbdsys_backend_init(&cbdt, &old_backend, backend_id);
+	ret = cbdsys_snapshot_init(&cbdt, &old_snap);
+	if (ret)
+		goto unlock;
+
+	ret = cbdsys_backend_init(&cbdt, &old_snap, &old_backend, backend_id);
 	if (ret) {
 		printf("Failed to get current backend information. Error: %d\n", ret);
-		return ret;
+		goto release_old;
 	}
 
 	/* Prepare the dev-start command */
@@ -438,15 +1102,21 @@ static int dev_start(unsigned int transport_id, unsigned int backend_id)
 	/* Get the sysfs attribute path */
 	transport_adm_path(transport_id, adm_path, sizeof(adm_path));
 
+	cbd_timing_begin(timing);
 	ret = cbdsys_write_value(adm_path, cmd);
 	if (ret)
-		return ret;
+		goto release_old;
+	cbd_timing_mark(timing, "adm_write");
 
 	/* Get information about the backend after dev-start */
-	ret = cbdsys_backend_init(&cbdt, &new_backend, backend_id);
+	ret = cbdsys_snapshot_init(&cbdt, &new_snap);
+	if (ret)
+		goto release_old;
+
+	ret = cbdsys_backend_init(&cbdt, &new_snap, &new_backend, backend_id);
 	if (ret) {
 		printf("Failed to get new backend information. Error: %d\n", ret);
-		return ret;
+		goto release_new;
 	}
 
 	/* Compare old_backend and new_backend to identify new block devices */
@@ -455,10 +1125,10 @@ static int dev_start(unsigned int transport_id, unsigned int backend_id)
 			if (new_backend.blkdevs[i].host_id != cbdt.host_id)
 				continue;
 
+			/* Backends may have blkdevs on several hosts, skip every known one */
 			for (unsigned int j = 0; j < old_backend.dev_num; j++) {
 				if (new_backend.blkdevs[i].blkdev_id == old_backend.blkdevs[j].blkdev_id)
 					goto next;
-				break;
 			}
 
 			found_dev = &new_backend.blkdevs[i];
@@ -470,62 +1140,707 @@ next:
 
 	if (!found_dev) {
 		printf("No new block devices were added.\n");
-		return 1;
+		ret = 1;
+		goto release_new;
 	}
 
-	printf("%s\n", found_dev->dev_name);
-	return 0;
+	memcpy(blkdev, found_dev, sizeof(struct cbd_blkdev));
+	cbd_timing_mark(timing, "sysfs");
+release_new:
+	cbdsys_snapshot_release(&new_snap);
+release_old:
+	cbdsys_snapshot_release(&old_snap);
+unlock:
+	cbdsys_unlock(lock_fd);
+
+	if (!ret && timing)
+		dev_start_timing(&cbdt, blkdev, timing);
+	return ret;
 }
 
-int cbdctrl_backend_start(cbd_opt_t *options) {
+#define MAX_RETRIES 3
+#define RETRY_INTERVAL 500 // in milliseconds
+
+static int dev_stop(unsigned int transport_id, unsigned int dev_id, struct cbd_timing *timing)
+{
 	char adm_path[CBD_PATH_LEN];
 	char cmd[CBD_PATH_LEN * 3] = { 0 };
 	struct cbd_transport cbdt;
-	unsigned int backend_id;
+	struct cbd_blkdev blkdev;
 	int ret;
+	int attempt;
 
-	cbdsys_transport_init(&cbdt, options->co_transport_id);
+	/* The node and the uevent to wait for are named after the mapped id */
+	if (timing) {
+		ret = cbdsys_transport_init(&cbdt, transport_id);
+		if (!ret)
+			ret = cbdsys_blkdev_init(&cbdt, &blkdev, dev_id);
+		if (ret) {
+			printf("blkdev %u not found.\n", dev_id);
+			return ret;
+		}
+	}
 
-	snprintf(cmd, sizeof(cmd), "op=backend-start,path=%s", options->co_path);
+	snprintf(cmd, sizeof(cmd), "op=dev-stop,dev_id=%u", dev_id);
 
-	if (options->co_cache_size != 0)
-	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",cache_size=%u", options->co_cache_size);
+	transport_adm_path(transport_id, adm_path, sizeof(adm_path));
 
-	if (options->co_handlers != UINT_MAX)
-	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",handlers=%u", options->co_handlers);
+	cbd_timing_begin(timing);
 
-	if (options->co_backend_id != UINT_MAX) {
-		printf("backend-start dont accept --backend option.\n");
-		return -EINVAL;
-	}
+	// Retry mechanism for sysfs_write_attribute
+	for (attempt = 0; attempt < MAX_RETRIES; ++attempt) {
+		ret = cbdsys_write_value(adm_path, cmd);
+		if (ret == 0)
+			break; // Success, exit the loop
 
-	transport_adm_path(options->co_transport_id, adm_path, sizeof(adm_path));
-	ret = cbdsys_write_value(adm_path, cmd);
-	if (ret)
-		return ret;
+		printf("Attempt %d/%d failed to write command '%s'. Error: %s\n",
+			attempt + 1, MAX_RETRIES, cmd, strerror(-ret));
 
-	ret = cbdsys_find_backend_id_from_path(&cbdt, options->co_path, &backend_id);
-	if (ret) {
-		printf("Backend for host: %u path: %s not found\n", cbdt.host_id, options->co_path);
+		// Wait before retrying
+		usleep(RETRY_INTERVAL * 1000); // Convert milliseconds to microseconds
+	}
+
+	if (ret != 0) {
+		printf("Failed to write command '%s' after %d attempts. Final Error: %s\n",
+			cmd, MAX_RETRIES, strerror(-ret));
 		return ret;
 	}
 
-	if (options->co_start_dev)
-		return dev_start(options->co_transport_id, backend_id);
+	if (timing) {
+		cbd_timing_mark(timing, "adm_write");
+		cbd_timing_wait_uevent(timing, "uevent", "remove", blkdev.dev_name);
+		cbd_timing_wait_node(timing, "dev_node_removed", blkdev.dev_name, false);
+		timing_wait_alive(timing, "sysfs_removed", blkdev_alive, &cbdt, dev_id, false);
+	}
 
 	return 0;
 }
 
-int cbdctrl_backend_stop(cbd_opt_t *options) {
-	struct cbd_transport cbdt;
+static int backend_start(struct cbd_transport *cbdt, const char *path, unsigned int cache_size,
+			 unsigned int handlers, unsigned int *backend_id, struct cbd_timing *timing)
+{
 	char adm_path[CBD_PATH_LEN];
 	char cmd[CBD_PATH_LEN * 3] = { 0 };
+	int lock_fd;
 	int ret;
 
-	if (options->co_backend_id == UINT_MAX) {
-		printf("--backend required for backend-stop command\n");
-		return -EINVAL;
-	}
+	snprintf(cmd, sizeof(cmd), "op=backend-start,path=%s", path);
+
+	if (cache_size != 0)
+	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",cache_size=%u", cache_size);
+
+	if (handlers != UINT_MAX)
+	    snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd), ",handlers=%u", handlers);
+
+	/* Identify the backend by path before another backend-start can reuse it */
+	lock_fd = cbdsys_lock(cbdt->transport_id, CBD_LOCK_BACKEND_START);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	transport_adm_path(cbdt->transport_id, adm_path, sizeof(adm_path));
+	cbd_timing_begin(timing);
+	ret = cbdsys_write_value(adm_path, cmd);
+	if (ret)
+		goto unlock;
+	cbd_timing_mark(timing, "adm_write");
+
+	ret = cbdsys_find_backend_id_from_path(cbdt, (char *)path, backend_id);
+	if (ret)
+		printf("Backend for host: %u path: %s not found\n", cbdt->host_id, path);
+	else
+		cbd_timing_mark(timing, "sysfs");
+unlock:
+	cbdsys_unlock(lock_fd);
+
+	if (!ret && timing)
+		timing_wait_alive(timing, "alive", backend_alive, cbdt, *backend_id, true);
+	return ret;
+}
+
+static int backend_stop(unsigned int transport_id, unsigned int backend_id, struct cbd_timing *timing)
+{
+	char adm_path[CBD_PATH_LEN];
+	char cmd[CBD_PATH_LEN * 3] = { 0 };
+	struct cbd_transport cbdt;
+	int ret;
+
+	snprintf(cmd, sizeof(cmd), "op=backend-stop,backend_id=%u", backend_id);
+
+	transport_adm_path(transport_id, adm_path, sizeof(adm_path));
+	cbd_timing_begin(timing);
+	ret = cbdsys_write_value(adm_path, cmd);
+	if (ret || !timing)
+		return ret;
+
+	/* The write returns once the kernel has drained and stopped the handlers */
+	cbd_timing_mark(timing, "adm_write");
+	if (cbdsys_transport_init(&cbdt, transport_id) == 0)
+		timing_wait_alive(timing, "sysfs_removed", backend_alive, &cbdt, backend_id, false);
+
+	return 0;
+}
+
+/* Handler count by CPU count and backend device type, used when probing isn't possible */
+static unsigned int backend_handlers_table(const char *path)
+{
+	char sys_path[PATH_MAX];
+	char real_path[PATH_MAX];
+	char buf[16];
+	struct stat st;
+	unsigned int cpus = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int handlers;
+	int len;
+
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return cpus < 4 ? cpus : 4;
+
+	/* Partitions have no queue directory, look at their parent disk */
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(sys_path, real_path))
+		return cpus < 4 ? cpus : 4;
+
+	len = snprintf(sys_path, sizeof(sys_path), "%s/queue/rotational", real_path);
+	if (len < (int)sizeof(sys_path) && access(sys_path, F_OK) != 0)
+		len = snprintf(sys_path, sizeof(sys_path), "%s/../queue/rotational", real_path);
+
+	if (len < (int)sizeof(sys_path) && read_sysfs_value(sys_path, buf, sizeof(buf)) == 0 &&
+	    strcmp(buf, "1") == 0)
+		handlers = 2;		/* HDD, more handlers only add seeks */
+	else if (strstr(real_path, "/nvme"))
+		handlers = 16;		/* NVMe, plenty of hardware queues */
+	else if (strstr(real_path, "/pmem"))
+		handlers = 8;
+	else
+		handlers = 4;		/* SATA/SAS SSD and everything else */
+
+	if (handlers > cpus)
+		handlers = cpus;
+	if (handlers > CBD_BACKEND_HANDLERS_MAX)
+		handlers = CBD_BACKEND_HANDLERS_MAX;
+
+	return handlers ? handlers : 1;
+}
+
+static int wait_for_dev_node(const char *dev_name, unsigned int timeout_ms)
+{
+	for (unsigned int waited = 0; waited < timeout_ms; waited += 10) {
+		if (access(dev_name, F_OK) == 0)
+			return 0;
+		usleep(10 * 1000);
+	}
+
+	return -ETIMEDOUT;
+}
+
+/* Stop the blkdevs of this host on @backend_id, e.g. one dev_start() couldn't identify */
+static int backend_blkdevs_stop(struct cbd_transport *cbdt, unsigned int backend_id)
+{
+	struct cbd_snapshot snap;
+	struct cbd_backend backend;
+	int ret;
+
+	ret = cbdsys_snapshot_init(cbdt, &snap);
+	if (ret)
+		return ret;
+
+	ret = cbdsys_backend_init(cbdt, &snap, &backend, backend_id);
+	for (unsigned int i = 0; !ret && i < backend.dev_num; i++) {
+		if (backend.blkdevs[i].host_id == cbdt->host_id)
+			ret = dev_stop(cbdt->transport_id, backend.blkdevs[i].blkdev_id, NULL);
+	}
+	cbdsys_snapshot_release(&snap);
+
+	return ret;
+}
+
+/*
+ * Start the backend with a growing handler count, 1, 2, 4 and so on, and
+ * measure 4K random read IOPS through a temporary blkdev for each. The
+ * sweep stops once doubling the handlers gains less than
+ * CBD_HANDLERS_PLATEAU_GAIN percent, the count before that is chosen. A
+ * failed probe falls back to the calibration table. The backend is left
+ * stopped, a probe backend or blkdev which won't stop fails the command.
+ */
+static int backend_handlers_autotune(struct cbd_transport *cbdt, cbd_opt_t *options,
+				     unsigned int *handlers)
+{
+	unsigned int cpus = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int max_handlers = cpus < CBD_BACKEND_HANDLERS_MAX ? cpus : CBD_BACKEND_HANDLERS_MAX;
+	unsigned int probe_jobs = cpus < 4 ? cpus : 4;
+	unsigned int table = backend_handlers_table(options->co_path);
+	double best_iops = 0;
+	int ret, stop_ret;
+
+	*handlers = table;
+	printf("handlers auto: calibration table suggests %u\n", table);
+
+	for (unsigned int h = 1; h <= max_handlers; h *= 2) {
+		struct cbd_blkdev blkdev;
+		unsigned int backend_id;
+		double iops = 0;
+
+		ret = backend_start(cbdt, options->co_path, options->co_cache_size, h, &backend_id, NULL);
+		if (ret)
+			return ret;
+
+		stop_ret = 0;
+		ret = dev_start(cbdt->transport_id, backend_id, &blkdev, NULL);
+		if (ret > 0) {
+			/* Started but not identified, it can only be on the probe backend */
+			stop_ret = backend_blkdevs_stop(cbdt, backend_id);
+			if (stop_ret)
+				printf("handlers auto: failed to stop probe blkdevs of backend %u: %s, left running\n",
+				       backend_id, strerror(-stop_ret));
+		} else if (ret == 0) {
+			ret = wait_for_dev_node(blkdev.dev_name, 5000);
+			if (ret == 0)
+				ret = cbdctrl_bench_probe(blkdev.dev_name, CBD_HANDLERS_PROBE_IODEPTH,
+							  probe_jobs, CBD_HANDLERS_PROBE_RUNTIME, &iops);
+			stop_ret = dev_stop(cbdt->transport_id, blkdev.blkdev_id, NULL);
+			if (stop_ret)
+				printf("handlers auto: failed to stop probe blkdev %u: %s, backend %u left running\n",
+				       blkdev.blkdev_id, strerror(-stop_ret), backend_id);
+		}
+		if (!stop_ret) {
+			stop_ret = backend_stop(cbdt->transport_id, backend_id, NULL);
+			if (stop_ret)
+				printf("handlers auto: failed to stop probe backend %u: %s\n",
+				       backend_id, strerror(-stop_ret));
+		}
+		if (stop_ret)
+			return stop_ret;
+
+		if (ret) {
+			printf("handlers auto: probe failed, using the calibration table\n");
+			*handlers = table;
+			return 0;
+		}
+
+		printf("handlers auto: %3u handlers %12.0f IOPS\n", h, iops);
+		if (iops < best_iops * (100 + CBD_HANDLERS_PLATEAU_GAIN) / 100)
+			break;
+
+		best_iops = iops;
+		*handlers = h;
+	}
+
+	return 0;
+}
+
+/*
+ * Work out the CPUs requested by --cpus or --numa-local. Returns 1 if the
+ * handlers should be pinned, 0 if no placement was requested.
+ */
+static int backend_placement(struct cbd_transport *cbdt, cbd_opt_t *options, cpu_set_t *set)
+{
+	int node;
+
+	if (options->co_cpus[0] && options->co_numa_local) {
+		printf("--cpus and --numa-local are mutually exclusive.\n");
+		return -EINVAL;
+	}
+
+	if (options->co_cpus[0]) {
+		if (cbdsys_parse_cpulist(options->co_cpus, set) || !CPU_COUNT(set)) {
+			printf("invalid cpu list: %s\n", options->co_cpus);
+			return -EINVAL;
+		}
+		return 1;
+	}
+
+	if (!options->co_numa_local)
+		return 0;
+
+	node = cbdsys_transport_numa_node(cbdt);
+	if (node < 0) {
+		printf("numa-local: no NUMA node for transport %u, handlers left unpinned\n", cbdt->transport_id);
+		return 0;
+	}
+
+	if (cbdsys_node_cpus(node, set) || !CPU_COUNT(set)) {
+		printf("numa-local: failed to read cpus of node %d\n", node);
+		return -ENOENT;
+	}
+	printf("numa-local: transport %u is on node %d\n", cbdt->transport_id, node);
+
+	return 1;
+}
+
+struct place_candidate {
+	unsigned int	transport_id;
+	unsigned int	free_segs;
+	unsigned int	cache_segs;
+	unsigned int	used_segs;
+	unsigned int	score;
+};
+
+/*
+ * Account the cache segments of a transport: free segments are what is
+ * left of segment_num after the caches of all backends, dead ones
+ * included as their segments are not released until they are cleaned up.
+ */
+static int place_account(struct cbd_transport *cbdt, struct place_candidate *cand)
+{
+	struct cbd_backend backend;
+	uint64_t cache_segs = 0;
+	int ret;
+
+	memset(cand, 0, sizeof(*cand));
+	cand->transport_id = cbdt->transport_id;
+
+	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
+		ret = cbdsys_backend_info_init(cbdt, &backend, i);
+		if (ret == -ETIMEDOUT)
+			return ret;
+		if (ret < 0)
+			continue;
+
+		cache_segs += backend.cache_segs;
+		cand->used_segs += backend.cache_used_segs;
+	}
+
+	cand->cache_segs = cache_segs > cbdt->segment_num ? cbdt->segment_num : cache_segs;
+	cand->free_segs = cbdt->segment_num - cand->cache_segs;
+
+	return 0;
+}
+
+/* Size in bytes of the backend device or file at @path */
+static int backend_dev_size(const char *path, uint64_t *size)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0)
+		ret = -errno;
+	else if (!S_ISBLK(st.st_mode))
+		*size = st.st_size;
+	else if (ioctl(fd, BLKGETSIZE64, size) < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Choose the transport for a new backend: the local host must be alive on
+ * it and it must have room for the requested cache. Without --cache-size
+ * the cache the kernel picks isn't known here, so room for a cache as
+ * large as the backend is asked for. Among those the
+ * headroom left after the new cache wins, scaled down by how full the
+ * existing caches are, so a transport whose caches are under pressure is
+ * not picked only because it is the largest. Each candidate and the
+ * decision are printed.
+ */
+static int backend_auto_place(cbd_opt_t *options, struct cbd_transport *cbdt)
+{
+	struct place_candidate cand, best = { .transport_id = UINT_MAX };
+	uint64_t cache_bytes = (uint64_t)options->co_cache_size << 20;
+	struct cbd_transport t;
+	struct cbd_host host;
+	unsigned int need, pressure;
+	int ret;
+
+	if (!cache_bytes) {
+		ret = backend_dev_size(options->co_path, &cache_bytes);
+		if (ret < 0) {
+			printf("auto-place: failed to get the size of %s: %s\n", options->co_path, strerror(-ret));
+			return ret;
+		}
+		printf("auto-place: no --cache-size, counting the backend size of %lu bytes\n", cache_bytes);
+	}
+
+	for (unsigned int i = 0; i < CBD_TRANSPORT_MAX; i++) {
+		ret = cbdsys_transport_init(&t, i);
+		if (ret == -ENOENT)
+			break;
+		if (ret < 0) {
+			printf("auto-place: transport %u: skipped, %s\n", i,
+			       ret == -ETIMEDOUT ? "attributes timed out" : "not registered on this host");
+			continue;
+		}
+
+		ret = cbdsys_host_init(&t, &host, t.host_id);
+		if (ret < 0 || !host.alive) {
+			printf("auto-place: transport %u: skipped, host %u is not alive\n", i, t.host_id);
+			continue;
+		}
+
+		ret = place_account(&t, &cand);
+		if (ret < 0) {
+			printf("auto-place: transport %u: skipped, backend attributes timed out\n", i);
+			continue;
+		}
+
+		need = (cache_bytes + t.bytes_per_segment - 1) / t.bytes_per_segment;
+		pressure = cand.cache_segs ? (uint64_t)cand.used_segs * 100 / cand.cache_segs : 0;
+		if (pressure > 100)
+			pressure = 100;
+
+		printf("auto-place: transport %u: %u/%u segments free, caches %u%% used, needs %u segments",
+		       i, cand.free_segs, t.segment_num, pressure, need);
+
+		if (cand.free_segs < need + CBD_AUTO_PLACE_MIN_FREE) {
+			printf(", not enough free segments\n");
+			continue;
+		}
+
+		cand.score = (uint64_t)(cand.free_segs - need) * (100 - pressure) / 100;
+		printf(", score %u\n", cand.score);
+
+		if (best.transport_id == UINT_MAX || cand.score > best.score)
+			best = cand;
+	}
+
+	if (best.transport_id == UINT_MAX) {
+		printf("auto-place: no transport with a live host and enough free segments%s\n",
+		       options->co_cache_size ? "" : ", give the cache size with --cache-size");
+		return -ENOSPC;
+	}
+
+	printf("auto-place: selected transport %u, most headroom (score %u)\n",
+	       best.transport_id, best.score);
+
+	options->co_transport_id = best.transport_id;
+	return cbdsys_transport_init(cbdt, best.transport_id);
+}
+
+/*
+ * Apply --queue-profile to a blkdev just started, before its name is
+ * printed, so whatever opens it next sees the profile. Settings that didn't
+ * stick are printed, the blkdev is left running either way.
+ */
+static int dev_queue_apply(struct cbd_blkdev *blkdev, const struct cbd_queue_profile *profile,
+			   json_t **json_settings)
+{
+	json_t *json_setting;
+	size_t i;
+	int ret;
+
+	ret = cbd_queue_profile_apply(blkdev->mapped_id, profile, json_settings);
+	if (ret != -EIO)
+		return ret;
+
+	json_array_foreach(*json_settings, i, json_setting) {
+		json_t *json_error = json_object_get(json_setting, "error");
+
+		if (json_is_true(json_object_get(json_setting, "ok")))
+			continue;
+		printf("%s: queue/%s: wanted %s, got %s%s\n", blkdev->dev_name,
+		       json_string_value(json_object_get(json_setting, "attr")),
+		       json_string_value(json_object_get(json_setting, "value")),
+		       json_error ? "an error: " : "",
+		       json_error ? json_string_value(json_error) :
+				    json_string_value(json_object_get(json_setting, "actual")));
+	}
+
+	return ret;
+}
+
+static bool dev_io_limits_wanted(cbd_opt_t *options)
+{
+	return options->co_io_max[0] || options->co_io_weight;
+}
+
+/* Load --queue-profile and check --cgroup before anything is started */
+static int dev_tune_check(cbd_opt_t *options, struct cbd_queue_profile *profile)
+{
+	int ret;
+
+	if (options->co_queue_profile[0]) {
+		ret = cbd_queue_profile_load(options->co_queue_profile, profile);
+		if (ret)
+			return ret;
+	}
+
+	if (!dev_io_limits_wanted(options))
+		return 0;
+
+	if (!options->co_cgroup[0]) {
+		printf("--cgroup required with --io-max and --io-weight\n");
+		return -EINVAL;
+	}
+	return cbd_cgroup_check(options->co_cgroup);
+}
+
+/*
+ * Apply --queue-profile, --io-max and --io-weight to a blkdev just started,
+ * before its name is printed, so whatever opens it next sees them. The
+ * blkdev is left running when one fails. The read back settings are added
+ * to @json_out as "queue" and "io_limits" if it isn't NULL.
+ */
+static int dev_start_tune(struct cbd_blkdev *blkdev, cbd_opt_t *options,
+			  const struct cbd_queue_profile *profile, json_t *json_out)
+{
+	json_t *json_queue = NULL, *json_limits = NULL;
+	int ret = 0, err;
+
+	if (options->co_queue_profile[0]) {
+		ret = dev_queue_apply(blkdev, profile, &json_queue);
+		if (json_out)
+			json_object_set_new(json_out, "queue", json_queue);
+		else
+			json_decref(json_queue);
+	}
+
+	if (dev_io_limits_wanted(options)) {
+		err = cbd_cgroup_apply(options->co_cgroup, blkdev->mapped_id, options->co_io_max,
+				       options->co_io_weight, &json_limits);
+		if (json_out)
+			json_object_set_new(json_out, "io_limits", json_limits);
+		else
+			json_decref(json_limits);
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/* Print the phases of a --timing run as {"<id_name>": id, "timing_ns": {...}, ...} */
+static void timing_print(json_t *json_out)
+{
+	char *json_str = json_dumps(json_out, JSON_INDENT(4));
+
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+}
+
+int cbdctrl_backend_start(cbd_opt_t *options) {
+	struct cbd_transport cbdt;
+	struct cbd_blkdev blkdev;
+	struct cbd_timing backend_timing, dev_timing;
+	struct cbd_timing *timing = NULL;
+	struct cbd_queue_profile profile;
+	json_t *json_tune = NULL;
+	unsigned int backend_id;
+	unsigned int handlers = options->co_handlers;
+	cpu_set_t cpus;
+	int pin;
+	int ret;
+
+	cbdsys_transport_init(&cbdt, options->co_transport_id);
+
+	if (options->co_backend_id != UINT_MAX) {
+		printf("backend-start dont accept --backend option.\n");
+		return -EINVAL;
+	}
+
+	if ((options->co_queue_profile[0] || dev_io_limits_wanted(options)) && !options->co_start_dev) {
+		printf("--queue-profile, --io-max and --io-weight need --start-dev\n");
+		return -EINVAL;
+	}
+
+	ret = dev_tune_check(options, &profile);
+	if (ret)
+		return ret;
+
+	if (options->co_auto_place) {
+		ret = backend_auto_place(options, &cbdt);
+		if (ret)
+			return ret;
+	}
+
+	pin = backend_placement(&cbdt, options, &cpus);
+	if (pin < 0)
+		return pin;
+
+	if (handlers == CBD_BACKEND_HANDLERS_AUTO) {
+		ret = backend_handlers_autotune(&cbdt, options, &handlers);
+		if (ret)
+			return ret;
+		printf("handlers auto: selected %u handlers\n", handlers);
+	}
+
+	if (options->co_timing) {
+		cbd_timing_init(&backend_timing);
+		cbd_timing_init(&dev_timing);
+		timing = &backend_timing;
+	}
+
+	ret = backend_start(&cbdt, options->co_path, options->co_cache_size, handlers, &backend_id, timing);
+	if (ret)
+		goto out;
+
+	if (pin) {
+		char cpulist[CBD_PATH_LEN];
+		unsigned int kthreads;
+		char count[16];
+
+		cbdsys_format_cpulist(&cpus, cpulist, sizeof(cpulist));
+		ret = cbdsys_backend_handlers_pin(&cbdt, backend_id, &cpus, &kthreads);
+		if (ret < 0) {
+			printf("failed to pin handlers of backend %u: %s\n", backend_id, strerror(-ret));
+			goto out;
+		}
+		if (ret == 0) {
+			/* The placement asked for can't be had, don't leave the backend running without */
+			printf("no handlers named " CBD_BACKEND_HANDLER_NAME_FMT " found, placement not applied\n",
+			       cbdt.transport_id, backend_id);
+			if (backend_stop(cbdt.transport_id, backend_id, NULL))
+				printf("failed to stop backend %u\n", backend_id);
+			ret = -ENOENT;
+			goto out;
+		}
+
+		/* A workqueue's cpumask covers its workers, only kthreads count one by one */
+		if (handlers == UINT_MAX)
+			snprintf(count, sizeof(count), "default");
+		else
+			snprintf(count, sizeof(count), "%u", handlers);
+		printf("backend %u: %d workqueues and threads of %s handlers pinned to cpus %s, %u of them kthreads\n",
+		       backend_id, ret, count, cpulist, kthreads);
+		ret = 0;
+	}
+
+	if (options->co_start_dev) {
+		ret = dev_start(options->co_transport_id, backend_id, &blkdev, timing ? &dev_timing : NULL);
+		if (ret)
+			goto out;
+
+		json_tune = json_object();
+		ret = dev_start_tune(&blkdev, options, &profile, json_tune);
+
+		if (!timing)
+			printf("%s\n", blkdev.dev_name);
+	}
+
+	if (timing) {
+		json_t *json_out = json_object();
+
+		json_object_set_new(json_out, "backend_id", json_integer(backend_id));
+		json_object_set_new(json_out, "timing_ns", cbd_timing_to_json(&backend_timing));
+		if (options->co_start_dev) {
+			json_object_set_new(json_out, "dev", json_string(blkdev.dev_name));
+			json_object_set_new(json_out, "dev_timing_ns", cbd_timing_to_json(&dev_timing));
+			json_object_update(json_out, json_tune);
+		}
+		timing_print(json_out);
+	}
+out:
+	json_decref(json_tune);
+	if (timing) {
+		cbd_timing_exit(&backend_timing);
+		cbd_timing_exit(&dev_timing);
+	}
+	return ret;
+}
+
+int cbdctrl_backend_stop(cbd_opt_t *options) {
+	struct cbd_transport cbdt;
+	int ret;
+
+	if (options->co_backend_id == UINT_MAX) {
+		printf("--backend required for backend-stop command\n");
+		return -EINVAL;
+	}
 
 	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
 	if (ret) {
@@ -540,10 +1855,23 @@ int cbdctrl_backend_stop(cbd_opt_t *options) {
 			return ret;
 	}
 
-	snprintf(cmd, sizeof(cmd), "op=backend-stop,backend_id=%u", options->co_backend_id);
+	if (options->co_timing) {
+		struct cbd_timing timing;
+		json_t *json_out;
+
+		cbd_timing_init(&timing);
+		ret = backend_stop(options->co_transport_id, options->co_backend_id, &timing);
+		if (!ret) {
+			json_out = json_object();
+			json_object_set_new(json_out, "backend_id", json_integer(options->co_backend_id));
+			json_object_set_new(json_out, "timing_ns", cbd_timing_to_json(&timing));
+			timing_print(json_out);
+		}
+		cbd_timing_exit(&timing);
+		return ret;
+	}
 
-	transport_adm_path(options->co_transport_id, adm_path, sizeof(adm_path));
-	return cbdsys_write_value(adm_path, cmd);
+	return backend_stop(options->co_transport_id, options->co_backend_id, NULL);
 }
 
 int cbdctrl_backend_list(cbd_opt_t *options)
@@ -562,10 +1890,33 @@ int cbdctrl_backend_list(cbd_opt_t *options)
 		return ret;
 	}
 
+	// Read all blkdevs once, backends point into this snapshot
+	struct cbd_snapshot snap;
+	ret = cbdsys_snapshot_init(&cbdt, &snap);
+	if (ret < 0) {
+		json_decref(array);
+		return ret;
+	}
+
+	// Handler placement of all backends from one scan of /proc
+	cpu_set_t *handler_cpus = calloc(cbdt.backend_num ? cbdt.backend_num : 1, sizeof(*handler_cpus));
+	if (!handler_cpus) {
+		cbdsys_snapshot_release(&snap);
+		json_decref(array);
+		return -ENOMEM;
+	}
+	bool handlers_scanned = false;
+	int numa_node = -1;
+
 	// Iterate through all backends and generate JSON object for each
 	for (unsigned int i = 0; i < cbdt.backend_num; i++) {
 		struct cbd_backend backend;
-		ret = cbdsys_backend_init(&cbdt, &backend, i); // Initialize current backend
+		ret = cbdsys_backend_init(&cbdt, &snap, &backend, i); // Initialize current backend
+		if (ret == -ETIMEDOUT) {
+			// Host unknown, always listed so it isn't silently missed
+			json_array_append_new(array, cbd_stale_to_json("backend_id", i));
+			continue;
+		}
 		if (ret < 0) {
 			continue;
 		}
@@ -582,6 +1933,25 @@ int cbdctrl_backend_list(cbd_opt_t *options)
 		json_object_set_new(json_backend, "cache_segs", json_integer(backend.cache_segs));
 		json_object_set_new(json_backend, "cache_gc_percent", json_integer(backend.cache_gc_percent));
 		json_object_set_new(json_backend, "cache_used_segs", json_integer(backend.cache_used_segs));
+		// A blkdev which timed out may belong to this backend
+		if (cbdsys_snapshot_stale(&snap, backend.backend_id))
+			json_object_set_new(json_backend, "partial", json_true());
+
+		// Handler placement is only visible on the host running the backend
+		if (backend.host_id == cbdt.host_id) {
+			char cpulist[CBD_PATH_LEN];
+
+			if (!handlers_scanned) {
+				cbdsys_transport_handlers_cpus(&cbdt, handler_cpus);
+				numa_node = cbdsys_transport_numa_node(&cbdt);
+				handlers_scanned = true;
+			}
+			if (CPU_COUNT(&handler_cpus[i])) {
+				cbdsys_format_cpulist(&handler_cpus[i], cpulist, sizeof(cpulist));
+				json_object_set_new(json_backend, "handler_cpus", json_string(cpulist));
+			}
+			json_object_set_new(json_backend, "transport_numa_node", json_integer(numa_node));
+		}
 
 		// Create JSON array for blkdevs within the backend
 		json_t *json_blkdevs = json_array();
@@ -615,6 +1985,8 @@ int cbdctrl_backend_list(cbd_opt_t *options)
 	}
 
 	json_decref(array); // Free JSON array memory
+	free(handler_cpus);
+	cbdsys_snapshot_release(&snap);
 	return 0;
 }
 
@@ -624,51 +1996,422 @@ int cbdctrl_dev_start(cbd_opt_t *options) {
 		return -EINVAL;
 	}
 
-	return dev_start(options->co_transport_id, options->co_backend_id);
+	struct cbd_queue_profile profile;
+	struct cbd_blkdev blkdev;
+	struct cbd_timing timing;
+	json_t *json_out;
+	int ret;
+
+	ret = dev_tune_check(options, &profile);
+	if (ret)
+		return ret;
+
+	if (!options->co_timing) {
+		ret = dev_start(options->co_transport_id, options->co_backend_id, &blkdev, NULL);
+		if (ret)
+			return ret;
+
+		ret = dev_start_tune(&blkdev, options, &profile, NULL);
+		printf("%s\n", blkdev.dev_name);
+		return ret;
+	}
+
+	cbd_timing_init(&timing);
+	ret = dev_start(options->co_transport_id, options->co_backend_id, &blkdev, &timing);
+	if (!ret) {
+		json_out = json_object();
+		json_object_set_new(json_out, "dev_id", json_integer(blkdev.blkdev_id));
+		json_object_set_new(json_out, "dev", json_string(blkdev.dev_name));
+		json_object_set_new(json_out, "timing_ns", cbd_timing_to_json(&timing));
+		ret = dev_start_tune(&blkdev, options, &profile, json_out);
+		timing_print(json_out);
+	}
+	cbd_timing_exit(&timing);
+
+	return ret;
 }
 
-#define MAX_RETRIES 3
-#define RETRY_INTERVAL 500 // in milliseconds
+int cbdctrl_dev_cycle(unsigned int transport_id, unsigned int backend_id,
+		      struct cbd_timing *start_timing, struct cbd_timing *stop_timing)
+{
+	struct cbd_blkdev blkdev;
+	int ret;
 
-int cbdctrl_dev_stop(cbd_opt_t *options) {
-	char adm_path[CBD_PATH_LEN];
-	char cmd[CBD_PATH_LEN * 3] = { 0 };
+	ret = dev_start(transport_id, backend_id, &blkdev, start_timing);
+	if (ret)
+		return ret < 0 ? ret : -ENODEV;
+
+	return dev_stop(transport_id, blkdev.blkdev_id, stop_timing);
+}
+
+#define MOVE_CGROUPS_MAX	4
+
+/* Settings of a blkdev of a move, given to the blkdev started in its place */
+struct move_dev_saved {
+	char			dev_name[CBD_NAME_LEN];	/* "" if the blkdev couldn't be read */
+	struct cbd_queue_profile queue;			/* no settings without a queue */
+	unsigned int		nr_cgroups;
+	struct {
+		char		cgroup[CBD_PATH_LEN];
+		char		io_max[CBD_PATH_LEN];	/* "" for none */
+		unsigned int	io_weight;		/* 0 for none */
+	} cgroups[MOVE_CGROUPS_MAX];
+};
+
+/* Queue settings and cgroup limits of blkdev @dev_id, they go with its disk */
+static void move_dev_save(struct cbd_transport *cbdt, unsigned int dev_id, struct move_dev_saved *saved)
+{
+	struct cbd_blkdev blkdev;
+	json_t *json_cgroups, *json_limits;
+	size_t i;
+
+	memset(saved, 0, sizeof(*saved));
+	if (cbdsys_blkdev_init(cbdt, &blkdev, dev_id) < 0)
+		return;
+
+	snprintf(saved->dev_name, sizeof(saved->dev_name), "%s", blkdev.dev_name);
+	cbd_queue_profile_save(blkdev.mapped_id, &saved->queue);
+
+	json_cgroups = cbd_cgroup_limits_to_json(blkdev.mapped_id);
+	json_array_foreach(json_cgroups, i, json_limits) {
+		json_t *json_io_max = json_object_get(json_limits, "io_max");
+		json_t *json_weight = json_object_get(json_limits, "io_weight");
+		const char *key;
+		json_t *json_value;
+		size_t len = 0;
+
+		if (saved->nr_cgroups == MOVE_CGROUPS_MAX) {
+			printf("rebalance: %s is limited in more than %d cgroups, the others are not carried over\n",
+			       blkdev.dev_name, MOVE_CGROUPS_MAX);
+			break;
+		}
+
+		snprintf(saved->cgroups[saved->nr_cgroups].cgroup, CBD_PATH_LEN, "%s",
+			 json_string_value(json_object_get(json_limits, "cgroup")));
+		json_object_foreach(json_io_max, key, json_value) {
+			if (len < CBD_PATH_LEN)
+				len += snprintf(saved->cgroups[saved->nr_cgroups].io_max + len, CBD_PATH_LEN - len,
+						"%s%s=%lld", len ? " " : "", key,
+						(long long)json_integer_value(json_value));
+		}
+		saved->cgroups[saved->nr_cgroups].io_weight = json_integer_value(json_weight);
+		saved->nr_cgroups++;
+	}
+	json_decref(json_cgroups);
+}
+
+/*
+ * Give @blkdev the settings of the one it replaces with dev_start_tune(),
+ * once per cgroup, the read back values go to @json_step. A setting which
+ * doesn't take is reported, the blkdev runs anyway.
+ */
+static int move_dev_tune(struct cbd_blkdev *blkdev, const struct move_dev_saved *saved,
+			 json_t *json_step)
+{
+	json_t *json_io_limits = json_array();
+	cbd_opt_t tune;
+	int ret = 0, err;
+
+	for (unsigned int i = 0; i == 0 || i < saved->nr_cgroups; i++) {
+		json_t *json_tune = json_object();
+
+		memset(&tune, 0, sizeof(tune));
+		if (!i && saved->queue.nr_settings)
+			snprintf(tune.co_queue_profile, sizeof(tune.co_queue_profile), "%s", saved->queue.name);
+		if (i < saved->nr_cgroups) {
+			snprintf(tune.co_cgroup, sizeof(tune.co_cgroup), "%s", saved->cgroups[i].cgroup);
+			snprintf(tune.co_io_max, sizeof(tune.co_io_max), "%s", saved->cgroups[i].io_max);
+			tune.co_io_weight = saved->cgroups[i].io_weight;
+		}
+
+		err = dev_start_tune(blkdev, &tune, &saved->queue, json_tune);
+		if (!ret)
+			ret = err;
+
+		if (json_object_get(json_tune, "queue"))
+			json_object_set(json_step, "queue", json_object_get(json_tune, "queue"));
+		if (json_object_get(json_tune, "io_limits"))
+			json_array_append(json_io_limits, json_object_get(json_tune, "io_limits"));
+		json_decref(json_tune);
+	}
+
+	if (json_array_size(json_io_limits))
+		json_object_set_new(json_step, "io_limits", json_io_limits);
+	else
+		json_decref(json_io_limits);
+
+	return ret;
+}
+
+static json_t *move_step(json_t *json_steps, const char *step, unsigned int transport_id,
+			 unsigned int id, uint64_t start_ns, int ret)
+{
+	json_t *json_step = json_object();
+
+	json_object_set_new(json_step, "step", json_string(step));
+	json_object_set_new(json_step, "transport_id", json_integer(transport_id));
+	json_object_set_new(json_step, "id", json_integer(id));
+	json_object_set_new(json_step, "ms", json_real((cbd_now_ns() - start_ns) / 1e6));
+	json_object_set_new(json_step, "ok", json_boolean(!ret));
+	if (ret)
+		json_object_set_new(json_step, "error", json_string(strerror(-ret)));
+	json_array_append_new(json_steps, json_step);
+
+	printf("rebalance: transport %u: %s %u %s\n", transport_id, step, id, ret ? strerror(-ret) : "done");
+	return json_step;
+}
+
+/*
+ * As many blkdevs as @move had up on @backend_id, each with the settings
+ * in @saved of the one it replaces. Those started are kept in @move.
+ */
+static int move_start_devs(struct cbd_backend_move *move, struct cbd_transport *cbdt,
+			   unsigned int backend_id, const struct move_dev_saved *saved,
+			   json_t *json_steps)
+{
+	uint64_t start_ns;
+	json_t *json_step;
 	int ret;
-	int attempt;
 
-	if (options->co_dev_id == UINT_MAX) {
-		printf("--dev required for dev-stop command\n");
-		return -EINVAL;
+	for (move->nr_new_devs = 0; move->nr_new_devs < move->nr_devs; move->nr_new_devs++) {
+		const struct move_dev_saved *old = &saved[move->nr_new_devs];
+		struct cbd_blkdev *blkdev = &move->new_devs[move->nr_new_devs];
+
+		start_ns = cbd_now_ns();
+		ret = dev_start(cbdt->transport_id, backend_id, blkdev, NULL);
+		if (ret > 0)
+			ret = -ENODEV;
+		if (!ret)
+			ret = timing_wait_alive(NULL, "blkdev alive", blkdev_alive, cbdt, blkdev->blkdev_id, true);
+		if (!ret)
+			ret = wait_for_dev_node(blkdev->dev_name, CBD_TIMING_WAIT_MS);
+		json_step = move_step(json_steps, "dev-start", cbdt->transport_id,
+				      ret ? backend_id : blkdev->blkdev_id, start_ns, ret);
+		if (ret)
+			return ret;
+
+		/* Device names are handed out anew, say which one took over from which */
+		if (old->dev_name[0])
+			json_object_set_new(json_step, "old_dev", json_string(old->dev_name));
+		json_object_set_new(json_step, "dev", json_string(blkdev->dev_name));
+		if (old->dev_name[0])
+			printf("rebalance: %s is now %s\n", old->dev_name, blkdev->dev_name);
+
+		start_ns = cbd_now_ns();
+		json_step = json_object();
+		ret = move_dev_tune(blkdev, old, json_step);
+		json_object_update(move_step(json_steps, "dev-tune", cbdt->transport_id, blkdev->blkdev_id,
+					     start_ns, ret), json_step);
+		json_decref(json_step);
 	}
 
-	snprintf(cmd, sizeof(cmd), "op=dev-stop,dev_id=%u", options->co_dev_id);
+	return 0;
+}
 
-	transport_adm_path(options->co_transport_id, adm_path, sizeof(adm_path));
+/* Backend and blkdevs of @move up on @cbdt, the blkdevs started are kept in @move */
+static int move_start(struct cbd_backend_move *move, struct cbd_transport *cbdt,
+		      unsigned int *backend_id, const struct move_dev_saved *saved,
+		      json_t *json_steps)
+{
+	uint64_t start_ns = cbd_now_ns();
+	unsigned int id;
+	int ret;
 
-	// Retry mechanism for sysfs_write_attribute
-	for (attempt = 0; attempt < MAX_RETRIES; ++attempt) {
-		ret = cbdsys_write_value(adm_path, cmd);
-		if (ret == 0)
-			break; // Success, exit the loop
+	/* Stays UINT_MAX unless the backend was started */
+	*backend_id = UINT_MAX;
+	move->nr_new_devs = 0;
 
-		printf("Attempt %d/%d failed to write command '%s'. Error: %s\n",
-			attempt + 1, MAX_RETRIES, cmd, strerror(ret));
+	ret = backend_start(cbdt, move->path, move->cache_size, UINT_MAX, &id, NULL);
+	if (!ret) {
+		*backend_id = id;
+		ret = timing_wait_alive(NULL, "backend alive", backend_alive, cbdt, id, true);
+	}
+	move_step(json_steps, "backend-start", cbdt->transport_id, *backend_id == UINT_MAX ? move->backend_id : id,
+		  start_ns, ret);
+	if (ret)
+		return ret;
 
-		// Wait before retrying
-		usleep(RETRY_INTERVAL * 1000); // Convert milliseconds to microseconds
+	return move_start_devs(move, cbdt, *backend_id, saved, json_steps);
+}
+
+/*
+ * sysfs has no dirty counter, the cache is written back once the dirty tail
+ * in the backend info caught up with the key tail. With its blkdevs
+ * stopped nothing adds keys. Without the backend info to follow there's no
+ * telling, the move is refused rather than dropping dirty data.
+ */
+static int move_wait_clean(struct cbd_transport *cbdt, unsigned int backend_id)
+{
+	uint64_t deadline_ns = cbd_now_ns() + CBD_REBALANCE_CLEAN_WAIT_MS * 1000000ULL;
+	struct cbd_transport_info ti;
+	struct cbd_cache_info cache;
+	struct cbd_meta_live live;
+	char err[CBD_PATH_LEN] = "";
+	uint64_t off;
+	int ret;
+
+	ret = cbd_meta_live_open(&live, cbdt->path);
+	if (ret < 0) {
+		printf("rebalance: failed to open %s to follow the writeback: %s\n",
+		       cbdt->path, strerror(-ret));
+		return ret;
 	}
 
-	if (ret != 0) {
-		printf("Failed to write command '%s' after %d attempts. Final Error: %s\n",
-			cmd, MAX_RETRIES, strerror(ret));
+	ret = cbd_meta_live_read(&live, 0, &ti, sizeof(ti));
+	if (!ret)
+		ret = cbd_meta_layout_check(&ti, cbdt, err, sizeof(err));
+	if (!ret && backend_id >= ti.backend_num)
+		ret = -ENOENT;
+	if (ret) {
+		printf("rebalance: writeback of backend %u not readable on transport %u: %s\n",
+		       backend_id, cbdt->transport_id, err[0] ? err : strerror(-ret));
+		goto out;
 	}
 
+	off = ti.backend_area_off + (uint64_t)ti.bytes_per_backend_info * backend_id +
+	      offsetof(struct cbd_backend_info, cache_info);
+	while ((ret = cbd_meta_live_read(&live, off, &cache, sizeof(cache))) == 0 &&
+	       (cache.dirty_tail_pos.cache_seg_id != cache.key_tail_pos.cache_seg_id ||
+		cache.dirty_tail_pos.seg_off != cache.key_tail_pos.seg_off)) {
+		if (cbdctrl_stopping) {
+			ret = -EINTR;
+			break;
+		}
+		if (cbd_now_ns() > deadline_ns) {
+			printf("rebalance: cache of backend %u not written back after %dms\n",
+			       backend_id, CBD_REBALANCE_CLEAN_WAIT_MS);
+			ret = -ETIMEDOUT;
+			break;
+		}
+		usleep(10000);
+	}
+out:
+	cbd_meta_live_close(&live);
 	return ret;
 }
 
+/* Drop the slot of a stopped backend and the cache segments it still owns */
+static int backend_clear(unsigned int transport_id, unsigned int backend_id)
+{
+	char adm_path[CBD_PATH_LEN];
+	char cmd[CBD_PATH_LEN] = { 0 };
+
+	snprintf(cmd, sizeof(cmd), "op=backend-clear,backend_id=%u", backend_id);
+	transport_adm_path(transport_id, adm_path, sizeof(adm_path));
+
+	return cbdsys_write_value(adm_path, cmd);
+}
+
+int cbdctrl_backend_move(struct cbd_backend_move *move, json_t *json_steps)
+{
+	struct move_dev_saved *saved;
+	struct cbd_transport from, to;
+	unsigned int backend_id;
+	uint64_t start_ns;
+	int ret;
+
+	ret = cbdsys_transport_init(&from, move->from_id);
+	if (!ret)
+		ret = cbdsys_transport_init(&to, move->to_id);
+	if (ret)
+		return ret;
+
+	saved = calloc(move->nr_devs ? move->nr_devs : 1, sizeof(*saved));
+	if (!saved)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < move->nr_devs; i++)
+		move_dev_save(&from, move->dev_ids[i], &saved[i]);
+
+	for (unsigned int i = 0; i < move->nr_devs; i++) {
+		start_ns = cbd_now_ns();
+		ret = dev_stop(from.transport_id, move->dev_ids[i], NULL);
+		if (!ret)
+			ret = timing_wait_alive(NULL, "blkdev removed", blkdev_alive, &from, move->dev_ids[i], false);
+		move_step(json_steps, "dev-stop", from.transport_id, move->dev_ids[i], start_ns, ret);
+		if (ret)
+			goto out;
+	}
+
+	/* The target starts with an empty cache, dirty data must not stay behind */
+	start_ns = cbd_now_ns();
+	ret = move_wait_clean(&from, move->backend_id);
+	move_step(json_steps, "cache-clean", from.transport_id, move->backend_id, start_ns, ret);
+	if (ret) {
+		/* The backend still runs, its blkdevs go back on it */
+		if (move_start_devs(move, &from, move->backend_id, saved, json_steps) == 0) {
+			move->new_backend_id = move->backend_id;
+			move->rolled_back = true;
+		}
+		goto out;
+	}
+
+	start_ns = cbd_now_ns();
+	ret = backend_stop(from.transport_id, move->backend_id, NULL);
+	if (!ret)
+		ret = timing_wait_alive(NULL, "backend removed", backend_alive, &from, move->backend_id, false);
+	move_step(json_steps, "backend-stop", from.transport_id, move->backend_id, start_ns, ret);
+	if (ret)
+		goto out;
+
+	ret = move_start(move, &to, &move->new_backend_id, saved, json_steps);
+	if (ret && move->new_backend_id == UINT_MAX) {
+		/* Nothing runs on the target, bring the backend back where it was */
+		printf("rebalance: backend %s failed on transport %u, restarting it on transport %u\n",
+		       move->path, to.transport_id, from.transport_id);
+		if (move_start(move, &from, &backend_id, saved, json_steps) == 0) {
+			move->new_backend_id = backend_id;
+			move->rolled_back = true;
+		}
+	}
+	if (ret)
+		goto out;
+
+	/* Stopped backends keep their segments, see place_account(), the plan counted them freed */
+	start_ns = cbd_now_ns();
+	ret = backend_clear(from.transport_id, move->backend_id);
+	move_step(json_steps, "backend-clear", from.transport_id, move->backend_id, start_ns, ret);
+	if (ret)
+		printf("rebalance: segments of backend %u not freed on transport %u\n",
+		       move->backend_id, from.transport_id);
+out:
+	free(saved);
+	return ret;
+}
+
+int cbdctrl_dev_stop(cbd_opt_t *options) {
+	if (options->co_dev_id == UINT_MAX) {
+		printf("--dev required for dev-stop command\n");
+		return -EINVAL;
+	}
+
+	if (options->co_timing) {
+		struct cbd_timing timing;
+		json_t *json_out;
+		int ret;
+
+		cbd_timing_init(&timing);
+		ret = dev_stop(options->co_transport_id, options->co_dev_id, &timing);
+		if (!ret) {
+			json_out = json_object();
+			json_object_set_new(json_out, "dev_id", json_integer(options->co_dev_id));
+			json_object_set_new(json_out, "timing_ns", cbd_timing_to_json(&timing));
+			timing_print(json_out);
+		}
+		cbd_timing_exit(&timing);
+		return ret;
+	}
+
+	return dev_stop(options->co_transport_id, options->co_dev_id, NULL);
+}
+
 int cbdctrl_dev_list(cbd_opt_t *options)
 {
 	struct cbd_transport cbdt;
+	unsigned int *local_ids = NULL;
+	json_t **local_jsons = NULL;
+	json_t **local_cgroups = NULL;
+	unsigned int local_num = 0;
 	json_t *array = json_array(); // Create JSON array
 	if (array == NULL) {
 		fprintf(stderr, "Error creating JSON array\n");
@@ -682,10 +2425,25 @@ int cbdctrl_dev_list(cbd_opt_t *options)
 		return ret;
 	}
 
+	/* Blkdevs of this host, their cgroup limits are looked up in one walk */
+	if (cbdt.blkdev_num) {
+		local_ids = calloc(cbdt.blkdev_num, sizeof(*local_ids));
+		local_jsons = calloc(cbdt.blkdev_num, sizeof(*local_jsons));
+		local_cgroups = calloc(cbdt.blkdev_num, sizeof(*local_cgroups));
+		if (!local_ids || !local_jsons || !local_cgroups) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	// Iterate through all blkdevs and generate JSON object for each
 	for (unsigned int i = 0; i < cbdt.blkdev_num; i++) {
 		struct cbd_blkdev blkdev;
 		ret = cbdsys_blkdev_init(&cbdt, &blkdev, i); // Initialize current blkdev
+		if (ret == -ETIMEDOUT) {
+			json_array_append_new(array, cbd_stale_to_json("blkdev_id", i));
+			continue;
+		}
 		if (ret < 0) {
 			continue;
 		}
@@ -701,17 +2459,115 @@ int cbdctrl_dev_list(cbd_opt_t *options)
 		json_object_set_new(json_blkdev, "dev_name", json_string(blkdev.dev_name));
 		json_object_set_new(json_blkdev, "alive", json_boolean(blkdev.alive));
 
+		// Queue settings, only a blkdev of this host has a local queue
+		if (blkdev.host_id == cbdt.host_id) {
+			json_t *json_queue = cbd_queue_to_json(blkdev.mapped_id);
+
+			if (json_queue)
+				json_object_set_new(json_blkdev, "queue", json_queue);
+
+			local_ids[local_num] = blkdev.mapped_id;
+			local_jsons[local_num++] = json_blkdev;
+		}
+
 		// Append JSON object to JSON array
 		json_array_append_new(array, json_blkdev);
 	}
 
+	if (cbd_cgroup_limits_scan(local_ids, local_num, local_cgroups) == 0) {
+		for (unsigned int i = 0; i < local_num; i++) {
+			if (local_cgroups[i])
+				json_object_set_new(local_jsons[i], "io_limits", local_cgroups[i]);
+		}
+	}
+
 	// Convert JSON array to a formatted string and print to stdout
 	char *json_str = json_dumps(array, JSON_INDENT(4));
 	if (json_str != NULL) {
 		printf("%s\n", json_str);
 		free(json_str);
 	}
-
+	ret = 0;
+out:
+	free(local_ids);
+	free(local_jsons);
+	free(local_cgroups);
 	json_decref(array); // Free JSON array memory
-	return 0;
+	return ret;
+}
+
+int cbdctrl_dev_tune(cbd_opt_t *options)
+{
+	struct cbd_queue_profile profile;
+	struct cbd_transport cbdt;
+	struct cbd_blkdev blkdev;
+	json_t *json_queue = NULL;
+	json_t *json_out;
+	char *json_str;
+	int ret;
+
+	if (options->co_dev_id == UINT_MAX) {
+		printf("--dev required for dev-tune command\n");
+		return -EINVAL;
+	}
+
+	ret = dev_tune_check(options, &profile);
+	if (ret)
+		return ret;
+
+	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+	if (ret < 0)
+		return ret;
+
+	ret = cbdsys_blkdev_init(&cbdt, &blkdev, options->co_dev_id);
+	if (ret < 0) {
+		printf("blkdev %u not found.\n", options->co_dev_id);
+		return ret;
+	}
+
+	if (blkdev.host_id != cbdt.host_id) {
+		printf("blkdev %u is on host %u, dev-tune works on blkdevs of this host\n",
+		       blkdev.blkdev_id, blkdev.host_id);
+		return -EINVAL;
+	}
+
+	json_out = json_object();
+	json_object_set_new(json_out, "blkdev_id", json_integer(blkdev.blkdev_id));
+	json_object_set_new(json_out, "dev_name", json_string(blkdev.dev_name));
+
+	if (options->co_queue_profile[0]) {
+		ret = cbd_queue_profile_apply(blkdev.mapped_id, &profile, &json_queue);
+		json_object_set_new(json_out, "profile", json_string(profile.name));
+		json_object_set_new(json_out, "settings", json_queue);
+		json_object_set_new(json_out, "ok", json_boolean(!ret));
+	}
+
+	if (dev_io_limits_wanted(options)) {
+		json_t *json_limits = NULL;
+		int err;
+
+		err = cbd_cgroup_apply(options->co_cgroup, blkdev.mapped_id, options->co_io_max,
+				       options->co_io_weight, &json_limits);
+		json_object_set_new(json_out, "io_limits", json_limits);
+		if (!ret)
+			ret = err;
+	}
+
+	json_queue = cbd_queue_to_json(blkdev.mapped_id);
+	if (json_queue) {
+		json_object_set_new(json_out, "queue", json_queue);
+		json_object_set_new(json_out, "cgroups", cbd_cgroup_limits_to_json(blkdev.mapped_id));
+	} else if (!ret) {
+		printf("Queue of %s not found\n", blkdev.dev_name);
+		ret = -ENODEV;
+	}
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	return ret;
 }
@@ -2,6 +2,10 @@
 #define CBDCTRL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 #include <getopt.h>
 
 
@@ -13,14 +17,77 @@
 #define CBDCTL_TRANSPORT_UNREGISTER "tp-unreg"
 #define CBDCTL_TRANSPORT_LIST "tp-list"
 #define CBDCTL_HOST_LIST "host-list"
+#define CBDCTL_HOST_MONITOR "host-monitor"
+#define CBDCTL_GC "gc"
 #define CBDCTL_BACKEND_START "backend-start"
 #define CBDCTL_BACKEND_STOP "backend-stop"
 #define CBDCTL_BACKEND_LIST "backend-list"
 #define CBDCTL_DEV_START "dev-start"
 #define CBDCTL_DEV_STOP "dev-stop"
 #define CBDCTL_DEV_LIST "dev-list"
+#define CBDCTL_DEV_TUNE "dev-tune"
+#define CBDCTL_RECORD_DUMP "record-dump"
+#define CBDCTL_RECORD "record"
+#define CBDCTL_HEALTH "health"
+#define CBDCTL_REBALANCE "rebalance"
+#define CBDCTL_BACKEND_STAT "backend-stat"
+#define CBDCTL_DEV_STAT "dev-stat"
+#define CBDCTL_EXPORT "export"
+#define CBDCTL_BENCH "bench"
+#define CBDCTL_TRANSPORT_BENCH "tp-bench"
+#define CBDCTL_TRANSPORT_CHECK "tp-check"
+#define CBDCTL_TRANSPORT_SEGMENTS "tp-segments"
+#define CBDCTL_TRANSPORT_PREPARE "tp-prepare"
+#define CBDCTL_CACHE_SIM "cache-sim"
+#define CBDCTL_CACHE_WARM "cache-warm"
+#define CBDCTL_CACHE_PROFILE "cache-profile"
+#define CBDCTL_BATCH "batch"
+#define CBDCTL_SHELL "shell"
 
 #define CBD_BACKEND_HANDLERS_MAX 128
+#define CBD_BACKEND_HANDLERS_AUTO	(UINT_MAX - 1)	/* -n auto */
+
+#define CBD_HANDLERS_PROBE_IODEPTH	64
+#define CBD_HANDLERS_PROBE_RUNTIME	2000000		/* usecs per handler count */
+#define CBD_HANDLERS_PLATEAU_GAIN	5		/* percent */
+
+#define CBD_AUTO_PLACE_MIN_FREE		1		/* segments left free besides the new cache */
+
+#define CBD_SEGMENTS_HEATMAP_CELLS	64		/* width of the tp-segments heat map */
+
+#define CBD_GC_JOBS_DEFAULT		4		/* clears in flight */
+
+#define CBD_STAT_INTERVAL_DEFAULT	1000000		/* Default sampling interval in usecs */
+
+/*
+ * Exit status of health, the class of the first failed check. Without
+ * --deadline all reads together are bounded by CBD_HEALTH_BUDGET_MS.
+ */
+enum cbd_health_status {
+	CBD_HEALTH_OK		= 0,
+	CBD_HEALTH_ERROR,		/* bad arguments */
+	CBD_HEALTH_MODULE,		/* cbd module not loaded */
+	CBD_HEALTH_TRANSPORT,		/* transport not registered or not readable */
+	CBD_HEALTH_HOST,		/* this host not alive */
+	CBD_HEALTH_BACKEND,
+	CBD_HEALTH_DEV,
+	CBD_HEALTH_TIMEOUT,		/* budget exceeded */
+};
+
+#define CBD_HEALTH_BUDGET_MS		20
+
+#define CBD_RECORD_SIZE_DEFAULT		(64ULL * 1024 * 1024)	/* of a new flight recorder ring */
+
+#define CBD_BENCH_BS_DEFAULT		4096
+#define CBD_BENCH_IODEPTH_DEFAULT	32
+#define CBD_BENCH_RUNTIME_DEFAULT	10000000	/* usecs */
+#define CBD_BENCH_CYCLES_DEFAULT	10		/* dev-start/dev-stop cycles of bench --timing */
+
+#define CBD_CACHE_SIM_SEG_SIZE_DEFAULT	(16 * 1024 * 1024)
+
+#define CBD_PROFILE_REGION_DEFAULT	(1024 * 1024)
+#define CBD_CACHE_WARM_IO_SIZE		(256 * 1024)
+#define CBD_CACHE_WARM_RATE_DEFAULT	(256ULL * 1024 * 1024)	/* bytes per second */
 
 enum CBDCTL_CMD_TYPE {
 	CCT_TRANSPORT_REGISTER	= 0,
@@ -33,6 +100,26 @@ enum CBDCTL_CMD_TYPE {
 	CCT_DEV_START,
 	CCT_DEV_STOP,
 	CCT_DEV_LIST,
+	CCT_BACKEND_STAT,
+	CCT_DEV_STAT,
+	CCT_EXPORT,
+	CCT_BENCH,
+	CCT_TRANSPORT_BENCH,
+	CCT_CACHE_SIM,
+	CCT_CACHE_WARM,
+	CCT_CACHE_PROFILE,
+	CCT_TRANSPORT_CHECK,
+	CCT_BATCH,
+	CCT_SHELL,
+	CCT_TRANSPORT_SEGMENTS,
+	CCT_HOST_MONITOR,
+	CCT_GC,
+	CCT_TRANSPORT_PREPARE,
+	CCT_DEV_TUNE,
+	CCT_RECORD_DUMP,
+	CCT_RECORD,
+	CCT_HEALTH,
+	CCT_REBALANCE,
 	CCT_INVALID,
 };
 
@@ -51,6 +138,91 @@ struct cbd_options
 	unsigned int		co_dev_id;
 	bool			co_start_dev;
 	bool			co_all;
+	unsigned long		co_interval_us;
+	unsigned long		co_count;
+	bool			co_ndjson;
+	char			co_listen[CBD_PATH_LEN];
+	char			co_textfile[CBD_PATH_LEN];
+	char			co_rw[16];
+	unsigned int		co_bs;
+	unsigned int		co_iodepth;
+	unsigned int		co_jobs;
+	unsigned long		co_runtime_us;
+	bool			co_compare_backend;
+	unsigned int		co_segment;
+	uint64_t		co_size;
+	bool			co_numa;
+	char			co_cpus[CBD_PATH_LEN];
+	bool			co_numa_local;
+	char			co_cache_sizes[CBD_PATH_LEN];
+	char			co_gc_percents[CBD_PATH_LEN];
+	uint64_t		co_segment_size;
+	uint64_t		co_gc_rate;
+	char			co_profile[CBD_PATH_LEN];
+	uint64_t		co_region;
+	uint64_t		co_rate;
+	unsigned int		co_deadline_ms;
+	bool			co_auto_place;
+	bool			co_timing;
+	char			co_image[CBD_PATH_LEN];
+	char			co_hooks[CBD_PATH_LEN];
+	bool			co_clear_dead;
+	bool			co_dry_run;
+	bool			co_verify;
+	char			co_queue_profile[CBD_PATH_LEN];
+	char			co_cgroup[CBD_PATH_LEN];
+	char			co_io_max[CBD_PATH_LEN];
+	unsigned int		co_io_weight;
+	char			co_ring[CBD_PATH_LEN];
+	uint64_t		co_from_ns;	/* unix ns, 0 for no bound */
+	uint64_t		co_to_ns;
+	bool			co_local;
+	bool			co_plan;
+	bool			co_execute;
+};
+
+/* Values of long options which have no short form */
+enum CBDCTL_LONG_OPT {
+	CLO_COUNT = 256,
+	CLO_NDJSON,
+	CLO_LISTEN,
+	CLO_TEXTFILE,
+	CLO_RW,
+	CLO_BS,
+	CLO_IODEPTH,
+	CLO_JOBS,
+	CLO_RUNTIME,
+	CLO_COMPARE_BACKEND,
+	CLO_SEGMENT,
+	CLO_SIZE,
+	CLO_NUMA,
+	CLO_CPUS,
+	CLO_NUMA_LOCAL,
+	CLO_CACHE_SIZES,
+	CLO_GC_PERCENTS,
+	CLO_SEGMENT_SIZE,
+	CLO_GC_RATE,
+	CLO_PROFILE,
+	CLO_REGION,
+	CLO_RATE,
+	CLO_DEADLINE,
+	CLO_AUTO_PLACE,
+	CLO_TIMING,
+	CLO_IMAGE,
+	CLO_HOOKS,
+	CLO_CLEAR_DEAD,
+	CLO_DRY_RUN,
+	CLO_VERIFY,
+	CLO_QUEUE_PROFILE,
+	CLO_CGROUP,
+	CLO_IO_MAX,
+	CLO_IO_WEIGHT,
+	CLO_RING,
+	CLO_FROM,
+	CLO_TO,
+	CLO_LOCAL,
+	CLO_PLAN,
+	CLO_EXECUTE,
 };
 
 /* Exports options as a global type */
@@ -72,6 +244,27 @@ static cbdctrl_cmd_t cbdctrl_cmd_tables[] = {
 	{CBDCTL_DEV_START, CCT_DEV_START},
 	{CBDCTL_DEV_STOP, CCT_DEV_STOP},
 	{CBDCTL_DEV_LIST, CCT_DEV_LIST},
+	{CBDCTL_BACKEND_STAT, CCT_BACKEND_STAT},
+	{CBDCTL_DEV_STAT, CCT_DEV_STAT},
+	{CBDCTL_EXPORT, CCT_EXPORT},
+	{CBDCTL_BENCH, CCT_BENCH},
+	{CBDCTL_TRANSPORT_BENCH, CCT_TRANSPORT_BENCH},
+	{CBDCTL_CACHE_SIM, CCT_CACHE_SIM},
+	{CBDCTL_CACHE_WARM, CCT_CACHE_WARM},
+	{CBDCTL_CACHE_PROFILE, CCT_CACHE_PROFILE},
+	{CBDCTL_TRANSPORT_CHECK, CCT_TRANSPORT_CHECK},
+	{CBDCTL_BATCH, CCT_BATCH},
+	{CBDCTL_SHELL, CCT_SHELL},
+	{CBDCTL_TRANSPORT_SEGMENTS, CCT_TRANSPORT_SEGMENTS},
+	{CBDCTL_HOST_MONITOR, CCT_HOST_MONITOR},
+	{CBDCTL_GC, CCT_GC},
+	{CBDCTL_TRANSPORT_PREPARE, CCT_TRANSPORT_PREPARE},
+	{CBDCTL_DEV_TUNE, CCT_DEV_TUNE},
+	/* before "record", commands match by prefix */
+	{CBDCTL_RECORD_DUMP, CCT_RECORD_DUMP},
+	{CBDCTL_RECORD, CCT_RECORD},
+	{CBDCTL_HEALTH, CCT_HEALTH},
+	{CBDCTL_REBALANCE, CCT_REBALANCE},
 	{"", CCT_INVALID},
 };
 
@@ -81,16 +274,72 @@ static cbdctrl_cmd_t cbdctrl_cmd_tables[] = {
 enum CBDCTL_CMD_TYPE cbd_get_cmd_type(char *cmd_str);
 
 void cbd_options_parser(int argc, char* argv[], cbd_opt_t* options);
+int cbd_options_parse_line(int argc, char *argv[], cbd_opt_t *options);
+/* Run the command parsed into @options */
+int cbdctrl_dispatch(cbd_opt_t *options);
 
 int cbdctrl_transport_register(cbd_opt_t *options);
 int cbdctrl_transport_unregister(cbd_opt_t *opt);
 int cbdctrl_transport_list(cbd_opt_t *opt);
 int cbdctrl_host_list(cbd_opt_t *opt);
+int cbdctrl_host_monitor(cbd_opt_t *options);
+int cbdctrl_gc(cbd_opt_t *options);
 int cbdctrl_backend_start(cbd_opt_t *options);
 int cbdctrl_backend_stop(cbd_opt_t *options);
 int cbdctrl_backend_list(cbd_opt_t *options);
 int cbdctrl_dev_start(cbd_opt_t *options);
 int cbdctrl_dev_stop(cbd_opt_t *options);
 int cbdctrl_dev_list(cbd_opt_t *options);
+int cbdctrl_dev_tune(cbd_opt_t *options);
+int cbdctrl_record(cbd_opt_t *options);
+int cbdctrl_record_dump(cbd_opt_t *options);
+int cbdctrl_health(cbd_opt_t *options);
+int cbdctrl_rebalance(cbd_opt_t *options);
+int cbdctrl_backend_stat(cbd_opt_t *options);
+int cbdctrl_dev_stat(cbd_opt_t *options);
+int cbdctrl_export(cbd_opt_t *options);
+int cbdctrl_bench(cbd_opt_t *options);
+/* 4K random read run on @path, used to calibrate other commands */
+int cbdctrl_bench_probe(const char *path, unsigned int iodepth, unsigned int jobs,
+			unsigned long runtime_us, double *iops);
+int cbdctrl_transport_bench(cbd_opt_t *options);
+int cbdctrl_transport_check(cbd_opt_t *options);
+int cbdctrl_transport_segments(cbd_opt_t *options);
+int cbdctrl_transport_prepare(cbd_opt_t *options);
+/* dev-start and dev-stop a blkdev of @backend_id, timing each when given */
+struct cbd_timing;
+int cbdctrl_dev_cycle(unsigned int transport_id, unsigned int backend_id,
+		      struct cbd_timing *start_timing, struct cbd_timing *stop_timing);
+int cbdctrl_cache_sim(cbd_opt_t *options);
+int cbdctrl_cache_warm(cbd_opt_t *options);
+int cbdctrl_cache_profile(cbd_opt_t *options);
+int cbdctrl_batch(cbd_opt_t *options);
+int cbdctrl_shell(cbd_opt_t *options);
+
+void trim_newline(char *str);
+unsigned long opt_to_bytes(const char *input);
+
+/* Set by SIGINT/SIGTERM for the long running sampling commands */
+extern volatile sig_atomic_t cbdctrl_stopping;
+void cbdctrl_catch_stop_signals(void);
+
+static inline uint64_t cbd_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep until an absolute CLOCK_MONOTONIC deadline, so sampling doesn't drift */
+static inline void cbd_sleep_until_ns(uint64_t deadline_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline_ns / 1000000000ULL;
+	ts.tv_nsec = deadline_ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && !cbdctrl_stopping)
+		;
+}
 
 #endif // CBDCTRL_H
@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/* Full rescan to pick up created or removed entities, in nsecs */
+#define EXPORT_RESCAN_INTERVAL_NS	(30 * 1000000000ULL)
+
+#define EXPORT_REQUEST_LEN		4096
+#define EXPORT_CLIENT_TIMEOUT_MS	1000
+
+struct export_host {
+	struct cbd_host			host;
+	int				alive_fd;
+};
+
+struct export_backend {
+	struct cbd_backend		backend;
+	struct cbdsys_backend_sampler	sampler;
+};
+
+struct export_blkdev {
+	struct cbd_blkdev		blkdev;
+	int				alive_fd;
+	bool				local;		/* iostat only exists on the owning host */
+	struct cbdsys_blkdev_sampler	sampler;
+	struct cbd_blkdev_iostat	iostat;
+};
+
+struct export_transport {
+	struct cbd_transport		cbdt;
+	struct export_host		*hosts;
+	unsigned int			host_cnt;
+	struct export_backend		*backends;
+	unsigned int			backend_cnt;
+	struct export_blkdev		*blkdevs;
+	unsigned int			blkdev_cnt;
+};
+
+struct export_snapshot {
+	struct export_transport		*transports;
+	unsigned int			transport_cnt;
+	uint64_t			rescan_ns;
+	bool				need_rescan;
+	double				refresh_seconds;
+
+	/* Rendered metrics, scrapes are answered from here */
+	char				*text;
+	size_t				text_len;
+	size_t				text_size;
+};
+
+static void export_transport_release(struct export_transport *et)
+{
+	for (unsigned int i = 0; i < et->host_cnt; i++)
+		cbdsys_attr_close(&et->hosts[i].alive_fd);
+	for (unsigned int i = 0; i < et->backend_cnt; i++)
+		cbdsys_backend_sampler_close(&et->backends[i].sampler);
+	for (unsigned int i = 0; i < et->blkdev_cnt; i++) {
+		cbdsys_attr_close(&et->blkdevs[i].alive_fd);
+		if (et->blkdevs[i].local)
+			cbdsys_blkdev_sampler_close(&et->blkdevs[i].sampler);
+	}
+
+	free(et->hosts);
+	free(et->backends);
+	free(et->blkdevs);
+}
+
+static void export_snapshot_release(struct export_snapshot *snap)
+{
+	for (unsigned int i = 0; i < snap->transport_cnt; i++)
+		export_transport_release(&snap->transports[i]);
+
+	free(snap->transports);
+	snap->transports = NULL;
+	snap->transport_cnt = 0;
+}
+
+static int export_transport_scan(struct export_transport *et)
+{
+	struct cbd_transport *cbdt = &et->cbdt;
+	char path[CBD_PATH_LEN];
+
+	et->hosts = calloc(cbdt->host_num, sizeof(*et->hosts));
+	et->backends = calloc(cbdt->backend_num, sizeof(*et->backends));
+	et->blkdevs = calloc(cbdt->blkdev_num, sizeof(*et->blkdevs));
+	if ((cbdt->host_num && !et->hosts) || (cbdt->backend_num && !et->backends) ||
+	    (cbdt->blkdev_num && !et->blkdevs))
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < cbdt->host_num; i++) {
+		struct export_host *eh = &et->hosts[et->host_cnt];
+
+		if (cbdsys_host_init(cbdt, &eh->host, i) < 0)
+			continue;
+
+		host_alive_path(cbdt->transport_id, i, path, CBD_PATH_LEN);
+		eh->alive_fd = cbdsys_attr_open(path);
+		if (eh->alive_fd < 0)
+			continue;
+
+		et->host_cnt++;
+	}
+
+	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
+		struct export_backend *eb = &et->backends[et->backend_cnt];
+
+		if (cbdsys_backend_info_init(cbdt, &eb->backend, i) < 0)
+			continue;
+
+		if (cbdsys_backend_sampler_open(cbdt, &eb->sampler, i) < 0)
+			continue;
+
+		et->backend_cnt++;
+	}
+
+	for (unsigned int i = 0; i < cbdt->blkdev_num; i++) {
+		struct export_blkdev *ed = &et->blkdevs[et->blkdev_cnt];
+
+		if (cbdsys_blkdev_init(cbdt, &ed->blkdev, i) < 0)
+			continue;
+
+		blkdev_alive_path(cbdt->transport_id, i, path, CBD_PATH_LEN);
+		ed->alive_fd = cbdsys_attr_open(path);
+		if (ed->alive_fd < 0)
+			continue;
+
+		ed->local = (ed->blkdev.host_id == cbdt->host_id && ed->blkdev.alive &&
+			     cbdsys_blkdev_sampler_open(&ed->blkdev, &ed->sampler) == 0);
+
+		et->blkdev_cnt++;
+	}
+
+	return 0;
+}
+
+static int export_snapshot_scan(struct export_snapshot *snap)
+{
+	struct cbd_transport cbdt;
+	int ret;
+
+	export_snapshot_release(snap);
+
+	for (int i = 0; i < CBD_TRANSPORT_MAX; i++) {
+		struct export_transport *transports;
+
+		ret = cbdsys_transport_init(&cbdt, i);
+		if (ret == -ENOENT)
+			break;
+		if (ret < 0)
+			return ret;
+
+		transports = realloc(snap->transports, (snap->transport_cnt + 1) * sizeof(*transports));
+		if (!transports)
+			return -ENOMEM;
+		snap->transports = transports;
+
+		memset(&transports[snap->transport_cnt], 0, sizeof(*transports));
+		transports[snap->transport_cnt].cbdt = cbdt;
+
+		ret = export_transport_scan(&transports[snap->transport_cnt++]);
+		if (ret < 0)
+			return ret;
+	}
+
+	snap->rescan_ns = cbd_now_ns();
+	snap->need_rescan = false;
+	return 0;
+}
+
+/* Re-read the already opened attributes, no directory walking */
+static void export_snapshot_refresh(struct export_snapshot *snap)
+{
+	char buf[16];
+
+	for (unsigned int t = 0; t < snap->transport_cnt; t++) {
+		struct export_transport *et = &snap->transports[t];
+
+		for (unsigned int i = 0; i < et->host_cnt; i++) {
+			struct export_host *eh = &et->hosts[i];
+
+			if (cbdsys_attr_read(eh->alive_fd, buf, sizeof(buf)) < 0) {
+				snap->need_rescan = true;
+				continue;
+			}
+			eh->host.alive = (strcmp(buf, "true") == 0);
+		}
+
+		for (unsigned int i = 0; i < et->backend_cnt; i++) {
+			struct export_backend *eb = &et->backends[i];
+
+			if (cbdsys_backend_sampler_read(&eb->sampler, &eb->backend) < 0)
+				snap->need_rescan = true;
+		}
+
+		for (unsigned int i = 0; i < et->blkdev_cnt; i++) {
+			struct export_blkdev *ed = &et->blkdevs[i];
+			bool alive;
+
+			if (cbdsys_attr_read(ed->alive_fd, buf, sizeof(buf)) < 0) {
+				snap->need_rescan = true;
+				continue;
+			}
+
+			/* A blkdev coming up on this host gets its /sys/block entry on rescan */
+			alive = (strcmp(buf, "true") == 0);
+			if (alive != ed->blkdev.alive)
+				snap->need_rescan = true;
+			ed->blkdev.alive = alive;
+
+			if (ed->local && cbdsys_blkdev_sampler_read(&ed->sampler, &ed->iostat) < 0)
+				snap->need_rescan = true;
+		}
+	}
+}
+
+static void export_printf(struct export_snapshot *snap, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	while (true) {
+		size_t avail = snap->text_size - snap->text_len;
+
+		va_start(ap, fmt);
+		len = vsnprintf(snap->text + snap->text_len, avail, fmt, ap);
+		va_end(ap);
+
+		if (len < 0)
+			return;
+
+		if ((size_t)len < avail) {
+			snap->text_len += len;
+			return;
+		}
+
+		/* The buffer only grows, in steady state rendering doesn't allocate */
+		char *text = realloc(snap->text, snap->text_size * 2 + len);
+		if (!text)
+			return;
+		snap->text = text;
+		snap->text_size = snap->text_size * 2 + len;
+	}
+}
+
+/* Label values are user controlled, escape them as the text format requires */
+static void export_label_value(const char *src, char *dst, size_t dst_len)
+{
+	size_t i = 0;
+
+	for (; *src && i + 2 < dst_len; src++) {
+		if (*src == '\\' || *src == '"') {
+			dst[i++] = '\\';
+			dst[i++] = *src;
+		} else if (*src == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+		} else {
+			dst[i++] = *src;
+		}
+	}
+	dst[i] = '\0';
+}
+
+static void export_family(struct export_snapshot *snap, const char *name, const char *type, const char *help)
+{
+	export_printf(snap, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void export_render(struct export_snapshot *snap)
+{
+	char label[CBD_PATH_LEN * 2];
+	unsigned int t, i;
+
+	if (!snap->text) {
+		snap->text_size = 64 * 1024;
+		snap->text = malloc(snap->text_size);
+		if (!snap->text)
+			return;
+	}
+	snap->text_len = 0;
+
+#define FOR_EACH_TRANSPORT for (t = 0; t < snap->transport_cnt; t++)
+#define ET (&snap->transports[t])
+
+	export_family(snap, "cbd_transport_info", "gauge", "Transport registered on this node.");
+	FOR_EACH_TRANSPORT {
+		export_label_value(ET->cbdt.path, label, sizeof(label));
+		export_printf(snap, "cbd_transport_info{transport=\"%u\",path=\"%s\",host_id=\"%u\",version=\"%d\"} 1\n",
+			      ET->cbdt.transport_id, label, ET->cbdt.host_id, ET->cbdt.version);
+	}
+
+	export_family(snap, "cbd_transport_segment_num", "gauge", "Number of segments in the transport.");
+	FOR_EACH_TRANSPORT
+		export_printf(snap, "cbd_transport_segment_num{transport=\"%u\"} %u\n",
+			      ET->cbdt.transport_id, ET->cbdt.segment_num);
+
+	export_family(snap, "cbd_transport_bytes_per_segment", "gauge", "Size of a segment in bytes.");
+	FOR_EACH_TRANSPORT
+		export_printf(snap, "cbd_transport_bytes_per_segment{transport=\"%u\"} %u\n",
+			      ET->cbdt.transport_id, ET->cbdt.bytes_per_segment);
+
+	export_family(snap, "cbd_transport_host_num", "gauge", "Number of host slots in the transport.");
+	FOR_EACH_TRANSPORT
+		export_printf(snap, "cbd_transport_host_num{transport=\"%u\"} %u\n",
+			      ET->cbdt.transport_id, ET->cbdt.host_num);
+
+	export_family(snap, "cbd_transport_backend_num", "gauge", "Number of backend slots in the transport.");
+	FOR_EACH_TRANSPORT
+		export_printf(snap, "cbd_transport_backend_num{transport=\"%u\"} %u\n",
+			      ET->cbdt.transport_id, ET->cbdt.backend_num);
+
+	export_family(snap, "cbd_transport_blkdev_num", "gauge", "Number of blkdev slots in the transport.");
+	FOR_EACH_TRANSPORT
+		export_printf(snap, "cbd_transport_blkdev_num{transport=\"%u\"} %u\n",
+			      ET->cbdt.transport_id, ET->cbdt.blkdev_num);
+
+	export_family(snap, "cbd_host_alive", "gauge", "Whether the host is alive.");
+	FOR_EACH_TRANSPORT {
+		for (i = 0; i < ET->host_cnt; i++) {
+			struct cbd_host *host = &ET->hosts[i].host;
+
+			export_label_value(host->hostname, label, sizeof(label));
+			export_printf(snap, "cbd_host_alive{transport=\"%u\",host=\"%d\",hostname=\"%s\"} %d\n",
+				      ET->cbdt.transport_id, host->host_id, label, host->alive);
+		}
+	}
+
+	export_family(snap, "cbd_backend_alive", "gauge", "Whether the backend is alive.");
+	FOR_EACH_TRANSPORT {
+		for (i = 0; i < ET->backend_cnt; i++) {
+			struct cbd_backend *backend = &ET->backends[i].backend;
+
+			export_label_value(backend->backend_path, label, sizeof(label));
+			export_printf(snap, "cbd_backend_alive{transport=\"%u\",backend=\"%u\",host=\"%u\",path=\"%s\"} %d\n",
+				      ET->cbdt.transport_id, backend->backend_id, backend->host_id, label, backend->alive);
+		}
+	}
+
+#define EXPORT_BACKEND_GAUGE(MEMBER, HELP)								\
+	export_family(snap, "cbd_backend_" #MEMBER, "gauge", HELP);					\
+	FOR_EACH_TRANSPORT {										\
+		for (i = 0; i < ET->backend_cnt; i++)							\
+			export_printf(snap, "cbd_backend_" #MEMBER "{transport=\"%u\",backend=\"%u\"} %u\n",	\
+				      ET->cbdt.transport_id, ET->backends[i].backend.backend_id,		\
+				      ET->backends[i].backend.MEMBER);						\
+	}
+
+	EXPORT_BACKEND_GAUGE(cache_segs, "Number of segments of the backend cache.")
+	EXPORT_BACKEND_GAUGE(cache_used_segs, "Number of used segments of the backend cache.")
+	EXPORT_BACKEND_GAUGE(cache_gc_percent, "Cache usage percentage at which GC starts.")
+
+	export_family(snap, "cbd_blkdev_alive", "gauge", "Whether the blkdev is alive.");
+	FOR_EACH_TRANSPORT {
+		for (i = 0; i < ET->blkdev_cnt; i++) {
+			struct cbd_blkdev *blkdev = &ET->blkdevs[i].blkdev;
+
+			export_printf(snap, "cbd_blkdev_alive{transport=\"%u\",blkdev=\"%u\",host=\"%u\",backend=\"%u\",dev=\"%s\"} %d\n",
+				      ET->cbdt.transport_id, blkdev->blkdev_id, blkdev->host_id,
+				      blkdev->backend_id, blkdev->dev_name, blkdev->alive);
+		}
+	}
+
+#define EXPORT_BLKDEV_IOSTAT(NAME, TYPE, HELP, FMT, EXPR)						\
+	export_family(snap, "cbd_blkdev_" NAME, TYPE, HELP);						\
+	FOR_EACH_TRANSPORT {										\
+		for (i = 0; i < ET->blkdev_cnt; i++) {							\
+			struct export_blkdev *ed = &ET->blkdevs[i];					\
+													\
+			if (!ed->local)									\
+				continue;								\
+			export_printf(snap, "cbd_blkdev_" NAME "{transport=\"%u\",blkdev=\"%u\",dev=\"%s\"} " FMT "\n", \
+				      ET->cbdt.transport_id, ed->blkdev.blkdev_id, ed->blkdev.dev_name, EXPR); \
+		}											\
+	}
+
+	EXPORT_BLKDEV_IOSTAT("reads_completed_total", "counter", "Reads completed.",
+			     "%lu", ed->iostat.rd_ios)
+	EXPORT_BLKDEV_IOSTAT("read_bytes_total", "counter", "Bytes read.",
+			     "%lu", ed->iostat.rd_sectors * 512)
+	EXPORT_BLKDEV_IOSTAT("read_time_seconds_total", "counter", "Time spent reading.",
+			     "%.3f", ed->iostat.rd_ticks / 1000.0)
+	EXPORT_BLKDEV_IOSTAT("writes_completed_total", "counter", "Writes completed.",
+			     "%lu", ed->iostat.wr_ios)
+	EXPORT_BLKDEV_IOSTAT("written_bytes_total", "counter", "Bytes written.",
+			     "%lu", ed->iostat.wr_sectors * 512)
+	EXPORT_BLKDEV_IOSTAT("write_time_seconds_total", "counter", "Time spent writing.",
+			     "%.3f", ed->iostat.wr_ticks / 1000.0)
+	EXPORT_BLKDEV_IOSTAT("io_time_seconds_total", "counter", "Time spent doing I/Os.",
+			     "%.3f", ed->iostat.io_ticks / 1000.0)
+	EXPORT_BLKDEV_IOSTAT("io_time_weighted_seconds_total", "counter", "Weighted time spent doing I/Os.",
+			     "%.3f", ed->iostat.time_in_queue / 1000.0)
+	EXPORT_BLKDEV_IOSTAT("inflight", "gauge", "I/Os currently in flight.",
+			     "%u", ed->iostat.inflight_rd + ed->iostat.inflight_wr)
+
+#undef EXPORT_BLKDEV_IOSTAT
+#undef EXPORT_BACKEND_GAUGE
+#undef ET
+#undef FOR_EACH_TRANSPORT
+
+	export_family(snap, "cbd_exporter_refresh_duration_seconds", "gauge", "Time spent on the last refresh.");
+	export_printf(snap, "cbd_exporter_refresh_duration_seconds %.6f\n", snap->refresh_seconds);
+}
+
+static void export_update(struct export_snapshot *snap)
+{
+	uint64_t start_ns = cbd_now_ns();
+
+	/* --deadline bounds each refresh, not the whole run */
+	cbdsys_deadline_restart();
+	if (snap->need_rescan || start_ns - snap->rescan_ns >= EXPORT_RESCAN_INTERVAL_NS)
+		export_snapshot_scan(snap);
+
+	export_snapshot_refresh(snap);
+	snap->refresh_seconds = (cbd_now_ns() - start_ns) / 1e9;
+	export_render(snap);
+}
+
+static int export_textfile_write(struct export_snapshot *snap, const char *path)
+{
+	char tmp_path[CBD_PATH_LEN + 8];
+	FILE *file;
+
+	/* node_exporter may read at any time, never let it see a partial file */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "w");
+	if (!file) {
+		fprintf(stderr, "Failed to open '%s': %s\n", tmp_path, strerror(errno));
+		return -errno;
+	}
+
+	if (fwrite(snap->text, 1, snap->text_len, file) != snap->text_len || fclose(file) != 0) {
+		fprintf(stderr, "Failed to write '%s'\n", tmp_path);
+		unlink(tmp_path);
+		return -EIO;
+	}
+
+	if (rename(tmp_path, path) < 0) {
+		fprintf(stderr, "Failed to rename '%s': %s\n", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int export_listen(const char *addr)
+{
+	char host[CBD_PATH_LEN];
+	struct addrinfo hints = { 0 }, *res, *ai;
+	char *port;
+	int fd = -1, one = 1, ret;
+
+	/* host:port, [v6addr]:port or :port */
+	strncpy(host, addr, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	port = strrchr(host, ':');
+	if (!port) {
+		printf("Invalid listen address '%s', expected <host>:<port>\n", addr);
+		return -EINVAL;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if (ret) {
+		printf("Failed to resolve '%s': %s\n", addr, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		printf("Failed to listen on '%s': %s\n", addr, strerror(errno));
+		return -errno;
+	}
+
+	return fd;
+}
+
+static void export_send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static void export_serve(struct export_snapshot *snap, int listen_fd)
+{
+	struct timeval tv = { .tv_sec = EXPORT_CLIENT_TIMEOUT_MS / 1000,
+			      .tv_usec = (EXPORT_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+	char req[EXPORT_REQUEST_LEN];
+	char hdr[256];
+	ssize_t len;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	/* Scrapers are trusted local clients, but never let one stall the refresh */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	len = recv(fd, req, sizeof(req) - 1, 0);
+	if (len <= 0)
+		goto out;
+	req[len] = '\0';
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n"
+			 "Content-Length: 0\r\nConnection: close\r\n\r\n");
+		export_send_all(fd, hdr, strlen(hdr));
+		goto out;
+	}
+
+	snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		 "Content-Length: %zu\r\nConnection: close\r\n\r\n", snap->text_len);
+	export_send_all(fd, hdr, strlen(hdr));
+	export_send_all(fd, snap->text, snap->text_len);
+out:
+	close(fd);
+}
+
+int cbdctrl_export(cbd_opt_t *options)
+{
+	struct export_snapshot snap = { 0 };
+	uint64_t next_ns;
+	unsigned long round = 0;
+	int listen_fd = -1;
+	int ret;
+
+	if (!options->co_listen[0] && !options->co_textfile[0]) {
+		printf("--listen or --textfile required for export command\n");
+		return -EINVAL;
+	}
+
+	if (options->co_listen[0]) {
+		listen_fd = export_listen(options->co_listen);
+		if (listen_fd < 0)
+			return listen_fd;
+	}
+
+	ret = export_snapshot_scan(&snap);
+	if (ret < 0)
+		goto out;
+
+	cbdctrl_catch_stop_signals();
+
+	next_ns = cbd_now_ns();
+	while (!cbdctrl_stopping) {
+		export_update(&snap);
+		round++;
+
+		if (options->co_textfile[0]) {
+			ret = export_textfile_write(&snap, options->co_textfile);
+			if (ret < 0)
+				goto out;
+		}
+
+		if (options->co_count && round >= options->co_count)
+			break;
+
+		next_ns += options->co_interval_us * 1000ULL;
+
+		if (listen_fd < 0) {
+			cbd_sleep_until_ns(next_ns);
+			continue;
+		}
+
+		/* Serve scrapes from the rendered text until the next refresh is due */
+		while (!cbdctrl_stopping) {
+			struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+			uint64_t now_ns = cbd_now_ns();
+
+			if (now_ns >= next_ns)
+				break;
+
+			if (poll(&pfd, 1, (int)((next_ns - now_ns + 999999) / 1000000)) > 0)
+				export_serve(&snap, listen_fd);
+		}
+	}
+	ret = 0;
+out:
+	if (listen_fd >= 0)
+		close(listen_fd);
+	export_snapshot_release(&snap);
+	free(snap.text);
+	return ret;
+}
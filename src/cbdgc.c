@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * Reclaim the slots of dead entities of a transport from one snapshot:
+ * dead blkdevs first, then dead backends of dead hosts, which the kernel
+ * only lets go once no blkdev refers to them. The clears are issued by up
+ * to --jobs workers, each writing through an adm fd it opened once: kernfs
+ * serializes the writes to one open file on its mutex, so workers sharing
+ * a single fd would clear one slot at a time.
+ */
+#define GC_ERRORS_MAX		16
+
+enum gc_kind {
+	GC_BLKDEV,
+	GC_BACKEND,
+	GC_KIND_NR,
+};
+
+static const char *gc_kind_names[] = {
+	[GC_BLKDEV]	= "blkdevs",
+	[GC_BACKEND]	= "backends",
+};
+
+struct gc_op {
+	char			cmd[64];
+	int			ret;
+};
+
+struct gc_queue {
+	unsigned int		transport_id;
+	struct gc_op		*ops;
+	unsigned int		nr_ops;
+	unsigned int		next;		/* next op to issue, taken atomically */
+};
+
+struct gc_worker {
+	pthread_t		thread;
+	struct gc_queue		*queue;
+};
+
+static void *gc_worker_fn(void *arg)
+{
+	struct gc_worker *worker = arg;
+	struct gc_queue *queue = worker->queue;
+	int adm_fd = -1;
+
+	while (true) {
+		unsigned int i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+		struct gc_op *op;
+
+		if (i >= queue->nr_ops)
+			break;
+		op = &queue->ops[i];
+
+		if (adm_fd < 0) {
+			adm_fd = cbdsys_adm_open(queue->transport_id);
+			if (adm_fd < 0) {
+				op->ret = adm_fd;
+				continue;
+			}
+		}
+		op->ret = cbdsys_adm_write(adm_fd, op->cmd);
+	}
+
+	cbdsys_attr_close(&adm_fd);
+	return NULL;
+}
+
+/* Run the ops of @queue with up to @jobs workers */
+static int gc_run(struct gc_queue *queue, unsigned int jobs)
+{
+	struct gc_worker *workers;
+	unsigned int started;
+
+	if (!queue->nr_ops)
+		return 0;
+	if (jobs > queue->nr_ops)
+		jobs = queue->nr_ops;
+
+	workers = calloc(jobs, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	for (started = 0; started < jobs; started++) {
+		workers[started].queue = queue;
+		if (pthread_create(&workers[started].thread, NULL, gc_worker_fn, &workers[started]))
+			break;
+	}
+
+	/* Without any thread the ops are still issued, just serially */
+	if (!started) {
+		workers[0].queue = queue;
+		gc_worker_fn(&workers[0]);
+	}
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	free(workers);
+	return 0;
+}
+
+static json_t *gc_kind_to_json(struct gc_queue *queue, json_t *json_ids, bool dry_run,
+			       json_t *json_errors)
+{
+	json_t *json_kind = json_object();
+	unsigned int cleared = 0, failed = 0;
+
+	for (unsigned int i = 0; !dry_run && i < queue->nr_ops; i++) {
+		struct gc_op *op = &queue->ops[i];
+
+		if (!op->ret) {
+			cleared++;
+			continue;
+		}
+
+		failed++;
+		if (json_array_size(json_errors) < GC_ERRORS_MAX) {
+			json_t *json_error = json_object();
+
+			json_object_set_new(json_error, "op", json_string(op->cmd));
+			json_object_set_new(json_error, "error", json_string(strerror(-op->ret)));
+			json_array_append_new(json_errors, json_error);
+		}
+	}
+
+	json_object_set_new(json_kind, "dead", json_integer(queue->nr_ops));
+	json_object_set_new(json_kind, "cleared", json_integer(cleared));
+	json_object_set_new(json_kind, "failed", json_integer(failed));
+	json_object_set_new(json_kind, "ids", json_ids);
+
+	return json_kind;
+}
+
+/* Dead backends whose host is dead too and which no live blkdev uses */
+static int gc_dead_backends(struct cbd_transport *cbdt, struct cbd_snapshot *snap,
+			    struct gc_queue *queue, json_t *json_ids)
+{
+	bool *host_dead;
+
+	host_dead = calloc(cbdt->host_num ? cbdt->host_num : 1, sizeof(*host_dead));
+	if (!host_dead)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < cbdt->host_num; i++) {
+		struct cbd_host host;
+
+		host_dead[i] = cbdsys_host_init(cbdt, &host, i) == 0 && !host.alive;
+	}
+
+	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
+		struct cbd_backend backend;
+		bool in_use = false;
+
+		if (cbdsys_backend_init(cbdt, snap, &backend, i) < 0 || backend.alive ||
+		    backend.host_id >= cbdt->host_num || !host_dead[backend.host_id])
+			continue;
+
+		for (unsigned int j = 0; j < backend.dev_num; j++)
+			in_use |= backend.blkdevs[j].alive;
+		if (in_use)
+			continue;
+
+		snprintf(queue->ops[queue->nr_ops++].cmd, sizeof(queue->ops[0].cmd),
+			 "op=backend-clear,backend_id=%u", i);
+		json_array_append_new(json_ids, json_integer(i));
+	}
+
+	free(host_dead);
+	return 0;
+}
+
+int cbdctrl_gc(cbd_opt_t *options)
+{
+	struct gc_queue queues[GC_KIND_NR] = { 0 };
+	json_t *json_ids[GC_KIND_NR];
+	struct cbd_transport cbdt;
+	struct cbd_snapshot snap;
+	unsigned int jobs = options->co_jobs ? options->co_jobs : CBD_GC_JOBS_DEFAULT;
+	json_t *json_out, *json_errors;
+	uint64_t start_ns;
+	char *json_str;
+	int ret;
+
+	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+	if (ret < 0)
+		return ret;
+
+	ret = cbdsys_snapshot_init(&cbdt, &snap);
+	if (ret < 0)
+		return ret;
+
+	for (int k = 0; k < GC_KIND_NR; k++) {
+		queues[k].transport_id = cbdt.transport_id;
+		json_ids[k] = json_array();
+	}
+
+	queues[GC_BLKDEV].ops = calloc(snap.blkdev_cnt + 1, sizeof(struct gc_op));
+	queues[GC_BACKEND].ops = calloc(cbdt.backend_num + 1, sizeof(struct gc_op));
+	if (!queues[GC_BLKDEV].ops || !queues[GC_BACKEND].ops) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < snap.blkdev_cnt; i++) {
+		struct cbd_blkdev *blkdev = &snap.blkdevs[i];
+		struct gc_queue *queue = &queues[GC_BLKDEV];
+
+		if (blkdev->alive)
+			continue;
+
+		snprintf(queue->ops[queue->nr_ops++].cmd, sizeof(queue->ops[0].cmd),
+			 "op=dev-clear,dev_id=%u", blkdev->blkdev_id);
+		json_array_append_new(json_ids[GC_BLKDEV], json_integer(blkdev->blkdev_id));
+	}
+
+	ret = gc_dead_backends(&cbdt, &snap, &queues[GC_BACKEND], json_ids[GC_BACKEND]);
+	if (ret < 0)
+		goto out;
+
+	start_ns = cbd_now_ns();
+	if (!options->co_dry_run) {
+		/* Backends are only released once their blkdevs are gone */
+		for (int k = 0; k < GC_KIND_NR; k++) {
+			ret = gc_run(&queues[k], jobs);
+			if (ret < 0)
+				goto out;
+		}
+		cbdsys_cache_invalidate(cbdt.transport_id);
+	}
+
+	json_errors = json_array();
+	json_out = json_object();
+	json_object_set_new(json_out, "transport_id", json_integer(cbdt.transport_id));
+	json_object_set_new(json_out, "dry_run", json_boolean(options->co_dry_run));
+	json_object_set_new(json_out, "jobs", json_integer(jobs));
+	if (snap.stale_cnt)
+		json_object_set_new(json_out, "stale_blkdevs", json_integer(snap.stale_cnt));
+	for (int k = 0; k < GC_KIND_NR; k++) {
+		json_object_set_new(json_out, gc_kind_names[k],
+				    gc_kind_to_json(&queues[k], json_ids[k], options->co_dry_run, json_errors));
+		json_ids[k] = NULL;
+	}
+	json_object_set_new(json_out, "elapsed_sec", json_real((cbd_now_ns() - start_ns) / 1e9));
+	json_object_set_new(json_out, "errors", json_errors);
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	for (int k = 0; k < GC_KIND_NR && !options->co_dry_run; k++) {
+		for (unsigned int i = 0; i < queues[k].nr_ops; i++) {
+			int op_ret = queues[k].ops[i].ret;
+
+			/* Kernels without backend-clear keep dead backends, that's not a failure */
+			if (op_ret && !(k == GC_BACKEND && (op_ret == -EINVAL || op_ret == -EOPNOTSUPP)))
+				ret = -EIO;
+		}
+	}
+out:
+	for (int k = 0; k < GC_KIND_NR; k++) {
+		json_decref(json_ids[k]);
+		free(queues[k].ops);
+	}
+	cbdsys_snapshot_release(&snap);
+	return ret;
+}
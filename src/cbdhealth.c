@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * Liveness probe: every check reads only the attributes it needs, through
+ * the bounded reads of --deadline, so a stuck attribute fails the probe
+ * with CBD_HEALTH_TIMEOUT instead of hanging it. The first failure decides
+ * the exit status. The module is looked up in /sys/module, never loaded.
+ */
+struct health_ctx {
+	unsigned int		transport_id;
+	unsigned int		host_id;
+	bool			host_known;
+	int			status;
+	char			error[CBD_PATH_LEN];
+	unsigned int		backends;	/* checked */
+	unsigned int		blkdevs;
+};
+
+static const char *health_status_names[] = {
+	[CBD_HEALTH_OK]		= "ok",
+	[CBD_HEALTH_ERROR]	= "error",
+	[CBD_HEALTH_MODULE]	= "module",
+	[CBD_HEALTH_TRANSPORT]	= "transport",
+	[CBD_HEALTH_HOST]	= "host",
+	[CBD_HEALTH_BACKEND]	= "backend",
+	[CBD_HEALTH_DEV]	= "dev",
+	[CBD_HEALTH_TIMEOUT]	= "timeout",
+};
+
+static int health_fail(struct health_ctx *ctx, int status, int err, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+/* A timed out read fails the probe as a timeout, whatever it was checking */
+static int health_fail(struct health_ctx *ctx, int status, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	ctx->status = err == -ETIMEDOUT ? CBD_HEALTH_TIMEOUT : status;
+	va_start(ap, fmt);
+	vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+	va_end(ap);
+
+	return -1;
+}
+
+static int health_read(const char *path, char *buf, size_t buf_len)
+{
+	int ret = read_sysfs_value(path, buf, buf_len);
+
+	if (ret == -ENODATA) {
+		buf[0] = '\0';
+		ret = 0;
+	}
+	return ret;
+}
+
+static int health_read_alive(const char *path, bool *alive)
+{
+	char buf[8];
+	int ret;
+
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	*alive = !strcmp(buf, "true");
+	return 0;
+}
+
+static int health_check_host(struct health_ctx *ctx)
+{
+	char path[CBD_PATH_LEN];
+	char buf[32];
+	bool alive;
+	int ret;
+
+	transport_host_id_path(ctx->transport_id, path, sizeof(path));
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret < 0 || sscanf(buf, "%u", &ctx->host_id) != 1)
+		return health_fail(ctx, CBD_HEALTH_TRANSPORT, ret, "transport %u not reachable",
+				   ctx->transport_id);
+	ctx->host_known = true;
+
+	host_alive_path(ctx->transport_id, ctx->host_id, path, sizeof(path));
+	ret = health_read_alive(path, &alive);
+	if (ret < 0 || !alive)
+		return health_fail(ctx, CBD_HEALTH_HOST, ret, "host %u not alive", ctx->host_id);
+
+	return 0;
+}
+
+/* A backend of any host, or with @local one of this host: alive in the transport */
+static int health_check_backend(struct health_ctx *ctx, unsigned int backend_id, bool local)
+{
+	char path[CBD_PATH_LEN];
+	char buf[32];
+	bool alive;
+	int ret;
+
+	backend_host_id_path(ctx->transport_id, backend_id, path, sizeof(path));
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret == 0 && local && (!buf[0] || strtoul(buf, NULL, 10) != ctx->host_id))
+		return 0;
+	if (ret < 0 || !buf[0])
+		return health_fail(ctx, CBD_HEALTH_BACKEND, ret, "backend %u not found", backend_id);
+
+	backend_alive_path(ctx->transport_id, backend_id, path, sizeof(path));
+	ret = health_read_alive(path, &alive);
+	if (ret < 0 || !alive)
+		return health_fail(ctx, CBD_HEALTH_BACKEND, ret, "backend %u not alive", backend_id);
+
+	ctx->backends++;
+	return 0;
+}
+
+/* A blkdev of this host: alive, and its disk readable */
+static int health_check_blkdev(struct health_ctx *ctx, unsigned int blkdev_id, bool local)
+{
+	char path[CBD_PATH_LEN];
+	char buf[CBDSYS_ATTR_SIZE_MAX];
+	unsigned int mapped_id;
+	bool alive;
+	int ret;
+
+	blkdev_host_id_path(ctx->transport_id, blkdev_id, path, sizeof(path));
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret == 0 && local && (!buf[0] || strtoul(buf, NULL, 10) != ctx->host_id))
+		return 0;
+	if (ret < 0 || !buf[0])
+		return health_fail(ctx, CBD_HEALTH_DEV, ret, "blkdev %u not found", blkdev_id);
+	if (strtoul(buf, NULL, 10) != ctx->host_id)
+		return health_fail(ctx, CBD_HEALTH_DEV, 0, "blkdev %u is on host %s", blkdev_id, buf);
+
+	blkdev_alive_path(ctx->transport_id, blkdev_id, path, sizeof(path));
+	ret = health_read_alive(path, &alive);
+	if (ret < 0 || !alive)
+		return health_fail(ctx, CBD_HEALTH_DEV, ret, "blkdev %u not alive", blkdev_id);
+
+	blkdev_mapped_id_path(ctx->transport_id, blkdev_id, path, sizeof(path));
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret < 0 || sscanf(buf, "%u", &mapped_id) != 1)
+		return health_fail(ctx, CBD_HEALTH_DEV, ret, "blkdev %u has no disk", blkdev_id);
+
+	block_stat_path(mapped_id, path, sizeof(path));
+	ret = health_read(path, buf, sizeof(buf));
+	if (ret < 0)
+		return health_fail(ctx, CBD_HEALTH_DEV, ret, "%s%u not readable", SYSFS_BLOCK_BASE_PATH,
+				   mapped_id);
+
+	ctx->blkdevs++;
+	return 0;
+}
+
+/* Slot counts from the transport info, the only check which needs them */
+static int health_check_local(struct health_ctx *ctx)
+{
+	struct cbd_transport cbdt;
+	int ret;
+
+	ret = cbdsys_transport_init(&cbdt, ctx->transport_id);
+	if (ret < 0)
+		return health_fail(ctx, CBD_HEALTH_TRANSPORT, ret, "transport %u not reachable",
+				   ctx->transport_id);
+
+	/* Empty slots and those of other hosts are skipped */
+	for (unsigned int i = 0; i < cbdt.backend_num; i++) {
+		if (health_check_backend(ctx, i, true) < 0)
+			return -1;
+	}
+
+	for (unsigned int i = 0; i < cbdt.blkdev_num; i++) {
+		if (health_check_blkdev(ctx, i, true) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int cbdctrl_health(cbd_opt_t *options)
+{
+	struct health_ctx ctx = { .transport_id = options->co_transport_id };
+	unsigned int budget_ms = options->co_deadline_ms ? options->co_deadline_ms : CBD_HEALTH_BUDGET_MS;
+	uint64_t start_ns = cbd_now_ns();
+	json_t *json_out;
+	char *json_str;
+	double elapsed_ms;
+
+	cbdsys_set_deadline(budget_ms);
+
+	if ((options->co_backend_id != UINT_MAX) + (options->co_dev_id != UINT_MAX) + options->co_local > 1)
+		health_fail(&ctx, CBD_HEALTH_ERROR, 0, "--dev, --backend and --local are exclusive");
+	else if (access(SYSFS_MODULE_PATH, F_OK))
+		health_fail(&ctx, CBD_HEALTH_MODULE, 0, "cbd module not loaded");
+	else if (health_check_host(&ctx) < 0)
+		;
+	else if (options->co_backend_id != UINT_MAX)
+		health_check_backend(&ctx, options->co_backend_id, false);
+	else if (options->co_dev_id != UINT_MAX)
+		health_check_blkdev(&ctx, options->co_dev_id, false);
+	else if (options->co_local)
+		health_check_local(&ctx);
+
+	/* Reads finished in time may still add up past the budget */
+	elapsed_ms = (cbd_now_ns() - start_ns) / 1e6;
+	if (!ctx.status && elapsed_ms > budget_ms)
+		health_fail(&ctx, CBD_HEALTH_TIMEOUT, 0, "took %.1f ms", elapsed_ms);
+
+	json_out = json_object();
+	json_object_set_new(json_out, "status", json_string(health_status_names[ctx.status]));
+	json_object_set_new(json_out, "exit", json_integer(ctx.status));
+	json_object_set_new(json_out, "transport_id", json_integer(ctx.transport_id));
+	if (ctx.host_known)
+		json_object_set_new(json_out, "host_id", json_integer(ctx.host_id));
+	if (options->co_backend_id != UINT_MAX)
+		json_object_set_new(json_out, "backend_id", json_integer(options->co_backend_id));
+	else if (options->co_dev_id != UINT_MAX)
+		json_object_set_new(json_out, "dev_id", json_integer(options->co_dev_id));
+	else if (options->co_local) {
+		json_object_set_new(json_out, "backends", json_integer(ctx.backends));
+		json_object_set_new(json_out, "blkdevs", json_integer(ctx.blkdevs));
+	}
+	json_object_set_new(json_out, "elapsed_ms", json_real(elapsed_ms));
+	json_object_set_new(json_out, "budget_ms", json_integer(budget_ms));
+	if (ctx.status)
+		json_object_set_new(json_out, "error", json_string(ctx.error));
+
+	json_str = json_dumps(json_out, JSON_COMPACT);
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	return ctx.status;
+}
@@ -0,0 +1,108 @@
+#ifndef CBDHIST_H
+#define CBDHIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear latency histogram in the spirit of HdrHistogram: every power of
+ * two is split into CBD_HIST_SUB_BUCKETS linear buckets, so any recorded
+ * value is reported with less than 1/CBD_HIST_SUB_BUCKETS relative error.
+ * Recording is a couple of shifts and an increment, no allocation.
+ */
+#define CBD_HIST_SUB_BITS	6
+#define CBD_HIST_SUB_BUCKETS	(1U << CBD_HIST_SUB_BITS)
+#define CBD_HIST_BUCKETS	((64 - CBD_HIST_SUB_BITS + 1) * CBD_HIST_SUB_BUCKETS)
+
+struct cbd_hist {
+	uint64_t	count;
+	uint64_t	min;
+	uint64_t	max;
+	double		sum;
+	uint64_t	buckets[CBD_HIST_BUCKETS];
+};
+
+static inline void cbd_hist_init(struct cbd_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+static inline unsigned int cbd_hist_index(uint64_t value)
+{
+	unsigned int msb, shift;
+
+	if (value < 2 * CBD_HIST_SUB_BUCKETS)
+		return (unsigned int)value;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - CBD_HIST_SUB_BITS;
+	return (shift + 1) * CBD_HIST_SUB_BUCKETS + (unsigned int)((value >> shift) - CBD_HIST_SUB_BUCKETS);
+}
+
+/* Highest value which falls into bucket @index */
+static inline uint64_t cbd_hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < 2 * CBD_HIST_SUB_BUCKETS)
+		return index;
+
+	shift = index / CBD_HIST_SUB_BUCKETS - 1;
+	return ((((uint64_t)CBD_HIST_SUB_BUCKETS + index % CBD_HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static inline void cbd_hist_record(struct cbd_hist *hist, uint64_t value)
+{
+	hist->buckets[cbd_hist_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static inline void cbd_hist_merge(struct cbd_hist *dst, const struct cbd_hist *src)
+{
+	for (unsigned int i = 0; i < CBD_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static inline double cbd_hist_mean(const struct cbd_hist *hist)
+{
+	return hist->count ? hist->sum / hist->count : 0;
+}
+
+/* Value at @percentile (0-100), clamped to the recorded max */
+static inline uint64_t cbd_hist_percentile(const struct cbd_hist *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+
+	if (!hist->count)
+		return 0;
+
+	target = (uint64_t)(percentile / 100 * hist->count + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (unsigned int i = 0; i < CBD_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			uint64_t value = cbd_hist_value(i);
+
+			return value < hist->max ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+#endif // CBDHIST_H
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "cbdmeta.h"
+
+/*
+ * Map a transport device, device DAX or image file read-only. *@size is
+ * the size of the transport, *@map_len what to munmap() afterwards.
+ */
+int cbd_meta_map(const char *path, const char **base, uint64_t *size, size_t *map_len)
+{
+	struct cbd_transport_info ti;
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0)
+		goto err_errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size) < 0)
+			goto err_errno;
+	} else if (S_ISCHR(st.st_mode)) {
+		/* device DAX has no size to ask for, trust the transport geometry */
+		map = mmap(NULL, CBD_META_MAP_ALIGN, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			goto err_errno;
+		memcpy(&ti, map, sizeof(ti));
+		munmap(map, CBD_META_MAP_ALIGN);
+		*size = ti.segment_area_off + (uint64_t)ti.bytes_per_segment * ti.segment_num;
+	} else {
+		*size = st.st_size;
+	}
+
+	if (*size < sizeof(ti)) {
+		printf("'%s' is too small for a transport\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	*map_len = (*size + CBD_META_MAP_ALIGN - 1) / CBD_META_MAP_ALIGN * CBD_META_MAP_ALIGN;
+	if (!S_ISCHR(st.st_mode))
+		*map_len = *size;
+	map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err_errno;
+
+	/* Only the infos at the start of the segments are read, don't read ahead */
+	madvise(map, *map_len, MADV_RANDOM);
+	close(fd);
+
+	*base = map;
+	return 0;
+err_errno:
+	ret = -errno;
+	printf("Failed to map '%s': %s\n", path, strerror(-ret));
+	close(fd);
+	return ret;
+}
+
+#define CBD_META_DIO_ALIGN	4096
+
+int cbd_meta_live_open(struct cbd_meta_live *live, const char *path)
+{
+	struct stat st;
+	int ret;
+
+	memset(live, 0, sizeof(*live));
+	live->fd = -1;
+
+	if (stat(path, &st) < 0)
+		return -errno;
+
+	if (S_ISCHR(st.st_mode))
+		return cbd_meta_map(path, &live->base, &live->size, &live->map_len);
+
+	live->fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (live->fd < 0)
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(live->fd, BLKGETSIZE64, &live->size) < 0)
+			goto err_errno;
+	} else {
+		live->size = st.st_size;
+	}
+
+	return 0;
+err_errno:
+	ret = -errno;
+	close(live->fd);
+	live->fd = -1;
+	return ret;
+}
+
+/* Copy @len bytes at @off as they are on the media now */
+int cbd_meta_live_read(struct cbd_meta_live *live, uint64_t off, void *dst, size_t len)
+{
+	uint64_t start = off / CBD_META_DIO_ALIGN * CBD_META_DIO_ALIGN;
+	size_t span;
+	ssize_t done;
+
+	if (off + len > live->size)
+		return -ERANGE;
+
+	if (live->base) {
+		memcpy(dst, live->base + off, len);
+		return 0;
+	}
+
+	span = (off + len - start + CBD_META_DIO_ALIGN - 1) / CBD_META_DIO_ALIGN * CBD_META_DIO_ALIGN;
+	if (span > live->buf_len) {
+		free(live->buf);
+		live->buf_len = 0;
+		if (posix_memalign(&live->buf, CBD_META_DIO_ALIGN, span)) {
+			live->buf = NULL;
+			return -ENOMEM;
+		}
+		live->buf_len = span;
+	}
+
+	done = pread(live->fd, live->buf, span, start);
+	if (done < 0)
+		return -errno;
+	if ((uint64_t)done < off + len - start)
+		return -EIO;
+
+	memcpy(dst, (char *)live->buf + (off - start), len);
+	return 0;
+}
+
+void cbd_meta_live_close(struct cbd_meta_live *live)
+{
+	if (live->base)
+		munmap((void *)live->base, live->map_len);
+	if (live->fd >= 0)
+		close(live->fd);
+	free(live->buf);
+	memset(live, 0, sizeof(*live));
+	live->fd = -1;
+}
+
+/*
+ * Whether the infos of @ti can be decoded with the structs of cbdmeta.h:
+ * the format version they mirror, with slots large enough to hold them,
+ * and for a registered transport @cbdt the geometry the cbd module itself
+ * reports in sysfs. -EINVAL if @ti is no transport, -EPROTONOSUPPORT if its
+ * layout isn't the one known here; @err says why.
+ */
+int cbd_meta_layout_check(const struct cbd_transport_info *ti, const struct cbd_transport *cbdt,
+			  char *err, size_t err_len)
+{
+	if (ti->magic != CBD_TRANSPORT_MAGIC) {
+		snprintf(err, err_len, "bad magic 0x%016lx", ti->magic);
+		return -EINVAL;
+	}
+
+	if (ti->version != CBD_TRANSPORT_VERSION) {
+		snprintf(err, err_len, "unsupported format version %u, only version %u is decoded",
+			 ti->version, CBD_TRANSPORT_VERSION);
+		return -EPROTONOSUPPORT;
+	}
+
+	if ((ti->host_num && ti->bytes_per_host_info < sizeof(struct cbd_host_info)) ||
+	    (ti->backend_num && ti->bytes_per_backend_info < sizeof(struct cbd_backend_info)) ||
+	    (ti->blkdev_num && ti->bytes_per_blkdev_info < sizeof(struct cbd_blkdev_info)) ||
+	    (ti->segment_num && ti->bytes_per_segment < sizeof(struct cbd_segment_info))) {
+		snprintf(err, err_len, "info slots too small for the version %u layout",
+			 CBD_TRANSPORT_VERSION);
+		return -EPROTONOSUPPORT;
+	}
+
+	if (cbdt && (cbdt->magic != ti->magic || cbdt->version != ti->version ||
+		     cbdt->host_area_off != ti->host_area_off ||
+		     cbdt->bytes_per_host_info != ti->bytes_per_host_info ||
+		     cbdt->host_num != ti->host_num ||
+		     cbdt->backend_area_off != ti->backend_area_off ||
+		     cbdt->bytes_per_backend_info != ti->bytes_per_backend_info ||
+		     cbdt->backend_num != ti->backend_num ||
+		     cbdt->blkdev_area_off != ti->blkdev_area_off ||
+		     cbdt->bytes_per_blkdev_info != ti->bytes_per_blkdev_info ||
+		     cbdt->blkdev_num != ti->blkdev_num ||
+		     cbdt->segment_area_off != ti->segment_area_off ||
+		     cbdt->bytes_per_segment != ti->bytes_per_segment ||
+		     cbdt->segment_num != ti->segment_num)) {
+		snprintf(err, err_len, "transport info differs from the one the cbd module reports");
+		return -EPROTONOSUPPORT;
+	}
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef CBDMETA_H
+#define CBDMETA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cbdctrl.h"
+#include "libcbd.h"
+
+/*
+ * On-media layout of a transport as the cbd module writes it: the transport
+ * info at offset 0, the host, backend and blkdev areas with one fixed size
+ * slot per entry, then the segments, each starting with a segment info.
+ * Fields are little endian and read in host order, CXL hosts are little
+ * endian. Every info starts with a cbd_meta_header whose crc is the CRC32C
+ * (seed 0, as the kernel's crc32c(0, ...)) of the rest of the info. A slot
+ * with state CBD_META_STATE_NONE is unused.
+ *
+ * The structs mirror those of the same names in the cbd module's
+ * drivers/block/cbd/cbd_internal.h for transport format version
+ * CBD_TRANSPORT_VERSION. They are hand copies, so nothing is decoded before
+ * cbd_meta_layout_check() passed: a transport of another version, or one
+ * whose geometry differs from what the module reports in sysfs, is refused
+ * as unsupported instead of being reported corrupt. Update both together
+ * when the module bumps the version.
+ */
+#define CBD_TRANSPORT_MAGIC		0x65B05EFA96C596EFULL
+#define CBD_TRANSPORT_VERSION		1
+
+#define CBD_SEG_NONE			UINT32_MAX	/* end of a segment chain */
+
+#define CBD_META_MAP_ALIGN		(2 * 1024 * 1024)	/* device DAX wants 2M aligned mappings */
+
+struct cbd_meta_header {
+	uint32_t		crc;
+	uint8_t			seq;
+	uint8_t			version;
+	uint16_t		res;
+};
+
+struct cbd_transport_info {
+	uint64_t		magic;
+	uint16_t		version;
+	uint16_t		flags;
+	uint32_t		host_area_off;
+	uint32_t		bytes_per_host_info;
+	uint32_t		host_num;
+	uint32_t		backend_area_off;
+	uint32_t		bytes_per_backend_info;
+	uint32_t		backend_num;
+	uint32_t		blkdev_area_off;
+	uint32_t		bytes_per_blkdev_info;
+	uint32_t		blkdev_num;
+	uint32_t		segment_area_off;
+	uint32_t		bytes_per_segment;
+	uint32_t		segment_num;
+};
+
+enum cbd_meta_state {
+	CBD_META_STATE_NONE	= 0,
+	CBD_META_STATE_RUNNING,
+};
+
+struct cbd_host_info {
+	struct cbd_meta_header	header;
+	uint8_t			state;
+	uint64_t		alive_ts;
+	char			hostname[CBD_NAME_LEN];
+};
+
+/* A position in the cache, a segment of the chain and the offset in it */
+struct cbd_cache_pos {
+	uint32_t		cache_seg_id;
+	uint32_t		seg_off;
+};
+
+/*
+ * Keys are appended at the head and reclaimed from key_tail_pos, writeback
+ * follows them at dirty_tail_pos: the cache holds nothing dirty once both
+ * tails are at the same position.
+ */
+struct cbd_cache_info {
+	uint32_t		seg_id;		/* first segment of the cache chain */
+	uint32_t		n_segs;
+	uint16_t		gc_percent;
+	uint16_t		res;
+	uint32_t		used_segs;
+	struct cbd_cache_pos	key_tail_pos;
+	struct cbd_cache_pos	dirty_tail_pos;
+};
+
+struct cbd_backend_info {
+	struct cbd_meta_header	header;
+	uint8_t			state;
+	uint32_t		host_id;
+	uint32_t		blkdev_count;
+	uint64_t		alive_ts;
+	uint64_t		dev_size;
+	char			path[CBD_PATH_LEN];
+	struct cbd_cache_info	cache_info;
+};
+
+struct cbd_blkdev_info {
+	struct cbd_meta_header	header;
+	uint8_t			state;
+	uint32_t		backend_id;
+	uint32_t		host_id;
+	uint32_t		mapped_id;
+	uint64_t		alive_ts;
+};
+
+enum cbd_seg_type {
+	CBD_SEG_TYPE_NONE	= 0,
+	CBD_SEG_TYPE_CHANNEL,
+	CBD_SEG_TYPE_CACHE,
+};
+
+struct cbd_segment_info {
+	struct cbd_meta_header	header;
+	uint8_t			type;
+	uint8_t			state;
+	uint16_t		flags;
+	uint32_t		next_seg;	/* next segment of a cache chain */
+	uint32_t		backend_id;	/* owner */
+};
+
+int cbd_meta_map(const char *path, const char **base, uint64_t *size, size_t *map_len);
+
+/*
+ * Reader of infos the module keeps updating, e.g. heartbeats. The module
+ * stores to the transport through DAX, which a page cache mapping of a
+ * pmem block device or image never sees: device DAX is mapped, anything
+ * else is read with O_DIRECT on every cbd_meta_live_read().
+ */
+struct cbd_meta_live {
+	int			fd;		/* -1 when mapped */
+	const char		*base;		/* mapped device DAX */
+	size_t			map_len;
+	uint64_t		size;
+	void			*buf;		/* aligned buffer of the O_DIRECT reads */
+	size_t			buf_len;
+};
+
+int cbd_meta_live_open(struct cbd_meta_live *live, const char *path);
+int cbd_meta_live_read(struct cbd_meta_live *live, uint64_t off, void *dst, size_t len);
+void cbd_meta_live_close(struct cbd_meta_live *live);
+int cbd_meta_layout_check(const struct cbd_transport_info *ti, const struct cbd_transport *cbdt,
+			  char *err, size_t err_len);
+
+#endif // CBDMETA_H
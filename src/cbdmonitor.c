@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdmeta.h"
+#include "libcbdsys.h"
+
+/*
+ * The kernel only turns a host's alive to false once its heartbeat is
+ * older than the kernel's timeout, so a fixed sampling interval adds up
+ * to a whole interval to every detection. The heartbeats themselves are
+ * read from the host infos, mapped on device DAX and read with O_DIRECT
+ * otherwise, as the module's DAX stores bypass the page cache: a host whose
+ * alive_ts has not moved for 1.5 of its observed heartbeat periods is
+ * suspect, and while any host is suspect, or hooks are running, alive is
+ * sampled every interval / MONITOR_FAST_DIV. A host dying again while the
+ * hooks of its last death still run gets its failover once they are done.
+ */
+#define MONITOR_FAST_DIV	10
+#define MONITOR_FAST_MIN_US	10000
+#define MONITOR_HOOKS_MAX	16
+
+struct monitor_hook {
+	char			name[NAME_MAX + 1];
+	pid_t			pid;
+	uint64_t		done_ns;
+	int			status;
+};
+
+struct monitor_host {
+	int			alive_fd;
+	bool			known;
+	bool			alive;
+	char			hostname[CBD_NAME_LEN];
+
+	uint64_t		alive_ts;	/* last heartbeat in the host info */
+	uint64_t		hb_seen_ns;	/* when it changed */
+	uint64_t		hb_period_ns;	/* EWMA of the time between changes */
+
+	/* failover of the last death */
+	uint64_t		detect_ns;
+	uint64_t		queued_ns;	/* detection of a death waiting for the hooks, 0 if none */
+	uint64_t		action_ns;
+	unsigned int		pending;
+	unsigned int		nr_hooks;
+	struct monitor_hook	hooks[MONITOR_HOOKS_MAX];
+	int			cleared;
+	uint64_t		cleared_ns;
+};
+
+struct monitor_ctx {
+	cbd_opt_t		*options;
+	struct cbd_transport	cbdt;
+	struct monitor_host	*hosts;
+	uint64_t		start_ns;
+
+	struct cbd_meta_live	live;
+	bool			live_ok;	/* heartbeats readable */
+	uint64_t		host_area_off;
+	uint64_t		host_stride;
+
+	unsigned int		nr_hooks;
+	char			hooks[MONITOR_HOOKS_MAX][NAME_MAX + 1];
+};
+
+static void monitor_print(json_t *json_event)
+{
+	char *json_str = json_dumps(json_event, JSON_COMPACT);
+
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	fflush(stdout);
+	json_decref(json_event);
+}
+
+static json_t *monitor_event(struct monitor_ctx *ctx, const char *event, unsigned int host_id,
+			     uint64_t now_ns)
+{
+	json_t *json_event = json_object();
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	json_object_set_new(json_event, "event", json_string(event));
+	json_object_set_new(json_event, "ts", json_real((now_ns - ctx->start_ns) / 1e9));
+	json_object_set_new(json_event, "unix_ts", json_real(ts.tv_sec + ts.tv_nsec / 1e9));
+	json_object_set_new(json_event, "transport_id", json_integer(ctx->cbdt.transport_id));
+	json_object_set_new(json_event, "host_id", json_integer(host_id));
+	json_object_set_new(json_event, "hostname", json_string(ctx->hosts[host_id].hostname));
+
+	return json_event;
+}
+
+/* Executables of the --hooks directory, run in name order */
+static int monitor_hooks_load(struct monitor_ctx *ctx, const char *dir)
+{
+	struct dirent **entries;
+	int n;
+
+	n = scandir(dir, &entries, NULL, alphasort);
+	if (n < 0) {
+		n = -errno;
+		printf("Failed to read hooks directory '%s': %s\n", dir, strerror(-n));
+		return n;
+	}
+
+	for (int i = 0; i < n; i++) {
+		char path[PATH_MAX];
+		struct stat st;
+
+		if (snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name) >= (int)sizeof(path))
+			fprintf(stderr, "Path of hook '%s' too long, ignored\n", entries[i]->d_name);
+		else if (entries[i]->d_name[0] != '.' && !stat(path, &st) && S_ISREG(st.st_mode) &&
+			 !access(path, X_OK)) {
+			if (ctx->nr_hooks == MONITOR_HOOKS_MAX)
+				fprintf(stderr, "More than %d hooks, '%s' ignored\n", MONITOR_HOOKS_MAX, path);
+			else
+				snprintf(ctx->hooks[ctx->nr_hooks++], sizeof(ctx->hooks[0]), "%s",
+					 entries[i]->d_name);
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	return 0;
+}
+
+static void monitor_live_fail(struct monitor_ctx *ctx)
+{
+	cbd_meta_live_close(&ctx->live);
+	ctx->live_ok = false;
+	fprintf(stderr, "Heartbeats of transport %u not readable, sampling every interval\n",
+		ctx->cbdt.transport_id);
+}
+
+/* Open the transport to follow heartbeats, monitoring works without */
+static void monitor_live_open(struct monitor_ctx *ctx)
+{
+	struct cbd_transport_info ti;
+	char err[CBD_PATH_LEN];
+
+	if (cbd_meta_live_open(&ctx->live, ctx->cbdt.path) < 0) {
+		monitor_live_fail(ctx);
+		return;
+	}
+
+	if (cbd_meta_live_read(&ctx->live, 0, &ti, sizeof(ti)) < 0 ||
+	    cbd_meta_layout_check(&ti, &ctx->cbdt, err, sizeof(err)) < 0 ||
+	    ti.host_area_off + (uint64_t)ti.bytes_per_host_info * ti.host_num > ctx->live.size) {
+		monitor_live_fail(ctx);
+		return;
+	}
+
+	ctx->host_area_off = ti.host_area_off;
+	ctx->host_stride = ti.bytes_per_host_info;
+	ctx->live_ok = true;
+}
+
+/* Follow the heartbeat of @host_id, true if it is overdue */
+static bool monitor_heartbeat(struct monitor_ctx *ctx, unsigned int host_id, uint64_t now_ns)
+{
+	struct monitor_host *host = &ctx->hosts[host_id];
+	uint64_t alive_ts;
+
+	if (!ctx->live_ok)
+		return false;
+
+	if (cbd_meta_live_read(&ctx->live, ctx->host_area_off + host_id * ctx->host_stride +
+			       offsetof(struct cbd_host_info, alive_ts),
+			       &alive_ts, sizeof(alive_ts)) < 0) {
+		monitor_live_fail(ctx);
+		return false;
+	}
+	if (alive_ts != host->alive_ts) {
+		if (host->hb_seen_ns) {
+			uint64_t period = now_ns - host->hb_seen_ns;
+
+			host->hb_period_ns = host->hb_period_ns ?
+					     (host->hb_period_ns * 7 + period) / 8 : period;
+		}
+		host->alive_ts = alive_ts;
+		host->hb_seen_ns = now_ns;
+		return false;
+	}
+
+	return host->alive && host->hb_period_ns &&
+	       now_ns - host->hb_seen_ns > host->hb_period_ns * 3 / 2;
+}
+
+static void monitor_hook_start(struct monitor_ctx *ctx, unsigned int host_id, const char *name)
+{
+	struct monitor_host *host = &ctx->hosts[host_id];
+	struct monitor_hook *hook = &host->hooks[host->nr_hooks];
+	char path[PATH_MAX];
+	char val[32];
+	pid_t pid;
+
+	/* Checked to fit by monitor_hooks_load() */
+	snprintf(path, sizeof(path), "%s/%s", ctx->options->co_hooks, name);
+	snprintf(hook->name, sizeof(hook->name), "%s", name);
+
+	pid = fork();
+	if (pid == 0) {
+		/* Keep stdout for the events */
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		snprintf(val, sizeof(val), "%u", ctx->cbdt.transport_id);
+		setenv("CBD_TRANSPORT_ID", val, 1);
+		snprintf(val, sizeof(val), "%u", host_id);
+		setenv("CBD_HOST_ID", val, 1);
+		setenv("CBD_HOSTNAME", host->hostname, 1);
+		setenv("CBD_EVENT", "dead", 1);
+		execl(path, name, (char *)NULL);
+		_exit(127);
+	}
+
+	if (pid < 0) {
+		hook->pid = 0;
+		hook->status = -errno;
+		fprintf(stderr, "Failed to run hook '%s': %s\n", path, strerror(-hook->status));
+		hook->done_ns = cbd_now_ns();
+	} else {
+		hook->pid = pid;
+		host->pending++;
+	}
+	host->nr_hooks++;
+}
+
+static void monitor_failover_done(struct monitor_ctx *ctx, unsigned int host_id)
+{
+	struct monitor_host *host = &ctx->hosts[host_id];
+	json_t *json_event = monitor_event(ctx, "failover", host_id, cbd_now_ns());
+	json_t *json_hooks = json_array();
+	uint64_t done_ns = host->cleared_ns;
+
+	for (unsigned int i = 0; i < host->nr_hooks; i++) {
+		struct monitor_hook *hook = &host->hooks[i];
+		json_t *json_hook = json_object();
+
+		json_object_set_new(json_hook, "hook", json_string(hook->name));
+		json_object_set_new(json_hook, "status", json_integer(hook->status));
+		json_object_set_new(json_hook, "ms", json_real((hook->done_ns - host->action_ns) / 1e6));
+		json_array_append_new(json_hooks, json_hook);
+		if (hook->done_ns > done_ns)
+			done_ns = hook->done_ns;
+	}
+
+	if (ctx->options->co_clear_dead)
+		json_object_set_new(json_event, "cleared_blkdevs", json_integer(host->cleared));
+	json_object_set_new(json_event, "hooks", json_hooks);
+	json_object_set_new(json_event, "detect_to_action_ms", json_real((host->action_ns - host->detect_ns) / 1e6));
+	json_object_set_new(json_event, "detect_to_done_ms", json_real((done_ns - host->detect_ns) / 1e6));
+	monitor_print(json_event);
+}
+
+/*
+ * Hooks run in parallel, --clear-dead runs here meanwhile. While hooks of
+ * the last death still run, this one is queued until monitor_reap() saw
+ * them done.
+ */
+static void monitor_failover(struct monitor_ctx *ctx, unsigned int host_id, uint64_t detect_ns)
+{
+	struct monitor_host *host = &ctx->hosts[host_id];
+
+	if (host->pending) {
+		fprintf(stderr, "Hooks for host %u still running, failover deferred until they are done\n",
+			host_id);
+		host->queued_ns = detect_ns;
+		return;
+	}
+
+	host->detect_ns = detect_ns;
+	host->nr_hooks = 0;
+	host->action_ns = cbd_now_ns();
+
+	for (unsigned int i = 0; i < ctx->nr_hooks; i++)
+		monitor_hook_start(ctx, host_id, ctx->hooks[i]);
+
+	if (ctx->options->co_clear_dead)
+		host->cleared = cbdsys_host_blkdevs_clear(&ctx->cbdt, host_id);
+	host->cleared_ns = cbd_now_ns();
+
+	if (!host->pending)
+		monitor_failover_done(ctx, host_id);
+}
+
+static void monitor_reap(struct monitor_ctx *ctx, bool block)
+{
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+		for (unsigned int h = 0; h < ctx->cbdt.host_num; h++) {
+			struct monitor_host *host = &ctx->hosts[h];
+
+			for (unsigned int i = 0; i < host->nr_hooks; i++) {
+				struct monitor_hook *hook = &host->hooks[i];
+
+				if (hook->pid != pid)
+					continue;
+
+				hook->pid = 0;
+				hook->done_ns = cbd_now_ns();
+				hook->status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+				if (--host->pending)
+					goto next;
+
+				monitor_failover_done(ctx, h);
+				if (host->queued_ns) {
+					uint64_t detect_ns = host->queued_ns;
+
+					host->queued_ns = 0;
+					monitor_failover(ctx, h, detect_ns);
+				}
+				goto next;
+			}
+		}
+next:
+		;
+	}
+}
+
+static bool monitor_pending(struct monitor_ctx *ctx)
+{
+	for (unsigned int h = 0; h < ctx->cbdt.host_num; h++) {
+		if (ctx->hosts[h].pending)
+			return true;
+	}
+
+	return false;
+}
+
+/* Sample the alive of @host_id, returns true if it just died */
+static bool monitor_sample(struct monitor_ctx *ctx, unsigned int host_id, uint64_t now_ns,
+			   uint64_t interval_ns)
+{
+	struct monitor_host *host = &ctx->hosts[host_id];
+	char alive_str[8];
+	json_t *json_event;
+	bool alive;
+
+	if (host->alive_fd < 0) {
+		char path[CBD_PATH_LEN];
+		struct cbd_host info;
+
+		/* Slots come and go with hosts registering */
+		if (cbdsys_host_init(&ctx->cbdt, &info, host_id) < 0)
+			return false;
+
+		snprintf(host->hostname, sizeof(host->hostname), "%s", info.hostname);
+		host_alive_path(ctx->cbdt.transport_id, host_id, path, CBD_PATH_LEN);
+		host->alive_fd = cbdsys_attr_open(path);
+		if (host->alive_fd < 0)
+			return false;
+	}
+
+	if (cbdsys_attr_read(host->alive_fd, alive_str, sizeof(alive_str)) < 0)
+		return false;
+	alive = !strncmp(alive_str, "true", 4);
+
+	if (!host->known) {
+		host->known = true;
+		host->alive = alive;
+		return false;
+	}
+
+	if (alive == host->alive)
+		return false;
+	host->alive = alive;
+
+	json_event = monitor_event(ctx, alive ? "alive" : "dead", host_id, now_ns);
+	if (!alive && host->hb_seen_ns)
+		json_object_set_new(json_event, "heartbeat_age_ms", json_real((now_ns - host->hb_seen_ns) / 1e6));
+	json_object_set_new(json_event, "sample_interval_ms", json_real(interval_ns / 1e6));
+	monitor_print(json_event);
+
+	return !alive;
+}
+
+int cbdctrl_host_monitor(cbd_opt_t *options)
+{
+	struct monitor_ctx ctx = { .options = options };
+	uint64_t interval_ns = options->co_interval_us * 1000ULL;
+	uint64_t fast_ns = interval_ns / MONITOR_FAST_DIV;
+	uint64_t step_ns = interval_ns;
+	unsigned long deaths = 0;
+	uint64_t next_ns;
+	int ret;
+
+	if (fast_ns < MONITOR_FAST_MIN_US * 1000ULL)
+		fast_ns = interval_ns < MONITOR_FAST_MIN_US * 1000ULL ? interval_ns : MONITOR_FAST_MIN_US * 1000ULL;
+
+	ret = cbdsys_transport_init(&ctx.cbdt, options->co_transport_id);
+	if (ret < 0)
+		return ret;
+
+	if (strlen(options->co_hooks)) {
+		ret = monitor_hooks_load(&ctx, options->co_hooks);
+		if (ret < 0)
+			return ret;
+	}
+
+	ctx.hosts = calloc(ctx.cbdt.host_num ? ctx.cbdt.host_num : 1, sizeof(*ctx.hosts));
+	if (!ctx.hosts)
+		return -ENOMEM;
+	for (unsigned int i = 0; i < ctx.cbdt.host_num; i++)
+		ctx.hosts[i].alive_fd = -1;
+
+	monitor_live_open(&ctx);
+	cbdctrl_catch_stop_signals();
+
+	ctx.start_ns = next_ns = cbd_now_ns();
+	while (!cbdctrl_stopping) {
+		uint64_t now_ns = cbd_now_ns();
+		bool fast = false;
+
+		cbdsys_deadline_restart();
+
+		for (unsigned int i = 0; i < ctx.cbdt.host_num; i++) {
+			if (monitor_heartbeat(&ctx, i, now_ns))
+				fast = true;
+
+			if (!monitor_sample(&ctx, i, now_ns, step_ns))
+				continue;
+
+			monitor_failover(&ctx, i, now_ns);
+			deaths++;
+		}
+
+		monitor_reap(&ctx, false);
+		if (options->co_count && deaths >= options->co_count)
+			break;
+
+		step_ns = fast || monitor_pending(&ctx) ? fast_ns : interval_ns;
+		next_ns += step_ns;
+		if (next_ns < now_ns)
+			next_ns = now_ns;
+		cbd_sleep_until_ns(next_ns);
+	}
+
+	/* Report the failovers still running */
+	while (monitor_pending(&ctx))
+		monitor_reap(&ctx, true);
+
+	for (unsigned int i = 0; i < ctx.cbdt.host_num; i++)
+		cbdsys_attr_close(&ctx.hosts[i].alive_fd);
+	if (ctx.live_ok)
+		cbd_meta_live_close(&ctx.live);
+	free(ctx.hosts);
+
+	return 0;
+}
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <jansson.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * Zero a transport device before tp-reg --format, in chunks handed out to
+ * --jobs threads. Block devices are zeroed with BLKZEROOUT, which the
+ * kernel turns into an unmapping write-zeroes where the device has one and
+ * into written zero pages where it doesn't. BLKDISCARD is not used, reads
+ * of discarded blocks aren't guaranteed to return zeroes. Device DAX and
+ * files are mapped and zeroed with non-temporal stores, which bypass the
+ * CPU caches on the way to the media.
+ */
+#define PREPARE_CHUNK		(64ULL * 1024 * 1024)
+#define PREPARE_MAP_ALIGN	(2 * 1024 * 1024)	/* device DAX wants 2M aligned mappings */
+#define PREPARE_SECTOR		512
+#define PREPARE_LINE		64
+#define PREPARE_THREADS_MAX	64
+#define PREPARE_POLL_US		10000
+
+enum prepare_method {
+	PREPARE_ZEROOUT,
+	PREPARE_MMAP_NT,
+};
+
+static const char *prepare_method_names[] = {
+	[PREPARE_ZEROOUT]	= "zeroout",
+	[PREPARE_MMAP_NT]	= "mmap-nt",
+};
+
+struct prepare_ctx {
+	int			fd;
+	enum prepare_method	method;
+	bool			verify;		/* this pass checks instead of zeroing */
+	char			*base;		/* mapping, NULL for zeroout */
+	uint64_t		size;
+	uint64_t		nr_chunks;
+
+	uint64_t		next_chunk;
+	uint64_t		done;		/* bytes */
+	unsigned int		running;
+	int			error;
+	uint64_t		first_nonzero;
+};
+
+static void prepare_zero(char *addr, size_t len)
+{
+	size_t off = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__m128i zero = _mm_setzero_si128();
+
+	/* Chunks start page aligned, only the end of the device may be partial */
+	for (; off + PREPARE_LINE <= len; off += PREPARE_LINE) {
+		__m128i *p = (__m128i *)(addr + off);
+
+		_mm_stream_si128(p, zero);
+		_mm_stream_si128(p + 1, zero);
+		_mm_stream_si128(p + 2, zero);
+		_mm_stream_si128(p + 3, zero);
+	}
+	_mm_sfence();
+#endif
+	memset(addr + off, 0, len - off);
+}
+
+/* Offset of the first non-zero byte of [@addr, @addr + @len), @len if none */
+static size_t prepare_check(const char *addr, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off + PREPARE_LINE <= len; off += PREPARE_LINE) {
+		const uint64_t *p = (const uint64_t *)(addr + off);
+
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			break;
+	}
+
+	for (; off < len; off++) {
+		if (addr[off])
+			return off;
+	}
+
+	return len;
+}
+
+static int prepare_chunk(struct prepare_ctx *ctx, uint64_t off, uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+	size_t bad;
+
+	if (ctx->verify) {
+		uint64_t first = __atomic_load_n(&ctx->first_nonzero, __ATOMIC_RELAXED);
+
+		bad = prepare_check(ctx->base + off, len);
+		while (bad < len && off + bad < first &&
+		       !__atomic_compare_exchange_n(&ctx->first_nonzero, &first, off + bad, false,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		return 0;
+	}
+
+	if (ctx->method == PREPARE_MMAP_NT) {
+		prepare_zero(ctx->base + off, len);
+		return 0;
+	}
+
+	return ioctl(ctx->fd, BLKZEROOUT, range) < 0 ? -errno : 0;
+}
+
+static void *prepare_thread_fn(void *arg)
+{
+	struct prepare_ctx *ctx = arg;
+
+	while (!cbdctrl_stopping && !__atomic_load_n(&ctx->error, __ATOMIC_RELAXED)) {
+		uint64_t chunk = __atomic_fetch_add(&ctx->next_chunk, 1, __ATOMIC_RELAXED);
+		uint64_t off = chunk * PREPARE_CHUNK;
+		uint64_t len;
+		int ret;
+
+		if (chunk >= ctx->nr_chunks)
+			break;
+
+		len = ctx->size - off < PREPARE_CHUNK ? ctx->size - off : PREPARE_CHUNK;
+		ret = prepare_chunk(ctx, off, len);
+		if (ret) {
+			int none = 0;
+
+			__atomic_compare_exchange_n(&ctx->error, &none, ret, false,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			break;
+		}
+		__atomic_fetch_add(&ctx->done, len, __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_sub(&ctx->running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void prepare_progress(struct prepare_ctx *ctx, uint64_t start_ns, bool last)
+{
+	uint64_t done = __atomic_load_n(&ctx->done, __ATOMIC_RELAXED);
+	double elapsed = (cbd_now_ns() - start_ns) / 1e9;
+
+	fprintf(stderr, "%s%s: %lu/%lu MiB (%.0f%%), %.0f MiB/s%s",
+		isatty(STDERR_FILENO) ? "\r" : "", ctx->verify ? "verify" : "prepare",
+		done >> 20, ctx->size >> 20, ctx->size ? done * 100.0 / ctx->size : 100.0,
+		elapsed > 0 ? done / elapsed / (1 << 20) : 0.0,
+		last || !isatty(STDERR_FILENO) ? "\n" : "");
+}
+
+/* One pass over the device, returns its duration in seconds */
+static double prepare_pass(struct prepare_ctx *ctx, unsigned int jobs, uint64_t interval_ns)
+{
+	pthread_t threads[PREPARE_THREADS_MAX];
+	uint64_t start_ns, next_ns;
+	unsigned int started;
+
+	ctx->next_chunk = 0;
+	ctx->done = 0;
+	ctx->running = jobs;
+
+	start_ns = next_ns = cbd_now_ns();
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, prepare_thread_fn, ctx))
+			break;
+	}
+	__atomic_fetch_sub(&ctx->running, jobs - started, __ATOMIC_RELEASE);
+
+	/* Without any thread the chunks are still done, just serially */
+	if (!started) {
+		ctx->running = 1;
+		prepare_thread_fn(ctx);
+	}
+
+	while (true) {
+		next_ns += interval_ns;
+		while (__atomic_load_n(&ctx->running, __ATOMIC_ACQUIRE) && cbd_now_ns() < next_ns)
+			usleep(PREPARE_POLL_US);
+		if (!__atomic_load_n(&ctx->running, __ATOMIC_ACQUIRE))
+			break;
+		prepare_progress(ctx, start_ns, false);
+	}
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	prepare_progress(ctx, start_ns, true);
+
+	return (cbd_now_ns() - start_ns) / 1e9;
+}
+
+/* Size of a device DAX, from /sys/dev/char/<maj>:<min>/size */
+static int prepare_dax_size(dev_t rdev, uint64_t *size)
+{
+	char path[CBD_PATH_LEN];
+	char buf[32];
+	int ret;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/size", major(rdev), minor(rdev));
+	ret = read_sysfs_value(path, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	*size = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+/* Whether the block device zeroes in hardware, -1 if unknown */
+static int prepare_offloaded(dev_t rdev)
+{
+	static const char *fmts[] = {
+		"/sys/dev/block/%u:%u/queue/write_zeroes_max_bytes",
+		"/sys/dev/block/%u:%u/../queue/write_zeroes_max_bytes",	/* partitions */
+	};
+	char path[CBD_PATH_LEN];
+	char buf[32];
+
+	for (unsigned int i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		snprintf(path, sizeof(path), fmts[i], major(rdev), minor(rdev));
+		if (read_sysfs_value(path, buf, sizeof(buf)) == 0)
+			return strtoull(buf, NULL, 10) > 0;
+	}
+
+	return -1;
+}
+
+static int prepare_map(struct prepare_ctx *ctx, size_t *map_len, bool chr, int prot)
+{
+	size_t align = chr ? PREPARE_MAP_ALIGN : (size_t)sysconf(_SC_PAGESIZE);
+	void *map;
+
+	*map_len = (ctx->size + align - 1) / align * align;
+	map = mmap(NULL, *map_len, prot, MAP_SHARED, ctx->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	/* Every byte is touched once, in chunk order per thread */
+	madvise(map, *map_len, MADV_SEQUENTIAL);
+	ctx->base = map;
+	return 0;
+}
+
+int cbdctrl_transport_prepare(cbd_opt_t *options)
+{
+	struct prepare_ctx ctx = { .fd = -1 };
+	uint64_t interval_ns = options->co_interval_us * 1000ULL;
+	const char *path = options->co_path;
+	unsigned int jobs;
+	size_t map_len = 0;
+	double elapsed, verify_elapsed = 0;
+	uint64_t prepared;
+	int offloaded = -1;
+	int flags = O_RDWR | O_CLOEXEC;
+	struct stat st;
+	json_t *json_out;
+	char *json_str;
+	int ret;
+
+	if (!strlen(path)) {
+		printf("--path required for tp-prepare command\n");
+		return -EINVAL;
+	}
+
+	if (!options->co_force) {
+		printf("tp-prepare overwrites all of '%s', use --force to confirm\n", path);
+		return -EINVAL;
+	}
+
+	ret = cbdsys_transport_find_path(path);
+	if (ret >= 0) {
+		printf("'%s' is registered as transport %d, unregister it first\n", path, ret);
+		return -EBUSY;
+	}
+	if (ret != -ENOENT) {
+		printf("Failed to check '%s' against the transports: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	/*
+	 * O_EXCL fails on a block device something has mounted or holds open
+	 * exclusively. Only images are created, a mistyped /dev name is not.
+	 */
+	if (!stat(path, &st) && S_ISBLK(st.st_mode))
+		flags |= O_EXCL;
+	else if (options->co_size && strncmp(path, "/dev/", strlen("/dev/")))
+		flags |= O_CREAT;
+
+	ctx.fd = open(path, flags, 0644);
+	if (ctx.fd < 0 || fstat(ctx.fd, &st) < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	if (S_ISBLK(st.st_mode) && !(flags & O_EXCL)) {
+		printf("'%s' changed to a block device while opening it\n", path);
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(ctx.fd, BLKGETSIZE64, &ctx.size) < 0) {
+			ret = -errno;
+			printf("Failed to get the size of '%s': %s\n", path, strerror(-ret));
+			goto out;
+		}
+		ctx.method = PREPARE_ZEROOUT;
+		offloaded = prepare_offloaded(st.st_rdev);
+	} else if (S_ISCHR(st.st_mode)) {
+		if (prepare_dax_size(st.st_rdev, &ctx.size) < 0 && !options->co_size) {
+			printf("Size of '%s' unknown, give it with --size\n", path);
+			ret = -EINVAL;
+			goto out;
+		}
+		ctx.method = PREPARE_MMAP_NT;
+	} else {
+		/* A test image, --size creates or grows it */
+		if (options->co_size > (uint64_t)st.st_size && ftruncate(ctx.fd, options->co_size) < 0) {
+			ret = -errno;
+			printf("Failed to resize '%s': %s\n", path, strerror(-ret));
+			goto out;
+		}
+		ctx.size = options->co_size ? options->co_size : (uint64_t)st.st_size;
+		ctx.method = PREPARE_MMAP_NT;
+	}
+
+	/* --size limits the preparation to the start of the device */
+	if (options->co_size && options->co_size < ctx.size)
+		ctx.size = options->co_size;
+	if (ctx.method == PREPARE_ZEROOUT)
+		ctx.size = ctx.size / PREPARE_SECTOR * PREPARE_SECTOR;
+	if (!ctx.size) {
+		printf("Nothing to prepare on '%s'\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+	ctx.nr_chunks = (ctx.size + PREPARE_CHUNK - 1) / PREPARE_CHUNK;
+
+	if (ctx.method == PREPARE_MMAP_NT) {
+		ret = prepare_map(&ctx, &map_len, S_ISCHR(st.st_mode), PROT_READ | PROT_WRITE);
+		if (ret < 0) {
+			printf("Failed to map '%s': %s\n", path, strerror(-ret));
+			goto out;
+		}
+	}
+
+	jobs = options->co_jobs ? options->co_jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > PREPARE_THREADS_MAX)
+		jobs = PREPARE_THREADS_MAX;
+	if (jobs > ctx.nr_chunks)
+		jobs = ctx.nr_chunks;
+
+	cbdctrl_catch_stop_signals();
+	elapsed = prepare_pass(&ctx, jobs, interval_ns);
+	prepared = ctx.done;
+
+	/* Stores through a file mapping are in the page cache until written back */
+	if (!ctx.error && !S_ISCHR(st.st_mode) && fsync(ctx.fd) < 0)
+		ctx.error = -errno;
+
+	if (options->co_verify && !ctx.error && !cbdctrl_stopping) {
+		if (!ctx.base) {
+			ret = prepare_map(&ctx, &map_len, false, PROT_READ);
+			if (ret < 0) {
+				printf("Failed to map '%s' for --verify: %s\n", path, strerror(-ret));
+				goto out;
+			}
+		}
+		ctx.verify = true;
+		ctx.first_nonzero = UINT64_MAX;
+		verify_elapsed = prepare_pass(&ctx, jobs, interval_ns);
+	}
+
+	json_out = json_object();
+	json_object_set_new(json_out, "path", json_string(path));
+	json_object_set_new(json_out, "size", json_integer(ctx.size));
+	json_object_set_new(json_out, "method", json_string(prepare_method_names[ctx.method]));
+	if (offloaded >= 0)
+		json_object_set_new(json_out, "offloaded", json_boolean(offloaded));
+	json_object_set_new(json_out, "jobs", json_integer(jobs));
+	json_object_set_new(json_out, "elapsed_sec", json_real(elapsed));
+	json_object_set_new(json_out, "prepared", json_integer(prepared));
+	json_object_set_new(json_out, "throughput_mib_s",
+			    json_real(elapsed > 0 ? prepared / elapsed / (1 << 20) : 0));
+	if (ctx.verify) {
+		json_t *json_verify = json_object();
+
+		json_object_set_new(json_verify, "ok", json_boolean(ctx.first_nonzero == UINT64_MAX &&
+								    ctx.done == ctx.size));
+		if (ctx.first_nonzero != UINT64_MAX)
+			json_object_set_new(json_verify, "first_nonzero", json_integer(ctx.first_nonzero));
+		json_object_set_new(json_verify, "elapsed_sec", json_real(verify_elapsed));
+		json_object_set_new(json_out, "verify", json_verify);
+	}
+	if (ctx.error)
+		json_object_set_new(json_out, "error", json_string(strerror(-ctx.error)));
+	json_object_set_new(json_out, "interrupted", json_boolean(cbdctrl_stopping));
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	ret = ctx.error;
+	if (!ret && (cbdctrl_stopping || (ctx.verify && ctx.first_nonzero != UINT64_MAX)))
+		ret = cbdctrl_stopping ? -EINTR : -EUCLEAN;
+out:
+	if (ctx.base)
+		munmap(ctx.base, map_len);
+	if (ctx.fd >= 0)
+		close(ctx.fd);
+	return ret;
+}
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdtrace.h"
+#include "libcbdsys.h"
+
+#define TRACEFS_PATH		"/sys/kernel/tracing"
+#define DEBUGFS_TRACING_PATH	"/sys/kernel/debug/tracing"
+#define BIO_QUEUE_EVENT		"block_bio_queue: "
+
+/* region -> heat, open addressing */
+struct profile_entry {
+	uint64_t		region;		/* region + 1, 0 is an empty slot */
+	uint64_t		heat;
+};
+
+struct profile_map {
+	struct profile_entry	*entries;
+	uint64_t		mask;
+	uint64_t		used;
+	uint64_t		region_size;
+};
+
+static int profile_map_grow(struct profile_map *map)
+{
+	uint64_t size = map->entries ? (map->mask + 1) * 2 : 1 << 16;
+	struct profile_entry *entries = calloc(size, sizeof(*entries));
+
+	if (!entries)
+		return -ENOMEM;
+
+	for (uint64_t i = 0; map->entries && i <= map->mask; i++) {
+		uint64_t slot;
+
+		if (!map->entries[i].region)
+			continue;
+
+		slot = (map->entries[i].region * 0x9e3779b97f4a7c15ULL >> 17) & (size - 1);
+		while (entries[slot].region)
+			slot = (slot + 1) & (size - 1);
+		entries[slot] = map->entries[i];
+	}
+
+	free(map->entries);
+	map->entries = entries;
+	map->mask = size - 1;
+	return 0;
+}
+
+static int profile_map_add(struct profile_map *map, uint64_t region, uint64_t heat)
+{
+	uint64_t slot = ((region + 1) * 0x9e3779b97f4a7c15ULL >> 17) & map->mask;
+
+	while (map->entries[slot].region && map->entries[slot].region != region + 1)
+		slot = (slot + 1) & map->mask;
+
+	if (!map->entries[slot].region) {
+		map->entries[slot].region = region + 1;
+		if (++map->used * 2 > map->mask + 1) {
+			map->entries[slot].heat += heat;
+			return profile_map_grow(map);
+		}
+	}
+
+	map->entries[slot].heat += heat;
+	return 0;
+}
+
+/* Account the 4K blocks of a request to the regions they fall into */
+static int profile_map_account(struct profile_map *map, uint64_t block, uint64_t nr_blocks)
+{
+	uint64_t blocks_per_region = map->region_size >> CBD_TRACE_BLOCK_SHIFT;
+	int ret = 0;
+
+	while (nr_blocks && !ret) {
+		uint64_t region = block / blocks_per_region;
+		uint64_t n = (region + 1) * blocks_per_region - block;
+
+		if (n > nr_blocks)
+			n = nr_blocks;
+		ret = profile_map_add(map, region, n);
+		block += n;
+		nr_blocks -= n;
+	}
+
+	return ret;
+}
+
+static int profile_range_cmp(const void *a, const void *b)
+{
+	const struct cbd_profile_range *ra = a, *rb = b;
+
+	if (ra->heat != rb->heat)
+		return ra->heat < rb->heat ? 1 : -1;
+	return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+static int profile_save(struct profile_map *map, const char *path, uint64_t *nr_ranges)
+{
+	struct cbd_profile_range *ranges;
+	char tmp_path[CBD_PATH_LEN + 8];
+	uint64_t n = 0;
+	FILE *fp;
+	int ret = 0;
+
+	ranges = calloc(map->used ? map->used : 1, sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	for (uint64_t i = 0; i <= map->mask; i++) {
+		if (!map->entries[i].region)
+			continue;
+		ranges[n].offset = (map->entries[i].region - 1) * map->region_size;
+		ranges[n].length = map->region_size;
+		ranges[n].heat = map->entries[i].heat;
+		n++;
+	}
+	qsort(ranges, n, sizeof(*ranges), profile_range_cmp);
+
+	/* Same as the export textfile, a reader never sees a half written profile */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		ret = -errno;
+		printf("failed to create %s: %s\n", tmp_path, strerror(errno));
+		goto out;
+	}
+
+	fprintf(fp, "%s\n# region %lu\n# offset length heat\n", CBD_PROFILE_HEADER,
+		(unsigned long)map->region_size);
+	for (uint64_t i = 0; i < n; i++)
+		fprintf(fp, "%lu %lu %lu\n", (unsigned long)ranges[i].offset,
+			(unsigned long)ranges[i].length, (unsigned long)ranges[i].heat);
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) < 0) {
+		ret = -errno;
+		printf("failed to write %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		goto out;
+	}
+	*nr_ranges = n;
+out:
+	free(ranges);
+	return ret;
+}
+
+int cbd_profile_load(const char *path, struct cbd_profile_range **ranges, uint64_t *nr_ranges)
+{
+	struct cbd_profile_range *r = NULL;
+	uint64_t n = 0, cap = 0;
+	char line[256];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		int ret = -errno;
+
+		printf("failed to open profile %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, CBD_PROFILE_HEADER, strlen(CBD_PROFILE_HEADER))) {
+		printf("%s is not a cache profile\n", path);
+		fclose(fp);
+		return -EINVAL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned long offset, length, heat;
+
+		if (line[0] == '#' || sscanf(line, "%lu %lu %lu", &offset, &length, &heat) != 3)
+			continue;
+
+		if (n == cap) {
+			struct cbd_profile_range *tmp;
+
+			cap = cap ? cap * 2 : 4096;
+			tmp = realloc(r, cap * sizeof(*r));
+			if (!tmp) {
+				free(r);
+				fclose(fp);
+				return -ENOMEM;
+			}
+			r = tmp;
+		}
+		r[n].offset = offset;
+		r[n].length = length;
+		r[n].heat = heat;
+		n++;
+	}
+	fclose(fp);
+
+	/* Hand edited or merged profiles may be out of order */
+	qsort(r, n, sizeof(*r), profile_range_cmp);
+	*ranges = r;
+	*nr_ranges = n;
+	return 0;
+}
+
+static int tracefs_write(const char *dir, const char *file, const char *value)
+{
+	char path[CBD_PATH_LEN * 2];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, value, strlen(value)) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Sample the bios queued to @dev_name through a private tracefs instance, so
+ * the global trace buffer and other tracing users are left alone.
+ */
+static int profile_sample_dev(const char *dev_name, unsigned long runtime_us,
+			      struct profile_map *map, uint64_t *nr_ios)
+{
+	char inst[CBD_PATH_LEN], path[CBD_PATH_LEN * 2], filter[64];
+	char buf[65536];
+	size_t len = 0;
+	struct stat st;
+	struct pollfd pfd;
+	uint64_t deadline;
+	const char *tracefs;
+	int ret;
+
+	if (stat(dev_name, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		printf("%s is not a block device\n", dev_name);
+		return -ENODEV;
+	}
+
+	tracefs = access(TRACEFS_PATH "/instances", F_OK) == 0 ? TRACEFS_PATH : DEBUGFS_TRACING_PATH;
+	snprintf(inst, sizeof(inst), "%s/instances/cbdctrl-%d", tracefs, getpid());
+	if (mkdir(inst, 0700) < 0) {
+		ret = -errno;
+		printf("failed to create tracing instance %s: %s\n", inst, strerror(errno));
+		return ret;
+	}
+
+	/* the block tracepoints print the kernel dev_t, major << 20 | minor */
+	snprintf(filter, sizeof(filter), "dev == %u", (major(st.st_rdev) << 20) | minor(st.st_rdev));
+	ret = tracefs_write(inst, "events/block/block_bio_queue/filter", filter);
+	if (!ret)
+		ret = tracefs_write(inst, "events/block/block_bio_queue/enable", "1");
+	if (ret) {
+		printf("failed to enable block_bio_queue tracing: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/trace_pipe", inst);
+	pfd.fd = open(path, O_RDONLY | O_NONBLOCK);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0) {
+		ret = -errno;
+		printf("failed to open %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	deadline = cbd_now_ns() + runtime_us * 1000ULL;
+	while (!cbdctrl_stopping) {
+		uint64_t now = cbd_now_ns();
+		char *line, *eol;
+		ssize_t n;
+
+		if (now >= deadline)
+			break;
+
+		if (poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) <= 0)
+			continue;
+
+		n = read(pfd.fd, buf + len, sizeof(buf) - len - 1);
+		if (n <= 0)
+			continue;
+		len += n;
+		buf[len] = '\0';
+
+		/* "<task>-<pid> [cpu] ... <ts>: block_bio_queue: 252,0 R 2048 + 8 [comm]" */
+		for (line = buf; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+			unsigned int maj, min, nr_sectors;
+			unsigned long sector;
+			char rwbs[16];
+			char *ev;
+
+			*eol = '\0';
+			ev = strstr(line, BIO_QUEUE_EVENT);
+			if (!ev || sscanf(ev + strlen(BIO_QUEUE_EVENT), "%u,%u %15s %lu + %u",
+					  &maj, &min, rwbs, &sector, &nr_sectors) != 5 || !nr_sectors)
+				continue;
+			if (!strchr(rwbs, 'R') && !strchr(rwbs, 'W'))
+				continue;
+
+			ret = profile_map_account(map, (uint64_t)sector >> (CBD_TRACE_BLOCK_SHIFT - 9),
+						  (((uint64_t)sector + nr_sectors - 1) >> (CBD_TRACE_BLOCK_SHIFT - 9)) -
+						  ((uint64_t)sector >> (CBD_TRACE_BLOCK_SHIFT - 9)) + 1);
+			if (ret)
+				break;
+			(*nr_ios)++;
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (ret)
+			break;
+
+		/* No bio event fills the buffer, drop a line that does instead of reading 0 bytes forever */
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+	close(pfd.fd);
+out:
+	tracefs_write(inst, "events/block/block_bio_queue/enable", "0");
+	rmdir(inst);
+	return ret;
+}
+
+int cbdctrl_cache_profile(cbd_opt_t *options)
+{
+	struct profile_map map = { 0 };
+	struct cbd_transport cbdt;
+	struct cbd_blkdev blkdev;
+	uint64_t nr_ios = 0, nr_ranges = 0;
+	json_t *json_out;
+	char *json_str;
+	int ret;
+
+	if (!strlen(options->co_profile)) {
+		printf("--profile <file> required for cache-profile command\n");
+		return -EINVAL;
+	}
+
+	map.region_size = options->co_region ? options->co_region : CBD_PROFILE_REGION_DEFAULT;
+	if (map.region_size % (1 << CBD_TRACE_BLOCK_SHIFT)) {
+		printf("region size must be a multiple of %u\n", 1 << CBD_TRACE_BLOCK_SHIFT);
+		return -EINVAL;
+	}
+
+	ret = profile_map_grow(&map);
+	if (ret)
+		return ret;
+
+	if (options->co_dev_id != UINT_MAX) {
+		ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+		if (ret < 0) {
+			printf("transport for id %u not found.\n", options->co_transport_id);
+			goto out;
+		}
+
+		ret = cbdsys_blkdev_init(&cbdt, &blkdev, options->co_dev_id);
+		if (ret < 0 || !blkdev.alive || blkdev.host_id != cbdt.host_id) {
+			printf("blkdev %u is not alive on this host.\n", options->co_dev_id);
+			ret = -ENOENT;
+			goto out;
+		}
+
+		/* Ctrl-C ends the sampling early and still saves the profile */
+		cbdctrl_catch_stop_signals();
+		ret = profile_sample_dev(blkdev.dev_name, options->co_runtime_us, &map, &nr_ios);
+	} else if (strlen(options->co_path)) {
+		struct cbd_trace trace = { 0 };
+
+		ret = cbd_trace_load(options->co_path, &trace);
+		for (uint64_t i = 0; i < trace.nr_ios && !ret; i++)
+			ret = profile_map_account(&map, trace.ios[i].block, trace.ios[i].nr_blocks);
+		nr_ios = trace.nr_ios;
+		cbd_trace_free(&trace);
+	} else {
+		printf("--dev or --path <trace> required for cache-profile command\n");
+		ret = -EINVAL;
+	}
+	if (ret)
+		goto out;
+
+	ret = profile_save(&map, options->co_profile, &nr_ranges);
+	if (ret)
+		goto out;
+
+	json_out = json_object();
+	json_object_set_new(json_out, "profile", json_string(options->co_profile));
+	json_object_set_new(json_out, "requests", json_integer(nr_ios));
+	json_object_set_new(json_out, "region_size", json_integer(map.region_size));
+	json_object_set_new(json_out, "ranges", json_integer(nr_ranges));
+	json_object_set_new(json_out, "bytes", json_integer(nr_ranges * map.region_size));
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+out:
+	free(map.entries);
+	return ret;
+}
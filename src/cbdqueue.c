@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdqueue.h"
+#include "libcbdsys.h"
+
+struct cbd_queue_builtin {
+	const char		*name;
+	const char		*settings[CBD_QUEUE_SETTINGS_MAX][2];
+};
+
+/*
+ * latency: no scheduler, no merging and completions on the submitting CPU,
+ * every request goes straight to the cache. throughput: mq-deadline with a
+ * deep queue to merge sequential streams, large read-ahead and requests.
+ */
+static const struct cbd_queue_builtin queue_builtins[] = {
+	{ "latency", {
+		{ "scheduler",		"none" },
+		{ "nomerges",		"2" },
+		{ "rq_affinity",	"2" },
+		{ "read_ahead_kb",	"0" },
+		{ "max_sectors_kb",	"128" },
+	} },
+	{ "throughput", {
+		{ "scheduler",		"mq-deadline" },
+		{ "nr_requests",	"256" },
+		{ "nomerges",		"0" },
+		{ "rq_affinity",	"1" },
+		{ "read_ahead_kb",	"4096" },
+		{ "max_sectors_kb",	"max" },
+	} },
+};
+
+/* Reported by dev-list and dev-tune without a profile */
+static const char *queue_report_attrs[] = {
+	"scheduler", "nr_requests", "read_ahead_kb", "rq_affinity", "nomerges", "max_sectors_kb",
+};
+
+static int queue_profile_add(struct cbd_queue_profile *profile, const char *attr,
+			     const char *value)
+{
+	struct cbd_queue_setting *setting;
+
+	/* Only attributes of the queue directory itself */
+	if (!*attr || *attr == '.' || strchr(attr, '/') || !*value)
+		return -EINVAL;
+	if (strlen(attr) >= sizeof(setting->attr) || strlen(value) >= sizeof(setting->value))
+		return -ENAMETOOLONG;
+	if (profile->nr_settings == CBD_QUEUE_SETTINGS_MAX)
+		return -E2BIG;
+
+	/* The scheduler goes first, a switch resets nr_requests */
+	setting = &profile->settings[profile->nr_settings];
+	if (!strcmp(attr, "scheduler")) {
+		memmove(&profile->settings[1], &profile->settings[0],
+			profile->nr_settings * sizeof(*setting));
+		setting = &profile->settings[0];
+	}
+	snprintf(setting->attr, sizeof(setting->attr), "%s", attr);
+	snprintf(setting->value, sizeof(setting->value), "%s", value);
+	profile->nr_settings++;
+
+	return 0;
+}
+
+static int queue_profile_read(const char *path, struct cbd_queue_profile *profile)
+{
+	unsigned int line_nr = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (getline(&line, &cap, fp) >= 0) {
+		char *attr, *value, *end;
+
+		line_nr++;
+		line[strcspn(line, "#\n")] = '\0';
+
+		attr = line;
+		while (isspace((unsigned char)*attr))
+			attr++;
+		if (!*attr)
+			continue;
+
+		value = attr + strcspn(attr, "= \t");
+		end = value;
+		while (*value == '=' || isspace((unsigned char)*value))
+			value++;
+		*end = '\0';
+		for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+
+		ret = queue_profile_add(profile, attr, value);
+		if (ret) {
+			printf("%s:%u: invalid setting '%s': %s\n", path, line_nr, attr, strerror(-ret));
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+int cbd_queue_profile_load(const char *name, struct cbd_queue_profile *profile)
+{
+	int ret;
+
+	memset(profile, 0, sizeof(*profile));
+	snprintf(profile->name, sizeof(profile->name), "%s", name);
+
+	for (unsigned int i = 0; i < sizeof(queue_builtins) / sizeof(queue_builtins[0]); i++) {
+		const struct cbd_queue_builtin *builtin = &queue_builtins[i];
+
+		if (strcmp(builtin->name, name))
+			continue;
+
+		for (unsigned int j = 0; j < CBD_QUEUE_SETTINGS_MAX && builtin->settings[j][0]; j++)
+			queue_profile_add(profile, builtin->settings[j][0], builtin->settings[j][1]);
+		return 0;
+	}
+
+	ret = queue_profile_read(name, profile);
+	if (ret == -ENOENT && !strchr(name, '/')) {
+		printf("Unknown queue profile '%s', built-in profiles: latency, throughput\n", name);
+		return -EINVAL;
+	}
+	if (ret < 0 && ret != -EINVAL && ret != -E2BIG && ret != -ENAMETOOLONG)
+		printf("Failed to read queue profile %s: %s\n", name, strerror(-ret));
+	if (!ret && !profile->nr_settings) {
+		printf("Queue profile %s has no settings\n", name);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static int queue_attr_write(const char *path, const char *value)
+{
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, value, strlen(value)) < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+/* "none [mq-deadline] kyber" reads back as "mq-deadline" */
+static void queue_scheduler_active(char *buf)
+{
+	char *start = strchr(buf, '[');
+	char *end = start ? strchr(start, ']') : NULL;
+
+	if (!start || !end)
+		return;
+
+	*end = '\0';
+	memmove(buf, start + 1, end - start);
+}
+
+static int queue_attr_read(unsigned int mapped_id, const char *attr, char *buf, size_t buf_len)
+{
+	char path[CBD_PATH_LEN];
+	int ret;
+
+	block_queue_path(mapped_id, attr, path, sizeof(path));
+	ret = read_sysfs_value(path, buf, buf_len);
+	if (ret < 0)
+		return ret;
+
+	if (!strcmp(attr, "scheduler"))
+		queue_scheduler_active(buf);
+	return 0;
+}
+
+static bool queue_value_equal(const char *wanted, const char *actual)
+{
+	char *wanted_end, *actual_end;
+	unsigned long long w, a;
+
+	if (!strcmp(wanted, actual))
+		return true;
+
+	w = strtoull(wanted, &wanted_end, 0);
+	a = strtoull(actual, &actual_end, 0);
+	return *wanted && *actual && !*wanted_end && !*actual_end && w == a;
+}
+
+/* The queue directory shows up with the disk, shortly after dev-start returns */
+static int queue_wait(unsigned int mapped_id)
+{
+	uint64_t deadline_ns = cbd_now_ns() + CBD_QUEUE_WAIT_MS * 1000000ULL;
+	char path[CBD_PATH_LEN];
+
+	block_queue_path(mapped_id, "scheduler", path, sizeof(path));
+	while (access(path, F_OK)) {
+		if (cbd_now_ns() > deadline_ns)
+			return -ENODEV;
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+int cbd_queue_profile_apply(unsigned int mapped_id, const struct cbd_queue_profile *profile,
+			    json_t **json_out)
+{
+	json_t *json_settings = json_array();
+	char path[CBD_PATH_LEN];
+	int ret = 0;
+
+	*json_out = json_settings;
+
+	if (queue_wait(mapped_id)) {
+		printf("Queue of %s%u not found\n", SYSFS_BLOCK_BASE_PATH, mapped_id);
+		return -ENODEV;
+	}
+
+	for (unsigned int i = 0; i < profile->nr_settings; i++) {
+		const struct cbd_queue_setting *setting = &profile->settings[i];
+		json_t *json_setting = json_object();
+		char wanted[sizeof(setting->value)];
+		char actual[CBD_PATH_LEN] = { 0 };
+		int err;
+
+		snprintf(wanted, sizeof(wanted), "%s", setting->value);
+		if (!strcmp(setting->attr, "max_sectors_kb") && !strcmp(wanted, "max"))
+			queue_attr_read(mapped_id, "max_hw_sectors_kb", wanted, sizeof(wanted));
+
+		block_queue_path(mapped_id, setting->attr, path, sizeof(path));
+		err = queue_attr_write(path, wanted);
+		if (!err)
+			err = queue_attr_read(mapped_id, setting->attr, actual, sizeof(actual));
+		if (!err && !queue_value_equal(wanted, actual))
+			err = -EIO;
+
+		json_object_set_new(json_setting, "attr", json_string(setting->attr));
+		json_object_set_new(json_setting, "value", json_string(wanted));
+		json_object_set_new(json_setting, "actual", json_string(actual));
+		json_object_set_new(json_setting, "ok", json_boolean(!err));
+		if (err && err != -EIO)
+			json_object_set_new(json_setting, "error", json_string(strerror(-err)));
+		json_array_append_new(json_settings, json_setting);
+
+		/* Keep going, one rejected value shouldn't leave the rest at defaults */
+		if (err)
+			ret = -EIO;
+	}
+
+	return ret;
+}
+
+json_t *cbd_queue_to_json(unsigned int mapped_id)
+{
+	json_t *json_queue;
+	char buf[CBD_PATH_LEN];
+
+	if (queue_attr_read(mapped_id, "scheduler", buf, sizeof(buf)))
+		return NULL;
+
+	json_queue = json_object();
+	for (unsigned int i = 0; i < sizeof(queue_report_attrs) / sizeof(queue_report_attrs[0]); i++) {
+		if (queue_attr_read(mapped_id, queue_report_attrs[i], buf, sizeof(buf)))
+			continue;
+		json_object_set_new(json_queue, queue_report_attrs[i], json_string(buf));
+	}
+
+	return json_queue;
+}
+
+int cbd_queue_profile_save(unsigned int mapped_id, struct cbd_queue_profile *profile)
+{
+	char buf[CBD_PATH_LEN];
+
+	memset(profile, 0, sizeof(*profile));
+	snprintf(profile->name, sizeof(profile->name), "%s%u", SYSFS_BLOCK_BASE_PATH, mapped_id);
+
+	for (unsigned int i = 0; i < sizeof(queue_report_attrs) / sizeof(queue_report_attrs[0]); i++) {
+		if (queue_attr_read(mapped_id, queue_report_attrs[i], buf, sizeof(buf)))
+			continue;
+		queue_profile_add(profile, queue_report_attrs[i], buf);
+	}
+
+	return profile->nr_settings ? 0 : -ENODEV;
+}
@@ -0,0 +1,42 @@
+#ifndef CBDQUEUE_H
+#define CBDQUEUE_H
+
+#include <stdbool.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+
+/*
+ * A queue profile is a list of /sys/block/cbdN/queue attributes and the
+ * values to write to them. Built-in profiles are looked up by name, any
+ * other name is read as a file of "attribute = value" lines, '#' starts a
+ * comment. The scheduler is always applied first, switching it resets
+ * nr_requests. max_sectors_kb may be "max" for max_hw_sectors_kb.
+ */
+#define CBD_QUEUE_SETTINGS_MAX	16
+#define CBD_QUEUE_WAIT_MS	1000		/* for the queue directory of a new blkdev */
+
+struct cbd_queue_setting {
+	char			attr[32];
+	char			value[32];
+};
+
+struct cbd_queue_profile {
+	char			name[CBD_PATH_LEN];
+	unsigned int		nr_settings;
+	struct cbd_queue_setting settings[CBD_QUEUE_SETTINGS_MAX];
+};
+
+int cbd_queue_profile_load(const char *name, struct cbd_queue_profile *profile);
+
+/* Write @profile to the queue of /dev/cbd@mapped_id, the read back values go to *@json_out */
+int cbd_queue_profile_apply(unsigned int mapped_id, const struct cbd_queue_profile *profile,
+			    json_t **json_out);
+
+/* Current values of the attributes profiles usually set, NULL without a queue */
+json_t *cbd_queue_to_json(unsigned int mapped_id);
+
+/* The same values as a profile to apply to another blkdev, -ENODEV without a queue */
+int cbd_queue_profile_save(unsigned int mapped_id, struct cbd_queue_profile *profile);
+
+#endif // CBDQUEUE_H
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdrebalance.h"
+#include "libcbdsys.h"
+
+struct rebalance_backend {
+	unsigned int		backend_id;
+	char			path[CBD_PATH_LEN];
+	uint64_t		cache_bytes;
+	uint64_t		used_bytes;
+	unsigned int		cache_segs;
+	unsigned int		nr_devs;
+	unsigned int		dev_ids[CBD_REBALANCE_DEVS_MAX];
+	const char		*unmovable;	/* why, NULL if movable */
+	bool			moved;
+};
+
+struct rebalance_transport {
+	struct cbd_transport	cbdt;
+	uint64_t		capacity;	/* segment_num * bytes_per_segment */
+	uint64_t		used_bytes;
+	unsigned int		free_segs;
+	double			pressure;	/* before the plan */
+	unsigned int		nr_backends;
+	struct rebalance_backend *backends;
+};
+
+struct rebalance_plan {
+	unsigned int		nr_transports;
+	struct rebalance_transport *transports;
+	unsigned int		nr_moves;
+	struct rebalance_move {
+		unsigned int	from;		/* index in transports */
+		unsigned int	to;
+		unsigned int	backend;	/* index in backends of from */
+	} *moves;
+};
+
+static double rebalance_pressure(struct rebalance_transport *t, int64_t used_delta)
+{
+	return t->capacity ? (double)(t->used_bytes + used_delta) * 100 / t->capacity : 0;
+}
+
+/* Only a live backend of this host with all its blkdevs alive on this host is moved */
+static const char *rebalance_unmovable(struct cbd_transport *cbdt, struct cbd_backend *backend)
+{
+	unsigned int nr_devs = 0;
+
+	if (backend->host_id != cbdt->host_id)
+		return "on another host";
+	if (!backend->alive)
+		return "not alive";
+
+	for (unsigned int i = 0; i < backend->dev_num; i++) {
+		if (backend->blkdevs[i].host_id != cbdt->host_id)
+			return "has blkdevs on other hosts";
+		if (!backend->blkdevs[i].alive)
+			return "has dead blkdevs";
+		nr_devs++;
+	}
+	if (nr_devs > CBD_REBALANCE_DEVS_MAX)
+		return "has too many blkdevs";
+
+	return NULL;
+}
+
+static int rebalance_transport_load(struct rebalance_transport *t)
+{
+	struct cbd_transport *cbdt = &t->cbdt;
+	struct cbd_snapshot snap;
+	struct cbd_backend backend;
+	uint64_t cache_segs = 0;
+	int ret;
+
+	t->capacity = (uint64_t)cbdt->segment_num * cbdt->bytes_per_segment;
+	t->backends = calloc(cbdt->backend_num ? cbdt->backend_num : 1, sizeof(*t->backends));
+	if (!t->backends)
+		return -ENOMEM;
+
+	ret = cbdsys_snapshot_init(cbdt, &snap);
+	if (ret)
+		return ret;
+
+	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
+		struct rebalance_backend *b = &t->backends[t->nr_backends];
+
+		ret = cbdsys_backend_init(cbdt, &snap, &backend, i);
+		if (ret == -ETIMEDOUT)
+			goto out;
+		if (ret < 0)
+			continue;
+
+		/* Dead backends hold their segments until cleaned up, see place_account() */
+		cache_segs += backend.cache_segs;
+		t->used_bytes += (uint64_t)backend.cache_used_segs * cbdt->bytes_per_segment;
+
+		b->backend_id = i;
+		snprintf(b->path, sizeof(b->path), "%s", backend.backend_path);
+		b->cache_segs = backend.cache_segs;
+		b->cache_bytes = (uint64_t)backend.cache_segs * cbdt->bytes_per_segment;
+		b->used_bytes = (uint64_t)backend.cache_used_segs * cbdt->bytes_per_segment;
+		b->unmovable = rebalance_unmovable(cbdt, &backend);
+		if (!b->unmovable) {
+			for (unsigned int j = 0; j < backend.dev_num; j++)
+				b->dev_ids[b->nr_devs++] = backend.blkdevs[j].blkdev_id;
+		}
+		t->nr_backends++;
+	}
+
+	t->free_segs = cache_segs > cbdt->segment_num ? 0 : cbdt->segment_num - cache_segs;
+	t->pressure = rebalance_pressure(t, 0);
+	ret = 0;
+out:
+	cbdsys_snapshot_release(&snap);
+	return ret;
+}
+
+/* Every transport this host is registered on and alive in */
+static int rebalance_snapshot(struct rebalance_plan *plan)
+{
+	struct rebalance_transport *t;
+	struct cbd_host host;
+	int ret;
+
+	for (unsigned int i = 0; i < CBD_TRANSPORT_MAX; i++) {
+		struct cbd_transport cbdt;
+
+		ret = cbdsys_transport_init(&cbdt, i);
+		if (ret == -ENOENT)
+			break;
+		if (ret < 0) {
+			printf("rebalance: transport %u: skipped, %s\n", i,
+			       ret == -ETIMEDOUT ? "attributes timed out" : "not registered on this host");
+			continue;
+		}
+
+		ret = cbdsys_host_init(&cbdt, &host, cbdt.host_id);
+		if (ret < 0 || !host.alive) {
+			printf("rebalance: transport %u: skipped, host %u is not alive\n", i, cbdt.host_id);
+			continue;
+		}
+
+		t = realloc(plan->transports, (plan->nr_transports + 1) * sizeof(*t));
+		if (!t)
+			return -ENOMEM;
+		plan->transports = t;
+
+		t = &plan->transports[plan->nr_transports];
+		memset(t, 0, sizeof(*t));
+		t->cbdt = cbdt;
+
+		ret = rebalance_transport_load(t);
+		if (ret < 0) {
+			free(t->backends);
+			if (ret == -ENOMEM)
+				return ret;
+			printf("rebalance: transport %u: skipped, backend attributes timed out\n", i);
+			continue;
+		}
+		plan->nr_transports++;
+	}
+
+	return 0;
+}
+
+/* Segments of the cache of @b on @t, with CBD_AUTO_PLACE_MIN_FREE left over */
+static bool rebalance_fits(struct rebalance_transport *t, struct rebalance_backend *b)
+{
+	uint64_t seg = t->cbdt.bytes_per_segment;
+	uint64_t need = seg ? (b->cache_bytes + seg - 1) / seg : UINT_MAX;
+
+	if (t->free_segs < need + CBD_AUTO_PLACE_MIN_FREE)
+		return false;
+
+	/* backend-start finds the new backend by path */
+	for (unsigned int i = 0; i < t->nr_backends; i++) {
+		if (!t->backends[i].moved && !strcmp(t->backends[i].path, b->path))
+			return false;
+	}
+
+	return true;
+}
+
+static double rebalance_spread(struct rebalance_plan *plan)
+{
+	double min = 100, max = 0;
+
+	for (unsigned int i = 0; i < plan->nr_transports; i++) {
+		double p = rebalance_pressure(&plan->transports[i], 0);
+
+		if (p < min)
+			min = p;
+		if (p > max)
+			max = p;
+	}
+
+	return plan->nr_transports ? max - min : 0;
+}
+
+/*
+ * Account @m as done, later rounds plan on top of it. The source gets all
+ * of the backend's segments back: an executed move only clears the old
+ * slot once the cache is written back and the backend runs on the target,
+ * and a move whose clear fails is failed, so the moves planned on top of
+ * it don't run.
+ */
+static void rebalance_apply(struct rebalance_plan *plan, struct rebalance_move *m)
+{
+	struct rebalance_transport *src = &plan->transports[m->from];
+	struct rebalance_transport *dst = &plan->transports[m->to];
+	struct rebalance_backend *b = &src->backends[m->backend];
+	uint64_t seg = dst->cbdt.bytes_per_segment;
+
+	b->moved = true;
+	src->used_bytes -= b->used_bytes;
+	src->free_segs += b->cache_segs;
+	dst->used_bytes += b->used_bytes;
+	dst->free_segs -= (b->cache_bytes + seg - 1) / seg;
+	plan->moves[plan->nr_moves++] = *m;
+}
+
+/*
+ * Greedy: each round takes the move which lowers the sum of squared
+ * pressures the most, that is the one evening out the most cache in a
+ * single move, so the plan stays short. Moved caches are assumed to fill
+ * up to the same used size on their new transport. A backend moves at
+ * most once.
+ */
+static int rebalance_plan(struct rebalance_plan *plan, unsigned long max_moves)
+{
+	unsigned int nr_backends = 0;
+
+	for (unsigned int i = 0; i < plan->nr_transports; i++)
+		nr_backends += plan->transports[i].nr_backends;
+
+	plan->moves = calloc(nr_backends ? nr_backends : 1, sizeof(*plan->moves));
+	if (!plan->moves)
+		return -ENOMEM;
+
+	while (plan->nr_moves < nr_backends && (!max_moves || plan->nr_moves < max_moves) &&
+	       rebalance_spread(plan) >= CBD_REBALANCE_SPREAD_MIN) {
+		struct rebalance_move best = { 0 };
+		double best_gain = 0;
+
+		for (unsigned int from = 0; from < plan->nr_transports; from++) {
+			struct rebalance_transport *src = &plan->transports[from];
+
+			for (unsigned int k = 0; k < src->nr_backends; k++) {
+				struct rebalance_backend *b = &src->backends[k];
+				double p_src = rebalance_pressure(src, 0);
+				double p_src_after = rebalance_pressure(src, -(int64_t)b->used_bytes);
+
+				if (b->unmovable || b->moved || !b->used_bytes)
+					continue;
+
+				for (unsigned int to = 0; to < plan->nr_transports; to++) {
+					struct rebalance_transport *dst = &plan->transports[to];
+					double p_dst, p_dst_after, gain;
+
+					if (to == from || !rebalance_fits(dst, b))
+						continue;
+
+					p_dst = rebalance_pressure(dst, 0);
+					p_dst_after = rebalance_pressure(dst, b->used_bytes);
+					gain = p_src * p_src + p_dst * p_dst -
+					       p_src_after * p_src_after - p_dst_after * p_dst_after;
+					if (gain > best_gain) {
+						best_gain = gain;
+						best = (struct rebalance_move){ from, to, k };
+					}
+				}
+			}
+		}
+
+		if (best_gain <= 0)
+			break;
+
+		rebalance_apply(plan, &best);
+	}
+
+	return 0;
+}
+
+static json_t *rebalance_move_to_json(struct rebalance_plan *plan, struct rebalance_move *m)
+{
+	struct rebalance_transport *src = &plan->transports[m->from];
+	struct rebalance_backend *b = &src->backends[m->backend];
+	json_t *json_move = json_object();
+	json_t *json_devs = json_array();
+
+	json_object_set_new(json_move, "backend_id", json_integer(b->backend_id));
+	json_object_set_new(json_move, "path", json_string(b->path));
+	json_object_set_new(json_move, "from", json_integer(src->cbdt.transport_id));
+	json_object_set_new(json_move, "to", json_integer(plan->transports[m->to].cbdt.transport_id));
+	json_object_set_new(json_move, "cache_size", json_integer(b->cache_bytes));
+	json_object_set_new(json_move, "cache_used", json_integer(b->used_bytes));
+	for (unsigned int i = 0; i < b->nr_devs; i++)
+		json_array_append_new(json_devs, json_integer(b->dev_ids[i]));
+	json_object_set_new(json_move, "blkdevs", json_devs);
+
+	return json_move;
+}
+
+/* Warm @blkdev from the profile named after the backend in the --profile directory, if any */
+static void rebalance_warm(cbd_opt_t *options, struct rebalance_backend *b, unsigned int transport_id,
+			   struct cbd_blkdev *blkdev, json_t *json_steps)
+{
+	const char *name = strrchr(b->path, '/');
+	json_t *json_step;
+	cbd_opt_t warm = *options;
+	char path[PATH_MAX];
+	uint64_t start_ns;
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s/%s.prof", options->co_profile, name ? name + 1 : b->path);
+	if (ret < 0 || (size_t)ret >= sizeof(warm.co_profile)) {
+		printf("rebalance: profile path of %s too long, not warming\n", b->path);
+		return;
+	}
+	if (access(path, R_OK))
+		return;
+	memcpy(warm.co_profile, path, ret + 1);
+
+	warm.co_transport_id = transport_id;
+	warm.co_dev_id = blkdev->blkdev_id;
+	warm.co_size = 0;
+
+	start_ns = cbd_now_ns();
+	ret = cbdctrl_cache_warm(&warm);
+
+	json_step = json_object();
+	json_object_set_new(json_step, "step", json_string("cache-warm"));
+	json_object_set_new(json_step, "transport_id", json_integer(transport_id));
+	json_object_set_new(json_step, "id", json_integer(blkdev->blkdev_id));
+	json_object_set_new(json_step, "ms", json_real((cbd_now_ns() - start_ns) / 1e6));
+	json_object_set_new(json_step, "ok", json_boolean(!ret));
+	json_array_append_new(json_steps, json_step);
+}
+
+static int rebalance_execute(struct rebalance_plan *plan, struct rebalance_move *m,
+			     cbd_opt_t *options, json_t *json_move)
+{
+	struct rebalance_transport *src = &plan->transports[m->from];
+	struct rebalance_backend *b = &src->backends[m->backend];
+	struct cbd_backend_move move = {
+		.from_id	= src->cbdt.transport_id,
+		.to_id		= plan->transports[m->to].cbdt.transport_id,
+		.backend_id	= b->backend_id,
+		.cache_size	= (b->cache_bytes + (1 << 20) - 1) >> 20,
+		.nr_devs	= b->nr_devs,
+	};
+	json_t *json_steps = json_array();
+	json_t *json_devs = json_array();
+	int ret;
+
+	snprintf(move.path, sizeof(move.path), "%s", b->path);
+	memcpy(move.dev_ids, b->dev_ids, sizeof(move.dev_ids));
+
+	ret = cbdctrl_backend_move(&move, json_steps);
+
+	for (unsigned int i = 0; !ret && options->co_profile[0] && i < move.nr_new_devs; i++)
+		rebalance_warm(options, b, move.to_id, &move.new_devs[i], json_steps);
+
+	if (move.new_backend_id != UINT_MAX)
+		json_object_set_new(json_move, "new_backend_id", json_integer(move.new_backend_id));
+	for (unsigned int i = 0; i < move.nr_new_devs; i++)
+		json_array_append_new(json_devs, json_string(move.new_devs[i].dev_name));
+	json_object_set_new(json_move, "new_blkdevs", json_devs);
+	json_object_set_new(json_move, "steps", json_steps);
+	json_object_set_new(json_move, "ok", json_boolean(!ret));
+	if (move.rolled_back)
+		json_object_set_new(json_move, "rolled_back", json_true());
+
+	return ret;
+}
+
+int cbdctrl_rebalance(cbd_opt_t *options)
+{
+	struct rebalance_plan plan = { 0 };
+	json_t *json_out, *json_transports, *json_moves, *json_skipped;
+	double spread;
+	char *json_str;
+	int ret;
+
+	if (options->co_plan && options->co_execute) {
+		printf("--plan and --execute are exclusive\n");
+		return -EINVAL;
+	}
+
+	ret = rebalance_snapshot(&plan);
+	if (ret)
+		goto out;
+
+	spread = rebalance_spread(&plan);
+	ret = rebalance_plan(&plan, options->co_count);
+	if (ret)
+		goto out;
+
+	json_out = json_object();
+	json_transports = json_array();
+	json_skipped = json_array();
+	for (unsigned int i = 0; i < plan.nr_transports; i++) {
+		struct rebalance_transport *t = &plan.transports[i];
+		json_t *json_tp = json_object();
+
+		json_object_set_new(json_tp, "transport_id", json_integer(t->cbdt.transport_id));
+		json_object_set_new(json_tp, "host_id", json_integer(t->cbdt.host_id));
+		json_object_set_new(json_tp, "segment_num", json_integer(t->cbdt.segment_num));
+		json_object_set_new(json_tp, "pressure", json_real(t->pressure));
+		json_object_set_new(json_tp, "pressure_after", json_real(rebalance_pressure(t, 0)));
+		json_object_set_new(json_tp, "free_segs_after", json_integer(t->free_segs));
+		json_array_append_new(json_transports, json_tp);
+
+		/* Only what this host could have moved */
+		for (unsigned int k = 0; k < t->nr_backends; k++) {
+			struct rebalance_backend *b = &t->backends[k];
+			json_t *json_b;
+
+			if (!b->unmovable || !strcmp(b->unmovable, "on another host"))
+				continue;
+
+			json_b = json_object();
+			json_object_set_new(json_b, "transport_id", json_integer(t->cbdt.transport_id));
+			json_object_set_new(json_b, "backend_id", json_integer(b->backend_id));
+			json_object_set_new(json_b, "reason", json_string(b->unmovable));
+			json_array_append_new(json_skipped, json_b);
+		}
+	}
+	json_object_set_new(json_out, "transports", json_transports);
+	json_object_set_new(json_out, "spread", json_real(spread));
+	json_object_set_new(json_out, "spread_after", json_real(rebalance_spread(&plan)));
+	json_object_set_new(json_out, "skipped", json_skipped);
+
+	json_moves = json_array();
+	if (options->co_execute)
+		cbdctrl_catch_stop_signals();
+	for (unsigned int i = 0; i < plan.nr_moves; i++) {
+		json_t *json_move = rebalance_move_to_json(&plan, &plan.moves[i]);
+
+		json_array_append_new(json_moves, json_move);
+		if (!options->co_execute || ret)
+			continue;
+
+		/* Later moves were planned on top of this one, stop at the first failure */
+		if (cbdctrl_stopping) {
+			ret = -EINTR;
+			continue;
+		}
+		ret = rebalance_execute(&plan, &plan.moves[i], options, json_move);
+	}
+	json_object_set_new(json_out, "moves", json_moves);
+	json_object_set_new(json_out, "executed", json_boolean(options->co_execute));
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+out:
+	for (unsigned int i = 0; i < plan.nr_transports; i++)
+		free(plan.transports[i].backends);
+	free(plan.transports);
+	free(plan.moves);
+	return ret;
+}
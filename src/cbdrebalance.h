@@ -0,0 +1,50 @@
+#ifndef CBDREBALANCE_H
+#define CBDREBALANCE_H
+
+#include <stdbool.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * Cache pressure of a transport is the share of its segments holding
+ * cached data, cache_used_segs of all backends over segment_num. rebalance
+ * moves backends of this host between transports this host is registered
+ * on until the pressures are within CBD_REBALANCE_SPREAD_MIN points, or no
+ * move brings them closer.
+ */
+#define CBD_REBALANCE_SPREAD_MIN	10		/* percent points */
+#define CBD_REBALANCE_DEVS_MAX		8		/* blkdevs restarted with a moved backend */
+#define CBD_REBALANCE_CLEAN_WAIT_MS	30000		/* for a stopped backend's cache writeback */
+
+struct cbd_backend_move {
+	unsigned int		from_id;	/* transport IDs */
+	unsigned int		to_id;
+	unsigned int		backend_id;
+	char			path[CBD_PATH_LEN];
+	unsigned int		cache_size;	/* MiB */
+	unsigned int		nr_devs;
+	unsigned int		dev_ids[CBD_REBALANCE_DEVS_MAX];
+
+	/* Filled in by cbdctrl_backend_move() */
+	unsigned int		new_backend_id;
+	unsigned int		nr_new_devs;
+	struct cbd_blkdev	new_devs[CBD_REBALANCE_DEVS_MAX];
+	bool			rolled_back;
+};
+
+/*
+ * Stop the blkdevs of @move, wait for the backend's cache to be written
+ * back and stop the backend, start it with the same path and cache size on
+ * the target transport and as many blkdevs on it, each with the queue
+ * settings and cgroup limits of the one it replaces, then clear its old
+ * slot so its cache segments are freed. sysfs has to show each step done,
+ * every step is appended to @json_steps. A cache not written back within
+ * CBD_REBALANCE_CLEAN_WAIT_MS, or whose writeback can't be followed in the
+ * backend info, gets its blkdevs back, a backend that won't start on the
+ * target is started on its old transport again.
+ */
+int cbdctrl_backend_move(struct cbd_backend_move *move, json_t *json_steps);
+
+#endif // CBDREBALANCE_H
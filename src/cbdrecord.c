@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "libcbdsys.h"
+
+/*
+ * Flight recorder ring: a header page followed by fixed-size entries. Each
+ * sample is a RECORD_SAMPLE entry followed by one entry per host, backend
+ * and blkdev in use, all carrying the sample's seq. The writer fills the
+ * entries of a sample before it publishes the new head. A reader takes a
+ * copy of a sample only if all its entries carry its seq and the next
+ * sample past the head can't have reached it meanwhile, so a dump can run
+ * while record wraps the ring.
+ *
+ * Every slot of the transport gets its sysfs attributes opened once and
+ * re-read with pread() each interval; the slots in use are rescanned every
+ * RECORD_RESCAN_NS. Nothing is allocated after the start.
+ */
+#define RECORD_MAGIC		0x31434552444243ULL	/* "CBDREC1" */
+#define RECORD_VERSION		1
+#define RECORD_HEADER_SIZE	4096
+#define RECORD_RESCAN_NS	(10 * 1000000000ULL)
+
+enum record_type {
+	RECORD_NONE	= 0,
+	RECORD_SAMPLE,
+	RECORD_HOST,
+	RECORD_BACKEND,
+	RECORD_BLKDEV,
+};
+
+struct record_header {
+	uint64_t		magic;
+	uint32_t		version;
+	uint32_t		entry_size;
+	uint64_t		nr_entries;
+	uint64_t		head;		/* entries ever written, next is head % nr_entries */
+	uint64_t		seq;		/* of the last sample written */
+	uint64_t		max_sample;	/* entries of the largest sample a writer may write */
+};
+
+/* 64 bytes, one cache line */
+struct record_entry {
+	uint64_t		seq;
+	uint8_t			type;
+	uint8_t			alive;
+	uint16_t		host_id;	/* of the sample, backend or blkdev */
+	uint32_t		id;
+	union {
+		struct {
+			uint64_t	unix_ns;
+			uint32_t	nr_entries;	/* following this one */
+			uint32_t	transport_id;
+		} sample;
+		struct {
+			uint32_t	cache_segs;
+			uint32_t	cache_used_segs;
+			uint32_t	cache_gc_percent;
+		} backend;
+		struct {
+			uint32_t	backend_id;
+			uint32_t	mapped_id;
+			uint16_t	inflight_rd;
+			uint16_t	inflight_wr;
+			uint32_t	io_ticks;	/* ms, wraps */
+			uint64_t	rd_ios;
+			uint64_t	wr_ios;
+			uint64_t	rd_sectors;
+			uint64_t	wr_sectors;
+		} blkdev;
+	} u;
+};
+
+struct record_ring {
+	struct record_header	*header;
+	struct record_entry	*entries;
+	size_t			map_len;
+};
+
+struct record_slot {
+	bool			used;
+	bool			local;		/* blkdev of this host, with I/O counters */
+	uint32_t		host_id;
+	uint32_t		backend_id;
+	uint32_t		mapped_id;
+	int			alive_fd;
+	struct cbdsys_backend_sampler	backend_sampler;
+	struct cbdsys_blkdev_sampler	blkdev_sampler;
+};
+
+struct record_ctx {
+	struct cbd_transport	cbdt;
+	struct record_ring	ring;
+	struct record_slot	*hosts;
+	struct record_slot	*backends;
+	struct record_slot	*blkdevs;
+	unsigned int		max_sample;	/* entries of a sample with every slot used */
+};
+
+static int record_ring_map(const char *path, uint64_t size, bool create, struct record_ring *ring)
+{
+	struct record_header *header;
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(path, (create ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	/* A new ring is preallocated, an existing one keeps its size and history */
+	if (create && (uint64_t)st.st_size < RECORD_HEADER_SIZE) {
+		ret = posix_fallocate(fd, 0, size);
+		if (ret) {
+			ret = -ret;
+			printf("Failed to allocate %lu bytes for '%s': %s\n", size, path, strerror(-ret));
+			goto out;
+		}
+		st.st_size = size;
+	}
+
+	if ((uint64_t)st.st_size < RECORD_HEADER_SIZE + sizeof(struct record_entry)) {
+		printf("'%s' is too small for a ring\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		printf("Failed to map '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	header = map;
+	if (create && header->magic == 0) {
+		header->version = RECORD_VERSION;
+		header->entry_size = sizeof(struct record_entry);
+		header->nr_entries = (st.st_size - RECORD_HEADER_SIZE) / sizeof(struct record_entry);
+		__atomic_store_n(&header->magic, RECORD_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	if (header->magic != RECORD_MAGIC || header->version != RECORD_VERSION ||
+	    header->entry_size != sizeof(struct record_entry) || !header->nr_entries ||
+	    RECORD_HEADER_SIZE + header->nr_entries * sizeof(struct record_entry) > (uint64_t)st.st_size) {
+		printf("'%s' is not a flight recorder ring\n", path);
+		munmap(map, st.st_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ring->header = header;
+	ring->entries = (struct record_entry *)((char *)map + RECORD_HEADER_SIZE);
+	ring->map_len = st.st_size;
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static void record_slot_close(struct record_slot *slot)
+{
+	cbdsys_attr_close(&slot->alive_fd);
+	cbdsys_backend_sampler_close(&slot->backend_sampler);
+	cbdsys_blkdev_sampler_close(&slot->blkdev_sampler);
+	slot->used = false;
+	slot->local = false;
+}
+
+static void record_slots_init(struct record_slot *slots, unsigned int nr)
+{
+	for (unsigned int i = 0; i < nr; i++) {
+		slots[i].alive_fd = -1;
+		slots[i].backend_sampler.alive_fd = -1;
+		slots[i].backend_sampler.cache_segs_fd = -1;
+		slots[i].backend_sampler.cache_gc_percent_fd = -1;
+		slots[i].backend_sampler.cache_used_segs_fd = -1;
+		slots[i].blkdev_sampler.stat_fd = -1;
+		slots[i].blkdev_sampler.inflight_fd = -1;
+	}
+}
+
+/* Find the slots in use, open the attributes of new ones */
+static void record_rescan(struct record_ctx *ctx)
+{
+	struct cbd_transport *cbdt = &ctx->cbdt;
+	char path[CBD_PATH_LEN];
+
+	for (unsigned int i = 0; i < cbdt->host_num; i++) {
+		struct record_slot *slot = &ctx->hosts[i];
+		struct cbd_host host;
+
+		if (cbdsys_host_init(cbdt, &host, i) < 0 || !host.hostname[0]) {
+			record_slot_close(slot);
+			continue;
+		}
+		if (slot->used)
+			continue;
+
+		host_alive_path(cbdt->transport_id, i, path, sizeof(path));
+		slot->alive_fd = cbdsys_attr_open(path);
+		slot->used = slot->alive_fd >= 0;
+	}
+
+	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
+		struct record_slot *slot = &ctx->backends[i];
+		struct cbd_backend backend;
+
+		if (cbdsys_backend_info_init(cbdt, &backend, i) < 0) {
+			record_slot_close(slot);
+			continue;
+		}
+		if (slot->used && slot->host_id == backend.host_id)
+			continue;
+
+		record_slot_close(slot);
+		slot->host_id = backend.host_id;
+		slot->used = cbdsys_backend_sampler_open(cbdt, &slot->backend_sampler, i) == 0;
+	}
+
+	for (unsigned int i = 0; i < cbdt->blkdev_num; i++) {
+		struct record_slot *slot = &ctx->blkdevs[i];
+		struct cbd_blkdev blkdev;
+
+		if (cbdsys_blkdev_init(cbdt, &blkdev, i) < 0) {
+			record_slot_close(slot);
+			continue;
+		}
+		if (slot->used && slot->host_id == blkdev.host_id && slot->mapped_id == blkdev.mapped_id)
+			continue;
+
+		record_slot_close(slot);
+		slot->host_id = blkdev.host_id;
+		slot->backend_id = blkdev.backend_id;
+		slot->mapped_id = blkdev.mapped_id;
+
+		blkdev_alive_path(cbdt->transport_id, i, path, sizeof(path));
+		slot->alive_fd = cbdsys_attr_open(path);
+		slot->used = slot->alive_fd >= 0;
+		if (slot->used && blkdev.host_id == cbdt->host_id && blkdev.alive)
+			slot->local = cbdsys_blkdev_sampler_open(&blkdev, &slot->blkdev_sampler) == 0;
+	}
+}
+
+static bool record_read_alive(int fd)
+{
+	char buf[8];
+
+	return cbdsys_attr_read(fd, buf, sizeof(buf)) == 0 && !strcmp(buf, "true");
+}
+
+static struct record_entry *record_entry_at(struct record_ring *ring, uint64_t pos)
+{
+	return &ring->entries[pos % ring->header->nr_entries];
+}
+
+static void record_sample(struct record_ctx *ctx)
+{
+	struct record_ring *ring = &ctx->ring;
+	uint64_t head = ring->header->head;
+	uint64_t seq = ring->header->seq + 1;
+	struct record_entry *sample, *e;
+	struct timespec ts;
+	uint32_t n = 0;
+
+	for (unsigned int i = 0; i < ctx->cbdt.host_num; i++) {
+		struct record_slot *slot = &ctx->hosts[i];
+
+		if (!slot->used)
+			continue;
+
+		e = record_entry_at(ring, head + 1 + n++);
+		memset(e, 0, sizeof(*e));
+		e->seq = seq;
+		e->type = RECORD_HOST;
+		e->id = i;
+		e->alive = record_read_alive(slot->alive_fd);
+	}
+
+	for (unsigned int i = 0; i < ctx->cbdt.backend_num; i++) {
+		struct record_slot *slot = &ctx->backends[i];
+		struct cbd_backend backend;
+
+		if (!slot->used)
+			continue;
+
+		if (cbdsys_backend_sampler_read(&slot->backend_sampler, &backend) < 0) {
+			record_slot_close(slot);
+			continue;
+		}
+
+		e = record_entry_at(ring, head + 1 + n++);
+		memset(e, 0, sizeof(*e));
+		e->seq = seq;
+		e->type = RECORD_BACKEND;
+		e->id = i;
+		e->alive = backend.alive;
+		e->host_id = slot->host_id;
+		e->u.backend.cache_segs = backend.cache_segs;
+		e->u.backend.cache_used_segs = backend.cache_used_segs;
+		e->u.backend.cache_gc_percent = backend.cache_gc_percent;
+	}
+
+	for (unsigned int i = 0; i < ctx->cbdt.blkdev_num; i++) {
+		struct record_slot *slot = &ctx->blkdevs[i];
+		struct cbd_blkdev_iostat iostat;
+
+		if (!slot->used)
+			continue;
+
+		e = record_entry_at(ring, head + 1 + n++);
+		memset(e, 0, sizeof(*e));
+		e->seq = seq;
+		e->type = RECORD_BLKDEV;
+		e->id = i;
+		e->alive = record_read_alive(slot->alive_fd);
+		e->u.blkdev.backend_id = slot->backend_id;
+		e->host_id = slot->host_id;
+		e->u.blkdev.mapped_id = slot->mapped_id;
+
+		if (slot->local && cbdsys_blkdev_sampler_read(&slot->blkdev_sampler, &iostat) == 0) {
+			e->u.blkdev.inflight_rd = iostat.inflight_rd;
+			e->u.blkdev.inflight_wr = iostat.inflight_wr;
+			e->u.blkdev.io_ticks = iostat.io_ticks;
+			e->u.blkdev.rd_ios = iostat.rd_ios;
+			e->u.blkdev.wr_ios = iostat.wr_ios;
+			e->u.blkdev.rd_sectors = iostat.rd_sectors;
+			e->u.blkdev.wr_sectors = iostat.wr_sectors;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sample = record_entry_at(ring, head);
+	memset(sample, 0, sizeof(*sample));
+	sample->seq = seq;
+	sample->type = RECORD_SAMPLE;
+	sample->u.sample.unix_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	sample->u.sample.nr_entries = n;
+	sample->u.sample.transport_id = ctx->cbdt.transport_id;
+	sample->host_id = ctx->cbdt.host_id;
+
+	/* Entries first, then the head a reader starts from */
+	ring->header->seq = seq;
+	__atomic_store_n(&ring->header->head, head + 1 + n, __ATOMIC_RELEASE);
+}
+
+static void record_summary(struct record_ctx *ctx, unsigned long samples, uint64_t start_ns)
+{
+	double elapsed = (cbd_now_ns() - start_ns) / 1e9;
+	json_t *json_out = json_object();
+	struct rusage ru;
+	double cpu = 0;
+	char *json_str;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	json_object_set_new(json_out, "samples", json_integer(samples));
+	json_object_set_new(json_out, "seq", json_integer(ctx->ring.header->seq));
+	json_object_set_new(json_out, "ring_entries", json_integer(ctx->ring.header->nr_entries));
+	json_object_set_new(json_out, "elapsed_sec", json_real(elapsed));
+	json_object_set_new(json_out, "cpu_percent", json_real(elapsed > 0 ? cpu * 100 / elapsed : 0));
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+}
+
+int cbdctrl_record(cbd_opt_t *options)
+{
+	struct record_ctx ctx = { 0 };
+	uint64_t size = options->co_size ? options->co_size : CBD_RECORD_SIZE_DEFAULT;
+	uint64_t start_ns, next_ns, rescan_ns;
+	unsigned long samples;
+	int ret;
+
+	if (!options->co_ring[0]) {
+		printf("--ring required for record command\n");
+		return -EINVAL;
+	}
+
+	ret = cbdsys_transport_init(&ctx.cbdt, options->co_transport_id);
+	if (ret < 0) {
+		printf("transport for id %u not found.\n", options->co_transport_id);
+		return ret;
+	}
+
+	ret = record_ring_map(options->co_ring, size, true, &ctx.ring);
+	if (ret < 0)
+		return ret;
+
+	/* Room for two full samples at least, or a reader never finds a whole one */
+	ctx.max_sample = 1 + ctx.cbdt.host_num + ctx.cbdt.backend_num + ctx.cbdt.blkdev_num;
+	if (ctx.ring.header->nr_entries < 2ULL * ctx.max_sample) {
+		printf("ring '%s' holds %lu entries, a sample of transport %u takes up to %u\n",
+		       options->co_ring, ctx.ring.header->nr_entries, ctx.cbdt.transport_id,
+		       ctx.max_sample);
+		ret = -ENOSPC;
+		goto unmap;
+	}
+	if (ctx.ring.header->max_sample < ctx.max_sample)
+		ctx.ring.header->max_sample = ctx.max_sample;
+
+	ctx.hosts = calloc(ctx.cbdt.host_num, sizeof(*ctx.hosts));
+	ctx.backends = calloc(ctx.cbdt.backend_num, sizeof(*ctx.backends));
+	ctx.blkdevs = calloc(ctx.cbdt.blkdev_num, sizeof(*ctx.blkdevs));
+	if (!ctx.hosts || !ctx.backends || !ctx.blkdevs) {
+		ret = -ENOMEM;
+		goto free;
+	}
+	record_slots_init(ctx.hosts, ctx.cbdt.host_num);
+	record_slots_init(ctx.backends, ctx.cbdt.backend_num);
+	record_slots_init(ctx.blkdevs, ctx.cbdt.blkdev_num);
+
+	cbdctrl_catch_stop_signals();
+
+	start_ns = next_ns = cbd_now_ns();
+	rescan_ns = 0;
+	for (samples = 0; !cbdctrl_stopping; samples++) {
+		/* --deadline bounds each sample, not the whole run */
+		cbdsys_deadline_restart();
+
+		if (cbd_now_ns() >= rescan_ns) {
+			record_rescan(&ctx);
+			rescan_ns = cbd_now_ns() + RECORD_RESCAN_NS;
+		}
+		record_sample(&ctx);
+
+		if (options->co_count && samples + 1 >= options->co_count) {
+			samples++;
+			break;
+		}
+
+		next_ns += options->co_interval_us * 1000ULL;
+		cbd_sleep_until_ns(next_ns);
+	}
+
+	record_summary(&ctx, samples, start_ns);
+	ret = 0;
+free:
+	for (unsigned int i = 0; ctx.hosts && i < ctx.cbdt.host_num; i++)
+		record_slot_close(&ctx.hosts[i]);
+	for (unsigned int i = 0; ctx.backends && i < ctx.cbdt.backend_num; i++)
+		record_slot_close(&ctx.backends[i]);
+	for (unsigned int i = 0; ctx.blkdevs && i < ctx.cbdt.blkdev_num; i++)
+		record_slot_close(&ctx.blkdevs[i]);
+	free(ctx.hosts);
+	free(ctx.backends);
+	free(ctx.blkdevs);
+unmap:
+	munmap(ctx.ring.header, ctx.ring.map_len);
+	return ret;
+}
+
+static json_t *record_sample_to_json(const struct record_entry *sample, const struct record_entry *entries)
+{
+	json_t *json_sample = json_object();
+	json_t *json_hosts = json_array();
+	json_t *json_backends = json_array();
+	json_t *json_blkdevs = json_array();
+
+	json_object_set_new(json_sample, "seq", json_integer(sample->seq));
+	json_object_set_new(json_sample, "unix_ts", json_real(sample->u.sample.unix_ns / 1e9));
+	json_object_set_new(json_sample, "transport_id", json_integer(sample->u.sample.transport_id));
+	json_object_set_new(json_sample, "host_id", json_integer(sample->host_id));
+
+	for (uint32_t i = 0; i < sample->u.sample.nr_entries; i++) {
+		const struct record_entry *e = &entries[i];
+		json_t *json_entry = json_object();
+
+		switch (e->type) {
+		case RECORD_HOST:
+			json_object_set_new(json_entry, "host_id", json_integer(e->id));
+			json_object_set_new(json_entry, "alive", json_boolean(e->alive));
+			json_array_append_new(json_hosts, json_entry);
+			break;
+		case RECORD_BACKEND:
+			json_object_set_new(json_entry, "backend_id", json_integer(e->id));
+			json_object_set_new(json_entry, "host_id", json_integer(e->host_id));
+			json_object_set_new(json_entry, "alive", json_boolean(e->alive));
+			json_object_set_new(json_entry, "cache_segs", json_integer(e->u.backend.cache_segs));
+			json_object_set_new(json_entry, "cache_used_segs", json_integer(e->u.backend.cache_used_segs));
+			json_object_set_new(json_entry, "cache_gc_percent", json_integer(e->u.backend.cache_gc_percent));
+			json_array_append_new(json_backends, json_entry);
+			break;
+		case RECORD_BLKDEV:
+			json_object_set_new(json_entry, "blkdev_id", json_integer(e->id));
+			json_object_set_new(json_entry, "backend_id", json_integer(e->u.blkdev.backend_id));
+			json_object_set_new(json_entry, "host_id", json_integer(e->host_id));
+			json_object_set_new(json_entry, "mapped_id", json_integer(e->u.blkdev.mapped_id));
+			json_object_set_new(json_entry, "alive", json_boolean(e->alive));
+			if (e->host_id == sample->host_id) {
+				json_object_set_new(json_entry, "rd_ios", json_integer(e->u.blkdev.rd_ios));
+				json_object_set_new(json_entry, "wr_ios", json_integer(e->u.blkdev.wr_ios));
+				json_object_set_new(json_entry, "rd_sectors", json_integer(e->u.blkdev.rd_sectors));
+				json_object_set_new(json_entry, "wr_sectors", json_integer(e->u.blkdev.wr_sectors));
+				json_object_set_new(json_entry, "io_ticks", json_integer(e->u.blkdev.io_ticks));
+				json_object_set_new(json_entry, "inflight_r", json_integer(e->u.blkdev.inflight_rd));
+				json_object_set_new(json_entry, "inflight_w", json_integer(e->u.blkdev.inflight_wr));
+			}
+			json_array_append_new(json_blkdevs, json_entry);
+			break;
+		default:
+			json_decref(json_entry);
+			break;
+		}
+	}
+
+	json_object_set_new(json_sample, "hosts", json_hosts);
+	json_object_set_new(json_sample, "backends", json_backends);
+	json_object_set_new(json_sample, "blkdevs", json_blkdevs);
+	return json_sample;
+}
+
+int cbdctrl_record_dump(cbd_opt_t *options)
+{
+	struct record_ring ring;
+	struct record_entry *entries = NULL;
+	uint32_t entries_cap = 0;
+	uint64_t head, pos, nr;
+	unsigned long dumped = 0;
+	int ret;
+
+	if (!options->co_ring[0]) {
+		printf("--ring required for record-dump command\n");
+		return -EINVAL;
+	}
+
+	ret = record_ring_map(options->co_ring, 0, false, &ring);
+	if (ret < 0)
+		return ret;
+
+	nr = ring.header->nr_entries;
+	head = __atomic_load_n(&ring.header->head, __ATOMIC_ACQUIRE);
+	pos = head > nr ? head - nr : 0;
+
+	while (pos < head) {
+		struct record_entry sample = *record_entry_at(&ring, pos);
+		uint32_t n = sample.u.sample.nr_entries;
+		uint64_t now_head;
+		bool whole = true;
+		json_t *json_sample;
+		char *json_str;
+
+		if (sample.type != RECORD_SAMPLE || pos + 1 + n > head || n >= nr / 2) {
+			pos++;
+			continue;
+		}
+
+		if (n > entries_cap) {
+			struct record_entry *grown = realloc(entries, n * sizeof(*entries));
+
+			if (!grown) {
+				ret = -ENOMEM;
+				break;
+			}
+			entries = grown;
+			entries_cap = n;
+		}
+
+		for (uint32_t i = 0; i < n; i++) {
+			entries[i] = *record_entry_at(&ring, pos + 1 + i);
+			if (entries[i].seq != sample.seq)
+				whole = false;
+		}
+
+		/* A running record may be writing up to max_sample entries past its head */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		now_head = __atomic_load_n(&ring.header->head, __ATOMIC_ACQUIRE);
+		if (now_head + ring.header->max_sample > pos + nr)
+			whole = false;
+
+		pos += whole ? 1 + n : 1;
+		if (!whole ||
+		    (options->co_from_ns && sample.u.sample.unix_ns < options->co_from_ns) ||
+		    (options->co_to_ns && sample.u.sample.unix_ns > options->co_to_ns))
+			continue;
+
+		json_sample = record_sample_to_json(&sample, entries);
+		json_str = json_dumps(json_sample, JSON_COMPACT);
+		if (json_str != NULL) {
+			printf("%s\n", json_str);
+			free(json_str);
+		}
+		json_decref(json_sample);
+		dumped++;
+	}
+
+	free(entries);
+	if (!ret && !dumped)
+		fprintf(stderr, "No samples in range\n");
+	munmap(ring.header, ring.map_len);
+	return ret;
+}
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdmeta.h"
+#include "libcbdsys.h"
+
+/*
+ * Occupancy of the segment area, read from the segment infos at the start
+ * of every segment. The infos are bytes_per_segment apart, so the scan is a
+ * strided gather with the next infos prefetched; it only fills a bitmap of
+ * used segments and the per backend counts. Counts, free runs and the heat
+ * map are then computed on the bitmap a 64 bit word at a time.
+ */
+#define SEGMAP_PREFETCH		8		/* infos in flight ahead of the scan */
+#define SEGMAP_OWNER_NONE	UINT32_MAX
+
+struct segmap_backend {
+	uint32_t		cache_segs;
+	uint32_t		channel_segs;
+	uint32_t		extents;	/* runs of adjacent segments */
+};
+
+struct segmap {
+	uint32_t		num;
+	uint64_t		*used;		/* bitmap of used segments */
+	uint32_t		cache_segs;
+	uint32_t		channel_segs;
+
+	uint32_t		backend_num;
+	struct segmap_backend	*backends;
+	uint32_t		bad_owner;	/* owner beyond backend_num */
+
+	uint32_t		free_runs;
+	uint32_t		largest_free_run;
+};
+
+static void segmap_scan(struct segmap *map, const char *area, uint64_t stride)
+{
+	uint32_t prev_owner = SEGMAP_OWNER_NONE;
+
+	for (uint32_t s = 0; s < map->num; s++) {
+		const struct cbd_segment_info *si = (const void *)(area + s * stride);
+		struct segmap_backend *b;
+
+		if (s + SEGMAP_PREFETCH < map->num)
+			__builtin_prefetch(area + (s + SEGMAP_PREFETCH) * stride);
+
+		if (si->state == CBD_META_STATE_NONE) {
+			prev_owner = SEGMAP_OWNER_NONE;
+			continue;
+		}
+		map->used[s / 64] |= 1ULL << (s % 64);
+
+		if (si->type == CBD_SEG_TYPE_NONE) {
+			prev_owner = SEGMAP_OWNER_NONE;
+			continue;
+		}
+
+		if (si->type == CBD_SEG_TYPE_CACHE)
+			map->cache_segs++;
+		else
+			map->channel_segs++;
+
+		if (si->backend_id >= map->backend_num) {
+			map->bad_owner++;
+			prev_owner = SEGMAP_OWNER_NONE;
+			continue;
+		}
+
+		b = &map->backends[si->backend_id];
+		if (si->type == CBD_SEG_TYPE_CACHE)
+			b->cache_segs++;
+		else
+			b->channel_segs++;
+		if (prev_owner != si->backend_id)
+			b->extents++;
+		prev_owner = si->backend_id;
+	}
+}
+
+/* Bits of word @w that are segments, the last word may be partial */
+static uint64_t segmap_word_mask(const struct segmap *map, uint32_t w)
+{
+	uint32_t bits = map->num - w * 64;
+
+	return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* Used segments in [@start, @end) */
+static uint32_t segmap_count(const struct segmap *map, uint32_t start, uint32_t end)
+{
+	uint32_t count = 0;
+
+	while (start < end) {
+		uint32_t w = start / 64, bit = start % 64;
+		uint32_t n = end - start < 64 - bit ? end - start : 64 - bit;
+		uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
+
+		count += __builtin_popcountll(map->used[w] & mask);
+		start += n;
+	}
+
+	return count;
+}
+
+static void segmap_free_run_end(struct segmap *map, uint32_t run)
+{
+	if (!run)
+		return;
+
+	map->free_runs++;
+	if (run > map->largest_free_run)
+		map->largest_free_run = run;
+}
+
+/* Free runs from the free bits of each word, whole free words in one step */
+static void segmap_free_runs(struct segmap *map)
+{
+	uint32_t run = 0;
+
+	for (uint32_t w = 0; w * 64 < map->num; w++) {
+		uint64_t mask = segmap_word_mask(map, w);
+		uint64_t free = ~map->used[w] & mask;
+		uint32_t bits = __builtin_popcountll(mask);
+		uint32_t pos = 0;
+
+		if (free == ~0ULL) {
+			run += 64;
+			continue;
+		}
+
+		while (pos < bits) {
+			uint64_t rest = free >> pos;
+			uint32_t len;
+
+			if (rest & 1) {
+				len = __builtin_ctzll(~rest);
+				run += len;
+			} else {
+				segmap_free_run_end(map, run);
+				run = 0;
+				len = rest ? (uint32_t)__builtin_ctzll(rest) : bits - pos;
+			}
+			pos += len;
+		}
+	}
+	segmap_free_run_end(map, run);
+}
+
+/* One character per cell: '.' free, '#' full, 1-9 tenths in use */
+static json_t *segmap_heatmap(const struct segmap *map, unsigned int cells, json_t **json_cells)
+{
+	char heatmap[CBD_SEGMENTS_HEATMAP_CELLS + 1];
+
+	*json_cells = json_array();
+	for (unsigned int i = 0; i < cells; i++) {
+		uint32_t start = (uint64_t)map->num * i / cells;
+		uint32_t end = (uint64_t)map->num * (i + 1) / cells;
+		uint32_t used = segmap_count(map, start, end);
+		unsigned int tenths = used * 10 / (end - start);
+
+		if (!used)
+			heatmap[i] = '.';
+		else if (used == end - start)
+			heatmap[i] = '#';
+		else
+			heatmap[i] = '0' + (tenths ? tenths : 1);
+		json_array_append_new(*json_cells, json_integer(used * 100 / (end - start)));
+	}
+	heatmap[cells] = '\0';
+
+	return json_string(heatmap);
+}
+
+static json_t *segmap_backends_to_json(const struct segmap *map)
+{
+	json_t *json_backends = json_array();
+
+	for (uint32_t i = 0; i < map->backend_num; i++) {
+		const struct segmap_backend *b = &map->backends[i];
+		json_t *json_backend;
+
+		if (!b->cache_segs && !b->channel_segs)
+			continue;
+
+		json_backend = json_object();
+		json_object_set_new(json_backend, "backend_id", json_integer(i));
+		json_object_set_new(json_backend, "cache_segs", json_integer(b->cache_segs));
+		json_object_set_new(json_backend, "channel_segs", json_integer(b->channel_segs));
+		json_object_set_new(json_backend, "extents", json_integer(b->extents));
+		json_array_append_new(json_backends, json_backend);
+	}
+
+	return json_backends;
+}
+
+int cbdctrl_transport_segments(cbd_opt_t *options)
+{
+	struct cbd_transport_info ti;
+	struct segmap map = { 0 };
+	const char *path = options->co_image;
+	struct cbd_transport cbdt;
+	const char *base;
+	uint64_t size;
+	size_t map_len;
+	uint32_t used;
+	unsigned int cells;
+	json_t *json_out, *json_cells, *json_heatmap;
+	char err[CBD_PATH_LEN];
+	char *json_str;
+	int ret;
+
+	if (!strlen(path)) {
+		ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+		if (ret)
+			return ret;
+		path = cbdt.path;
+	}
+
+	ret = cbd_meta_map(path, &base, &size, &map_len);
+	if (ret)
+		return ret;
+
+	memcpy(&ti, base, sizeof(ti));
+	ret = cbd_meta_layout_check(&ti, strlen(options->co_image) ? NULL : &cbdt, err, sizeof(err));
+	if (ret) {
+		printf("'%s': %s, see tp-check\n", path, err);
+		goto out;
+	}
+
+	if ((ti.segment_num && ti.bytes_per_segment < sizeof(struct cbd_segment_info)) ||
+	    ti.segment_area_off + (uint64_t)ti.bytes_per_segment * ti.segment_num > size) {
+		printf("Segment area of '%s' is invalid, see tp-check\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	map.num = ti.segment_num;
+	map.backend_num = ti.backend_num;
+	map.used = calloc((map.num + 63) / 64 + 1, sizeof(*map.used));
+	map.backends = calloc(map.backend_num + 1, sizeof(*map.backends));
+	if (!map.used || !map.backends) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	segmap_scan(&map, base + ti.segment_area_off, ti.bytes_per_segment);
+	segmap_free_runs(&map);
+	used = segmap_count(&map, 0, map.num);
+
+	cells = map.num < CBD_SEGMENTS_HEATMAP_CELLS ? map.num : CBD_SEGMENTS_HEATMAP_CELLS;
+	json_heatmap = segmap_heatmap(&map, cells, &json_cells);
+
+	json_out = json_object();
+	if (strlen(options->co_image))
+		json_object_set_new(json_out, "image", json_string(path));
+	else
+		json_object_set_new(json_out, "transport_id", json_integer(options->co_transport_id));
+	json_object_set_new(json_out, "segment_num", json_integer(map.num));
+	json_object_set_new(json_out, "bytes_per_segment", json_integer(ti.bytes_per_segment));
+	json_object_set_new(json_out, "used", json_integer(used));
+	json_object_set_new(json_out, "free", json_integer(map.num - used));
+	json_object_set_new(json_out, "cache_segs", json_integer(map.cache_segs));
+	json_object_set_new(json_out, "channel_segs", json_integer(map.channel_segs));
+	json_object_set_new(json_out, "free_runs", json_integer(map.free_runs));
+	json_object_set_new(json_out, "largest_free_run", json_integer(map.largest_free_run));
+	/* Share of the free segments outside of the largest run, 0 is one contiguous run */
+	json_object_set_new(json_out, "fragmentation",
+			    json_real(map.num - used ? 1.0 - (double)map.largest_free_run / (map.num - used) : 0));
+	if (map.bad_owner)
+		json_object_set_new(json_out, "bad_owner_segs", json_integer(map.bad_owner));
+	json_object_set_new(json_out, "backends", segmap_backends_to_json(&map));
+	json_object_set_new(json_out, "heatmap_segs_per_cell",
+			    json_real(cells ? (double)map.num / cells : 0));
+	json_object_set_new(json_out, "heatmap", json_heatmap);
+	json_object_set_new(json_out, "heatmap_used_percent", json_cells);
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+out:
+	free(map.backends);
+	free(map.used);
+	munmap((void *)base, map_len);
+	return ret;
+}
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdcgroup.h"
+#include "libcbdsys.h"
+
+/* Usage histogram buckets, 10% each, a full cache falls into the last one */
+#define BACKEND_STAT_HIST_BUCKETS	10
+
+/* Weight of the newest sample in the smoothed fill rate */
+#define BACKEND_STAT_RATE_ALPHA		0.3
+
+struct backend_stat {
+	struct cbdsys_backend_sampler	sampler;
+	struct cbd_backend		backend;
+	bool				above_gc;
+	double				fill_rate;	/* segs per second, smoothed */
+	unsigned long			samples;
+	unsigned long			gc_crossings;
+	unsigned int			min_used;
+	unsigned int			max_used;
+	unsigned long			hist[BACKEND_STAT_HIST_BUCKETS];
+};
+
+static unsigned int backend_gc_threshold(struct cbd_backend *backend)
+{
+	return (unsigned int)((uint64_t)backend->cache_segs * backend->cache_gc_percent / 100);
+}
+
+static unsigned int backend_used_percent(struct cbd_backend *backend)
+{
+	if (!backend->cache_segs)
+		return 0;
+
+	return (unsigned int)((uint64_t)backend->cache_used_segs * 100 / backend->cache_segs);
+}
+
+/* Seconds until the cache is full at the current fill rate, negative if never */
+static double backend_time_to_full(struct backend_stat *stat)
+{
+	struct cbd_backend *backend = &stat->backend;
+
+	if (stat->fill_rate <= 0 || backend->cache_used_segs >= backend->cache_segs)
+		return backend->cache_used_segs >= backend->cache_segs ? 0 : -1;
+
+	return (backend->cache_segs - backend->cache_used_segs) / stat->fill_rate;
+}
+
+static void backend_stat_update(struct backend_stat *stat, unsigned int prev_used, double elapsed)
+{
+	struct cbd_backend *backend = &stat->backend;
+	unsigned int used = backend->cache_used_segs;
+	unsigned int bucket;
+	bool above_gc;
+
+	above_gc = (backend->cache_segs && used >= backend_gc_threshold(backend));
+
+	if (stat->samples) {
+		double rate = ((double)used - (double)prev_used) / elapsed;
+
+		if (stat->samples == 1)
+			stat->fill_rate = rate;
+		else
+			stat->fill_rate = BACKEND_STAT_RATE_ALPHA * rate +
+					  (1 - BACKEND_STAT_RATE_ALPHA) * stat->fill_rate;
+
+		if (above_gc && !stat->above_gc)
+			stat->gc_crossings++;
+	}
+	stat->above_gc = above_gc;
+
+	if (!stat->samples || used < stat->min_used)
+		stat->min_used = used;
+	if (used > stat->max_used)
+		stat->max_used = used;
+
+	bucket = backend_used_percent(backend) / (100 / BACKEND_STAT_HIST_BUCKETS);
+	if (bucket >= BACKEND_STAT_HIST_BUCKETS)
+		bucket = BACKEND_STAT_HIST_BUCKETS - 1;
+	stat->hist[bucket]++;
+
+	stat->samples++;
+}
+
+static void backend_stat_print(struct backend_stat *stat, double ts, bool ndjson)
+{
+	struct cbd_backend *backend = &stat->backend;
+	double ttf = backend_time_to_full(stat);
+
+	if (ndjson) {
+		json_t *json_stat = json_object();
+		char *json_str;
+
+		json_object_set_new(json_stat, "ts", json_real(ts));
+		json_object_set_new(json_stat, "backend_id", json_integer(backend->backend_id));
+		json_object_set_new(json_stat, "alive", json_boolean(backend->alive));
+		json_object_set_new(json_stat, "cache_segs", json_integer(backend->cache_segs));
+		json_object_set_new(json_stat, "cache_used_segs", json_integer(backend->cache_used_segs));
+		json_object_set_new(json_stat, "cache_gc_percent", json_integer(backend->cache_gc_percent));
+		json_object_set_new(json_stat, "fill_rate", json_real(stat->fill_rate));
+		json_object_set_new(json_stat, "time_to_full", ttf < 0 ? json_null() : json_real(ttf));
+		json_object_set_new(json_stat, "above_gc", json_boolean(stat->above_gc));
+		json_object_set_new(json_stat, "gc_crossings", json_integer(stat->gc_crossings));
+
+		json_str = json_dumps(json_stat, JSON_COMPACT);
+		if (json_str != NULL) {
+			printf("%s\n", json_str);
+			free(json_str);
+		}
+		json_decref(json_stat);
+		return;
+	}
+
+	printf("%10.3f backend %u %s used %u/%u (%u%%) rate %+.2f segs/s ttf ",
+		ts, backend->backend_id, backend->alive ? "alive" : "dead",
+		backend->cache_used_segs, backend->cache_segs, backend_used_percent(backend),
+		stat->fill_rate);
+	if (ttf < 0)
+		printf("-");
+	else
+		printf("%.1fs", ttf);
+	printf(" gc %u%%%s crossings %lu\n", backend->cache_gc_percent,
+		stat->above_gc ? "*" : "", stat->gc_crossings);
+}
+
+static void backend_stat_summary(struct backend_stat *stat, double elapsed, bool ndjson)
+{
+	double crossings_per_min = elapsed > 0 ? stat->gc_crossings * 60 / elapsed : 0;
+	unsigned int i;
+
+	if (ndjson) {
+		json_t *json_summary = json_object();
+		json_t *json_hist = json_array();
+		char *json_str;
+
+		for (i = 0; i < BACKEND_STAT_HIST_BUCKETS; i++)
+			json_array_append_new(json_hist, json_integer(stat->hist[i]));
+
+		json_object_set_new(json_summary, "summary", json_true());
+		json_object_set_new(json_summary, "backend_id", json_integer(stat->backend.backend_id));
+		json_object_set_new(json_summary, "samples", json_integer(stat->samples));
+		json_object_set_new(json_summary, "min_used_segs", json_integer(stat->min_used));
+		json_object_set_new(json_summary, "max_used_segs", json_integer(stat->max_used));
+		json_object_set_new(json_summary, "gc_crossings", json_integer(stat->gc_crossings));
+		json_object_set_new(json_summary, "gc_crossings_per_min", json_real(crossings_per_min));
+		json_object_set_new(json_summary, "used_percent_hist", json_hist);
+
+		json_str = json_dumps(json_summary, JSON_COMPACT);
+		if (json_str != NULL) {
+			printf("%s\n", json_str);
+			free(json_str);
+		}
+		json_decref(json_summary);
+		return;
+	}
+
+	printf("backend %u: %lu samples, used min %u max %u, gc crossings %lu (%.2f/min)\n",
+		stat->backend.backend_id, stat->samples, stat->min_used, stat->max_used,
+		stat->gc_crossings, crossings_per_min);
+	for (i = 0; i < BACKEND_STAT_HIST_BUCKETS; i++) {
+		unsigned int width = stat->samples ? (unsigned int)(stat->hist[i] * 50 / stat->samples) : 0;
+
+		printf("  %3u-%3u%% %8lu ", i * 10, i == BACKEND_STAT_HIST_BUCKETS - 1 ? 100 : i * 10 + 9,
+			stat->hist[i]);
+		while (width--)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+int cbdctrl_backend_stat(cbd_opt_t *options)
+{
+	struct cbd_transport cbdt;
+	struct backend_stat *stats;
+	unsigned int stat_num = 0;
+	uint64_t start_ns, last_ns, next_ns;
+	unsigned long round;
+	int ret;
+
+	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+	if (ret < 0) {
+		printf("transport for id %u not found.\n", options->co_transport_id);
+		return ret;
+	}
+
+	stats = calloc(cbdt.backend_num, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	/* Full scan only once, the loop below just re-reads the cache attributes */
+	for (unsigned int i = 0; i < cbdt.backend_num; i++) {
+		struct backend_stat *stat = &stats[stat_num];
+
+		if (options->co_backend_id != UINT_MAX && i != options->co_backend_id)
+			continue;
+
+		ret = cbdsys_backend_info_init(&cbdt, &stat->backend, i);
+		if (ret < 0)
+			continue;
+
+		if (options->co_backend_id == UINT_MAX && !options->co_all &&
+		    stat->backend.host_id != cbdt.host_id)
+			continue;
+
+		if (cbdsys_backend_sampler_open(&cbdt, &stat->sampler, i) < 0)
+			continue;
+
+		stat_num++;
+	}
+
+	if (!stat_num) {
+		if (options->co_backend_id != UINT_MAX)
+			printf("backend %u not found.\n", options->co_backend_id);
+		else
+			printf("No backend found.\n");
+		free(stats);
+		return -ENOENT;
+	}
+
+	cbdctrl_catch_stop_signals();
+
+	start_ns = last_ns = next_ns = cbd_now_ns();
+	for (round = 0; !cbdctrl_stopping; round++) {
+		uint64_t now_ns = cbd_now_ns();
+		double elapsed = (now_ns - last_ns) / 1e9;
+		double ts = (now_ns - start_ns) / 1e9;
+
+		/* --deadline bounds each sample, not the whole run */
+		cbdsys_deadline_restart();
+
+		for (unsigned int i = 0; i < stat_num; i++) {
+			struct backend_stat *stat = &stats[i];
+			unsigned int prev_used = stat->backend.cache_used_segs;
+
+			if (cbdsys_backend_sampler_read(&stat->sampler, &stat->backend) < 0)
+				continue;
+
+			backend_stat_update(stat, prev_used, elapsed);
+			backend_stat_print(stat, ts, options->co_ndjson);
+		}
+		fflush(stdout);
+		last_ns = now_ns;
+
+		if (options->co_count && round + 1 >= options->co_count)
+			break;
+
+		next_ns += options->co_interval_us * 1000ULL;
+		cbd_sleep_until_ns(next_ns);
+	}
+
+	for (unsigned int i = 0; i < stat_num; i++) {
+		backend_stat_summary(&stats[i], (last_ns - start_ns) / 1e9, options->co_ndjson);
+		cbdsys_backend_sampler_close(&stats[i].sampler);
+	}
+
+	free(stats);
+	return 0;
+}
+
+struct dev_stat {
+	struct cbd_blkdev		blkdev;
+	struct cbdsys_blkdev_sampler	sampler;
+	struct cbd_blkdev_iostat	iostat;
+	struct cbd_backend		*backend;	/* NULL if its cache is not readable */
+	json_t				*io_limits;	/* cgroups limiting it, read once */
+};
+
+struct dev_stat_result {
+	double	rd_iops;
+	double	wr_iops;
+	double	rd_bps;
+	double	wr_bps;
+	double	rd_await;	/* ms */
+	double	wr_await;	/* ms */
+	double	queue_depth;
+	double	util;		/* percent */
+};
+
+static double iostat_delta_ratio(uint64_t num, uint64_t den)
+{
+	return den ? (double)num / den : 0;
+}
+
+static void dev_stat_compute(struct cbd_blkdev_iostat *old, struct cbd_blkdev_iostat *new,
+			     double elapsed, struct dev_stat_result *res)
+{
+	double elapsed_ms = elapsed * 1000;
+
+	res->rd_iops = (new->rd_ios - old->rd_ios) / elapsed;
+	res->wr_iops = (new->wr_ios - old->wr_ios) / elapsed;
+	res->rd_bps = (new->rd_sectors - old->rd_sectors) * 512 / elapsed;
+	res->wr_bps = (new->wr_sectors - old->wr_sectors) * 512 / elapsed;
+	res->rd_await = iostat_delta_ratio(new->rd_ticks - old->rd_ticks, new->rd_ios - old->rd_ios);
+	res->wr_await = iostat_delta_ratio(new->wr_ticks - old->wr_ticks, new->wr_ios - old->wr_ios);
+	res->queue_depth = (new->time_in_queue - old->time_in_queue) / elapsed_ms;
+	res->util = (new->io_ticks - old->io_ticks) * 100 / elapsed_ms;
+	if (res->util > 100)
+		res->util = 100;
+}
+
+/* "# /dev/cbd0 io limits: tenant riops=1000 weight=200", above the table */
+static void dev_stat_print_limits(struct dev_stat *stat)
+{
+	json_t *json_limits, *json_value;
+	const char *key;
+	size_t i;
+
+	if (!json_array_size(stat->io_limits))
+		return;
+
+	printf("# %s io limits:", stat->blkdev.dev_name);
+	json_array_foreach(stat->io_limits, i, json_limits) {
+		printf("%s %s", i ? "," : "", json_string_value(json_object_get(json_limits, "cgroup")));
+		json_object_foreach(json_object_get(json_limits, "io_max"), key, json_value)
+			printf(" %s=%lld", key, (long long)json_integer_value(json_value));
+		json_value = json_object_get(json_limits, "io_weight");
+		if (json_value)
+			printf(" weight=%lld", (long long)json_integer_value(json_value));
+	}
+	printf("\n");
+}
+
+static void dev_stat_print(struct dev_stat *stat, struct dev_stat_result *res, double ts, bool ndjson)
+{
+	struct cbd_backend *backend = stat->backend;
+
+	if (ndjson) {
+		json_t *json_stat = json_object();
+		char *json_str;
+
+		json_object_set_new(json_stat, "ts", json_real(ts));
+		json_object_set_new(json_stat, "blkdev_id", json_integer(stat->blkdev.blkdev_id));
+		json_object_set_new(json_stat, "dev_name", json_string(stat->blkdev.dev_name));
+		json_object_set_new(json_stat, "backend_id", json_integer(stat->blkdev.backend_id));
+		json_object_set_new(json_stat, "r_iops", json_real(res->rd_iops));
+		json_object_set_new(json_stat, "w_iops", json_real(res->wr_iops));
+		json_object_set_new(json_stat, "r_bps", json_real(res->rd_bps));
+		json_object_set_new(json_stat, "w_bps", json_real(res->wr_bps));
+		json_object_set_new(json_stat, "r_await_ms", json_real(res->rd_await));
+		json_object_set_new(json_stat, "w_await_ms", json_real(res->wr_await));
+		json_object_set_new(json_stat, "queue_depth", json_real(res->queue_depth));
+		json_object_set_new(json_stat, "util", json_real(res->util));
+		json_object_set_new(json_stat, "inflight_r", json_integer(stat->iostat.inflight_rd));
+		json_object_set_new(json_stat, "inflight_w", json_integer(stat->iostat.inflight_wr));
+		if (backend) {
+			json_object_set_new(json_stat, "cache_segs", json_integer(backend->cache_segs));
+			json_object_set_new(json_stat, "cache_used_segs", json_integer(backend->cache_used_segs));
+		}
+		if (json_array_size(stat->io_limits))
+			json_object_set(json_stat, "io_limits", stat->io_limits);
+
+		json_str = json_dumps(json_stat, JSON_COMPACT);
+		if (json_str != NULL) {
+			printf("%s\n", json_str);
+			free(json_str);
+		}
+		json_decref(json_stat);
+		return;
+	}
+
+	printf("%10.3f %-10s %7u %9.1f %9.1f %9.2f %9.2f %7.2f %7.2f %6.2f %5.1f %3u/%-3u",
+		ts, stat->blkdev.dev_name, stat->blkdev.backend_id,
+		res->rd_iops, res->wr_iops, res->rd_bps / (1024 * 1024), res->wr_bps / (1024 * 1024),
+		res->rd_await, res->wr_await, res->queue_depth, res->util,
+		stat->iostat.inflight_rd, stat->iostat.inflight_wr);
+	if (backend)
+		printf(" %u/%u\n", backend->cache_used_segs, backend->cache_segs);
+	else
+		printf(" -\n");
+}
+
+static void dev_stat_limits_read(struct dev_stat *stats, unsigned int stat_num)
+{
+	unsigned int *mapped_ids = calloc(stat_num, sizeof(*mapped_ids));
+	json_t **json_cgroups = calloc(stat_num, sizeof(*json_cgroups));
+
+	if (mapped_ids && json_cgroups) {
+		for (unsigned int i = 0; i < stat_num; i++)
+			mapped_ids[i] = stats[i].blkdev.mapped_id;
+
+		if (cbd_cgroup_limits_scan(mapped_ids, stat_num, json_cgroups) == 0) {
+			for (unsigned int i = 0; i < stat_num; i++)
+				stats[i].io_limits = json_cgroups[i];
+		}
+	}
+
+	free(mapped_ids);
+	free(json_cgroups);
+}
+
+int cbdctrl_dev_stat(cbd_opt_t *options)
+{
+	struct cbd_transport cbdt;
+	struct dev_stat *stats;
+	struct backend_stat *backends;
+	unsigned int stat_num = 0, backend_num = 0;
+	uint64_t start_ns, last_ns, next_ns;
+	unsigned long round;
+	int ret;
+
+	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+	if (ret < 0) {
+		printf("transport for id %u not found.\n", options->co_transport_id);
+		return ret;
+	}
+
+	stats = calloc(cbdt.blkdev_num, sizeof(*stats));
+	backends = calloc(cbdt.blkdev_num, sizeof(*backends));
+	if (!stats || !backends) {
+		free(stats);
+		free(backends);
+		return -ENOMEM;
+	}
+
+	/* Only blkdevs on this host have a /sys/block entry to sample */
+	for (unsigned int i = 0; i < cbdt.blkdev_num; i++) {
+		struct dev_stat *stat = &stats[stat_num];
+		unsigned int j;
+
+		if (options->co_dev_id != UINT_MAX && i != options->co_dev_id)
+			continue;
+
+		ret = cbdsys_blkdev_init(&cbdt, &stat->blkdev, i);
+		if (ret < 0)
+			continue;
+
+		if (stat->blkdev.host_id != cbdt.host_id || !stat->blkdev.alive)
+			continue;
+
+		if (cbdsys_blkdev_sampler_open(&stat->blkdev, &stat->sampler) < 0)
+			continue;
+
+		if (cbdsys_blkdev_sampler_read(&stat->sampler, &stat->iostat) < 0) {
+			cbdsys_blkdev_sampler_close(&stat->sampler);
+			continue;
+		}
+
+		/* Blkdevs of the same backend share one cache sampler */
+		for (j = 0; j < backend_num; j++) {
+			if (backends[j].sampler.backend_id == stat->blkdev.backend_id)
+				break;
+		}
+
+		if (j == backend_num &&
+		    cbdsys_backend_sampler_open(&cbdt, &backends[j].sampler, stat->blkdev.backend_id) == 0)
+			backend_num++;
+
+		if (j < backend_num)
+			stat->backend = &backends[j].backend;
+
+		stat_num++;
+	}
+
+	if (!stat_num) {
+		if (options->co_dev_id != UINT_MAX)
+			printf("blkdev %u not found on this host.\n", options->co_dev_id);
+		else
+			printf("No blkdev found on this host.\n");
+		ret = -ENOENT;
+		goto out;
+	}
+
+	/* One walk of the cgroup tree for all of them, too slow to redo every interval */
+	dev_stat_limits_read(stats, stat_num);
+
+	cbdctrl_catch_stop_signals();
+
+	if (!options->co_ndjson) {
+		for (unsigned int i = 0; i < stat_num; i++)
+			dev_stat_print_limits(&stats[i]);
+		printf("%10s %-10s %7s %9s %9s %9s %9s %7s %7s %6s %5s %7s %s\n",
+			"time", "device", "backend", "r/s", "w/s", "rMB/s", "wMB/s",
+			"r_await", "w_await", "aqu-sz", "%util", "inflt", "cache");
+	}
+
+	start_ns = last_ns = next_ns = cbd_now_ns();
+	for (round = 0; !cbdctrl_stopping; round++) {
+		uint64_t now_ns;
+		double elapsed, ts;
+
+		if (options->co_count && round >= options->co_count)
+			break;
+
+		/* Counters are cumulative, the first line covers one interval */
+		next_ns += options->co_interval_us * 1000ULL;
+		cbd_sleep_until_ns(next_ns);
+		if (cbdctrl_stopping)
+			break;
+
+		now_ns = cbd_now_ns();
+		elapsed = (now_ns - last_ns) / 1e9;
+		ts = (now_ns - start_ns) / 1e9;
+		last_ns = now_ns;
+
+		/* --deadline bounds each sample, not the whole run */
+		cbdsys_deadline_restart();
+		for (unsigned int i = 0; i < backend_num; i++)
+			cbdsys_backend_sampler_read(&backends[i].sampler, &backends[i].backend);
+
+		for (unsigned int i = 0; i < stat_num; i++) {
+			struct dev_stat *stat = &stats[i];
+			struct cbd_blkdev_iostat iostat;
+			struct dev_stat_result res;
+
+			if (cbdsys_blkdev_sampler_read(&stat->sampler, &iostat) < 0)
+				continue;
+
+			dev_stat_compute(&stat->iostat, &iostat, elapsed, &res);
+			stat->iostat = iostat;
+			dev_stat_print(stat, &res, ts, options->co_ndjson);
+		}
+		fflush(stdout);
+	}
+	ret = 0;
+out:
+	for (unsigned int i = 0; i < stat_num; i++) {
+		cbdsys_blkdev_sampler_close(&stats[i].sampler);
+		json_decref(stats[i].io_limits);
+	}
+	for (unsigned int i = 0; i < backend_num; i++)
+		cbdsys_backend_sampler_close(&backends[i].sampler);
+	free(stats);
+	free(backends);
+	return ret;
+}
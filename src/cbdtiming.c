@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "cbdctrl.h"
+#include "cbdtiming.h"
+
+#define TIMING_POLL_US		1000
+#define TIMING_READ_SIZE	4096
+#define UEVENT_BUF_SIZE		8192
+#define UEVENT_GROUP_KERNEL	1
+
+static void timing_mark_at(struct cbd_timing *timing, const char *name, uint64_t ns)
+{
+	if (timing->nr_phases == CBD_TIMING_PHASES_MAX)
+		return;
+
+	timing->phases[timing->nr_phases].name = name;
+	timing->phases[timing->nr_phases].ns = ns > timing->start_ns ? ns - timing->start_ns : 0;
+	timing->nr_phases++;
+}
+
+/* "add@/devices/..\0ACTION=add\0DEVNAME=cbd0\0SUBSYSTEM=block\0.." */
+static void uevent_parse(struct cbd_timing *timing, const char *buf, size_t len, uint64_t ns)
+{
+	struct cbd_uevent ev = { .ns = ns };
+	bool block = false;
+
+	for (size_t off = 0; off < len; off += strlen(buf + off) + 1) {
+		const char *field = buf + off;
+
+		if (!strncmp(field, "ACTION=", 7))
+			snprintf(ev.action, sizeof(ev.action), "%s", field + 7);
+		else if (!strncmp(field, "DEVNAME=", 8))
+			snprintf(ev.devname, sizeof(ev.devname), "%s", field + 8);
+		else if (!strcmp(field, "SUBSYSTEM=block"))
+			block = true;
+	}
+
+	if (!block || !ev.action[0] || !ev.devname[0])
+		return;
+
+	pthread_mutex_lock(&timing->lock);
+	if (timing->nr_uevents < CBD_TIMING_UEVENTS_MAX)
+		timing->uevents[timing->nr_uevents++] = ev;
+	pthread_cond_broadcast(&timing->cond);
+	pthread_mutex_unlock(&timing->lock);
+}
+
+static void *uevent_listener_fn(void *arg)
+{
+	struct cbd_timing *timing = arg;
+	char buf[UEVENT_BUF_SIZE];
+
+	while (!timing->stop) {
+		struct pollfd pfd = { .fd = timing->uevent_fd, .events = POLLIN };
+		ssize_t len;
+
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+
+		len = recv(timing->uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len <= 0)
+			continue;
+
+		buf[len] = '\0';
+		uevent_parse(timing, buf, len, cbd_now_ns());
+	}
+
+	return NULL;
+}
+
+/*
+ * Set up @timing and start listening for uevents. Without a uevent socket,
+ * e.g. in a container, the uevent phase is skipped and the rest still works.
+ */
+int cbd_timing_init(struct cbd_timing *timing)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = UEVENT_GROUP_KERNEL,
+	};
+	pthread_condattr_t attr;
+
+	memset(timing, 0, sizeof(*timing));
+	timing->uevent_fd = -1;
+	pthread_mutex_init(&timing->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timing->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	timing->uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (timing->uevent_fd < 0)
+		return 0;
+
+	if (bind(timing->uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    pthread_create(&timing->listener, NULL, uevent_listener_fn, timing)) {
+		close(timing->uevent_fd);
+		timing->uevent_fd = -1;
+	}
+
+	return 0;
+}
+
+void cbd_timing_exit(struct cbd_timing *timing)
+{
+	if (!timing)
+		return;
+
+	if (timing->uevent_fd >= 0) {
+		timing->stop = true;
+		pthread_join(timing->listener, NULL);
+		close(timing->uevent_fd);
+		timing->uevent_fd = -1;
+	}
+
+	pthread_cond_destroy(&timing->cond);
+	pthread_mutex_destroy(&timing->lock);
+}
+
+/* Phases are relative to this, call it right before the admin write */
+void cbd_timing_begin(struct cbd_timing *timing)
+{
+	if (!timing)
+		return;
+
+	pthread_mutex_lock(&timing->lock);
+	timing->nr_phases = 0;
+	timing->nr_uevents = 0;
+	timing->start_ns = cbd_now_ns();
+	pthread_mutex_unlock(&timing->lock);
+}
+
+void cbd_timing_mark(struct cbd_timing *timing, const char *name)
+{
+	if (!timing)
+		return;
+
+	timing_mark_at(timing, name, cbd_now_ns());
+}
+
+/* Record when a block uevent @action for @dev_name ("/dev/cbdN") arrived */
+int cbd_timing_wait_uevent(struct cbd_timing *timing, const char *name, const char *action,
+			   const char *dev_name)
+{
+	const char *devname = strrchr(dev_name, '/') ? strrchr(dev_name, '/') + 1 : dev_name;
+	uint64_t deadline_ns;
+	struct timespec ts;
+	int ret = -ETIMEDOUT;
+
+	if (!timing)
+		return 0;
+
+	if (timing->uevent_fd < 0) {
+		fprintf(stderr, "timing: no uevent socket, %s skipped\n", name);
+		return -EOPNOTSUPP;
+	}
+
+	deadline_ns = cbd_now_ns() + CBD_TIMING_WAIT_MS * 1000000ULL;
+	ts.tv_sec = deadline_ns / 1000000000ULL;
+	ts.tv_nsec = deadline_ns % 1000000000ULL;
+
+	pthread_mutex_lock(&timing->lock);
+	for (unsigned int i = 0; ret; ) {
+		for (; i < timing->nr_uevents; i++) {
+			struct cbd_uevent *ev = &timing->uevents[i];
+
+			if (!strcmp(ev->action, action) && !strcmp(ev->devname, devname)) {
+				timing_mark_at(timing, name, ev->ns);
+				ret = 0;
+				break;
+			}
+		}
+
+		if (ret && pthread_cond_timedwait(&timing->cond, &timing->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&timing->lock);
+
+	if (ret)
+		fprintf(stderr, "timing: no %s uevent for %s within %dms\n", action, devname, CBD_TIMING_WAIT_MS);
+	return ret;
+}
+
+/* Record when @dev_name appears, or disappears if !@exists */
+int cbd_timing_wait_node(struct cbd_timing *timing, const char *name, const char *dev_name,
+			 bool exists)
+{
+	uint64_t deadline_ns;
+
+	if (!timing)
+		return 0;
+
+	deadline_ns = cbd_now_ns() + CBD_TIMING_WAIT_MS * 1000000ULL;
+	while ((access(dev_name, F_OK) == 0) != exists) {
+		if (cbd_now_ns() > deadline_ns) {
+			fprintf(stderr, "timing: %s not %s within %dms\n", dev_name,
+				exists ? "created" : "removed", CBD_TIMING_WAIT_MS);
+			return -ETIMEDOUT;
+		}
+		usleep(TIMING_POLL_US);
+	}
+
+	cbd_timing_mark(timing, name);
+	return 0;
+}
+
+/* Record when @dev_name first serves an O_DIRECT read */
+int cbd_timing_wait_read(struct cbd_timing *timing, const char *name, const char *dev_name)
+{
+	uint64_t deadline_ns;
+	void *buf;
+	int ret = -ETIMEDOUT;
+
+	if (!timing)
+		return 0;
+
+	if (posix_memalign(&buf, TIMING_READ_SIZE, TIMING_READ_SIZE))
+		return -ENOMEM;
+
+	deadline_ns = cbd_now_ns() + CBD_TIMING_WAIT_MS * 1000000ULL;
+	while (cbd_now_ns() < deadline_ns) {
+		int fd = open(dev_name, O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+		if (fd >= 0) {
+			ssize_t len = pread(fd, buf, TIMING_READ_SIZE, 0);
+
+			close(fd);
+			if (len == TIMING_READ_SIZE) {
+				cbd_timing_mark(timing, name);
+				ret = 0;
+				break;
+			}
+		}
+		usleep(TIMING_POLL_US);
+	}
+	free(buf);
+
+	if (ret)
+		fprintf(stderr, "timing: no successful read from %s within %dms\n", dev_name, CBD_TIMING_WAIT_MS);
+	return ret;
+}
+
+/* {"<phase>": ns, ...} in the order the phases were reached */
+json_t *cbd_timing_to_json(struct cbd_timing *timing)
+{
+	json_t *json_phases = json_object();
+
+	for (unsigned int i = 0; i < timing->nr_phases; i++)
+		json_object_set_new(json_phases, timing->phases[i].name,
+				    json_integer(timing->phases[i].ns));
+
+	return json_phases;
+}
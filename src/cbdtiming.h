@@ -0,0 +1,58 @@
+#ifndef CBDTIMING_H
+#define CBDTIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <jansson.h>
+
+/*
+ * Phase timestamps of a start or stop command, in ns since the admin write
+ * was issued. Kernel uevents are collected by a listener thread from before
+ * the write, so an event that arrives while the command is still busy with
+ * sysfs is timestamped when it arrives, not when it is looked for.
+ */
+#define CBD_TIMING_PHASES_MAX	8
+#define CBD_TIMING_UEVENTS_MAX	64
+#define CBD_TIMING_WAIT_MS	5000		/* give up on a phase after this */
+
+struct cbd_timing_phase {
+	const char		*name;
+	uint64_t		ns;
+};
+
+struct cbd_uevent {
+	uint64_t		ns;
+	char			action[16];
+	char			devname[32];
+};
+
+struct cbd_timing {
+	uint64_t		start_ns;
+	unsigned int		nr_phases;
+	struct cbd_timing_phase	phases[CBD_TIMING_PHASES_MAX];
+
+	int			uevent_fd;
+	pthread_t		listener;
+	volatile bool		stop;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		nr_uevents;
+	struct cbd_uevent	uevents[CBD_TIMING_UEVENTS_MAX];
+};
+
+/* All helpers but cbd_timing_init() accept a NULL timing and do nothing */
+int cbd_timing_init(struct cbd_timing *timing);
+void cbd_timing_exit(struct cbd_timing *timing);
+void cbd_timing_begin(struct cbd_timing *timing);
+void cbd_timing_mark(struct cbd_timing *timing, const char *name);
+
+int cbd_timing_wait_uevent(struct cbd_timing *timing, const char *name, const char *action,
+			   const char *dev_name);
+int cbd_timing_wait_node(struct cbd_timing *timing, const char *name, const char *dev_name,
+			 bool exists);
+int cbd_timing_wait_read(struct cbd_timing *timing, const char *name, const char *dev_name);
+
+json_t *cbd_timing_to_json(struct cbd_timing *timing);
+
+#endif // CBDTIMING_H
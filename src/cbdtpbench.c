@@ -0,0 +1,643 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <jansson.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+#include "cbdctrl.h"
+#include "cbdmeta.h"
+#include "libcbdsys.h"
+
+#define TPBENCH_LINE		64
+#define TPBENCH_MAP_ALIGN	(2 * 1024 * 1024)	/* device DAX wants 2M aligned mappings */
+#define TPBENCH_CHASE_LINES_MAX	(4 * 1024 * 1024)	/* 256M of lines in the chase ring */
+#define TPBENCH_PASSES		3
+#define TPBENCH_THREADS_MAX	8
+
+struct tpbench_region {
+	int		fd;
+	void		*map;
+	size_t		map_len;
+	char		*base;		/* start of the benchmarked range inside map */
+	size_t		size;
+	bool		dax;		/* mapped to the media, not through the page cache */
+	void		*saved;		/* original content, restored after the run */
+};
+
+struct tpbench_thread {
+	pthread_t		thread;
+	struct tpbench_ctx	*ctx;
+	char			*base;
+	size_t			size;
+	int			cpu;		/* -1 for no pinning */
+};
+
+enum tpbench_op {
+	TPBENCH_READ,
+	TPBENCH_WRITE,
+	TPBENCH_NT_WRITE,
+};
+
+struct tpbench_ctx {
+	struct tpbench_region	*region;
+	enum tpbench_op		op;
+	int			gate;		/* 0 wait, 1 go, -1 quit before the barrier */
+	pthread_barrier_t	barrier;
+	uint64_t		sink;
+};
+
+/*
+ * Write back and invalidate the cache lines of a range, so the next access
+ * goes to the device instead of the CPU caches.
+ */
+static void tpbench_flush(char *addr, size_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	for (size_t off = 0; off < len; off += TPBENCH_LINE)
+		_mm_clflush(addr + off);
+	_mm_mfence();
+#elif defined(__aarch64__)
+	for (size_t off = 0; off < len; off += TPBENCH_LINE)
+		asm volatile("dc civac, %0" : : "r" (addr + off) : "memory");
+	asm volatile("dsb sy" : : : "memory");
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+static uint64_t tpbench_read(const char *addr, size_t len)
+{
+	uint64_t sum = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__m128i acc = _mm_setzero_si128();
+
+	for (size_t off = 0; off < len; off += TPBENCH_LINE) {
+		const __m128i *p = (const __m128i *)(addr + off);
+
+		acc = _mm_xor_si128(acc, _mm_load_si128(p));
+		acc = _mm_xor_si128(acc, _mm_load_si128(p + 1));
+		acc = _mm_xor_si128(acc, _mm_load_si128(p + 2));
+		acc = _mm_xor_si128(acc, _mm_load_si128(p + 3));
+	}
+	sum = (uint64_t)_mm_cvtsi128_si64(acc);
+#else
+	for (size_t off = 0; off < len; off += sizeof(uint64_t))
+		sum ^= *(const volatile uint64_t *)(addr + off);
+#endif
+	return sum;
+}
+
+static void tpbench_write(char *addr, size_t len, bool nt)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__m128i val = _mm_set1_epi8((char)0x5a);
+
+	for (size_t off = 0; off < len; off += TPBENCH_LINE) {
+		__m128i *p = (__m128i *)(addr + off);
+
+		if (nt) {
+			_mm_stream_si128(p, val);
+			_mm_stream_si128(p + 1, val);
+			_mm_stream_si128(p + 2, val);
+			_mm_stream_si128(p + 3, val);
+		} else {
+			_mm_store_si128(p, val);
+			_mm_store_si128(p + 1, val);
+			_mm_store_si128(p + 2, val);
+			_mm_store_si128(p + 3, val);
+		}
+	}
+	_mm_sfence();
+#else
+	memset(addr, 0x5a, len);
+#endif
+	/* Regular stores only count once they reached the device */
+	if (!nt)
+		tpbench_flush(addr, len);
+}
+
+static void *tpbench_thread_fn(void *arg)
+{
+	struct tpbench_thread *t = arg;
+	struct tpbench_ctx *ctx = t->ctx;
+	uint64_t sum = 0;
+
+	if (t->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(t->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	/* Only enter the barrier once all threads exist to release it */
+	while (!__atomic_load_n(&ctx->gate, __ATOMIC_ACQUIRE))
+		sched_yield();
+	if (ctx->gate < 0)
+		return NULL;
+
+	pthread_barrier_wait(&ctx->barrier);
+
+	switch (ctx->op) {
+	case TPBENCH_READ:
+		sum = tpbench_read(t->base, t->size);
+		break;
+	case TPBENCH_WRITE:
+		tpbench_write(t->base, t->size, false);
+		break;
+	case TPBENCH_NT_WRITE:
+		tpbench_write(t->base, t->size, true);
+		break;
+	}
+
+	__atomic_fetch_xor(&ctx->sink, sum, __ATOMIC_RELAXED);
+	pthread_barrier_wait(&ctx->barrier);
+	return NULL;
+}
+
+/* Best bandwidth in bytes per second of @op over the region with @nr threads on @cpus */
+static int tpbench_bandwidth(struct tpbench_region *region, enum tpbench_op op,
+			     unsigned int nr, const int *cpus, double *best)
+{
+	struct tpbench_thread threads[TPBENCH_THREADS_MAX];
+	struct tpbench_ctx ctx = { .region = region, .op = op };
+	size_t slice = region->size / nr / TPBENCH_LINE * TPBENCH_LINE;
+	int ret = 0;
+
+	*best = 0;
+	if (!slice)
+		return 0;
+
+	for (unsigned int pass = 0; pass < TPBENCH_PASSES && !cbdctrl_stopping; pass++) {
+		unsigned int started = 0;
+		uint64_t start_ns;
+
+		tpbench_flush(region->base, slice * nr);
+		pthread_barrier_init(&ctx.barrier, NULL, nr + 1);
+		ctx.gate = 0;
+
+		for (; started < nr; started++) {
+			struct tpbench_thread *t = &threads[started];
+
+			t->ctx = &ctx;
+			t->base = region->base + slice * started;
+			t->size = slice;
+			t->cpu = cpus ? cpus[started] : -1;
+			ret = -pthread_create(&t->thread, NULL, tpbench_thread_fn, t);
+			if (ret)
+				break;
+		}
+
+		if (started != nr) {
+			/* The barrier can't be released, send the started ones home */
+			__atomic_store_n(&ctx.gate, -1, __ATOMIC_RELEASE);
+			for (unsigned int i = 0; i < started; i++)
+				pthread_join(threads[i].thread, NULL);
+			pthread_barrier_destroy(&ctx.barrier);
+			printf("Failed to start benchmark threads: %s\n", strerror(-ret));
+			return ret;
+		}
+		__atomic_store_n(&ctx.gate, 1, __ATOMIC_RELEASE);
+
+		/* Time from the release of all threads until the last one is done */
+		pthread_barrier_wait(&ctx.barrier);
+		start_ns = cbd_now_ns();
+		pthread_barrier_wait(&ctx.barrier);
+		double bw = (double)slice * nr / ((cbd_now_ns() - start_ns) / 1e9);
+
+		for (unsigned int i = 0; i < nr; i++)
+			pthread_join(threads[i].thread, NULL);
+		pthread_barrier_destroy(&ctx.barrier);
+
+		if (bw > *best)
+			*best = bw;
+	}
+
+	return 0;
+}
+
+/*
+ * Load latency by pointer chasing: every line of the region links to the
+ * next one of a random cyclic permutation, so each load depends on the
+ * previous one and hardware prefetchers can't guess the address. The region
+ * is flushed before every pass, a pass visits every line exactly once.
+ */
+static double tpbench_load_latency(struct tpbench_region *region)
+{
+	size_t lines = region->size / TPBENCH_LINE;
+	uint64_t *order;
+	uint64_t seed = cbd_now_ns() | 1;
+	double best = 0;
+
+	if (lines > TPBENCH_CHASE_LINES_MAX)
+		lines = TPBENCH_CHASE_LINES_MAX;
+	if (lines < 2)
+		return 0;
+
+	order = malloc(lines * sizeof(*order));
+	if (!order)
+		return 0;
+
+	for (size_t i = 0; i < lines; i++)
+		order[i] = i;
+	for (size_t i = lines - 1; i > 0; i--) {
+		size_t j;
+		uint64_t tmp;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (size_t i = 0; i < lines; i++)
+		*(char **)(region->base + order[i] * TPBENCH_LINE) =
+			region->base + order[(i + 1) % lines] * TPBENCH_LINE;
+	free(order);
+
+	for (unsigned int pass = 0; pass < TPBENCH_PASSES && !cbdctrl_stopping; pass++) {
+		char *volatile p = region->base;
+		uint64_t start_ns;
+		double lat;
+
+		tpbench_flush(region->base, lines * TPBENCH_LINE);
+
+		start_ns = cbd_now_ns();
+		for (size_t i = 0; i < lines; i++)
+			p = *(char **)p;
+		lat = (double)(cbd_now_ns() - start_ns) / lines;
+
+		if (!best || lat < best)
+			best = lat;
+	}
+
+	return best;
+}
+
+/* Latency of making a single line store durable: store, write back, fence */
+static double tpbench_store_latency(struct tpbench_region *region)
+{
+	size_t lines = region->size / TPBENCH_LINE;
+	size_t stride = 4099;	/* prime number of lines, defeats the prefetchers */
+	size_t count = lines < 65536 ? lines : 65536;
+	size_t line = 0;
+	uint64_t start_ns;
+
+	if (!count)
+		return 0;
+
+	tpbench_flush(region->base, region->size);
+
+	start_ns = cbd_now_ns();
+	for (size_t i = 0; i < count; i++) {
+		char *p = region->base + line * TPBENCH_LINE;
+
+		*(volatile uint64_t *)p = i;
+		tpbench_flush(p, TPBENCH_LINE);
+		line = (line + stride) % lines;
+	}
+
+	return (double)(cbd_now_ns() - start_ns) / count;
+}
+
+static void tpbench_region_close(struct tpbench_region *region)
+{
+	if (region->saved) {
+		memcpy(region->base, region->saved, region->size);
+		tpbench_flush(region->base, region->size);
+		free(region->saved);
+	}
+
+	if (region->map && region->map != MAP_FAILED)
+		munmap(region->map, region->map_len);
+
+	if (region->fd >= 0)
+		close(region->fd);
+}
+
+static int tpbench_region_open(struct tpbench_region *region, const char *path,
+			       uint64_t offset, uint64_t size, bool save)
+{
+	struct stat st;
+	uint64_t dev_size, map_off, delta;
+	size_t align = sysconf(_SC_PAGESIZE);
+	int ret;
+
+	memset(region, 0, sizeof(*region));
+	region->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (region->fd < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (fstat(region->fd, &st) < 0)
+		goto err_errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(region->fd, BLKGETSIZE64, &dev_size) < 0)
+			goto err_errno;
+	} else if (S_ISCHR(st.st_mode)) {
+		/* device DAX, trust the transport geometry */
+		align = TPBENCH_MAP_ALIGN;
+		dev_size = offset + size;
+		region->dax = true;
+	} else {
+		dev_size = st.st_size;
+	}
+
+	if (!size)
+		size = dev_size > offset ? dev_size - offset : 0;
+	size = size / TPBENCH_LINE * TPBENCH_LINE;
+	if (!size || offset + size > dev_size) {
+		printf("Range %lu+%lu is outside of '%s'\n", offset, size, path);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	map_off = offset / align * align;
+	delta = offset - map_off;
+	region->map_len = (delta + size + align - 1) / align * align;
+	region->map = mmap(NULL, region->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   region->fd, map_off);
+	if (region->map == MAP_FAILED)
+		goto err_errno;
+
+	region->base = (char *)region->map + delta;
+	region->size = size;
+
+	if (save) {
+		region->saved = malloc(size);
+		if (!region->saved) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		memcpy(region->saved, region->base, size);
+	}
+
+	return 0;
+err_errno:
+	ret = -errno;
+	printf("Failed to map '%s': %s\n", path, strerror(-ret));
+err:
+	tpbench_region_close(region);
+	return ret;
+}
+
+static json_t *tpbench_bandwidths(struct tpbench_region *region, unsigned int threads,
+				  const int *pin, int *ret)
+{
+	static const struct {
+		const char	*name;
+		enum tpbench_op	op;
+	} ops[] = {
+		{ "read",	TPBENCH_READ },
+		{ "write",	TPBENCH_WRITE },
+		{ "nt_write",	TPBENCH_NT_WRITE },
+	};
+	json_t *json_bw = json_object();
+	double bw;
+
+	for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		*ret = tpbench_bandwidth(region, ops[i].op, threads, pin, &bw);
+		if (*ret < 0)
+			break;
+		json_object_set_new(json_bw, ops[i].name, json_real(bw));
+	}
+
+	return json_bw;
+}
+
+/* Results of all measurements, or NULL with @ret set if one failed or a stop signal came */
+static json_t *tpbench_run(struct tpbench_region *region, unsigned int threads,
+			   const cpu_set_t *cpus, int *ret)
+{
+	int cpu_list[TPBENCH_THREADS_MAX];
+	const int *pin = NULL;
+	json_t *json_res = json_object();
+
+	*ret = 0;
+	if (cpus) {
+		unsigned int nr = 0;
+
+		for (int cpu = 0; cpu < CPU_SETSIZE && nr < threads; cpu++) {
+			if (CPU_ISSET(cpu, cpus))
+				cpu_list[nr++] = cpu;
+		}
+		threads = nr;
+		pin = cpu_list;
+
+		/* Latency is measured from the calling thread, move it too */
+		sched_setaffinity(0, sizeof(*cpus), cpus);
+	}
+
+	json_object_set_new(json_res, "load_latency_ns", json_real(tpbench_load_latency(region)));
+	json_object_set_new(json_res, "store_latency_ns", json_real(tpbench_store_latency(region)));
+	json_object_set_new(json_res, "bandwidth_1_thread", tpbench_bandwidths(region, 1, pin, ret));
+
+	if (!*ret && threads > 1) {
+		char key[32];
+
+		snprintf(key, sizeof(key), "bandwidth_%u_threads", threads);
+		json_object_set_new(json_res, key, tpbench_bandwidths(region, threads, pin, ret));
+	}
+
+	if (!*ret && cbdctrl_stopping)
+		*ret = -EINTR;
+	if (*ret) {
+		json_decref(json_res);
+		return NULL;
+	}
+
+	return json_res;
+}
+
+/*
+ * Only a device DAX transport maps straight to the media. Mapping a block
+ * device goes through the page cache, which the kernel's DAX accesses
+ * bypass: the run would measure DRAM, and writing back the page cache could
+ * overwrite what the kernel wrote meanwhile. The segment must also be free
+ * in its segment info.
+ */
+static int tpbench_segment_check(struct cbd_transport *cbdt, unsigned int segment)
+{
+	const struct cbd_segment_info *si;
+	struct cbd_transport_info ti;
+	char err[CBD_PATH_LEN];
+	const char *base;
+	struct stat st;
+	uint64_t size;
+	size_t map_len;
+	int ret;
+
+	if (stat(cbdt->path, &st) < 0 || !S_ISCHR(st.st_mode)) {
+		printf("--segment needs a device DAX transport, %s isn't one; "
+		       "use --path on a device which isn't a transport\n", cbdt->path);
+		return -EOPNOTSUPP;
+	}
+
+	ret = cbd_meta_map(cbdt->path, &base, &size, &map_len);
+	if (ret < 0)
+		return ret;
+
+	memcpy(&ti, base, sizeof(ti));
+	ret = cbd_meta_layout_check(&ti, cbdt, err, sizeof(err));
+	if (ret < 0) {
+		printf("transport %u: %s, can't tell whether segment %u is free\n",
+		       cbdt->transport_id, err, segment);
+		goto out;
+	}
+
+	si = (const void *)(base + ti.segment_area_off + (uint64_t)segment * ti.bytes_per_segment);
+	if (si->state != CBD_META_STATE_NONE) {
+		printf("segment %u of transport %u is in use\n", segment, cbdt->transport_id);
+		ret = -EBUSY;
+	}
+out:
+	munmap((void *)base, map_len);
+	return ret;
+}
+
+int cbdctrl_transport_bench(cbd_opt_t *options)
+{
+	struct tpbench_region region;
+	struct cbd_transport cbdt;
+	cpu_set_t orig_cpus;
+	char path[CBD_PATH_LEN];
+	uint64_t offset = 0, size = options->co_size;
+	unsigned int threads;
+	json_t *json_out, *json_res;
+	char *json_str;
+	bool save = false;
+	int ret;
+
+	if (strlen(options->co_path)) {
+		/* A test image or a device which isn't a registered transport */
+		snprintf(path, sizeof(path), "%s", options->co_path);
+		ret = cbdsys_transport_find_path(path);
+		if (ret >= 0) {
+			printf("%s is transport %d, use --segment for a free segment of it\n", path, ret);
+			return -EBUSY;
+		}
+		if (ret != -ENOENT) {
+			printf("Failed to check %s against the transports: %s\n", path, strerror(-ret));
+			return ret;
+		}
+	} else {
+		if (options->co_segment == UINT_MAX) {
+			printf("--path or --segment required for tp-bench command\n");
+			return -EINVAL;
+		}
+
+		ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+		if (ret < 0) {
+			printf("transport for id %u not found.\n", options->co_transport_id);
+			return ret;
+		}
+
+		if (options->co_segment >= cbdt.segment_num) {
+			printf("segment %u exceeds segment_num %u\n", options->co_segment, cbdt.segment_num);
+			return -EINVAL;
+		}
+
+		ret = tpbench_segment_check(&cbdt, options->co_segment);
+		if (ret < 0)
+			return ret;
+
+		/* The kernel may take the segment during the run, contents are saved and restored */
+		if (!options->co_force) {
+			printf("tp-bench writes segment %u of transport %u, use --force to confirm it is unused\n",
+				options->co_segment, options->co_transport_id);
+			return -EINVAL;
+		}
+
+		snprintf(path, sizeof(path), "%s", cbdt.path);
+		offset = cbdt.segment_area_off + (uint64_t)options->co_segment * cbdt.bytes_per_segment;
+		size = cbdt.bytes_per_segment;
+		save = true;
+	}
+
+	/* A stop signal ends the run between passes, the segment is restored all the same */
+	cbdctrl_catch_stop_signals();
+
+	ret = tpbench_region_open(&region, path, offset, size, save);
+	if (ret < 0)
+		return ret;
+
+	threads = options->co_jobs ? options->co_jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > TPBENCH_THREADS_MAX)
+		threads = TPBENCH_THREADS_MAX;
+
+	json_out = json_object();
+	json_object_set_new(json_out, "path", json_string(path));
+	json_object_set_new(json_out, "offset", json_integer(offset));
+	json_object_set_new(json_out, "size", json_integer(region.size));
+	json_object_set_new(json_out, "dax", json_boolean(region.dax));
+	json_res = tpbench_run(&region, threads, NULL, &ret);
+	if (!json_res)
+		goto out;
+	json_object_set_new(json_out, "all_cpus", json_res);
+
+	if (options->co_numa) {
+		json_t *json_nodes = json_array();
+		cpu_set_t nodes;
+
+		sched_getaffinity(0, sizeof(orig_cpus), &orig_cpus);
+		cbdsys_online_nodes(&nodes);
+
+		for (unsigned int node = 0; node < CPU_SETSIZE; node++) {
+			json_t *json_node;
+			cpu_set_t cpus;
+
+			if (!CPU_ISSET(node, &nodes))
+				continue;
+
+			/* Memory-only nodes, as CXL memory often is, have no CPUs to run on */
+			if (cbdsys_node_cpus(node, &cpus) < 0 || !CPU_COUNT(&cpus))
+				continue;
+
+			json_node = tpbench_run(&region, threads, &cpus, &ret);
+			if (!json_node)
+				break;
+			json_object_set_new(json_node, "node", json_integer(node));
+			json_array_append_new(json_nodes, json_node);
+		}
+
+		sched_setaffinity(0, sizeof(orig_cpus), &orig_cpus);
+		json_object_set_new(json_out, "numa", json_nodes);
+	}
+out:
+	tpbench_region_close(&region);
+	if (ret) {
+		if (ret == -EINTR)
+			printf("tp-bench interrupted%s\n", save ? ", segment restored" : "");
+		json_decref(json_out);
+		return ret;
+	}
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+
+	json_decref(json_out);
+	return 0;
+}
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <jansson.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "cbdctrl.h"
+#include "cbdmeta.h"
+
+#define TPCHECK_THREADS_MAX	64
+#define TPCHECK_ERRORS_MAX	64			/* errors listed in the report, all are counted */
+
+enum tpcheck_area_type {
+	TPCHECK_HOST,
+	TPCHECK_BACKEND,
+	TPCHECK_BLKDEV,
+	TPCHECK_SEGMENT,
+	TPCHECK_AREA_NR,
+};
+
+static const char *tpcheck_area_names[] = {
+	[TPCHECK_HOST]		= "host",
+	[TPCHECK_BACKEND]	= "backend",
+	[TPCHECK_BLKDEV]	= "blkdev",
+	[TPCHECK_SEGMENT]	= "segment",
+};
+
+struct tpcheck_area {
+	uint64_t		off;
+	uint64_t		stride;
+	uint32_t		num;
+	uint32_t		info_size;
+	uint64_t		used;
+	uint64_t		crc_errors;
+};
+
+struct tpcheck_ctx {
+	const char		*base;
+	uint64_t		size;
+	struct cbd_transport_info ti;
+	struct tpcheck_area	areas[TPCHECK_AREA_NR];
+	uint32_t		*seg_owner;	/* backend_id + 1 of the cache chain claiming a segment */
+	uint64_t		owned_segs;
+
+	pthread_mutex_t		lock;
+	json_t			*errors;
+	uint64_t		nr_errors;
+};
+
+struct tpcheck_thread {
+	pthread_t		thread;
+	struct tpcheck_ctx	*ctx;
+	uint64_t		start;		/* range of slots over all areas */
+	uint64_t		end;
+	uint64_t		used[TPCHECK_AREA_NR];
+	uint64_t		crc_errors[TPCHECK_AREA_NR];
+};
+
+/*
+ * CRC32C, Castagnoli polynomial, without pre and post inversion like the
+ * kernel's crc32c(). SSE4.2 or the ARMv8 CRC instructions when the CPU has
+ * them, a table otherwise.
+ */
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+static const char *crc32c_impl;
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t crc64 = crc;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		crc32c_table[i] = crc;
+	}
+
+	crc32c = crc32c_sw;
+	crc32c_impl = "software";
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c = crc32c_hw;
+		crc32c_impl = "sse4.2";
+	}
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c = crc32c_hw;
+		crc32c_impl = "armv8-crc";
+	}
+#endif
+}
+
+static void tpcheck_error(struct tpcheck_ctx *ctx, int area, int64_t index, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->nr_errors++ < TPCHECK_ERRORS_MAX) {
+		json_t *json_err = json_object();
+
+		json_object_set_new(json_err, "area", json_string(area < 0 ? "transport" : tpcheck_area_names[area]));
+		if (index >= 0)
+			json_object_set_new(json_err, "index", json_integer(index));
+		json_object_set_new(json_err, "error", json_string(msg));
+		json_array_append_new(ctx->errors, json_err);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static const void *tpcheck_slot(struct tpcheck_ctx *ctx, int area, uint32_t index)
+{
+	return ctx->base + ctx->areas[area].off + (uint64_t)index * ctx->areas[area].stride;
+}
+
+static uint8_t tpcheck_state(struct tpcheck_ctx *ctx, int area, uint32_t index)
+{
+	const void *slot = tpcheck_slot(ctx, area, index);
+
+	switch (area) {
+	case TPCHECK_HOST:
+		return ((const struct cbd_host_info *)slot)->state;
+	case TPCHECK_BACKEND:
+		return ((const struct cbd_backend_info *)slot)->state;
+	case TPCHECK_BLKDEV:
+		return ((const struct cbd_blkdev_info *)slot)->state;
+	default:
+		return ((const struct cbd_segment_info *)slot)->state;
+	}
+}
+
+/* Validate the transport info, the areas must lie inside the image and not overlap */
+static int tpcheck_header(struct tpcheck_ctx *ctx)
+{
+	static const uint32_t info_sizes[] = {
+		[TPCHECK_HOST]		= sizeof(struct cbd_host_info),
+		[TPCHECK_BACKEND]	= sizeof(struct cbd_backend_info),
+		[TPCHECK_BLKDEV]	= sizeof(struct cbd_blkdev_info),
+		[TPCHECK_SEGMENT]	= sizeof(struct cbd_segment_info),
+	};
+	struct cbd_transport_info *ti = &ctx->ti;
+	char err[CBD_PATH_LEN];
+	int ret;
+
+	/* A layout this tool doesn't know is refused, not decoded into errors */
+	ret = cbd_meta_layout_check(ti, NULL, err, sizeof(err));
+	if (ret) {
+		tpcheck_error(ctx, -1, -1, "%s", err);
+		return ret;
+	}
+
+	ctx->areas[TPCHECK_HOST] = (struct tpcheck_area) {
+		.off = ti->host_area_off, .stride = ti->bytes_per_host_info, .num = ti->host_num };
+	ctx->areas[TPCHECK_BACKEND] = (struct tpcheck_area) {
+		.off = ti->backend_area_off, .stride = ti->bytes_per_backend_info, .num = ti->backend_num };
+	ctx->areas[TPCHECK_BLKDEV] = (struct tpcheck_area) {
+		.off = ti->blkdev_area_off, .stride = ti->bytes_per_blkdev_info, .num = ti->blkdev_num };
+	ctx->areas[TPCHECK_SEGMENT] = (struct tpcheck_area) {
+		.off = ti->segment_area_off, .stride = ti->bytes_per_segment, .num = ti->segment_num };
+
+	for (int i = 0; i < TPCHECK_AREA_NR; i++) {
+		struct tpcheck_area *a = &ctx->areas[i];
+		uint64_t end = a->off + a->stride * a->num;
+
+		a->info_size = info_sizes[i];
+		if (a->num && a->stride < a->info_size) {
+			tpcheck_error(ctx, -1, -1, "%s entries of %lu bytes can't hold the %u byte info",
+				      tpcheck_area_names[i], a->stride, a->info_size);
+			ret = -EINVAL;
+		}
+
+		if (a->off < sizeof(*ti) || end > ctx->size) {
+			tpcheck_error(ctx, -1, -1, "%s area %lu-%lu is outside of the image (%lu bytes)",
+				      tpcheck_area_names[i], a->off, end, ctx->size);
+			ret = -EINVAL;
+		}
+
+		for (int j = 0; j < i; j++) {
+			struct tpcheck_area *b = &ctx->areas[j];
+
+			if (a->off < b->off + b->stride * b->num && b->off < end)
+				tpcheck_error(ctx, -1, -1, "%s area overlaps %s area",
+					      tpcheck_area_names[i], tpcheck_area_names[j]);
+		}
+	}
+
+	return ret;
+}
+
+/* Checksum every used info in the slot range of a thread */
+static void *tpcheck_thread_fn(void *arg)
+{
+	struct tpcheck_thread *th = arg;
+	struct tpcheck_ctx *ctx = th->ctx;
+	uint64_t slot = 0;
+
+	for (int area = 0; area < TPCHECK_AREA_NR && slot < th->end; slot += ctx->areas[area++].num) {
+		struct tpcheck_area *a = &ctx->areas[area];
+		uint64_t first = th->start > slot ? th->start - slot : 0;
+		uint64_t last = th->end < slot + a->num ? th->end - slot : a->num;
+
+		for (uint64_t i = first; i < last; i++) {
+			const struct cbd_meta_header *header = tpcheck_slot(ctx, area, i);
+			uint32_t crc;
+
+			if (tpcheck_state(ctx, area, i) == CBD_META_STATE_NONE)
+				continue;
+
+			th->used[area]++;
+			crc = crc32c(0, (const char *)header + sizeof(header->crc), a->info_size - sizeof(header->crc));
+			if (crc != header->crc) {
+				th->crc_errors[area]++;
+				tpcheck_error(ctx, area, i, "crc 0x%08x, expected 0x%08x", header->crc, crc);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static bool tpcheck_used(struct tpcheck_ctx *ctx, int area, uint32_t index)
+{
+	return index < ctx->areas[area].num && tpcheck_state(ctx, area, index) != CBD_META_STATE_NONE;
+}
+
+/*
+ * Follow the references between entries: hosts of backends and blkdevs,
+ * backends of blkdevs, and the cache segment chain of every backend. A
+ * segment claimed by two chains, or twice by one, is an overlap.
+ */
+static void tpcheck_references(struct tpcheck_ctx *ctx)
+{
+	for (uint32_t b = 0; b < ctx->ti.backend_num; b++) {
+		const struct cbd_backend_info *info = tpcheck_slot(ctx, TPCHECK_BACKEND, b);
+		uint32_t seg = info->cache_info.seg_id;
+
+		if (info->state == CBD_META_STATE_NONE)
+			continue;
+
+		if (!tpcheck_used(ctx, TPCHECK_HOST, info->host_id))
+			tpcheck_error(ctx, TPCHECK_BACKEND, b, "dangling host_id %u", info->host_id);
+
+		for (uint32_t n = 0; n < info->cache_info.n_segs; n++) {
+			const struct cbd_segment_info *si;
+
+			if (seg >= ctx->ti.segment_num) {
+				tpcheck_error(ctx, TPCHECK_BACKEND, b, "cache segment %u of %u is %u, beyond segment_num",
+					      n, info->cache_info.n_segs, seg);
+				break;
+			}
+
+			if (ctx->seg_owner[seg]) {
+				tpcheck_error(ctx, TPCHECK_SEGMENT, seg, "owned by backend %u and backend %u",
+					      ctx->seg_owner[seg] - 1, b);
+				break;
+			}
+			ctx->seg_owner[seg] = b + 1;
+			ctx->owned_segs++;
+
+			si = tpcheck_slot(ctx, TPCHECK_SEGMENT, seg);
+			if (si->type != CBD_SEG_TYPE_CACHE || si->backend_id != b)
+				tpcheck_error(ctx, TPCHECK_SEGMENT, seg,
+					      "in the cache chain of backend %u but type %u owner %u",
+					      b, si->type, si->backend_id);
+			seg = si->next_seg;
+		}
+	}
+
+	for (uint32_t d = 0; d < ctx->ti.blkdev_num; d++) {
+		const struct cbd_blkdev_info *info = tpcheck_slot(ctx, TPCHECK_BLKDEV, d);
+
+		if (info->state == CBD_META_STATE_NONE)
+			continue;
+
+		if (!tpcheck_used(ctx, TPCHECK_BACKEND, info->backend_id))
+			tpcheck_error(ctx, TPCHECK_BLKDEV, d, "dangling backend_id %u", info->backend_id);
+		if (!tpcheck_used(ctx, TPCHECK_HOST, info->host_id))
+			tpcheck_error(ctx, TPCHECK_BLKDEV, d, "dangling host_id %u", info->host_id);
+	}
+
+	for (uint32_t s = 0; s < ctx->ti.segment_num; s++) {
+		const struct cbd_segment_info *si = tpcheck_slot(ctx, TPCHECK_SEGMENT, s);
+
+		if (si->state == CBD_META_STATE_NONE)
+			continue;
+
+		if (si->type != CBD_SEG_TYPE_NONE && !tpcheck_used(ctx, TPCHECK_BACKEND, si->backend_id))
+			tpcheck_error(ctx, TPCHECK_SEGMENT, s, "dangling owner backend_id %u", si->backend_id);
+		else if (si->type == CBD_SEG_TYPE_CACHE && !ctx->seg_owner[s])
+			tpcheck_error(ctx, TPCHECK_SEGMENT, s, "cache segment of backend %u not in its chain",
+				      si->backend_id);
+	}
+}
+
+static json_t *tpcheck_areas_to_json(struct tpcheck_ctx *ctx)
+{
+	json_t *json_areas = json_object();
+
+	for (int i = 0; i < TPCHECK_AREA_NR; i++) {
+		struct tpcheck_area *a = &ctx->areas[i];
+		json_t *json_area = json_object();
+
+		json_object_set_new(json_area, "offset", json_integer(a->off));
+		json_object_set_new(json_area, "entries", json_integer(a->num));
+		json_object_set_new(json_area, "used", json_integer(a->used));
+		json_object_set_new(json_area, "crc_errors", json_integer(a->crc_errors));
+		if (i == TPCHECK_SEGMENT)
+			json_object_set_new(json_area, "cache_owned", json_integer(ctx->owned_segs));
+		json_object_set_new(json_areas, tpcheck_area_names[i], json_area);
+	}
+
+	return json_areas;
+}
+
+int cbdctrl_transport_check(cbd_opt_t *options)
+{
+	struct tpcheck_ctx ctx = { 0 };
+	struct tpcheck_thread *threads = NULL;
+	unsigned int nr_threads = 0;
+	uint64_t total = 0, start_ns;
+	size_t map_len;
+	char magic_str[19];
+	json_t *json_out;
+	char *json_str;
+	int ret;
+
+	if (!strlen(options->co_image)) {
+		printf("--image required for tp-check command\n");
+		return -EINVAL;
+	}
+
+	ret = cbd_meta_map(options->co_image, &ctx.base, &ctx.size, &map_len);
+	if (ret)
+		return ret;
+
+	crc32c_init();
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.errors = json_array();
+	memcpy(&ctx.ti, ctx.base, sizeof(ctx.ti));
+	start_ns = cbd_now_ns();
+
+	ret = tpcheck_header(&ctx);
+	if (ret)
+		goto report;
+
+	for (int i = 0; i < TPCHECK_AREA_NR; i++)
+		total += ctx.areas[i].num;
+
+	nr_threads = options->co_jobs ? options->co_jobs : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > TPCHECK_THREADS_MAX)
+		nr_threads = TPCHECK_THREADS_MAX;
+	if (nr_threads > total)
+		nr_threads = total ? total : 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	ctx.seg_owner = calloc(ctx.ti.segment_num ? ctx.ti.segment_num : 1, sizeof(*ctx.seg_owner));
+	if (!threads || !ctx.seg_owner) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		threads[i].ctx = &ctx;
+		threads[i].start = total * i / nr_threads;
+		threads[i].end = total * (i + 1) / nr_threads;
+		if (pthread_create(&threads[i].thread, NULL, tpcheck_thread_fn, &threads[i])) {
+			nr_threads = i;
+			ret = -EAGAIN;
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		for (int area = 0; area < TPCHECK_AREA_NR; area++) {
+			ctx.areas[area].used += threads[i].used[area];
+			ctx.areas[area].crc_errors += threads[i].crc_errors[area];
+		}
+	}
+	if (ret)
+		goto out;
+
+	tpcheck_references(&ctx);
+report:
+	snprintf(magic_str, sizeof(magic_str), "0x%016lx", ctx.ti.magic);
+
+	json_out = json_object();
+	json_object_set_new(json_out, "image", json_string(options->co_image));
+	json_object_set_new(json_out, "size", json_integer(ctx.size));
+	json_object_set_new(json_out, "magic", json_string(magic_str));
+	json_object_set_new(json_out, "version", json_integer(ctx.ti.version));
+	json_object_set_new(json_out, "layout_supported", json_boolean(ret != -EPROTONOSUPPORT));
+	json_object_set_new(json_out, "crc32c", json_string(crc32c_impl));
+	json_object_set_new(json_out, "threads", json_integer(nr_threads));
+	if (!ret)
+		json_object_set_new(json_out, "areas", tpcheck_areas_to_json(&ctx));
+	json_object_set_new(json_out, "elapsed_sec", json_real((cbd_now_ns() - start_ns) / 1e9));
+	json_object_set_new(json_out, "errors_total", json_integer(ctx.nr_errors));
+	json_object_set_new(json_out, "errors", ctx.errors);
+	json_object_set_new(json_out, "ok", json_boolean(!ctx.nr_errors));
+	ctx.errors = NULL;
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+
+	if (!ret && ctx.nr_errors)
+		ret = -EUCLEAN;
+out:
+	json_decref(ctx.errors);
+	free(ctx.seg_owner);
+	free(threads);
+	pthread_mutex_destroy(&ctx.lock);
+	munmap((void *)ctx.base, map_len);
+	return ret;
+}
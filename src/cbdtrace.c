@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cbdtrace.h"
+
+#define TRACE_SECTOR_SHIFT	9
+
+int cbd_trace_append(struct cbd_trace *trace, uint64_t ts_ns, uint64_t offset,
+		     uint64_t length, bool write)
+{
+	struct cbd_trace_io *io;
+	uint64_t first, last;
+
+	if (!length) {
+		trace->skipped++;
+		return 0;
+	}
+
+	if (trace->nr_ios == trace->cap) {
+		uint64_t cap = trace->cap ? trace->cap * 2 : 1 << 20;
+		struct cbd_trace_io *ios = realloc(trace->ios, cap * sizeof(*ios));
+
+		if (!ios)
+			return -ENOMEM;
+		trace->ios = ios;
+		trace->cap = cap;
+	}
+
+	first = offset >> CBD_TRACE_BLOCK_SHIFT;
+	last = (offset + length - 1) >> CBD_TRACE_BLOCK_SHIFT;
+
+	io = &trace->ios[trace->nr_ios++];
+	io->ts_ns = ts_ns;
+	io->block = first;
+	io->nr_blocks = (uint32_t)(last - first + 1);
+	io->write = write;
+
+	if (write)
+		trace->wr_bytes += length;
+	else
+		trace->rd_bytes += length;
+
+	return 0;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+static const char *skip_token(const char *p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\n')
+		p++;
+	return p;
+}
+
+static uint64_t parse_u64(const char *p, const char *end, const char **next)
+{
+	uint64_t val = 0;
+
+	while (p < end && isdigit((unsigned char)*p))
+		val = val * 10 + (uint64_t)(*p++ - '0');
+
+	*next = p;
+	return val;
+}
+
+/* "seconds.fraction" to nanoseconds */
+static uint64_t parse_seconds(const char *p, const char *end, const char **next)
+{
+	uint64_t ns = parse_u64(p, end, &p) * 1000000000ULL;
+	uint64_t scale = 100000000ULL;
+
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isdigit((unsigned char)*p)) {
+			ns += (uint64_t)(*p++ - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	*next = p;
+	return ns;
+}
+
+/*
+ * blkparse default output:
+ *   8,0    3        1     0.000000000   697  Q   R 223490 + 8 [kjournald]
+ * Only queue (Q) events are replayed, sectors are 512 bytes.
+ */
+static int parse_blkparse_line(struct cbd_trace *trace, const char *p, const char *end)
+{
+	const char *rwbs;
+	uint64_t ts_ns, sector, nr_sectors;
+	bool write;
+
+	p = skip_token(skip_space(p, end), end);		/* maj,min */
+	p = skip_token(skip_space(p, end), end);		/* cpu */
+	p = skip_token(skip_space(p, end), end);		/* sequence */
+	ts_ns = parse_seconds(skip_space(p, end), end, &p);
+	p = skip_token(skip_space(p, end), end);		/* pid */
+	p = skip_space(p, end);
+	if (end - p < 2 || p[0] != 'Q' || !isspace((unsigned char)p[1])) {
+		trace->skipped++;
+		return 0;
+	}
+
+	rwbs = skip_space(p + 1, end);
+	p = skip_token(rwbs, end);
+	if (memchr(rwbs, 'W', p - rwbs))
+		write = true;
+	else if (memchr(rwbs, 'R', p - rwbs))
+		write = false;
+	else {
+		/* flush, discard or a summary line */
+		trace->skipped++;
+		return 0;
+	}
+
+	sector = parse_u64(skip_space(p, end), end, &p);
+	p = skip_space(p, end);
+	if (p >= end || *p != '+') {
+		trace->skipped++;
+		return 0;
+	}
+	nr_sectors = parse_u64(skip_space(p + 1, end), end, &p);
+
+	return cbd_trace_append(trace, ts_ns, sector << TRACE_SECTOR_SHIFT,
+			    nr_sectors << TRACE_SECTOR_SHIFT, write);
+}
+
+/* CSV: seconds,R|W,offset_bytes,length_bytes */
+static int parse_csv_line(struct cbd_trace *trace, const char *p, const char *end)
+{
+	uint64_t ts_ns, offset, length;
+	bool write;
+
+	ts_ns = parse_seconds(skip_space(p, end), end, &p);
+	p = skip_space(p, end);
+	if (p >= end || *p++ != ',')
+		goto skip;
+
+	p = skip_space(p, end);
+	if (p >= end)
+		goto skip;
+	if (toupper((unsigned char)*p) == 'W')
+		write = true;
+	else if (toupper((unsigned char)*p) == 'R')
+		write = false;
+	else
+		goto skip;
+
+	while (p < end && *p != ',')
+		p++;
+	if (p++ >= end)
+		goto skip;
+	offset = parse_u64(skip_space(p, end), end, &p);
+
+	p = skip_space(p, end);
+	if (p >= end || *p++ != ',')
+		goto skip;
+	length = parse_u64(skip_space(p, end), end, &p);
+
+	return cbd_trace_append(trace, ts_ns, offset, length, write);
+skip:
+	trace->skipped++;
+	return 0;
+}
+
+/*
+ * The format is decided by the first data line: CSV has the op letter after
+ * the first comma, blkparse starts with the "maj,min" device number.
+ */
+static bool line_is_csv(const char *p, const char *end)
+{
+	p = skip_space(p, end);
+	while (p < end && (isdigit((unsigned char)*p) || *p == '.'))
+		p++;
+	p = skip_space(p, end);
+	if (p >= end || *p != ',')
+		return false;
+
+	p = skip_space(p + 1, end);
+	return p < end && isalpha((unsigned char)*p);
+}
+
+int cbd_trace_load(const char *path, struct cbd_trace *trace)
+{
+	const char *data, *p, *end;
+	struct stat st;
+	int fd, ret = 0;
+	int csv = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		printf("failed to open %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		printf("%s is empty\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		ret = -errno;
+		printf("failed to map %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+	end = data + st.st_size;
+	for (p = data; p < end && !ret; ) {
+		const char *eol = memchr(p, '\n', end - p);
+		const char *first;
+
+		if (!eol)
+			eol = end;
+
+		first = skip_space(p, eol);
+		if (first < eol && *first != '#' && isdigit((unsigned char)*first)) {
+			if (csv < 0)
+				csv = line_is_csv(first, eol);
+			ret = csv ? parse_csv_line(trace, first, eol) : parse_blkparse_line(trace, first, eol);
+		}
+		p = eol + 1;
+	}
+
+	munmap((void *)data, st.st_size);
+	return ret;
+}
+
+void cbd_trace_free(struct cbd_trace *trace)
+{
+	free(trace->ios);
+	memset(trace, 0, sizeof(*trace));
+}
@@ -0,0 +1,48 @@
+#ifndef CBDTRACE_H
+#define CBDTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Block I/O trace loaded into memory, shared by cache-sim and cache-profile.
+ * Requests are kept in 4K blocks, the granularity the cache is modeled at.
+ */
+#define CBD_TRACE_BLOCK_SHIFT	12
+
+struct cbd_trace_io {
+	uint64_t		ts_ns;
+	uint64_t		block;
+	uint32_t		nr_blocks;
+	uint32_t		write;
+};
+
+struct cbd_trace {
+	struct cbd_trace_io	*ios;
+	uint64_t		nr_ios;
+	uint64_t		cap;
+	uint64_t		rd_bytes;
+	uint64_t		wr_bytes;
+	uint64_t		skipped;	/* lines which are not a queued read or write */
+};
+
+int cbd_trace_append(struct cbd_trace *trace, uint64_t ts_ns, uint64_t offset,
+		     uint64_t length, bool write);
+int cbd_trace_load(const char *path, struct cbd_trace *trace);
+void cbd_trace_free(struct cbd_trace *trace);
+
+/*
+ * Access profile written by cache-profile and replayed by cache-warm: one
+ * "offset length heat" line per region, hottest first.
+ */
+#define CBD_PROFILE_HEADER	"# cbd cache profile v1"
+
+struct cbd_profile_range {
+	uint64_t		offset;
+	uint64_t		length;
+	uint64_t		heat;		/* 4K blocks accessed in the range */
+};
+
+int cbd_profile_load(const char *path, struct cbd_profile_range **ranges, uint64_t *nr_ranges);
+
+#endif // CBDTRACE_H
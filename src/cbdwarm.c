@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <liburing.h>
+#include <jansson.h>
+
+#include "cbdctrl.h"
+#include "cbdtrace.h"
+#include "libcbdsys.h"
+
+#define WARM_BUF_ALIGN		4096
+
+struct warm_io {
+	void			*buf;
+	uint32_t		len;
+};
+
+struct warm_ctx {
+	int			fd;
+	struct io_uring		ring;
+	bool			ring_ready;
+	unsigned int		stuck;		/* reads not reaped, their buffers can't be freed */
+	struct warm_io		*ios;
+	struct warm_io		**free_ios;
+	unsigned int		nr_free;
+	unsigned int		iodepth;
+	uint64_t		rate;		/* bytes per second, 0 for unlimited */
+	uint64_t		budget;		/* stop after warming this many bytes */
+	uint64_t		dev_size;
+	uint64_t		submitted;
+	uint64_t		completed;
+	uint64_t		errors;
+};
+
+static int warm_open(const char *path, uint64_t *size)
+{
+	struct stat st;
+	int fd, ret;
+
+	/* O_DIRECT, the data must land in the cbd cache, not in the page cache */
+	fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		printf("Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0 || ioctl(fd, BLKGETSIZE64, size) < 0) {
+		ret = -errno;
+		printf("Failed to get size of '%s': %s\n", path, strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+static void warm_cleanup(struct warm_ctx *ctx)
+{
+	if (ctx->ring_ready)
+		io_uring_queue_exit(&ctx->ring);
+
+	/* Better leaked than reused under a read that might still complete */
+	if (ctx->ios) {
+		for (unsigned int i = 0; !ctx->stuck && i < ctx->iodepth; i++)
+			free(ctx->ios[i].buf);
+		free(ctx->ios);
+	}
+	free(ctx->free_ios);
+
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+}
+
+static int warm_setup(struct warm_ctx *ctx, const char *path)
+{
+	int ret;
+
+	ctx->fd = warm_open(path, &ctx->dev_size);
+	if (ctx->fd < 0)
+		return ctx->fd;
+
+	ret = io_uring_queue_init(ctx->iodepth, &ctx->ring, 0);
+	if (ret < 0) {
+		printf("Failed to set up io_uring: %s\n", strerror(-ret));
+		return ret;
+	}
+	ctx->ring_ready = true;
+
+	ctx->ios = calloc(ctx->iodepth, sizeof(*ctx->ios));
+	ctx->free_ios = calloc(ctx->iodepth, sizeof(*ctx->free_ios));
+	if (!ctx->ios || !ctx->free_ios)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < ctx->iodepth; i++) {
+		if (posix_memalign(&ctx->ios[i].buf, WARM_BUF_ALIGN, CBD_CACHE_WARM_IO_SIZE))
+			return -ENOMEM;
+		ctx->free_ios[ctx->nr_free++] = &ctx->ios[i];
+	}
+
+	return 0;
+}
+
+static void warm_reap(struct warm_ctx *ctx)
+{
+	struct io_uring_cqe *cqe;
+
+	while (io_uring_peek_cqe(&ctx->ring, &cqe) == 0) {
+		struct warm_io *io = io_uring_cqe_get_data(cqe);
+
+		if (cqe->res != (int)io->len)
+			ctx->errors++;
+		else
+			ctx->completed += io->len;
+		io_uring_cqe_seen(&ctx->ring, cqe);
+		ctx->free_ios[ctx->nr_free++] = io;
+	}
+}
+
+/* The kernel may still DMA into the buffers of submitted reads, reap them first */
+static void warm_drain(struct warm_ctx *ctx)
+{
+	unsigned int inflight = ctx->iodepth - ctx->nr_free - io_uring_sq_ready(&ctx->ring);
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while (inflight) {
+		ret = io_uring_wait_cqe(&ctx->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		io_uring_cqe_seen(&ctx->ring, cqe);
+		inflight--;
+	}
+	ctx->stuck = inflight;
+}
+
+/* Wait for a completion, but not past @until_ns so the rate limiter can move on */
+static int warm_wait(struct warm_ctx *ctx, uint64_t until_ns)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	if (ctx->nr_free == ctx->iodepth) {
+		cbd_sleep_until_ns(until_ns);
+		return 0;
+	}
+
+	if (until_ns) {
+		struct __kernel_timespec ts;
+		uint64_t now = cbd_now_ns();
+		uint64_t wait = until_ns > now ? until_ns - now : 0;
+
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		ret = io_uring_submit_and_wait_timeout(&ctx->ring, &cqe, 1, &ts, NULL);
+	} else {
+		ret = io_uring_submit_and_wait(&ctx->ring, 1);
+	}
+
+	if (ret < 0 && ret != -ETIME && ret != -EINTR)
+		return ret;
+
+	warm_reap(ctx);
+	return 0;
+}
+
+static int warm_ranges(struct warm_ctx *ctx, struct cbd_profile_range *ranges, uint64_t nr_ranges,
+		       uint64_t *nr_warmed)
+{
+	uint64_t start_ns = cbd_now_ns();
+	uint64_t i;
+	int ret = 0;
+
+	for (i = 0; i < nr_ranges && !cbdctrl_stopping; i++) {
+		/* O_DIRECT needs aligned I/O, widen the range to 4K */
+		uint64_t off = ranges[i].offset & ~(uint64_t)(WARM_BUF_ALIGN - 1);
+		uint64_t end = (ranges[i].offset + ranges[i].length + WARM_BUF_ALIGN - 1) &
+			       ~(uint64_t)(WARM_BUF_ALIGN - 1);
+
+		if (end > ctx->dev_size)
+			end = ctx->dev_size;
+
+		while (off < end && !cbdctrl_stopping) {
+			struct io_uring_sqe *sqe;
+			struct warm_io *io;
+			uint32_t len;
+
+			if (ctx->budget && ctx->submitted >= ctx->budget)
+				goto out;
+
+			len = end - off < CBD_CACHE_WARM_IO_SIZE ? end - off : CBD_CACHE_WARM_IO_SIZE;
+			if (ctx->rate) {
+				uint64_t due = start_ns + (ctx->submitted * 1000000000ULL) / ctx->rate;
+
+				if (due > cbd_now_ns()) {
+					ret = warm_wait(ctx, due);
+					if (ret)
+						goto out;
+					continue;
+				}
+			}
+
+			if (!ctx->nr_free) {
+				ret = warm_wait(ctx, 0);
+				if (ret)
+					goto out;
+				continue;
+			}
+
+			sqe = io_uring_get_sqe(&ctx->ring);
+			if (!sqe) {
+				io_uring_submit(&ctx->ring);
+				continue;
+			}
+
+			io = ctx->free_ios[--ctx->nr_free];
+			io->len = len;
+			io_uring_prep_read(sqe, ctx->fd, io->buf, len, off);
+			io_uring_sqe_set_data(sqe, io);
+
+			/* keep the queue full, submit once per batch of iodepth */
+			if (!ctx->nr_free)
+				io_uring_submit(&ctx->ring);
+
+			ctx->submitted += len;
+			off += len;
+		}
+	}
+out:
+	*nr_warmed = i;
+	while (!ret && ctx->nr_free < ctx->iodepth)
+		ret = warm_wait(ctx, 0);
+	if (ret)
+		warm_drain(ctx);
+
+	return ret;
+}
+
+int cbdctrl_cache_warm(cbd_opt_t *options)
+{
+	struct warm_ctx ctx = { .fd = -1 };
+	struct cbd_transport cbdt;
+	struct cbd_blkdev blkdev;
+	struct cbd_backend backend;
+	struct cbd_profile_range *ranges = NULL;
+	uint64_t nr_ranges = 0, nr_warmed = 0, cache_bytes;
+	uint64_t start_ns, elapsed_ns;
+	json_t *json_out;
+	char *json_str;
+	int ret;
+
+	if (options->co_dev_id == UINT_MAX || !strlen(options->co_profile)) {
+		printf("--dev and --profile required for cache-warm command\n");
+		return -EINVAL;
+	}
+
+	if (!options->co_iodepth) {
+		printf("iodepth must be greater than 0\n");
+		return -EINVAL;
+	}
+
+	ret = cbdsys_transport_init(&cbdt, options->co_transport_id);
+	if (ret < 0) {
+		printf("transport for id %u not found.\n", options->co_transport_id);
+		return ret;
+	}
+
+	ret = cbdsys_blkdev_init(&cbdt, &blkdev, options->co_dev_id);
+	if (ret < 0 || !blkdev.alive || blkdev.host_id != cbdt.host_id) {
+		printf("blkdev %u is not alive on this host.\n", options->co_dev_id);
+		return -ENOENT;
+	}
+
+	ret = cbdsys_backend_info_init(&cbdt, &backend, blkdev.backend_id);
+	if (ret < 0) {
+		printf("backend %u not found.\n", blkdev.backend_id);
+		return ret;
+	}
+
+	/*
+	 * Warming past the GC threshold only makes GC evict what was just
+	 * warmed, so the default budget stops right below it.
+	 */
+	cache_bytes = (uint64_t)backend.cache_segs * cbdt.bytes_per_segment;
+	ctx.budget = options->co_size ? options->co_size : cache_bytes * backend.cache_gc_percent / 100;
+	if (!ctx.budget) {
+		printf("backend %u has no cache to warm.\n", blkdev.backend_id);
+		return -EINVAL;
+	}
+
+	ret = cbd_profile_load(options->co_profile, &ranges, &nr_ranges);
+	if (ret)
+		return ret;
+
+	ctx.iodepth = options->co_iodepth;
+	ctx.rate = options->co_rate;
+	ret = warm_setup(&ctx, blkdev.dev_name);
+	if (ret)
+		goto out;
+
+	/* Ctrl-C stops warming early and still reports the progress */
+	cbdctrl_catch_stop_signals();
+
+	start_ns = cbd_now_ns();
+	ret = warm_ranges(&ctx, ranges, nr_ranges, &nr_warmed);
+	elapsed_ns = cbd_now_ns() - start_ns;
+	if (ret) {
+		printf("cache-warm failed: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	json_out = json_object();
+	json_object_set_new(json_out, "dev", json_string(blkdev.dev_name));
+	json_object_set_new(json_out, "profile", json_string(options->co_profile));
+	json_object_set_new(json_out, "ranges", json_integer(nr_ranges));
+	json_object_set_new(json_out, "ranges_warmed", json_integer(nr_warmed));
+	json_object_set_new(json_out, "budget_bytes", json_integer(ctx.budget));
+	json_object_set_new(json_out, "warmed_bytes", json_integer(ctx.completed));
+	json_object_set_new(json_out, "errors", json_integer(ctx.errors));
+	json_object_set_new(json_out, "elapsed_sec", json_real(elapsed_ns / 1e9));
+	json_object_set_new(json_out, "mb_per_sec",
+		json_real(elapsed_ns ? ctx.completed / (elapsed_ns / 1e9) / (1 << 20) : 0));
+
+	json_str = json_dumps(json_out, JSON_INDENT(4));
+	if (json_str != NULL) {
+		printf("%s\n", json_str);
+		free(json_str);
+	}
+	json_decref(json_out);
+out:
+	warm_cleanup(&ctx);
+	free(ranges);
+	return ret;
+}
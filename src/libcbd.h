@@ -34,11 +34,27 @@ struct cbd_blkdev {
 	unsigned int blkdev_id;
 	unsigned int host_id;
 	unsigned int backend_id;
+	unsigned int mapped_id;
 	char dev_name[CBD_NAME_LEN];
 	bool alive;
 };
 
-#define CBDB_BLKDEV_COUNT_MAX   1
+/* Counters of /sys/block/cbdN/stat, see Documentation/block/stat.rst */
+struct cbd_blkdev_iostat {
+	uint64_t rd_ios;
+	uint64_t rd_merges;
+	uint64_t rd_sectors;
+	uint64_t rd_ticks;		/* ms */
+	uint64_t wr_ios;
+	uint64_t wr_merges;
+	uint64_t wr_sectors;
+	uint64_t wr_ticks;		/* ms */
+	uint64_t in_flight;
+	uint64_t io_ticks;		/* ms */
+	uint64_t time_in_queue;		/* ms */
+	unsigned int inflight_rd;
+	unsigned int inflight_wr;
+};
 
 struct cbd_backend {
 	unsigned int backend_id;
@@ -49,7 +65,20 @@ struct cbd_backend {
 	unsigned int cache_gc_percent;
 	unsigned int cache_used_segs;
 	unsigned int dev_num;
-	struct cbd_blkdev blkdevs[CBDB_BLKDEV_COUNT_MAX];
+	struct cbd_blkdev *blkdevs;	/* dev_num entries in the pool of a cbd_snapshot */
+};
+
+/*
+ * Blkdevs of a transport read in one pass. The pool is sorted by backend_id,
+ * so the blkdevs of a backend are a contiguous slice which cbd_backend
+ * points into instead of holding copies. Backends are only valid as long as
+ * the snapshot they were initialized from.
+ */
+struct cbd_snapshot {
+	struct cbd_blkdev *blkdevs;
+	unsigned int blkdev_cnt;
+	unsigned int stale_cnt;		/* blkdevs whose attributes timed out */
+	unsigned int *stale_backends;	/* their backend_id, UINT_MAX if that timed out too */
 };
 
 #endif // CBD_H
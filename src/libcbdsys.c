@@ -6,11 +6,308 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <sys/file.h>
 #include <sysfs/libsysfs.h>
 
 #include "cbdctrl.h"
 #include "libcbdsys.h"
 
+/*
+ * Bounded attribute reads. With a deadline set, reads are handed to a worker
+ * thread and waited for at most the per-attribute timeout, and never past
+ * the total deadline. A read stuck in the kernel can't be interrupted, so
+ * the worker is abandoned to finish it on its own and the next read starts
+ * a fresh one.
+ */
+struct attr_worker {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	bool		pending;
+	bool		done;
+	bool		abandoned;
+	int		fd;		/* pread() this fd, or open path if < 0 */
+	char		path[CBD_PATH_LEN];
+	char		data[CBDSYS_ATTR_SIZE_MAX];
+	ssize_t		ret;
+};
+
+static pthread_mutex_t attr_call_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct attr_worker *attr_worker;
+static unsigned int attr_deadline_ms;
+static uint64_t attr_deadline_ns;	/* 0 when reads are not bounded */
+
+static ssize_t attr_read_direct(int fd, const char *path, char *buf, size_t buf_len)
+{
+	ssize_t len;
+
+	if (fd >= 0) {
+		len = pread(fd, buf, buf_len - 1, 0);
+		if (len < 0)
+			return -errno;
+	} else {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+		len = read(fd, buf, buf_len - 1);
+		if (len < 0)
+			len = -errno;
+		close(fd);
+		if (len < 0)
+			return len;
+	}
+
+	buf[len] = '\0';
+	return len;
+}
+
+static void *attr_worker_fn(void *arg)
+{
+	struct attr_worker *worker = arg;
+
+	pthread_mutex_lock(&worker->lock);
+	while (true) {
+		ssize_t ret;
+
+		while (!worker->pending && !worker->abandoned)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		if (!worker->pending)
+			break;
+
+		pthread_mutex_unlock(&worker->lock);
+		ret = attr_read_direct(worker->fd, worker->path, worker->data, sizeof(worker->data));
+		pthread_mutex_lock(&worker->lock);
+
+		worker->ret = ret;
+		worker->pending = false;
+		worker->done = true;
+		pthread_cond_signal(&worker->cond);
+		if (worker->abandoned)
+			break;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_destroy(&worker->lock);
+	pthread_cond_destroy(&worker->cond);
+	free(worker);
+	return NULL;
+}
+
+static struct attr_worker *attr_worker_get(void)
+{
+	struct attr_worker *worker;
+
+	if (attr_worker)
+		return attr_worker;
+
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		return NULL;
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	if (pthread_create(&worker->thread, NULL, attr_worker_fn, worker)) {
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->cond);
+		free(worker);
+		return NULL;
+	}
+	pthread_detach(worker->thread);
+
+	attr_worker = worker;
+	return worker;
+}
+
+void cbdsys_set_deadline(unsigned int deadline_ms)
+{
+	attr_deadline_ms = deadline_ms;
+	cbdsys_deadline_restart();
+}
+
+void cbdsys_deadline_restart(void)
+{
+	attr_deadline_ns = attr_deadline_ms ? cbd_now_ns() + attr_deadline_ms * 1000000ULL : 0;
+}
+
+static ssize_t attr_read_bounded(int fd, const char *path, char *buf, size_t buf_len)
+{
+	struct attr_worker *worker;
+	uint64_t start = cbd_now_ns(), until, elapsed;
+	struct timespec ts;
+	ssize_t ret;
+
+	if (!attr_deadline_ns)
+		return attr_read_direct(fd, path, buf, buf_len);
+
+	if (start >= attr_deadline_ns)
+		return -ETIMEDOUT;
+
+	until = start + CBDSYS_ATTR_TIMEOUT_MS * 1000000ULL;
+	if (until > attr_deadline_ns)
+		until = attr_deadline_ns;
+
+	pthread_mutex_lock(&attr_call_lock);
+	worker = attr_worker_get();
+	if (!worker) {
+		pthread_mutex_unlock(&attr_call_lock);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	worker->fd = fd;
+	snprintf(worker->path, sizeof(worker->path), "%s", fd >= 0 ? "" : path);
+	worker->done = false;
+	worker->pending = true;
+	pthread_cond_signal(&worker->cond);
+
+	/* pthread_cond_timedwait() takes CLOCK_REALTIME, convert the monotonic deadline */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += (until - start) / 1000000000ULL;
+	ts.tv_nsec += (until - start) % 1000000000ULL;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	while (!worker->done) {
+		if (pthread_cond_timedwait(&worker->cond, &worker->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	if (worker->done) {
+		ret = worker->ret;
+		if (ret >= 0) {
+			snprintf(buf, buf_len, "%s", worker->data);
+			if ((size_t)ret >= buf_len)
+				ret = buf_len - 1;
+		}
+	} else {
+		worker->abandoned = true;
+		attr_worker = NULL;
+		ret = -ETIMEDOUT;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	pthread_mutex_unlock(&attr_call_lock);
+
+	elapsed = (cbd_now_ns() - start) / 1000000;
+	if (ret == -ETIMEDOUT)
+		fprintf(stderr, "attribute %s timed out after %lu ms\n", fd >= 0 ? "(open fd)" : path,
+			(unsigned long)elapsed);
+	else if (elapsed >= CBDSYS_ATTR_SLOW_MS)
+		fprintf(stderr, "slow attribute %s: %lu ms\n", fd >= 0 ? "(open fd)" : path,
+			(unsigned long)elapsed);
+
+	return ret;
+}
+
+/* Whole content of an attribute, returns its length or a negative error */
+static ssize_t read_sysfs_attr(const char *path, char *buf, size_t buf_len)
+{
+	return attr_read_bounded(-1, path, buf, buf_len);
+}
+
+int read_sysfs_value(const char *path, char *buf, size_t buf_len)
+{
+	ssize_t ret;
+
+	ret = read_sysfs_attr(path, buf, buf_len);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -ENODATA;
+
+	// Remove newline if present
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/*
+ * Changes made by other processes are not seen through the cache, so what
+ * is kept is only reused for a short while.
+ */
+#define CBDSYS_CACHE_TTL_NS	(1000 * 1000000ULL)
+
+struct cbdsys_cache_entry {
+	bool			tp_valid;
+	uint64_t		tp_ns;		/* when cbdt was read */
+	struct cbd_transport	cbdt;
+	bool			snap_valid;
+	uint64_t		snap_ns;	/* when snap was taken */
+	struct cbd_snapshot	snap;
+};
+
+static bool cache_enabled;
+static struct cbdsys_cache_entry *cache_entries[CBD_TRANSPORT_MAX];
+
+void cbdsys_cache_enable(void)
+{
+	cache_enabled = true;
+}
+
+static struct cbdsys_cache_entry *cache_entry(int transport_id)
+{
+	struct cbdsys_cache_entry *entry;
+	uint64_t now_ns;
+
+	if (!cache_enabled || transport_id < 0 || transport_id >= CBD_TRANSPORT_MAX)
+		return NULL;
+
+	if (!cache_entries[transport_id])
+		cache_entries[transport_id] = calloc(1, sizeof(struct cbdsys_cache_entry));
+
+	entry = cache_entries[transport_id];
+	if (!entry)
+		return NULL;
+
+	/* Drop what expired before anyone looks at it */
+	now_ns = cbd_now_ns();
+	if (entry->tp_valid && now_ns - entry->tp_ns >= CBDSYS_CACHE_TTL_NS)
+		entry->tp_valid = false;
+	if (entry->snap_valid && now_ns - entry->snap_ns >= CBDSYS_CACHE_TTL_NS) {
+		free(entry->snap.blkdevs);
+		entry->snap_valid = false;
+	}
+
+	return entry;
+}
+
+void cbdsys_cache_invalidate(int transport_id)
+{
+	for (int i = 0; i < CBD_TRANSPORT_MAX; i++) {
+		struct cbdsys_cache_entry *entry = cache_entries[i];
+
+		if (!entry || (transport_id >= 0 && i != transport_id))
+			continue;
+
+		entry->tp_valid = false;
+		if (entry->snap_valid) {
+			free(entry->snap.blkdevs);
+			entry->snap_valid = false;
+		}
+	}
+}
+
+static int snapshot_copy(struct cbd_snapshot *dst, const struct cbd_snapshot *src)
+{
+	*dst = *src;
+	dst->stale_backends = NULL;	/* only complete snapshots are copied */
+	if (!src->blkdev_cnt) {
+		dst->blkdevs = NULL;
+		return 0;
+	}
+
+	dst->blkdevs = malloc(src->blkdev_cnt * sizeof(*src->blkdevs));
+	if (!dst->blkdevs)
+		return -ENOMEM;
+	memcpy(dst->blkdevs, src->blkdevs, src->blkdev_cnt * sizeof(*src->blkdevs));
+
+	return 0;
+}
+
 static int blkdev_clean(unsigned int t_id, unsigned int blkdev_id)
 {
         char alive_path[CBD_PATH_LEN];
@@ -56,6 +353,7 @@ static int blkdev_clean(unsigned int t_id, unsigned int blkdev_id)
 
         ret = sysfs_write_attribute(sysattr, cmd, strlen(cmd));
         sysfs_close_attribute(sysattr);
+        cbdsys_cache_invalidate(t_id);
         if (ret != 0) {
                 printf("Failed to write '%s'. Error: %s\n", cmd, strerror(ret));
         }
@@ -90,27 +388,62 @@ int cbdsys_backend_blkdevs_clear(struct cbd_transport *cbdt, unsigned int backen
 	return 0;
 }
 
+/* Clear the blkdevs a dead host left behind, returns how many were cleared */
+int cbdsys_host_blkdevs_clear(struct cbd_transport *cbdt, unsigned int host_id)
+{
+	unsigned int i;
+	int cleared = 0;
+	int ret;
+
+	for (i = 0; i < cbdt->blkdev_num; i++) {
+		struct cbd_blkdev blkdev;
+
+		ret = cbdsys_blkdev_init(cbdt, &blkdev, i);
+		if (ret < 0 || blkdev.host_id != host_id || blkdev.alive)
+			continue;
+
+		ret = blkdev_clean(cbdt->transport_id, i);
+		if (ret < 0) {
+			printf("Failed to clear blkdev %u\n", i);
+			return ret;
+		}
+		cleared++;
+	}
+
+	return cleared;
+}
+
 int cbdsys_transport_init(struct cbd_transport *cbdt, int transport_id) {
 	char path[CBD_PATH_LEN];
-	FILE *file;
+	char info[CBDSYS_ATTR_SIZE_MAX];
+	char *line, *save;
 	char attribute[64];
-	char value_str[64];;
+	char value_str[64];
+	char buf[32];
 	uint64_t value;
+	struct cbdsys_cache_entry *entry = cache_entry(transport_id);
+	ssize_t len;
 	int ret;
 
+	if (entry && entry->tp_valid) {
+		*cbdt = entry->cbdt;
+		return 0;
+	}
+
 	cbdt->transport_id = transport_id;
 	/* Construct the file path */
 	transport_info_path(transport_id, path, CBD_PATH_LEN);
 
-	/* Open the file */
-	file = fopen(path, "r");
-	if (!file) {
-		//printf("failed to open %s\n", path);
-		return -errno;  // Return error code
-	}
+	/* Read the whole info attribute, one "attribute: value" per line */
+	len = read_sysfs_attr(path, info, sizeof(info));
+	if (len < 0)
+		return len;
 
 	/* Read and parse each line */
-	while (fscanf(file, "%63[^:]: %63s\n", attribute, value_str) == 2) {
+	for (line = strtok_r(info, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "%63[^:]: %63s", attribute, value_str) != 2)
+			break;
+
 		/* Check if the value is in hexadecimal by looking for "0x" prefix */
 		if (strncmp(value_str, "0x", 2) == 0) {
 			sscanf(value_str, "%lx", &value);
@@ -152,95 +485,91 @@ int cbdsys_transport_init(struct cbd_transport *cbdt, int transport_id) {
 			/* Unrecognized attribute, ignore */
 		}
 	}
-	/* Close the file */
-	fclose(file);
 
+	/* Read content from file into cbdt->path, without the newline */
 	transport_path_path(transport_id, path, CBD_PATH_LEN);
+	ret = read_sysfs_value(path, cbdt->path, CBD_PATH_LEN);
+	if (ret < 0) {
+		fprintf(stderr, "Error reading %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
 
-	/* Open the file for reading */
-	file = fopen(path, "r");
-	if (file == NULL) {
-		perror("Error opening file");
-		return -errno;
+	/* Read unsigned int from the file and set cbdt->host_id */
+	transport_host_id_path(transport_id, path, CBD_PATH_LEN);
+	ret = read_sysfs_value(path, buf, sizeof(buf));
+	if (ret < 0 || sscanf(buf, "%u", &cbdt->host_id) != 1) {
+		fprintf(stderr, "Error reading host_id from file: %s\n", path);
+		return ret == -ETIMEDOUT ? ret : -EINVAL;
 	}
 
-	/* Read content from file into cbdt->path */
-	if (fgets(cbdt->path, CBD_PATH_LEN, file) == NULL) {
-		if (ferror(file)) {
-			perror("Error reading file");
-			fclose(file);
-			return -errno;
-		}
+	if (entry) {
+		entry->cbdt = *cbdt;
+		entry->tp_ns = cbd_now_ns();
+		entry->tp_valid = true;
 	}
 
-	/* Close the file */
-	fclose(file);
+	return 0;
+}
 
-	/* Ensure null-termination of the string in cbdt->path */
-	cbdt->path[CBD_PATH_LEN - 1] = '\0';
+/*
+ * ID of the registered transport on the device or image @path, compared by
+ * device number or inode so other names of it match as well. -ENOENT if no
+ * transport is on it, another error if a transport couldn't be checked.
+ */
+int cbdsys_transport_find_path(const char *path)
+{
+	struct cbd_transport cbdt;
+	struct stat st, tp_st;
+	bool dev;
+	int ret;
 
-	transport_host_id_path(transport_id, path, CBD_PATH_LEN);
+	if (stat(path, &st) < 0)
+		return -ENOENT;
+	dev = S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode);
+
+	for (int i = 0; i < CBD_TRANSPORT_MAX; i++) {
+		ret = cbdsys_transport_init(&cbdt, i);
+		if (ret == -ENOENT)
+			break;
+		if (ret < 0)
+			return ret;
+		if (stat(cbdt.path, &tp_st) < 0 || (st.st_mode & S_IFMT) != (tp_st.st_mode & S_IFMT))
+			continue;
 
-	/* Open the file for reading */
-	file = fopen(path, "r");
-	if (file == NULL) {
-		perror("Error opening file");
-		return -errno;
+		if (dev ? st.st_rdev == tp_st.st_rdev :
+			  st.st_dev == tp_st.st_dev && st.st_ino == tp_st.st_ino)
+			return i;
 	}
 
-	/* Read unsigned int from the file and set cbdt->host_id */
-	if (fscanf(file, "%u", &cbdt->host_id) != 1) {
-		fprintf(stderr, "Error reading host_id from file: %s\n", path);
-		fclose(file);
-		return -EINVAL;
-	}
-
-	/* Close the file */
-	fclose(file);
-
-	return 0;
+	return -ENOENT;
 }
 
 int cbdsys_host_init(struct cbd_transport *cbdt, struct cbd_host *host, unsigned int host_id)
 {
 	char path[CBD_PATH_LEN];
-	FILE *file;
+	char alive_str[8];
+	int ret;
 
 	// Initialize host_id
 	host->host_id = host_id;
 
 	// Read hostname
 	host_hostname_path(cbdt->transport_id, host_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (file == NULL) {
-		perror("Error opening hostname file");
-		return -1;
-	}
-	if (fgets(host->hostname, sizeof(host->hostname), file) == NULL) {
-		fclose(file);
-		return -1;
-	}
-	// Remove newline character if present
-	host->hostname[strcspn(host->hostname, "\n")] = '\0';
-	fclose(file);
+	ret = read_sysfs_value(path, host->hostname, sizeof(host->hostname));
+	if (ret < 0)
+		return ret == -ETIMEDOUT ? ret : -1;
 
 	// Read alive status
 	host_alive_path(cbdt->transport_id, host_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (file == NULL) {
-		perror("Error opening alive file");
-		return -1;
-	}
-	char alive_str[8];
-	if (fgets(alive_str, sizeof(alive_str), file) == NULL) {
-		perror("Error reading alive status");
-		fclose(file);
-		return -1;
+	ret = read_sysfs_value(path, alive_str, sizeof(alive_str));
+	if (ret < 0) {
+		if (ret != -ETIMEDOUT)
+			perror("Error reading alive status");
+		return ret == -ETIMEDOUT ? ret : -1;
 	}
-	fclose(file);
 
 	// Convert alive status string to boolean
-	host->alive = (strcmp(alive_str, "true\n") == 0);
+	host->alive = (strcmp(alive_str, "true") == 0);
 
 	return 0;
 }
@@ -249,91 +578,47 @@ int cbdsys_host_init(struct cbd_transport *cbdt, struct cbd_host *host, unsigned
 
 int cbdsys_blkdev_init(struct cbd_transport *cbdt, struct cbd_blkdev *blkdev, unsigned int blkdev_id) {
 	char path[CBD_PATH_LEN];
-	FILE *file;
 	unsigned int mapped_id;
 	char buffer[16];
+	int ret;
 
 	// Load blkdev_id
 	blkdev->blkdev_id = blkdev_id;
 
-	// Load host_id
+	// Load host_id, empty for unused slots
 	blkdev_host_id_path(cbdt->transport_id, blkdev_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (!file) {
-		perror("Error opening host_id");
-		return -ENOENT;
-	}
-	if (fscanf(file, "%u", &blkdev->host_id) != 1) {
-		fclose(file);
-		return -ENOENT;
-	}
-	fclose(file);
+	ret = read_sysfs_value(path, buffer, sizeof(buffer));
+	if (ret < 0 || sscanf(buffer, "%u", &blkdev->host_id) != 1)
+		return ret == -ETIMEDOUT ? ret : -ENOENT;
 
 	// Load backend_id
 	blkdev_backend_id_path(cbdt->transport_id, blkdev_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (!file) {
-		perror("Error opening backend_id");
-		return -ENOENT;
-	}
-	if (fscanf(file, "%u", &blkdev->backend_id) != 1) {
-		fclose(file);
-		return -ENOENT;
-	}
-	fclose(file);
+	ret = read_sysfs_value(path, buffer, sizeof(buffer));
+	if (ret < 0 || sscanf(buffer, "%u", &blkdev->backend_id) != 1)
+		return ret == -ETIMEDOUT ? ret : -ENOENT;
 
 	// Load alive status
 	blkdev_alive_path(cbdt->transport_id, blkdev_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (!file) {
-		perror("Error opening alive");
-		return -ENOENT;
-	}
-	if (fgets(buffer, sizeof(buffer), file)) {
-		// Trim newline if present
-		buffer[strcspn(buffer, "\n")] = '\0';
-		blkdev->alive = (strcmp(buffer, "true") == 0);
-	}
-	fclose(file);
+	ret = read_sysfs_value(path, buffer, sizeof(buffer));
+	if (ret == -ETIMEDOUT)
+		return ret;
+	blkdev->alive = (ret == 0 && strcmp(buffer, "true") == 0);
 
 	// Load mapped_id and set dev_name
 	blkdev_mapped_id_path(cbdt->transport_id, blkdev_id, path, CBD_PATH_LEN);
-	file = fopen(path, "r");
-	if (!file) {
-		perror("Error opening mapped_id");
-		return -ENOENT;
-	}
-	if (fscanf(file, "%u", &mapped_id) != 1) {
-		fclose(file);
-		return -ENOENT;
-	}
-	fclose(file);
+	ret = read_sysfs_value(path, buffer, sizeof(buffer));
+	if (ret < 0 || sscanf(buffer, "%u", &mapped_id) != 1)
+		return ret == -ETIMEDOUT ? ret : -ENOENT;
+	blkdev->mapped_id = mapped_id;
 	snprintf(blkdev->dev_name, sizeof(blkdev->dev_name), CBD_DEV_NAME_FORMAT, mapped_id);
 
 	return 0;
 }
 
-int read_sysfs_value(const char *path, char *buf, size_t buf_len)
-{
-	FILE *f = fopen(path, "r");
-	if (!f) return -1;
-
-	if (fgets(buf, buf_len, f) == NULL) {
-		fclose(f);
-		return -1;
-	}
-
-	// Remove newline if present
-	buf[strcspn(buf, "\n")] = '\0';
-	fclose(f);
-	return 0;
-}
-
-int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_backend *backend, unsigned int backend_id)
+int cbdsys_backend_info_init(struct cbd_transport *cbdt, struct cbd_backend *backend, unsigned int backend_id)
 {
 	char path[CBD_PATH_LEN];
 	char buf[CBD_PATH_LEN];
-	struct stat sb;
 	int ret;
 
 	// Initialize backend_id
@@ -343,7 +628,7 @@ int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_backend *backend,
 	backend_host_id_path(cbdt->transport_id, backend_id, path, CBD_PATH_LEN);
 	ret = read_sysfs_value(path, buf, sizeof(buf));
 	if (ret < 0 || buf[0] == '\0') {
-		return -ENOENT; // Return if host_id is empty
+		return ret == -ETIMEDOUT ? ret : -ENOENT; // Return if host_id is empty
 	}
 	backend->host_id = atoi(buf);
 
@@ -384,28 +669,126 @@ int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_backend *backend,
 		return ret;
 	}
 	backend->cache_used_segs = (unsigned int)atoi(buf);
-
-	// Initialize block devices
 	backend->dev_num = 0;
+	backend->blkdevs = NULL;
+
+	return 0;
+}
+
+static int blkdev_backend_cmp(const void *a, const void *b)
+{
+	const struct cbd_blkdev *da = a, *db = b;
+
+	if (da->backend_id != db->backend_id)
+		return da->backend_id < db->backend_id ? -1 : 1;
+	return da->blkdev_id < db->blkdev_id ? -1 : da->blkdev_id > db->blkdev_id;
+}
+
+int cbdsys_snapshot_init(struct cbd_transport *cbdt, struct cbd_snapshot *snap)
+{
+	struct cbdsys_cache_entry *entry = cache_entry(cbdt->transport_id);
+	unsigned int cap = 0;
+
+	if (entry && entry->snap_valid)
+		return snapshot_copy(snap, &entry->snap);
+
+	snap->blkdevs = NULL;
+	snap->blkdev_cnt = 0;
+	snap->stale_cnt = 0;
+	snap->stale_backends = NULL;
+
 	for (unsigned int i = 0; i < cbdt->blkdev_num; i++) {
-		struct cbd_blkdev blkdev;
+		struct cbd_blkdev blkdev = { .backend_id = UINT_MAX };
+		int ret;
+
 		ret = cbdsys_blkdev_init(cbdt, &blkdev, i);
-		if (ret < 0) {
-			continue;
+		if (ret == -ETIMEDOUT) {
+			unsigned int *stale;
+
+			/* Slots are few and timeouts rare, grow one at a time */
+			stale = realloc(snap->stale_backends, (snap->stale_cnt + 1) * sizeof(*stale));
+			if (!stale) {
+				cbdsys_snapshot_release(snap);
+				return -ENOMEM;
+			}
+			snap->stale_backends = stale;
+			snap->stale_backends[snap->stale_cnt++] = blkdev.backend_id;
 		}
+		if (ret < 0)
+			continue;
 
-		// Check if blkdev's backend_id matches the current backend_id
-		if (blkdev.backend_id == backend_id) {
-			// Add to backend's blkdevs array if it matches
-			if (backend->dev_num < CBDB_BLKDEV_COUNT_MAX) {
-				memcpy(&backend->blkdevs[backend->dev_num++], &blkdev, sizeof(struct cbd_blkdev));
-			} else {
-				fprintf(stderr, "Warning: Exceeded max blkdev count for backend %u\n", backend_id);
-				break;
+		// Grow with the number of blkdevs in use, not the number of slots
+		if (snap->blkdev_cnt == cap) {
+			struct cbd_blkdev *pool;
+
+			cap = cap ? cap * 2 : 16;
+			pool = realloc(snap->blkdevs, cap * sizeof(*pool));
+			if (!pool) {
+				cbdsys_snapshot_release(snap);
+				return -ENOMEM;
 			}
+			snap->blkdevs = pool;
 		}
+		snap->blkdevs[snap->blkdev_cnt++] = blkdev;
+	}
+
+	qsort(snap->blkdevs, snap->blkdev_cnt, sizeof(*snap->blkdevs), blkdev_backend_cmp);
+
+	/* Partial snapshots are not kept, the next command retries the stale blkdevs */
+	if (entry && !snap->stale_cnt && snapshot_copy(&entry->snap, snap) == 0) {
+		entry->snap_ns = cbd_now_ns();
+		entry->snap_valid = true;
+	}
+
+	return 0;
+}
+
+void cbdsys_snapshot_release(struct cbd_snapshot *snap)
+{
+	free(snap->blkdevs);
+	free(snap->stale_backends);
+	snap->blkdevs = NULL;
+	snap->blkdev_cnt = 0;
+	snap->stale_cnt = 0;
+	snap->stale_backends = NULL;
+}
+
+/* Whether a blkdev which timed out may belong to @backend_id */
+bool cbdsys_snapshot_stale(const struct cbd_snapshot *snap, unsigned int backend_id)
+{
+	for (unsigned int i = 0; i < snap->stale_cnt; i++) {
+		if (snap->stale_backends[i] == backend_id || snap->stale_backends[i] == UINT_MAX)
+			return true;
+	}
+
+	return false;
+}
+
+int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_snapshot *snap,
+			struct cbd_backend *backend, unsigned int backend_id)
+{
+	unsigned int lo = 0, hi = snap->blkdev_cnt;
+	int ret;
+
+	ret = cbdsys_backend_info_init(cbdt, backend, backend_id);
+	if (ret < 0)
+		return ret;
+
+	// Find the first blkdev of the backend in the sorted pool
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (snap->blkdevs[mid].backend_id < backend_id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
+	backend->blkdevs = &snap->blkdevs[lo];
+	while (lo + backend->dev_num < snap->blkdev_cnt &&
+	       snap->blkdevs[lo + backend->dev_num].backend_id == backend_id)
+		backend->dev_num++;
+
 	return 0;
 }
 
@@ -416,7 +799,7 @@ int cbdsys_find_backend_id_from_path(struct cbd_transport *cbdt, char *path, uns
 	for (unsigned int i = 0; i < cbdt->backend_num; i++) {
 		struct cbd_backend backend = { 0 };
 
-		ret = cbdsys_backend_init(cbdt, &backend, i);
+		ret = cbdsys_backend_info_init(cbdt, &backend, i);
 		if (ret)
 			continue;
 
@@ -435,16 +818,30 @@ int cbdsys_find_backend_id_from_path(struct cbd_transport *cbdt, char *path, uns
 int cbdsys_write_value(const char *path, const char *value)
 {
 	struct sysfs_attribute *sysattr;
+	unsigned int transport_id;
 	int ret;
 
+	/* Tunables outside of the bus, e.g. irq affinity, change nothing cached */
+	if (cache_enabled && !strncmp(path, SYSFS_CBD_BASE_PATH, strlen(SYSFS_CBD_BASE_PATH))) {
+		if (sscanf(path, SYSFS_TRANSPORT_BASE_PATH "%u/", &transport_id) == 1)
+			cbdsys_cache_invalidate(transport_id);
+		else
+			cbdsys_cache_invalidate(-1);
+	}
+
+	/* libsysfs returns -1, the kernel's answer is in errno */
+	errno = 0;
 	sysattr = sysfs_open_attribute(path);
 	if (sysattr == NULL) {
+		ret = errno ? -errno : -EIO;
 		printf("failed to open %s, exit!\n", path);
-		return -1;
+		return ret;
 	}
 
+	errno = 0;
 	ret = sysfs_write_attribute(sysattr, value, strlen(value));
 	if (ret != 0) {
+		ret = errno ? -errno : -EIO;
 		printf("failed to write %s to %s, exit!\n", value, path);
 		goto out;
 	}
@@ -452,3 +849,570 @@ out:
 	sysfs_close_attribute(sysattr);
 	return ret;
 }
+
+/* Returns the fd holding the lock, released by cbdsys_unlock() or on exit */
+int cbdsys_lock(unsigned int transport_id, const char *name)
+{
+	char path[CBD_PATH_LEN];
+	int fd, ret;
+
+	if (mkdir(CBD_LOCK_DIR, 0755) < 0 && errno != EEXIST) {
+		ret = -errno;
+		printf("failed to create %s: %s\n", CBD_LOCK_DIR, strerror(-ret));
+		return ret;
+	}
+
+	snprintf(path, sizeof(path), "%s/transport%u-%s.lock", CBD_LOCK_DIR, transport_id, name);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		printf("failed to open lock %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	while (flock(fd, LOCK_EX) < 0) {
+		if (errno == EINTR)
+			continue;
+		ret = -errno;
+		printf("failed to lock %s: %s\n", path, strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+void cbdsys_unlock(int fd)
+{
+	if (fd < 0)
+		return;
+
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+int cbdsys_attr_open(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+int cbdsys_attr_read(int fd, char *buf, size_t buf_len)
+{
+	ssize_t len;
+
+	len = attr_read_bounded(fd, NULL, buf, buf_len);
+	if (len < 0)
+		return len;
+
+	// Remove newline if present
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+int cbdsys_attr_read_uint(int fd, unsigned int *value)
+{
+	char buf[32];
+	char *endptr;
+	int ret;
+
+	ret = cbdsys_attr_read(fd, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	errno = 0;
+	*value = (unsigned int)strtoul(buf, &endptr, 10);
+	if (errno || endptr == buf)
+		return -EINVAL;
+
+	return 0;
+}
+
+void cbdsys_attr_close(int *fd)
+{
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+int cbdsys_adm_open(unsigned int transport_id)
+{
+	char path[CBD_PATH_LEN];
+	int fd;
+
+	transport_adm_path(transport_id, path, sizeof(path));
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+int cbdsys_adm_write(int fd, const char *cmd)
+{
+	ssize_t len = strlen(cmd);
+	ssize_t ret;
+
+	ret = pwrite(fd, cmd, len, 0);
+	if (ret < 0)
+		return -errno;
+
+	return ret == len ? 0 : -EIO;
+}
+
+int cbdsys_backend_sampler_open(struct cbd_transport *cbdt, struct cbdsys_backend_sampler *sampler, unsigned int backend_id)
+{
+	char path[CBD_PATH_LEN];
+	int ret;
+
+	sampler->backend_id = backend_id;
+	sampler->alive_fd = -1;
+	sampler->cache_segs_fd = -1;
+	sampler->cache_gc_percent_fd = -1;
+	sampler->cache_used_segs_fd = -1;
+
+	backend_alive_path(cbdt->transport_id, backend_id, path, CBD_PATH_LEN);
+	ret = sampler->alive_fd = cbdsys_attr_open(path);
+	if (ret < 0)
+		goto err;
+
+	backend_cache_segs_path(cbdt->transport_id, backend_id, path, CBD_PATH_LEN);
+	ret = sampler->cache_segs_fd = cbdsys_attr_open(path);
+	if (ret < 0)
+		goto err;
+
+	backend_cache_gc_percent_path(cbdt->transport_id, backend_id, path, CBD_PATH_LEN);
+	ret = sampler->cache_gc_percent_fd = cbdsys_attr_open(path);
+	if (ret < 0)
+		goto err;
+
+	backend_cache_used_segs_path(cbdt->transport_id, backend_id, path, CBD_PATH_LEN);
+	ret = sampler->cache_used_segs_fd = cbdsys_attr_open(path);
+	if (ret < 0)
+		goto err;
+
+	return 0;
+err:
+	fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(-ret));
+	cbdsys_backend_sampler_close(sampler);
+	return ret;
+}
+
+int cbdsys_backend_sampler_read(struct cbdsys_backend_sampler *sampler, struct cbd_backend *backend)
+{
+	char buf[16];
+	int ret;
+
+	backend->backend_id = sampler->backend_id;
+
+	ret = cbdsys_attr_read(sampler->alive_fd, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+	backend->alive = (strcmp(buf, "true") == 0);
+
+	ret = cbdsys_attr_read_uint(sampler->cache_segs_fd, &backend->cache_segs);
+	if (ret < 0)
+		return ret;
+
+	ret = cbdsys_attr_read_uint(sampler->cache_gc_percent_fd, &backend->cache_gc_percent);
+	if (ret < 0)
+		return ret;
+
+	return cbdsys_attr_read_uint(sampler->cache_used_segs_fd, &backend->cache_used_segs);
+}
+
+void cbdsys_backend_sampler_close(struct cbdsys_backend_sampler *sampler)
+{
+	cbdsys_attr_close(&sampler->alive_fd);
+	cbdsys_attr_close(&sampler->cache_segs_fd);
+	cbdsys_attr_close(&sampler->cache_gc_percent_fd);
+	cbdsys_attr_close(&sampler->cache_used_segs_fd);
+}
+
+int cbdsys_blkdev_sampler_open(struct cbd_blkdev *blkdev, struct cbdsys_blkdev_sampler *sampler)
+{
+	char path[CBD_PATH_LEN];
+	int ret;
+
+	sampler->blkdev_id = blkdev->blkdev_id;
+	sampler->inflight_fd = -1;
+
+	block_stat_path(blkdev->mapped_id, path, CBD_PATH_LEN);
+	ret = sampler->stat_fd = cbdsys_attr_open(path);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	/* inflight is optional, stat carries the sum of both directions */
+	block_inflight_path(blkdev->mapped_id, path, CBD_PATH_LEN);
+	ret = cbdsys_attr_open(path);
+	if (ret >= 0)
+		sampler->inflight_fd = ret;
+
+	return 0;
+}
+
+int cbdsys_blkdev_sampler_read(struct cbdsys_blkdev_sampler *sampler, struct cbd_blkdev_iostat *iostat)
+{
+	char buf[256];
+	int ret;
+
+	ret = cbdsys_attr_read(sampler->stat_fd, buf, sizeof(buf));
+	if (ret < 0)
+		return ret;
+
+	ret = sscanf(buf, "%lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+		     &iostat->rd_ios, &iostat->rd_merges, &iostat->rd_sectors, &iostat->rd_ticks,
+		     &iostat->wr_ios, &iostat->wr_merges, &iostat->wr_sectors, &iostat->wr_ticks,
+		     &iostat->in_flight, &iostat->io_ticks, &iostat->time_in_queue);
+	if (ret != 11)
+		return -EINVAL;
+
+	iostat->inflight_rd = 0;
+	iostat->inflight_wr = (unsigned int)iostat->in_flight;
+	if (sampler->inflight_fd >= 0 &&
+	    cbdsys_attr_read(sampler->inflight_fd, buf, sizeof(buf)) == 0)
+		sscanf(buf, "%u %u", &iostat->inflight_rd, &iostat->inflight_wr);
+
+	return 0;
+}
+
+void cbdsys_blkdev_sampler_close(struct cbdsys_blkdev_sampler *sampler)
+{
+	cbdsys_attr_close(&sampler->stat_fd);
+	cbdsys_attr_close(&sampler->inflight_fd);
+}
+
+int cbdsys_parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *endptr;
+
+	CPU_ZERO(set);
+	while (*p && *p != '\n') {
+		unsigned long first, last;
+
+		first = strtoul(p, &endptr, 10);
+		if (endptr == p)
+			return -EINVAL;
+
+		last = first;
+		if (*endptr == '-') {
+			p = endptr + 1;
+			last = strtoul(p, &endptr, 10);
+			if (endptr == p || last < first)
+				return -EINVAL;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		p = endptr;
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int cbdsys_node_cpus(unsigned int node, cpu_set_t *set)
+{
+	char path[CBD_PATH_LEN];
+	char buf[CBD_PATH_LEN * 4];
+
+	node_cpulist_path(node, path, CBD_PATH_LEN);
+	if (read_sysfs_value(path, buf, sizeof(buf)) < 0)
+		return -ENOENT;
+
+	return cbdsys_parse_cpulist(buf, set);
+}
+
+/* NUMA node ids use the cpulist format as well, reuse cpu_set_t as the bitmap */
+int cbdsys_online_nodes(cpu_set_t *nodes)
+{
+	char path[CBD_PATH_LEN];
+	char buf[CBD_PATH_LEN];
+
+	snprintf(path, sizeof(path), "%s/online", SYSFS_NODE_BASE_PATH);
+	if (read_sysfs_value(path, buf, sizeof(buf)) < 0) {
+		/* Kernels without NUMA have a single node 0 */
+		CPU_ZERO(nodes);
+		CPU_SET(0, nodes);
+		return 0;
+	}
+
+	return cbdsys_parse_cpulist(buf, nodes);
+}
+
+void cbdsys_format_cpulist(const cpu_set_t *set, char *buf, size_t buf_len)
+{
+	size_t len = 0;
+	int cpu = 0;
+
+	buf[0] = '\0';
+	while (cpu < CPU_SETSIZE && len < buf_len) {
+		int first;
+
+		if (!CPU_ISSET(cpu, set)) {
+			cpu++;
+			continue;
+		}
+
+		first = cpu;
+		while (cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, set))
+			cpu++;
+
+		if (first == cpu)
+			len += snprintf(buf + len, buf_len - len, "%s%d", len ? "," : "", first);
+		else
+			len += snprintf(buf + len, buf_len - len, "%s%d-%d", len ? "," : "", first, cpu);
+		cpu++;
+	}
+}
+
+/* cpumask format of the workqueue cpumask attribute, 32 bit hex groups */
+static void format_cpumask(const cpu_set_t *set, char *buf, size_t buf_len)
+{
+	int groups = 0;
+	size_t len = 0;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, set))
+			groups = cpu / 32 + 1;
+	}
+
+	buf[0] = '\0';
+	for (int g = groups - 1; g >= 0 && len < buf_len; g--) {
+		uint32_t mask = 0;
+
+		for (int bit = 0; bit < 32; bit++) {
+			if (CPU_ISSET(g * 32 + bit, set))
+				mask |= 1U << bit;
+		}
+		len += snprintf(buf + len, buf_len - len, len ? ",%08x" : "%x", mask);
+	}
+}
+
+static int parse_cpumask(const char *mask, cpu_set_t *set)
+{
+	const char *p = mask + strlen(mask);
+	int bit = 0;
+
+	CPU_ZERO(set);
+	while (p > mask) {
+		char c = *--p;
+		int val;
+
+		if (c == ',' || c == '\n')
+			continue;
+		if (!isxdigit((unsigned char)c))
+			return -EINVAL;
+
+		val = isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+		for (int i = 0; i < 4; i++, bit++) {
+			if ((val & (1 << i)) && bit < CPU_SETSIZE)
+				CPU_SET(bit, set);
+		}
+	}
+
+	return 0;
+}
+
+int cbdsys_transport_numa_node(struct cbd_transport *cbdt)
+{
+	char dev_path[CBD_PATH_LEN];
+	char buf[16];
+	struct stat st;
+
+	if (stat(cbdt->path, &st) < 0 || !(S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)))
+		return -1;
+
+	/* pmem and dax devices carry numa_node on their parent device, partitions one level up */
+	snprintf(dev_path, sizeof(dev_path), "/sys/dev/%s/%u:%u/device/numa_node",
+		 S_ISBLK(st.st_mode) ? "block" : "char", major(st.st_rdev), minor(st.st_rdev));
+	if (read_sysfs_value(dev_path, buf, sizeof(buf)) < 0) {
+		snprintf(dev_path, sizeof(dev_path), "/sys/dev/%s/%u:%u/../device/numa_node",
+			 S_ISBLK(st.st_mode) ? "block" : "char", major(st.st_rdev), minor(st.st_rdev));
+		if (read_sysfs_value(dev_path, buf, sizeof(buf)) < 0)
+			return -1;
+	}
+
+	return atoi(buf);
+}
+
+/*
+ * Backend ID of a handler of @cbdt named @name, if it is one of @backend_id
+ * or with UINT_MAX of any backend, otherwise -1.
+ */
+static int handler_backend_id(struct cbd_transport *cbdt, unsigned int backend_id, const char *name)
+{
+	unsigned int tid, bid;
+	int len = 0;
+
+	/* %u takes every digit, "cbdt0-b12" is never taken for backend 1 */
+	if (sscanf(name, CBD_BACKEND_HANDLER_NAME_FMT "%n", &tid, &bid, &len) != 2 || !len ||
+	    tid != cbdt->transport_id || bid >= cbdt->backend_num ||
+	    (backend_id != UINT_MAX && bid != backend_id))
+		return -1;
+
+	return bid;
+}
+
+/*
+ * Call @fn for the handler workqueues in sysfs and the kernel threads of a
+ * backend, or with @backend_id UINT_MAX of every backend of @cbdt, in one
+ * scan of /proc. Returns the number of matches or a negative error of @fn.
+ */
+static int for_each_backend_handler(struct cbd_transport *cbdt, unsigned int backend_id,
+				    int (*wq_fn)(const char *wq_dir, unsigned int backend_id, void *data),
+				    int (*kthread_fn)(pid_t pid, unsigned int backend_id, void *data),
+				    void *data)
+{
+	char path[CBD_PATH_LEN * 2];
+	struct dirent *entry;
+	DIR *dir;
+	int found = 0, bid, ret;
+
+	dir = opendir(SYSFS_WORKQUEUE_BASE_PATH);
+	while (dir && (entry = readdir(dir)) != NULL) {
+		bid = handler_backend_id(cbdt, backend_id, entry->d_name);
+		if (bid < 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", SYSFS_WORKQUEUE_BASE_PATH, entry->d_name);
+		ret = wq_fn(path, bid, data);
+		if (ret < 0) {
+			closedir(dir);
+			return ret;
+		}
+		found++;
+	}
+	if (dir)
+		closedir(dir);
+
+	dir = opendir("/proc");
+	while (dir && (entry = readdir(dir)) != NULL) {
+		char buf[512];
+		unsigned long flags;
+		char *comm, *end;
+		pid_t pid;
+
+		if (!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+
+		pid = atoi(entry->d_name);
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		if (read_sysfs_value(path, buf, sizeof(buf)) < 0)
+			continue;
+
+		/* pid (comm) state ppid pgrp session tty_nr tpgid flags */
+		comm = strchr(buf, '(');
+		end = strrchr(buf, ')');
+		if (!comm || !end)
+			continue;
+		*end = '\0';
+		if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %lu", &flags) != 1)
+			continue;
+
+		/* PF_KTHREAD */
+		if (!(flags & 0x00200000))
+			continue;
+
+		bid = handler_backend_id(cbdt, backend_id, comm + 1);
+		if (bid < 0)
+			continue;
+
+		ret = kthread_fn(pid, bid, data);
+		if (ret < 0) {
+			closedir(dir);
+			return ret;
+		}
+		found++;
+	}
+	if (dir)
+		closedir(dir);
+
+	return found;
+}
+
+struct handlers_pin {
+	const cpu_set_t		*set;
+	unsigned int		kthreads;
+};
+
+static int wq_pin(const char *wq_dir, unsigned int backend_id, void *data)
+{
+	struct handlers_pin *pin = data;
+	char path[CBD_PATH_LEN * 3];
+	char mask[CPU_SETSIZE / 4 + CPU_SETSIZE / 32 + 1];
+
+	format_cpumask(pin->set, mask, sizeof(mask));
+	snprintf(path, sizeof(path), "%s/cpumask", wq_dir);
+	return cbdsys_write_value(path, mask) ? -EIO : 0;
+}
+
+static int kthread_pin(pid_t pid, unsigned int backend_id, void *data)
+{
+	struct handlers_pin *pin = data;
+
+	if (sched_setaffinity(pid, sizeof(cpu_set_t), pin->set) < 0) {
+		fprintf(stderr, "Failed to set affinity of pid %d: %s\n", pid, strerror(errno));
+		return -errno;
+	}
+
+	pin->kthreads++;
+	return 0;
+}
+
+int cbdsys_backend_handlers_pin(struct cbd_transport *cbdt, unsigned int backend_id, const cpu_set_t *set,
+				unsigned int *kthreads)
+{
+	struct handlers_pin pin = { .set = set };
+	int ret;
+
+	ret = for_each_backend_handler(cbdt, backend_id, wq_pin, kthread_pin, &pin);
+	*kthreads = pin.kthreads;
+	return ret;
+}
+
+static int wq_cpus(const char *wq_dir, unsigned int backend_id, void *data)
+{
+	char path[CBD_PATH_LEN * 3];
+	char mask[CPU_SETSIZE / 4 + CPU_SETSIZE / 32 + 1];
+	cpu_set_t *sets = data;
+	cpu_set_t set;
+
+	snprintf(path, sizeof(path), "%s/cpumask", wq_dir);
+	if (read_sysfs_value(path, mask, sizeof(mask)) < 0 || parse_cpumask(mask, &set) < 0)
+		return 0;
+
+	CPU_OR(&sets[backend_id], &sets[backend_id], &set);
+	return 0;
+}
+
+static int kthread_cpus(pid_t pid, unsigned int backend_id, void *data)
+{
+	cpu_set_t *sets = data;
+	cpu_set_t set;
+
+	if (sched_getaffinity(pid, sizeof(set), &set) == 0)
+		CPU_OR(&sets[backend_id], &sets[backend_id], &set);
+
+	return 0;
+}
+
+int cbdsys_transport_handlers_cpus(struct cbd_transport *cbdt, cpu_set_t *sets)
+{
+	for (unsigned int i = 0; i < cbdt->backend_num; i++)
+		CPU_ZERO(&sets[i]);
+
+	return for_each_backend_handler(cbdt, UINT_MAX, wq_cpus, kthread_cpus, sets);
+}
@@ -2,12 +2,15 @@
 #define CBDSYS_H
 
 #include <stdint.h>
+#include <sched.h>
 
 #include "libcbd.h"
 
+#define SYSFS_CBD_BASE_PATH "/sys/bus/cbd/"
 #define SYSFS_CBD_TRANSPORT_REGISTER "/sys/bus/cbd/transport_register"
 #define SYSFS_CBD_TRANSPORT_UNREGISTER "/sys/bus/cbd/transport_unregister"
 #define SYSFS_TRANSPORT_BASE_PATH "/sys/bus/cbd/devices/transport"
+#define SYSFS_MODULE_PATH "/sys/module/cbd"
 
 static inline void transport_info_path(int transport_id, char *buffer, size_t buffer_size)
 {
@@ -36,6 +39,36 @@ static inline void OBJ##_##MEMBER##_path(unsigned int t_id, unsigned int obj_id,
         snprintf(buffer, buffer_size, "%s%u/cbd_" #OBJ "s/" #OBJ "%u/" #MEMBER, SYSFS_TRANSPORT_BASE_PATH, t_id, obj_id); \
 }
 
+#define SYSFS_BLOCK_BASE_PATH "/sys/block/cbd"
+
+static inline void block_stat_path(unsigned int mapped_id, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%u/stat", SYSFS_BLOCK_BASE_PATH, mapped_id);
+}
+
+static inline void block_inflight_path(unsigned int mapped_id, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%u/inflight", SYSFS_BLOCK_BASE_PATH, mapped_id);
+}
+
+static inline void block_dev_path(unsigned int mapped_id, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%u/dev", SYSFS_BLOCK_BASE_PATH, mapped_id);
+}
+
+static inline void block_queue_path(unsigned int mapped_id, const char *attr, char *buffer,
+				    size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s%u/queue/%s", SYSFS_BLOCK_BASE_PATH, mapped_id, attr);
+}
+
+#define SYSFS_NODE_BASE_PATH "/sys/devices/system/node"
+
+static inline void node_cpulist_path(unsigned int node, char *buffer, size_t buffer_size)
+{
+	snprintf(buffer, buffer_size, "%s/node%u/cpulist", SYSFS_NODE_BASE_PATH, node);
+}
+
 CBDSYS_PATH(host, alive)
 CBDSYS_PATH(host, hostname)
 
@@ -52,12 +85,114 @@ CBDSYS_PATH(backend, cache_gc_percent)
 CBDSYS_PATH(backend, cache_used_segs)
 
 int cbdsys_backend_blkdevs_clear(struct cbd_transport *cbdt, unsigned int backend_id);
+int cbdsys_host_blkdevs_clear(struct cbd_transport *cbdt, unsigned int host_id);
 
 int cbdsys_transport_init(struct cbd_transport *cbdt, int transport_id);
+int cbdsys_transport_find_path(const char *path);
 int cbdsys_host_init(struct cbd_transport *cbdt, struct cbd_host *host, unsigned int host_id);
 int cbdsys_blkdev_init(struct cbd_transport *cbdt, struct cbd_blkdev *blkdev, unsigned int blkdev_id);
-int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_backend *backend, unsigned int backend_id);
+int cbdsys_snapshot_init(struct cbd_transport *cbdt, struct cbd_snapshot *snap);
+void cbdsys_snapshot_release(struct cbd_snapshot *snap);
+bool cbdsys_snapshot_stale(const struct cbd_snapshot *snap, unsigned int backend_id);
+int cbdsys_backend_init(struct cbd_transport *cbdt, struct cbd_snapshot *snap,
+			struct cbd_backend *backend, unsigned int backend_id);
+
+/*
+ * Cache of transport infos and blkdev snapshots for batch and shell, which
+ * run many commands in one process. An admin write to a transport drops
+ * what is cached for it, any other write, e.g. a register, drops it all,
+ * and nothing is kept for longer than a second.
+ */
+void cbdsys_cache_enable(void);
+void cbdsys_cache_invalidate(int transport_id);	/* -1 for all transports */
+/* Same as cbdsys_backend_init() without looking up the blkdevs of the backend */
+int cbdsys_backend_info_init(struct cbd_transport *cbdt, struct cbd_backend *backend, unsigned int backend_id);
 int cbdsys_find_backend_id_from_path(struct cbd_transport *cbdt, char *path, unsigned int *backend_id);
 int cbdsys_write_value(const char *path, const char *value);
 
+/*
+ * Advisory locks between cbdctrl processes. Commands which write an admin
+ * op and then work out what it created by diffing sysfs hold one across
+ * that window only, so parallel invocations on other backends or
+ * transports are not serialized.
+ */
+#define CBD_LOCK_DIR "/run/cbdctrl"
+#define CBD_LOCK_BACKEND_START "backend-start"
+#define CBD_LOCK_BACKEND_FMT "backend%u"
+
+int cbdsys_lock(unsigned int transport_id, const char *name);
+void cbdsys_unlock(int fd);
+int read_sysfs_value(const char *path, char *buf, size_t buf_len);
+
+/*
+ * --deadline: bound every attribute read by CBDSYS_ATTR_TIMEOUT_MS and all
+ * reads together by @deadline_ms, timed out reads return -ETIMEDOUT. Long
+ * running commands restart the deadline for every refresh.
+ */
+#define CBDSYS_ATTR_SIZE_MAX	4096
+#define CBDSYS_ATTR_TIMEOUT_MS	1000
+#define CBDSYS_ATTR_SLOW_MS	100	/* reads slower than this are logged */
+
+void cbdsys_set_deadline(unsigned int deadline_ms);
+void cbdsys_deadline_restart(void);
+
+/*
+ * Sampling helpers: keep the attribute fd open and re-read it with pread()
+ * at offset 0, sysfs regenerates the value on every read from the start.
+ */
+int cbdsys_attr_open(const char *path);
+int cbdsys_attr_read(int fd, char *buf, size_t buf_len);
+int cbdsys_attr_read_uint(int fd, unsigned int *value);
+void cbdsys_attr_close(int *fd);
+
+/*
+ * Admin ops through a kept open adm fd. Writes to one open file are
+ * serialized by kernfs, concurrent writers need an fd each. Nothing cached
+ * is dropped, callers do that once they are done.
+ */
+int cbdsys_adm_open(unsigned int transport_id);
+int cbdsys_adm_write(int fd, const char *cmd);
+
+struct cbdsys_backend_sampler {
+	unsigned int backend_id;
+	int alive_fd;
+	int cache_segs_fd;
+	int cache_gc_percent_fd;
+	int cache_used_segs_fd;
+};
+
+int cbdsys_backend_sampler_open(struct cbd_transport *cbdt, struct cbdsys_backend_sampler *sampler, unsigned int backend_id);
+int cbdsys_backend_sampler_read(struct cbdsys_backend_sampler *sampler, struct cbd_backend *backend);
+void cbdsys_backend_sampler_close(struct cbdsys_backend_sampler *sampler);
+
+/* cpulist format of sysfs and cpuset, e.g. "0-3,8,10-11" */
+int cbdsys_parse_cpulist(const char *list, cpu_set_t *set);
+int cbdsys_node_cpus(unsigned int node, cpu_set_t *set);
+int cbdsys_online_nodes(cpu_set_t *nodes);
+void cbdsys_format_cpulist(const cpu_set_t *set, char *buf, size_t buf_len);
+
+/*
+ * Handlers of a backend run on a workqueue, and its rescuer kthread, named
+ * after the transport and backend IDs.
+ */
+#define CBD_BACKEND_HANDLER_NAME_FMT "cbdt%u-b%u"
+#define SYSFS_WORKQUEUE_BASE_PATH "/sys/devices/virtual/workqueue"
+
+int cbdsys_transport_numa_node(struct cbd_transport *cbdt);
+/* Returns the workqueues plus kthreads pinned, *@kthreads counts the latter */
+int cbdsys_backend_handlers_pin(struct cbd_transport *cbdt, unsigned int backend_id, const cpu_set_t *set,
+				unsigned int *kthreads);
+/* CPUs of the handlers of every backend in one scan, @sets has backend_num entries */
+int cbdsys_transport_handlers_cpus(struct cbd_transport *cbdt, cpu_set_t *sets);
+
+struct cbdsys_blkdev_sampler {
+	unsigned int blkdev_id;
+	int stat_fd;
+	int inflight_fd;
+};
+
+int cbdsys_blkdev_sampler_open(struct cbd_blkdev *blkdev, struct cbdsys_blkdev_sampler *sampler);
+int cbdsys_blkdev_sampler_read(struct cbdsys_blkdev_sampler *sampler, struct cbd_blkdev_iostat *iostat);
+void cbdsys_blkdev_sampler_close(struct cbdsys_blkdev_sampler *sampler);
+
 #endif // CBDSYS_H
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "cbdctrl.h"
+#include "libcbdsys.h"
 
 /* Function to check if a kernel module is loaded */
 static int is_module_loaded(const char *module_name)
@@ -21,16 +22,33 @@ static int load_module(const char *module_name)
 
 static int cbdctrl_run(cbd_opt_t *options)
 {
-	int ret = 0;
-
-	/* Check if 'cbd' module is loaded */
-	if (!is_module_loaded("cbd")) {
+	/*
+	 * Check if 'cbd' module is loaded, cache-sim, tp-check, tp-prepare,
+	 * record-dump and tp-segments --image work offline. health checks it
+	 * itself, without forking lsmod or loading it.
+	 */
+	if (options->co_cmd != CCT_CACHE_SIM && options->co_cmd != CCT_TRANSPORT_CHECK &&
+	    options->co_cmd != CCT_TRANSPORT_PREPARE && options->co_cmd != CCT_RECORD_DUMP &&
+	    options->co_cmd != CCT_HEALTH &&
+	    !(options->co_cmd == CCT_TRANSPORT_SEGMENTS && options->co_image[0]) &&
+	    !is_module_loaded("cbd")) {
 		if (load_module("cbd") != 0) {
 			fprintf(stderr, "Failed to load 'cbd' module. Exiting.\n");
 			return -1; /* Return an error if module cannot be loaded */
 		}
 	}
 
+	/* Bound sysfs reads so a stuck attribute can't hang the command */
+	if (options->co_deadline_ms)
+		cbdsys_set_deadline(options->co_deadline_ms);
+
+	return cbdctrl_dispatch(options);
+}
+
+int cbdctrl_dispatch(cbd_opt_t *options)
+{
+	int ret = 0;
+
 	switch (options->co_cmd) {
 		case CCT_TRANSPORT_REGISTER:
 			ret = cbdctrl_transport_register(options);
@@ -44,6 +62,12 @@ static int cbdctrl_run(cbd_opt_t *options)
 		case CCT_HOST_LIST:
 			ret = cbdctrl_host_list(options);
 			break;
+		case CCT_HOST_MONITOR:
+			ret = cbdctrl_host_monitor(options);
+			break;
+		case CCT_GC:
+			ret = cbdctrl_gc(options);
+			break;
 		case CCT_BACKEND_START:
 			ret = cbdctrl_backend_start(options);
 			break;
@@ -62,6 +86,60 @@ static int cbdctrl_run(cbd_opt_t *options)
 		case CCT_DEV_LIST:
 			ret = cbdctrl_dev_list(options);
 			break;
+		case CCT_DEV_TUNE:
+			ret = cbdctrl_dev_tune(options);
+			break;
+		case CCT_RECORD:
+			ret = cbdctrl_record(options);
+			break;
+		case CCT_RECORD_DUMP:
+			ret = cbdctrl_record_dump(options);
+			break;
+		case CCT_HEALTH:
+			ret = cbdctrl_health(options);
+			break;
+		case CCT_REBALANCE:
+			ret = cbdctrl_rebalance(options);
+			break;
+		case CCT_BACKEND_STAT:
+			ret = cbdctrl_backend_stat(options);
+			break;
+		case CCT_DEV_STAT:
+			ret = cbdctrl_dev_stat(options);
+			break;
+		case CCT_EXPORT:
+			ret = cbdctrl_export(options);
+			break;
+		case CCT_BENCH:
+			ret = cbdctrl_bench(options);
+			break;
+		case CCT_TRANSPORT_BENCH:
+			ret = cbdctrl_transport_bench(options);
+			break;
+		case CCT_TRANSPORT_CHECK:
+			ret = cbdctrl_transport_check(options);
+			break;
+		case CCT_TRANSPORT_SEGMENTS:
+			ret = cbdctrl_transport_segments(options);
+			break;
+		case CCT_TRANSPORT_PREPARE:
+			ret = cbdctrl_transport_prepare(options);
+			break;
+		case CCT_CACHE_SIM:
+			ret = cbdctrl_cache_sim(options);
+			break;
+		case CCT_CACHE_WARM:
+			ret = cbdctrl_cache_warm(options);
+			break;
+		case CCT_CACHE_PROFILE:
+			ret = cbdctrl_cache_profile(options);
+			break;
+		case CCT_BATCH:
+			ret = cbdctrl_batch(options);
+			break;
+		case CCT_SHELL:
+			ret = cbdctrl_shell(options);
+			break;
 		default:
 			printf("Unknown command: %u\n", options->co_cmd);
 			ret = -1;
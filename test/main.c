@@ -0,0 +1,245 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <cmocka.h>
+#include <jansson.h>
+
+/*
+ * Tests against a live transport. They need root, the cbd module and a
+ * backend of this host to start devices on, given by the environment:
+ *
+ *   CBD_TEST_TRANSPORT	transport ID, 0 if unset
+ *   CBD_TEST_BACKEND	backend ID, the tests are skipped if unset
+ *   CBD_TEST_PARALLEL	dev-starts run at once, 8 if unset
+ *   CBDCTRL		binary under test, bin/cbdctrl if unset
+ */
+#define TEST_PARALLEL_DEFAULT	8
+#define TEST_PARALLEL_MAX	64
+#define TEST_OUT_LEN		256
+
+struct test_env {
+	const char	*cbdctrl;
+	char		transport[16];
+	char		backend[16];
+	unsigned int	parallel;
+	unsigned int	started;
+	char		devs[TEST_PARALLEL_MAX][TEST_OUT_LEN];
+};
+
+static int test_env_setup(void **state)
+{
+	static struct test_env env;
+	const char *val;
+
+	memset(&env, 0, sizeof(env));
+	*state = &env;
+
+	val = getenv("CBD_TEST_BACKEND");
+	if (!val || geteuid() != 0)
+		return 0;
+	snprintf(env.backend, sizeof(env.backend), "%s", val);
+
+	val = getenv("CBD_TEST_TRANSPORT");
+	snprintf(env.transport, sizeof(env.transport), "%s", val ? val : "0");
+
+	val = getenv("CBD_TEST_PARALLEL");
+	env.parallel = val ? strtoul(val, NULL, 10) : TEST_PARALLEL_DEFAULT;
+	if (env.parallel < 2 || env.parallel > TEST_PARALLEL_MAX)
+		env.parallel = TEST_PARALLEL_DEFAULT;
+
+	val = getenv("CBDCTRL");
+	env.cbdctrl = val ? val : "bin/cbdctrl";
+
+	return 0;
+}
+
+/* Fork cbdctrl with @argv, its stdout is read from the returned fd */
+static pid_t test_spawn(struct test_env *env, char *const argv[], int gate_fd, int *out_fd)
+{
+	int out[2];
+	pid_t pid;
+
+	if (pipe(out) < 0)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(out[0]);
+		close(out[1]);
+		return -errno;
+	}
+
+	if (pid == 0) {
+		char c;
+
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]);
+		close(out[1]);
+
+		/* Wait for the parent to release all children at once */
+		if (gate_fd >= 0 && read(gate_fd, &c, 1) != 1)
+			_exit(127);
+
+		execv(env->cbdctrl, argv);
+		_exit(127);
+	}
+
+	close(out[1]);
+	*out_fd = out[0];
+	return pid;
+}
+
+/* Output of a finished child, with the trailing newline removed */
+static int test_collect(pid_t pid, int out_fd, char *buf, size_t buf_len)
+{
+	size_t len = 0;
+	ssize_t ret;
+	int status;
+
+	while (len < buf_len - 1 && (ret = read(out_fd, buf + len, buf_len - 1 - len)) > 0)
+		len += ret;
+	buf[len] = '\0';
+	if (len && buf[len - 1] == '\n')
+		buf[len - 1] = '\0';
+	close(out_fd);
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int test_run(struct test_env *env, char *const argv[], char *buf, size_t buf_len)
+{
+	int out_fd;
+	pid_t pid;
+
+	pid = test_spawn(env, argv, -1, &out_fd);
+	if (pid < 0)
+		return pid;
+
+	return test_collect(pid, out_fd, buf, buf_len);
+}
+
+/* Stop the devices a test started, looked up by name in dev-list */
+static int test_devs_teardown(void **state)
+{
+	struct test_env *env = *state;
+	char *list_argv[] = { (char *)env->cbdctrl, "dev-list", "-t", env->transport, NULL };
+	static char list[1024 * 1024];
+	json_t *json_devs, *json_dev;
+	size_t i;
+
+	if (!env->started)
+		return 0;
+
+	if (test_run(env, list_argv, list, sizeof(list)) != 0)
+		return -1;
+
+	json_devs = json_loads(list, 0, NULL);
+	json_array_foreach(json_devs, i, json_dev) {
+		const char *name = json_string_value(json_object_get(json_dev, "dev_name"));
+		char dev_id[16], out[TEST_OUT_LEN];
+		char *stop_argv[] = { (char *)env->cbdctrl, "dev-stop", "-t", env->transport,
+				      "-d", dev_id, NULL };
+
+		for (unsigned int j = 0; name && j < env->started; j++) {
+			if (strcmp(name, env->devs[j]))
+				continue;
+
+			snprintf(dev_id, sizeof(dev_id), "%lld",
+				 json_integer_value(json_object_get(json_dev, "blkdev_id")));
+			test_run(env, stop_argv, out, sizeof(out));
+			break;
+		}
+	}
+	json_decref(json_devs);
+	env->started = 0;
+
+	return 0;
+}
+
+/*
+ * dev-start finds its device by diffing the backend before and after the
+ * admin write. Started all at once on one backend, every dev-start has to
+ * succeed and name a device of its own, and dev-list has to show each of
+ * them on that backend.
+ */
+static void test_dev_start_parallel(void **state)
+{
+	struct test_env *env = *state;
+	char *start_argv[] = { (char *)env->cbdctrl, "dev-start", "-t", env->transport,
+			       "-b", env->backend, NULL };
+	char *list_argv[] = { (char *)env->cbdctrl, "dev-list", "-t", env->transport, NULL };
+	static char list[1024 * 1024];
+	pid_t pids[TEST_PARALLEL_MAX];
+	int out_fds[TEST_PARALLEL_MAX];
+	char go[TEST_PARALLEL_MAX] = { 0 };
+	unsigned int spawned, listed = 0;
+	json_t *json_devs, *json_dev;
+	int gate[2];
+	size_t i;
+
+	if (!env->backend[0])
+		skip();
+
+	assert_int_equal(pipe(gate), 0);
+	for (spawned = 0; spawned < env->parallel; spawned++) {
+		pids[spawned] = test_spawn(env, start_argv, gate[0], &out_fds[spawned]);
+		if (pids[spawned] < 0)
+			break;
+	}
+	/* A byte for each child releases them all at once */
+	assert_int_equal(write(gate[1], go, spawned), spawned);
+	close(gate[0]);
+	close(gate[1]);
+
+	for (unsigned int j = 0; j < spawned; j++) {
+		char *dev = env->devs[env->started];
+
+		if (test_collect(pids[j], out_fds[j], dev, TEST_OUT_LEN) == 0 &&
+		    !strncmp(dev, "/dev/", 5))
+			env->started++;
+	}
+	assert_int_equal(spawned, env->parallel);
+	assert_int_equal(env->started, env->parallel);
+
+	for (unsigned int j = 0; j < env->started; j++) {
+		for (unsigned int k = j + 1; k < env->started; k++)
+			assert_string_not_equal(env->devs[j], env->devs[k]);
+	}
+
+	assert_int_equal(test_run(env, list_argv, list, sizeof(list)), 0);
+	json_devs = json_loads(list, 0, NULL);
+	assert_non_null(json_devs);
+	json_array_foreach(json_devs, i, json_dev) {
+		const char *name = json_string_value(json_object_get(json_dev, "dev_name"));
+
+		for (unsigned int j = 0; name && j < env->started; j++) {
+			if (strcmp(name, env->devs[j]))
+				continue;
+
+			assert_int_equal(json_integer_value(json_object_get(json_dev, "backend_id")),
+					 strtoll(env->backend, NULL, 10));
+			listed++;
+		}
+	}
+	json_decref(json_devs);
+	assert_int_equal(listed, env->started);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_teardown(test_dev_start_parallel, test_devs_teardown),
+	};
+
+	return cmocka_run_group_tests(tests, test_env_setup, NULL);
+}